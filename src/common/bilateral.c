@@ -0,0 +1,536 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2012 johannes hanika.
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/bilateral.h"
+#include "common/darktable.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xmmintrin.h>
+
+// upper bound for the number of grid cells. this is the volume of the old
+// 900x900x50 clamps, but the grid may take any shape within it.
+#define DT_BILATERAL_MAX_CELLS (900*900*50)
+// the blur kernels need at least five samples per line
+#define DT_BILATERAL_MIN_SIZE 4
+
+void
+dt_bilateral_grid_size(
+  const int width,
+  const int height,
+  const float sigma_s,
+  const float sigma_r,
+  int *size_x,
+  int *size_y,
+  int *size_z)
+{
+  // one cell per sigma is what the blur expects. if that's too many cells,
+  // coarsen space and range by the same factor: the filter then gets a bit
+  // wider everywhere instead of much wider along the one axis that hit a limit.
+  float x = MAX(width/sigma_s, DT_BILATERAL_MIN_SIZE);
+  float y = MAX(height/sigma_s, DT_BILATERAL_MIN_SIZE);
+  float z = MAX(100.0f/sigma_r, DT_BILATERAL_MIN_SIZE);
+  const float cells = (x + 1.0f)*(y + 1.0f)*(z + 1.0f);
+  if(cells > DT_BILATERAL_MAX_CELLS)
+  {
+    const float f = cbrtf(DT_BILATERAL_MAX_CELLS/cells);
+    x = MAX(x*f, DT_BILATERAL_MIN_SIZE);
+    y = MAX(y*f, DT_BILATERAL_MIN_SIZE);
+    z = MAX(z*f, DT_BILATERAL_MIN_SIZE);
+  }
+  *size_x = (int)roundf(x) + 1;
+  *size_y = (int)roundf(y) + 1;
+  *size_z = (int)roundf(z) + 1;
+}
+
+size_t
+dt_bilateral_memory_use(
+  const int width,       // width of input image
+  const int height,      // height of input image
+  const float sigma_s,   // spatial sigma (blur pixel coords)
+  const float sigma_r)   // range sigma (blur luma values)
+{
+  // the grid and the splat slabs on the cpu, the grid and a temporary copy with opencl
+  return 2*dt_bilateral_singlebuffer_size(width, height, sigma_s, sigma_r);
+}
+
+size_t
+dt_bilateral_singlebuffer_size(
+  const int width,       // width of input image
+  const int height,      // height of input image
+  const float sigma_s,   // spatial sigma (blur pixel coords)
+  const float sigma_r)   // range sigma (blur luma values)
+{
+  int size_x, size_y, size_z;
+  dt_bilateral_grid_size(width, height, sigma_s, sigma_r, &size_x, &size_y, &size_z);
+  return (size_t)size_x*size_y*size_z*sizeof(float);
+}
+
+static inline void
+image_to_grid(
+  const dt_bilateral_t *const b,
+  const int i,
+  const int j,
+  const float L,
+  float *x,
+  float *y,
+  float *z)
+{
+  *x = CLAMPS(i/b->sigma_s, 0, b->size_x-1);
+  *y = CLAMPS(j/b->sigma_s, 0, b->size_y-1);
+  *z = CLAMPS(L/b->sigma_r, 0, b->size_z-1);
+}
+
+// grid row the pixels of image row j are splatted to (and to the one after it)
+static inline int
+image_row_to_grid(
+  const dt_bilateral_t *const b,
+  const int j)
+{
+  return MIN((int)CLAMPS(j/b->sigma_s, 0, b->size_y-1), b->size_y-2);
+}
+
+// trilinear weights of the four cells (x,y) (x+1,y) (x,y+1) (x+1,y+1)
+// in the two z planes around a grid position, scaled by norm
+static inline void
+trilinear_weights(
+  const float xf,
+  const float yf,
+  const float zf,
+  const float norm,
+  __m128 *w0,
+  __m128 *w1)
+{
+  const __m128 wx = _mm_set_ps(xf, 1.0f-xf, xf, 1.0f-xf);
+  const __m128 wy = _mm_set_ps(yf, yf, 1.0f-yf, 1.0f-yf);
+  const __m128 wxy = _mm_mul_ps(_mm_mul_ps(wx, wy), _mm_set1_ps(norm));
+  *w0 = _mm_mul_ps(wxy, _mm_set1_ps(1.0f-zf));
+  *w1 = _mm_mul_ps(wxy, _mm_set1_ps(zf));
+}
+
+// the same four cells as one vector, p points to (x,y)
+static inline __m128
+load_quad(
+  const float *const p,
+  const int oy)
+{
+  return _mm_loadh_pi(_mm_loadl_pi(_mm_setzero_ps(), (const __m64 *)p), (const __m64 *)(p + oy));
+}
+
+static inline void
+store_quad(
+  float *const p,
+  const int oy,
+  const __m128 v)
+{
+  _mm_storel_pi((__m64 *)p, v);
+  _mm_storeh_pi((__m64 *)(p + oy), v);
+}
+
+dt_bilateral_t *
+dt_bilateral_init(
+  const int width,       // width of input image
+  const int height,      // height of input image
+  const float sigma_s,   // spatial sigma (blur pixel coords)
+  const float sigma_r)   // range sigma (blur luma values)
+{
+  dt_bilateral_t *b = (dt_bilateral_t *)malloc(sizeof(dt_bilateral_t));
+  if (!b) return NULL;
+  dt_bilateral_grid_size(width, height, sigma_s, sigma_r, &b->size_x, &b->size_y, &b->size_z);
+  b->width = width;
+  b->height = height;
+  b->sigma_s = MAX(height/(b->size_y-1.0f), width/(b->size_x-1.0f));
+  b->sigma_r = 100.0f/(b->size_z-1.0f);
+  // no need to clear it, the splat writes every cell
+  b->buf = dt_alloc_align(16, (size_t)b->size_x*b->size_y*b->size_z*sizeof(float));
+  if(!b->buf)
+  {
+    free(b);
+    return NULL;
+  }
+  dt_print(DT_DEBUG_DEV, "[bilateral] created grid [%d %d %d] with sigma (%f %f) (%f %f)\n",
+           b->size_x, b->size_y, b->size_z, b->sigma_s, sigma_s, b->sigma_r, sigma_r);
+  return b;
+}
+
+void
+dt_bilateral_splat(
+  dt_bilateral_t *b,
+  const float    *const in)
+{
+  const int size_x = b->size_x, size_y = b->size_y, size_z = b->size_z;
+  const float norm = 100.0f/(b->sigma_s*b->sigma_s);
+  // the image rows are cut into one band per thread. each band splats into its
+  // own slab of the grid: the grid rows its pixels touch, the last one of which
+  // is also the first of the next band. no atomics needed, the slabs are summed
+  // up afterwards.
+  const int bands = MAX(1, MIN(dt_get_num_threads(), size_y-1));
+  int *grid_row = (int *)malloc(sizeof(int)*(bands+1));
+  int *image_row = (int *)malloc(sizeof(int)*(bands+1));
+  float *slabs = dt_alloc_align(16, sizeof(float)*size_x*size_z*(size_y-1+bands));
+  if(!grid_row || !image_row || !slabs)
+  {
+    free(grid_row);
+    free(image_row);
+    free(slabs);
+    memset(b->buf, 0, (size_t)size_x*size_y*size_z*sizeof(float));
+    return;
+  }
+  for(int k=0; k<=bands; k++) grid_row[k] = (int)((size_y-1)*(int64_t)k/bands);
+  image_row[0] = 0;
+  for(int k=1, j=0; k<=bands; k++)
+  {
+    while(j < b->height && image_row_to_grid(b, j) < grid_row[k]) j++;
+    image_row[k] = k == bands ? b->height : j;
+  }
+  memset(slabs, 0, sizeof(float)*size_x*size_z*(size_y-1+bands));
+
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) shared(b, grid_row, image_row, slabs) schedule(static, 1)
+#endif
+  for(int k=0; k<bands; k++)
+  {
+    const int y0 = grid_row[k], ny = grid_row[k+1] - y0 + 1;
+    float *slab = slabs + (size_t)size_x*size_z*(y0 + k);
+    const int oy = size_x;
+    const int oz = size_x*ny;
+    for(int j=image_row[k]; j<image_row[k+1]; j++)
+    {
+      const float *px = in + 4*(size_t)j*b->width;
+      for(int i=0; i<b->width; i++, px+=4)
+      {
+        float x, y, z;
+        const float L = px[0];
+        image_to_grid(b, i, j, L, &x, &y, &z);
+        const int xi = MIN((int)x, size_x-2);
+        const int yi = MIN((int)y, size_y-2);
+        const int zi = MIN((int)z, size_z-2);
+        // sum up payload here, doesn't have to be same as edge stopping data
+        // for cross bilateral applications.
+        // also note that this is not clipped (as L->z is), so potentially hdr/out of gamut
+        // should not cause clipping here.
+        __m128 w0, w1;
+        trilinear_weights(x - xi, y - yi, z - zi, norm, &w0, &w1);
+        float *p = slab + xi + oy*(yi - y0) + (size_t)oz*zi;
+        store_quad(p, oy, _mm_add_ps(load_quad(p, oy), w0));
+        store_quad(p + oz, oy, _mm_add_ps(load_quad(p + oz, oy), w1));
+      }
+    }
+  }
+
+  // every band copies the rows it owns into the grid, then adds its
+  // last row to the first one of the next band (or copies it, if it's the last)
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) shared(b, grid_row, slabs) schedule(static, 1)
+#endif
+  for(int k=0; k<bands; k++)
+  {
+    const int y0 = grid_row[k], ny = grid_row[k+1] - y0 + 1;
+    const float *slab = slabs + (size_t)size_x*size_z*(y0 + k);
+    for(int z=0; z<size_z; z++)
+      memcpy(b->buf + (size_t)size_x*(y0 + (size_t)size_y*z), slab + (size_t)size_x*ny*z,
+             sizeof(float)*size_x*(ny-1));
+  }
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) shared(b, grid_row, slabs) schedule(static, 1)
+#endif
+  for(int k=0; k<bands; k++)
+  {
+    const int y0 = grid_row[k], ny = grid_row[k+1] - y0 + 1;
+    const float *slab = slabs + (size_t)size_x*size_z*(y0 + k);
+    for(int z=0; z<size_z; z++)
+    {
+      float *g = b->buf + (size_t)size_x*(grid_row[k+1] + (size_t)size_y*z);
+      const float *s = slab + (size_t)size_x*(ny-1 + (size_t)ny*z);
+      if(k == bands-1) memcpy(g, s, sizeof(float)*size_x);
+      else for(int i=0; i<size_x; i++) g[i] += s[i];
+    }
+  }
+
+  free(slabs);
+  free(image_row);
+  free(grid_row);
+}
+
+// gaussian up to 3 sigma along one line of n cells
+static inline void
+blur_line(
+  float    *buf,
+  const int stride,
+  const int n)
+{
+  const float w0 = 6.f/16.f;
+  const float w1 = 4.f/16.f;
+  const float w2 = 1.f/16.f;
+  int index = 0;
+  float tmp1 = buf[index];
+  buf[index] = buf[index]*w0 + w1*buf[index + stride] + w2*buf[index + 2*stride];
+  index += stride;
+  float tmp2 = buf[index];
+  buf[index] = buf[index]*w0 + w1*(buf[index + stride] + tmp1) + w2*buf[index + 2*stride];
+  index += stride;
+  for(int i=2; i<n-2; i++)
+  {
+    const float tmp3 = buf[index];
+    buf[index] = buf[index]*w0
+                 + w1*(buf[index + stride]   + tmp2)
+                 + w2*(buf[index + 2*stride] + tmp1);
+    index += stride;
+    tmp1 = tmp2;
+    tmp2 = tmp3;
+  }
+  const float tmp3 = buf[index];
+  buf[index] = buf[index]*w0 + w1*(buf[index + stride] + tmp2) + w2*tmp1;
+  index += stride;
+  buf[index] = buf[index]*w0 + w1*tmp3 + w2*tmp2;
+}
+
+// the same on four neighbouring lines at once, buf[0..3]
+static inline void
+blur_line_sse(
+  float    *buf,
+  const int stride,
+  const int n)
+{
+  const __m128 w0 = _mm_set1_ps(6.f/16.f);
+  const __m128 w1 = _mm_set1_ps(4.f/16.f);
+  const __m128 w2 = _mm_set1_ps(1.f/16.f);
+  float *p = buf;
+  __m128 tmp1 = _mm_loadu_ps(p);
+  __m128 b1 = _mm_loadu_ps(p + stride), b2 = _mm_loadu_ps(p + 2*stride);
+  _mm_storeu_ps(p, _mm_add_ps(_mm_add_ps(_mm_mul_ps(tmp1, w0), _mm_mul_ps(w1, b1)), _mm_mul_ps(w2, b2)));
+  p += stride;
+  __m128 tmp2 = b1;
+  b1 = b2;
+  b2 = _mm_loadu_ps(p + 2*stride);
+  _mm_storeu_ps(p, _mm_add_ps(_mm_add_ps(_mm_mul_ps(tmp2, w0), _mm_mul_ps(w1, _mm_add_ps(b1, tmp1))),
+                              _mm_mul_ps(w2, b2)));
+  p += stride;
+  for(int i=2; i<n-2; i++)
+  {
+    // b1 is the current cell, still unchanged
+    const __m128 tmp3 = b1;
+    const __m128 next1 = b2, next2 = _mm_loadu_ps(p + 2*stride);
+    _mm_storeu_ps(p, _mm_add_ps(_mm_add_ps(_mm_mul_ps(tmp3, w0), _mm_mul_ps(w1, _mm_add_ps(next1, tmp2))),
+                                _mm_mul_ps(w2, _mm_add_ps(next2, tmp1))));
+    p += stride;
+    tmp1 = tmp2;
+    tmp2 = tmp3;
+    b1 = next1;
+    b2 = next2;
+  }
+  const __m128 tmp3 = b1;
+  _mm_storeu_ps(p, _mm_add_ps(_mm_add_ps(_mm_mul_ps(tmp3, w0), _mm_mul_ps(w1, _mm_add_ps(b2, tmp2))),
+                              _mm_mul_ps(w2, tmp1)));
+  p += stride;
+  _mm_storeu_ps(p, _mm_add_ps(_mm_add_ps(_mm_mul_ps(b2, w0), _mm_mul_ps(w1, tmp3)), _mm_mul_ps(w2, tmp2)));
+}
+
+// -2 derivative of the gaussian up to 3 sigma: x*exp(-x*x), on four neighbouring lines
+static inline void
+blur_line_z_sse(
+  float    *buf,
+  const int stride,
+  const int n)
+{
+  const __m128 w1 = _mm_set1_ps(4.f/16.f);
+  const __m128 w2 = _mm_set1_ps(2.f/16.f);
+  float *p = buf;
+  __m128 tmp1 = _mm_loadu_ps(p);
+  __m128 b1 = _mm_loadu_ps(p + stride), b2 = _mm_loadu_ps(p + 2*stride);
+  _mm_storeu_ps(p, _mm_add_ps(_mm_mul_ps(w1, b1), _mm_mul_ps(w2, b2)));
+  p += stride;
+  __m128 tmp2 = b1;
+  b1 = b2;
+  b2 = _mm_loadu_ps(p + 2*stride);
+  _mm_storeu_ps(p, _mm_add_ps(_mm_mul_ps(w1, _mm_sub_ps(b1, tmp1)), _mm_mul_ps(w2, b2)));
+  p += stride;
+  for(int i=2; i<n-2; i++)
+  {
+    const __m128 tmp3 = b1;
+    const __m128 next1 = b2, next2 = _mm_loadu_ps(p + 2*stride);
+    _mm_storeu_ps(p, _mm_add_ps(_mm_mul_ps(w1, _mm_sub_ps(next1, tmp2)), _mm_mul_ps(w2, _mm_sub_ps(next2, tmp1))));
+    p += stride;
+    tmp1 = tmp2;
+    tmp2 = tmp3;
+    b1 = next1;
+    b2 = next2;
+  }
+  const __m128 tmp3 = b1;
+  _mm_storeu_ps(p, _mm_sub_ps(_mm_mul_ps(w1, _mm_sub_ps(b2, tmp2)), _mm_mul_ps(w2, tmp1)));
+  p += stride;
+  _mm_storeu_ps(p, _mm_sub_ps(_mm_setzero_ps(), _mm_add_ps(_mm_mul_ps(w1, tmp3), _mm_mul_ps(w2, tmp2))));
+}
+
+static inline void
+blur_line_z(
+  float    *buf,
+  const int stride,
+  const int n)
+{
+  const float w1 = 4.f/16.f;
+  const float w2 = 2.f/16.f;
+  int index = 0;
+  float tmp1 = buf[index];
+  buf[index] = w1*buf[index + stride] + w2*buf[index + 2*stride];
+  index += stride;
+  float tmp2 = buf[index];
+  buf[index] = w1*(buf[index + stride] - tmp1) + w2*buf[index + 2*stride];
+  index += stride;
+  for(int i=2; i<n-2; i++)
+  {
+    const float tmp3 = buf[index];
+    buf[index] =
+      + w1*(buf[index + stride]   - tmp2)
+      + w2*(buf[index + 2*stride] - tmp1);
+    index += stride;
+    tmp1 = tmp2;
+    tmp2 = tmp3;
+  }
+  const float tmp3 = buf[index];
+  buf[index] = w1*(buf[index + stride] - tmp2) - w2*tmp1;
+  index += stride;
+  buf[index] = - w1*tmp3 - w2*tmp2;
+}
+
+void
+dt_bilateral_blur(
+  dt_bilateral_t *b)
+{
+  const int size_x = b->size_x, size_y = b->size_y, size_z = b->size_z;
+  const size_t oz = (size_t)size_x*size_y;
+  // gaussian along x, the lines are the rows of the grid
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) shared(b) schedule(static)
+#endif
+  for(int l=0; l<size_y*size_z; l++)
+    blur_line(b->buf + (size_t)size_x*l, 1, size_x);
+
+  // gaussian along y and the derivative along z. neighbouring lines are
+  // next to each other in memory here, so four of them go into one register.
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) shared(b) schedule(static)
+#endif
+  for(int z=0; z<size_z; z++)
+  {
+    float *plane = b->buf + oz*z;
+    int i = 0;
+    for(; i+4<=size_x; i+=4) blur_line_sse(plane + i, size_x, size_y);
+    for(; i<size_x; i++) blur_line(plane + i, size_x, size_y);
+  }
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) shared(b) schedule(static)
+#endif
+  for(int y=0; y<size_y; y++)
+  {
+    float *row = b->buf + (size_t)size_x*y;
+    int i = 0;
+    for(; i+4<=size_x; i+=4) blur_line_z_sse(row + i, oz, size_z);
+    for(; i<size_x; i++) blur_line_z(row + i, oz, size_z);
+  }
+}
+
+// trilinear lookup of the blurred grid at the position of the pixel
+static inline float
+slice_pixel(
+  const dt_bilateral_t *const b,
+  const int i,
+  const int j,
+  const float L)
+{
+  float x, y, z;
+  image_to_grid(b, i, j, L, &x, &y, &z);
+  const int xi = MIN((int)x, b->size_x-2);
+  const int yi = MIN((int)y, b->size_y-2);
+  const int zi = MIN((int)z, b->size_z-2);
+  const int oy = b->size_x;
+  const size_t oz = (size_t)b->size_y*b->size_x;
+  const float *gi = b->buf + xi + (size_t)oy*yi + oz*zi;
+  __m128 w0, w1;
+  trilinear_weights(x - xi, y - yi, z - zi, 1.0f, &w0, &w1);
+  __m128 s = _mm_add_ps(_mm_mul_ps(load_quad(gi, oy), w0), _mm_mul_ps(load_quad(gi + oz, oy), w1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_shuffle_ps(s, s, _MM_SHUFFLE(1, 1, 1, 1)));
+  return _mm_cvtss_f32(s);
+}
+
+void
+dt_bilateral_slice(
+  const dt_bilateral_t *const b,
+  const float          *const in,
+  float                *out,
+  const float           detail)
+{
+  // detail: 0 is leave as is, -1 is bilateral filtered, +1 is contrast boost
+  const float norm = -detail * b->sigma_r * 0.04f;
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) shared(out) schedule(static)
+#endif
+  for(int j=0; j<b->height; j++)
+  {
+    size_t index = 4*(size_t)j*b->width;
+    for(int i=0; i<b->width; i++)
+    {
+      const float L = in[index];
+      const float Lout = L + norm * slice_pixel(b, i, j, L);
+      // copy color and mask, in and out may be the same buffer
+      const __m128 px = _mm_loadu_ps(in + index);
+      _mm_storeu_ps(out + index, _mm_move_ss(px, _mm_set_ss(MAX(0.0f, Lout))));
+      index += 4;
+    }
+  }
+}
+
+void
+dt_bilateral_slice_to_output(
+  const dt_bilateral_t *const b,
+  const float          *const in,
+  float                *out,
+  const float           detail)
+{
+  // detail: 0 is leave as is, -1 is bilateral filtered, +1 is contrast boost
+  const float norm = -detail * b->sigma_r * 0.04f;
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) shared(out) schedule(static)
+#endif
+  for(int j=0; j<b->height; j++)
+  {
+    size_t index = 4*(size_t)j*b->width;
+    for(int i=0; i<b->width; i++)
+    {
+      const float L = in[index];
+      const float Lout = norm * slice_pixel(b, i, j, L);
+      out[index] = MAX(0.0f, out[index] + Lout);
+      index += 4;
+    }
+  }
+}
+
+void
+dt_bilateral_free(
+  dt_bilateral_t *b)
+{
+  if(!b) return;
+  free(b->buf);
+  free(b);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
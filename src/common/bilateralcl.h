@@ -20,6 +20,7 @@
 #define DT_COMMON_BILATERAL_CL_H
 
 #ifdef HAVE_OPENCL
+#include "common/bilateral.h"
 #include "common/opencl.h"
 
 typedef struct dt_bilateral_cl_global_t
@@ -70,42 +71,6 @@ dt_bilateral_free_cl(
 }
 
 
-size_t
-dt_bilateral_memory_use(
-  const int width,       // width of input image
-  const int height,      // height of input image
-  const float sigma_s,   // spatial sigma (blur pixel coords)
-  const float sigma_r)   // range sigma (blur luma values)
-{
-  float _x = roundf(width/sigma_s);
-  float _y = roundf(height/sigma_s);
-  float _z = roundf(100.0f/sigma_r);
-  size_t size_x = CLAMPS((int)_x, 4, 900) + 1;
-  size_t size_y = CLAMPS((int)_y, 4, 900) + 1;
-  size_t size_z = CLAMPS((int)_z, 4, 50) + 1;
-
-  return size_x*size_y*size_z*sizeof(float)*2;
-}
-
-
-size_t
-dt_bilateral_singlebuffer_size(
-  const int width,       // width of input image
-  const int height,      // height of input image
-  const float sigma_s,   // spatial sigma (blur pixel coords)
-  const float sigma_r)   // range sigma (blur luma values)
-{
-  float _x = roundf(width/sigma_s);
-  float _y = roundf(height/sigma_s);
-  float _z = roundf(100.0f/sigma_r);
-  size_t size_x = CLAMPS((int)_x, 4, 900) + 1;
-  size_t size_y = CLAMPS((int)_y, 4, 900) + 1;
-  size_t size_z = CLAMPS((int)_z, 4, 50) + 1;
-
-  return size_x*size_y*size_z*sizeof(float);
-}
-
-
 dt_bilateral_cl_t *
 dt_bilateral_init_cl(
   const int devid,
@@ -153,12 +118,7 @@ dt_bilateral_init_cl(
   if(!b) return NULL;
 
   b->global = darktable.opencl->bilateral;
-  float _x = roundf(width/sigma_s);
-  float _y = roundf(height/sigma_s);
-  float _z = roundf(100.0f/sigma_r);
-  b->size_x = CLAMPS((int)_x, 4, 900) + 1;
-  b->size_y = CLAMPS((int)_y, 4, 900) + 1;
-  b->size_z = CLAMPS((int)_z, 4, 50) + 1;
+  dt_bilateral_grid_size(width, height, sigma_s, sigma_r, &b->size_x, &b->size_y, &b->size_z);
   b->width = width;
   b->height = height;
   b->blocksizex = blocksizex;
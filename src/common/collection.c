@@ -23,6 +23,7 @@
 #include "common/metadata.h"
 #include "common/utility.h"
 #include "common/image.h"
+#include "views/view.h"
 
 #include <stdio.h>
 #include <memory.h>
@@ -38,11 +39,91 @@
 /* Stores the collection query, returns 1 if changed.. */
 static int _dt_collection_store (const dt_collection_t *collection, gchar *query);
 
+/* drops the cached query result, cache->lock has to be held */
+static void
+_collection_cache_invalidate(dt_collection_cache_t *cache)
+{
+  g_free(cache->ids);
+  g_free(cache->keys);
+  if(cache->key_chunk)
+    g_string_chunk_free(cache->key_chunk);
+  if(cache->offsets)
+    g_hash_table_destroy(cache->offsets);
+  cache->ids = NULL;
+  cache->keys = NULL;
+  cache->key_chunk = NULL;
+  cache->offsets = NULL;
+  cache->count = 0;
+  cache->valid = 0;
+}
+
+/* runs the query once and keeps ids and sort keys, cache->lock has to be held */
+static void
+_collection_cache_fill(const dt_collection_t *collection)
+{
+  dt_collection_cache_t *cache = (dt_collection_cache_t *)&collection->cache;
+  if(cache->valid) return;
+  _collection_cache_invalidate(cache);
+
+  const gchar *query = cache->image_query ? cache->fill_query : collection->query;
+  if(!query) return;
+
+  sqlite3_stmt *stmt;
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), query, -1, &stmt, NULL);
+  if(!cache->image_query && (collection->params.query_flags&COLLECTION_QUERY_USE_LIMIT))
+  {
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1,  0);
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, -1);
+  }
+
+  uint32_t alloc = 1024;
+  cache->ids = g_malloc(sizeof(int32_t) * alloc);
+  if(cache->image_query)
+  {
+    cache->keys = g_malloc(sizeof(gchar *) * alloc);
+    cache->key_chunk = g_string_chunk_new(4096);
+  }
+  while(sqlite3_step(stmt) == SQLITE_ROW)
+  {
+    if(cache->count == alloc)
+    {
+      alloc *= 2;
+      cache->ids = g_realloc(cache->ids, sizeof(int32_t) * alloc);
+      if(cache->keys)
+        cache->keys = g_realloc(cache->keys, sizeof(gchar *) * alloc);
+    }
+    cache->ids[cache->count] = sqlite3_column_int(stmt, 0);
+    if(cache->keys)
+    {
+      const char *key = (const char *)sqlite3_column_text(stmt, 1);
+      cache->keys[cache->count] = key ? g_string_chunk_insert_const(cache->key_chunk, key) : NULL;
+    }
+    cache->count++;
+  }
+  sqlite3_finalize(stmt);
+  cache->valid = 1;
+}
+
+/* imgid -> offset + 1 of the cached result, cache->lock has to be held */
+static GHashTable *
+_collection_cache_offsets(dt_collection_cache_t *cache)
+{
+  if(!cache->offsets)
+  {
+    cache->offsets = g_hash_table_new(NULL, NULL);
+    for(uint32_t k = 0; k < cache->count; k++)
+      if(!g_hash_table_lookup(cache->offsets, GINT_TO_POINTER(cache->ids[k])))
+        g_hash_table_insert(cache->offsets, GINT_TO_POINTER(cache->ids[k]), GINT_TO_POINTER(k + 1));
+  }
+  return cache->offsets;
+}
+
 const dt_collection_t *
 dt_collection_new (const dt_collection_t *clone)
 {
   dt_collection_t *collection = g_malloc (sizeof (dt_collection_t));
   memset (collection,0,sizeof (dt_collection_t));
+  dt_pthread_mutex_init(&collection->cache.lock, NULL);
 
   /* initialize collection context*/
   if (clone)   /* if clone is provided let's copy it into this context */
@@ -50,6 +131,7 @@ dt_collection_new (const dt_collection_t *clone)
     memcpy (&collection->params,&clone->params,sizeof (dt_collection_params_t));
     memcpy (&collection->store,&clone->store,sizeof (dt_collection_params_t));
     collection->where_ext = g_strdup(clone->where_ext);
+    collection->where_ext_depends = clone->where_ext_depends;
     collection->query = g_strdup(clone->query);
     collection->clone = 1;
   }
@@ -66,6 +148,11 @@ dt_collection_free (const dt_collection_t *collection)
     g_free (collection->query);
   if (collection->where_ext)
     g_free (collection->where_ext);
+  dt_collection_cache_t *cache = (dt_collection_cache_t *)&collection->cache;
+  _collection_cache_invalidate(cache);
+  g_free(cache->fill_query);
+  g_free(cache->image_query);
+  dt_pthread_mutex_destroy(&cache->lock);
   g_free ((dt_collection_t *)collection);
 }
 
@@ -101,10 +188,11 @@ dt_collection_update (const dt_collection_t *collection)
     else if (collection->params.filter_flags & COLLECTION_FILTER_EQUAL_RATING)
       wq = dt_util_dstrcat(wq, " %s (flags & 7) == %d", (need_operator)?"and":((need_operator=1)?"":""), collection->params.rating);
 
+    /* correlated exists() probes imgid_index, the old "id in (select .. where imgid=id)" was re-run per image */
     if (collection->params.filter_flags & COLLECTION_FILTER_ALTERED)
-      wq = dt_util_dstrcat(wq, " %s id in (select imgid from history where imgid=id)", (need_operator)?"and":((need_operator=1)?"":"") );
+      wq = dt_util_dstrcat(wq, " %s exists(select 1 from history where imgid = images.id)", (need_operator)?"and":((need_operator=1)?"":"") );
     else if (collection->params.filter_flags & COLLECTION_FILTER_UNALTERED)
-      wq = dt_util_dstrcat(wq, " %s id not in (select imgid from history where imgid=id)", (need_operator)?"and":((need_operator=1)?"":"") );
+      wq = dt_util_dstrcat(wq, " %s not exists(select 1 from history where imgid = images.id)", (need_operator)?"and":((need_operator=1)?"":"") );
 
     /* add where ext if wanted */
     if ((collection->params.query_flags&COLLECTION_QUERY_USE_WHERE_EXT))
@@ -139,6 +227,41 @@ dt_collection_update (const dt_collection_t *collection)
   query = dt_util_dstrcat(query, "%s %s%s", selq, sq?sq:"", (collection->params.query_flags&COLLECTION_QUERY_USE_LIMIT)?" "LIMIT_QUERY:"");
   result = _dt_collection_store(collection, query);
 
+  /* what the result depends on, and the sort key to follow single images by */
+  uint32_t depends = COLLECTION_CHANGE_IMAGE;
+  const char *key = "id";
+  if (collection->params.filter_flags & (COLLECTION_FILTER_ALTERED|COLLECTION_FILTER_UNALTERED))
+    depends |= COLLECTION_CHANGE_HISTORY;
+  if (collection->params.query_flags & (COLLECTION_QUERY_USE_WHERE_EXT|COLLECTION_QUERY_USE_ONLY_WHERE_EXT))
+    depends |= collection->where_ext_depends;
+  if (collection->params.query_flags&COLLECTION_QUERY_USE_ONLY_WHERE_EXT)
+    key = NULL;
+  else if (collection->params.query_flags&COLLECTION_QUERY_USE_SORT)
+  {
+    switch(collection->params.sort)
+    {
+      case DT_COLLECTION_SORT_DATETIME: key = "datetime_taken"; break;
+      case DT_COLLECTION_SORT_RATING:   key = "flags & 7"; break;
+      case DT_COLLECTION_SORT_FILENAME: key = "filename"; break;
+      case DT_COLLECTION_SORT_ID:       key = "id"; break;
+      case DT_COLLECTION_SORT_COLOR:    key = NULL; depends |= COLLECTION_CHANGE_COLORLABEL; break;
+    }
+  }
+
+  dt_collection_cache_t *cache = (dt_collection_cache_t *)&collection->cache;
+  dt_pthread_mutex_lock(&cache->lock);
+  _collection_cache_invalidate(cache);
+  g_free(cache->fill_query);
+  g_free(cache->image_query);
+  cache->fill_query = cache->image_query = NULL;
+  cache->depends = depends;
+  if (key)
+  {
+    cache->fill_query = dt_util_dstrcat(NULL, "select distinct id, %s from images where %s %s", key, wq, sq?sq:"");
+    cache->image_query = dt_util_dstrcat(NULL, "select %s from images where id = ?1 and (%s)", key, wq);
+  }
+  dt_pthread_mutex_unlock(&cache->lock);
+
   /* free memory used */
   if (sq)
     g_free(sq);
@@ -214,8 +337,9 @@ dt_collection_set_extended_where(const dt_collection_t *collection,gchar *extend
   if (collection->where_ext)
     g_free (collection->where_ext);
 
-  /* set new from parameter */
+  /* set new from parameter, we don't know what it refers to */
   ((dt_collection_t *)collection)->where_ext = g_strdup(extended_where);
+  ((dt_collection_t *)collection)->where_ext_depends = COLLECTION_CHANGE_ALL;
 }
 
 void
@@ -357,6 +481,17 @@ uint32_t dt_collection_get_count(const dt_collection_t *collection)
   const gchar *query = dt_collection_get_query(collection);
   gchar *count_query = NULL;
 
+  /* the main collection keeps its result, clones are only used for their query */
+  if (!collection->clone)
+  {
+    dt_collection_cache_t *cache = (dt_collection_cache_t *)&collection->cache;
+    dt_pthread_mutex_lock(&cache->lock);
+    _collection_cache_fill(collection);
+    count = cache->count;
+    dt_pthread_mutex_unlock(&cache->lock);
+    return count;
+  }
+
   gchar *fq = g_strstr_len(query, strlen(query), "from");
   if ((collection->params.query_flags&COLLECTION_QUERY_USE_ONLY_WHERE_EXT))
     count_query = dt_util_dstrcat(NULL, "select count(images.id) from images %s", collection->where_ext);
@@ -429,6 +564,63 @@ GList *dt_collection_get_selected (const dt_collection_t *collection)
   return list;
 }
 
+/* is the full text index on meta_data there? see dt_control_create_database_indices() */
+static gboolean
+_collection_have_metadata_fts()
+{
+  static int have_fts = -1;
+  if(have_fts < 0)
+  {
+    // the table can be in the schema without this sqlite knowing fts4, so actually query it
+    have_fts = (sqlite3_exec(dt_database_get(darktable.db), "select docid from meta_data_fts limit 0",
+                             NULL, NULL, NULL) == SQLITE_OK);
+  }
+  return have_fts;
+}
+
+/* turn "foo bar" into the fts query "foo* bar*", i.e. all words have to
+   start with the given ones. that finds less than like '%...%' ("ark" doesn't
+   find "darktable"), so it is only used when the user asked for word search.
+   returns NULL if the text contains anything but letters, digits and blanks,
+   we use like '%...%' for those. */
+static gchar *
+_collection_fts_pattern(const gchar *text)
+{
+  for(const gchar *c = text; *c; c = g_utf8_next_char(c))
+  {
+    const gunichar u = g_utf8_get_char(c);
+    if(u != ' ' && !g_unichar_isalnum(u)) return NULL;
+  }
+
+  gchar *pattern = NULL;
+  gchar **words = g_strsplit(text, " ", -1);
+  for(gchar **w = words; *w; w++)
+  {
+    if(**w == '\0') continue;
+    // lower case, or AND, OR, NOT and NEAR would be taken as operators
+    gchar *word = g_ascii_strdown(*w, -1);
+    pattern = dt_util_dstrcat(pattern, "%s%s*", pattern ? " " : "", word);
+    g_free(word);
+  }
+  g_strfreev(words);
+  return pattern;
+}
+
+static void
+get_metadata_query_string(const int key, const gchar *escaped_text, char *query)
+{
+  gchar *pattern = NULL;
+  if(dt_conf_get_bool("plugins/lighttable/collect/metadata_word_search") && _collection_have_metadata_fts())
+    pattern = _collection_fts_pattern(escaped_text);
+  if(pattern)
+    snprintf(query, 1024, "(id in (select id from meta_data where key = %d and rowid in "
+             "(select docid from meta_data_fts where value match '%s')))", key, pattern);
+  else
+    snprintf(query, 1024, "(id in (select id from meta_data where key = %d and value like '%%%s%%'))",
+             key, escaped_text);
+  g_free(pattern);
+}
+
 static void
 get_query_string(const dt_collection_properties_t property, const gchar *escaped_text, char *query)
 {
@@ -462,7 +654,7 @@ get_query_string(const dt_collection_properties_t property, const gchar *escaped
     break;
 
     case DT_COLLECTION_PROP_HISTORY: // history
-      snprintf(query, 1024, "(id %s in (select imgid from history where imgid=images.id)) ",(strcmp(escaped_text,_("altered"))==0)?"":"not");
+      snprintf(query, 1024, "(%s exists(select 1 from history where imgid = images.id)) ",(strcmp(escaped_text,_("altered"))==0)?"":"not");
       break;
 
     case DT_COLLECTION_PROP_CAMERA: // camera
@@ -476,24 +668,19 @@ get_query_string(const dt_collection_properties_t property, const gchar *escaped
       // TODO: How to handle images without metadata? In the moment they are not shown.
       // TODO: Autogenerate this code?
     case DT_COLLECTION_PROP_TITLE: // title
-      snprintf(query, 1024, "(id in (select id from meta_data where key = %d and value like '%%%s%%'))",
-               DT_METADATA_XMP_DC_TITLE, escaped_text);
+      get_metadata_query_string(DT_METADATA_XMP_DC_TITLE, escaped_text, query);
       break;
     case DT_COLLECTION_PROP_DESCRIPTION: // description
-      snprintf(query, 1024, "(id in (select id from meta_data where key = %d and value like '%%%s%%'))",
-               DT_METADATA_XMP_DC_DESCRIPTION, escaped_text);
+      get_metadata_query_string(DT_METADATA_XMP_DC_DESCRIPTION, escaped_text, query);
       break;
     case DT_COLLECTION_PROP_CREATOR: // creator
-      snprintf(query, 1024, "(id in (select id from meta_data where key = %d and value like '%%%s%%'))",
-               DT_METADATA_XMP_DC_CREATOR, escaped_text);
+      get_metadata_query_string(DT_METADATA_XMP_DC_CREATOR, escaped_text, query);
       break;
     case DT_COLLECTION_PROP_PUBLISHER: // publisher
-      snprintf(query, 1024, "(id in (select id from meta_data where key = %d and value like '%%%s%%'))",
-               DT_METADATA_XMP_DC_PUBLISHER, escaped_text);
+      get_metadata_query_string(DT_METADATA_XMP_DC_PUBLISHER, escaped_text, query);
       break;
     case DT_COLLECTION_PROP_RIGHTS: // rights
-      snprintf(query, 1024, "(id in (select id from meta_data where key = %d and value like '%%%s%%'))",
-               DT_METADATA_XMP_DC_RIGHTS, escaped_text);
+      get_metadata_query_string(DT_METADATA_XMP_DC_RIGHTS, escaped_text, query);
       break;
     case DT_COLLECTION_PROP_LENS: // lens
       snprintf(query, 1024, "(lens like '%%%s%%')", escaped_text);
@@ -514,6 +701,29 @@ get_query_string(const dt_collection_properties_t property, const gchar *escaped
   }
 }
 
+/* which tables a rule of the given property looks at */
+static uint32_t
+get_query_depends(const dt_collection_properties_t property)
+{
+  switch(property)
+  {
+    case DT_COLLECTION_PROP_COLORLABEL:
+      return COLLECTION_CHANGE_COLORLABEL;
+    case DT_COLLECTION_PROP_HISTORY:
+      return COLLECTION_CHANGE_HISTORY;
+    case DT_COLLECTION_PROP_TAG:
+      return COLLECTION_CHANGE_TAG;
+    case DT_COLLECTION_PROP_TITLE:
+    case DT_COLLECTION_PROP_DESCRIPTION:
+    case DT_COLLECTION_PROP_CREATOR:
+    case DT_COLLECTION_PROP_PUBLISHER:
+    case DT_COLLECTION_PROP_RIGHTS:
+      return COLLECTION_CHANGE_METADATA;
+    default: // film roll, folders, exif data, filename, day and time are all in the images table
+      return COLLECTION_CHANGE_IMAGE;
+  }
+}
+
 int
 dt_collection_serialize(char *buf, int bufsize)
 {
@@ -584,6 +794,7 @@ dt_collection_update_query(const dt_collection_t *collection)
   const int _n_r = dt_conf_get_int("plugins/lighttable/collect/num_rules");
   const int num_rules = CLAMP(_n_r, 1, 10);
   char *conj[] = {"and", "or", "and not"};
+  uint32_t depends = 0;
 
   complete_query = dt_util_dstrcat(complete_query, "(");
 
@@ -599,6 +810,7 @@ dt_collection_update_query(const dt_collection_t *collection)
     gchar *escaped_text = dt_util_str_replace(text, "'", "''");
 
     get_query_string(property, escaped_text, query);
+    depends |= get_query_depends(property);
 
     if(i > 0)
       complete_query = dt_util_dstrcat(complete_query, " %s %s", conj[mode], query);
@@ -615,6 +827,7 @@ dt_collection_update_query(const dt_collection_t *collection)
 
   /* set the extended where and the use of it in the query */
   dt_collection_set_extended_where (collection, complete_query);
+  ((dt_collection_t *)collection)->where_ext_depends = depends;
   dt_collection_set_query_flags (collection, (dt_collection_get_query_flags (collection) | COLLECTION_QUERY_USE_WHERE_EXT));
 
   /* remove film id from default filter */
@@ -630,7 +843,40 @@ dt_collection_update_query(const dt_collection_t *collection)
   sqlite3_stmt *stmt = NULL;
   const gchar *cquery = dt_collection_get_query(collection);
   complete_query = NULL;
-  if(cquery && cquery[0] != '\0')
+  if(!collection->clone)
+  {
+    // the result is cached by now, no need to run the query once more
+    dt_collection_cache_t *cache = (dt_collection_cache_t *)&collection->cache;
+    GList *removed = NULL;
+    dt_pthread_mutex_lock(&cache->lock);
+    _collection_cache_fill(collection);
+    GHashTable *offsets = _collection_cache_offsets(cache);
+    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "select imgid from selected_images", -1, &stmt, NULL);
+    while(sqlite3_step(stmt) == SQLITE_ROW)
+    {
+      const int imgid = sqlite3_column_int(stmt, 0);
+      if(!g_hash_table_lookup(offsets, GINT_TO_POINTER(imgid)))
+        removed = g_list_prepend(removed, GINT_TO_POINTER(imgid));
+    }
+    sqlite3_finalize(stmt);
+    dt_pthread_mutex_unlock(&cache->lock);
+
+    if(removed)
+    {
+      DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "delete from selected_images where imgid = ?1", -1, &stmt, NULL);
+      for(GList *l = removed; l; l = g_list_next(l))
+      {
+        DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, GPOINTER_TO_INT(l->data));
+        sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+      }
+      sqlite3_finalize(stmt);
+      g_list_free(removed);
+      dt_view_image_info_invalidate();
+    }
+  }
+  else if(cquery && cquery[0] != '\0')
   {
     complete_query = dt_util_dstrcat(complete_query, "delete from selected_images where imgid not in (%s)", cquery);
     DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), complete_query, -1, &stmt, NULL);
@@ -641,6 +887,7 @@ dt_collection_update_query(const dt_collection_t *collection)
 
     /* free allocated strings */
     g_free(complete_query);
+    dt_view_image_info_invalidate();
   }
 
 
@@ -652,6 +899,10 @@ dt_collection_update_query(const dt_collection_t *collection)
 
 void dt_collection_hint_message(const dt_collection_t *collection)
 {
+  /* we are called after selection, rating and label changes, all of which
+     show up in the thumbnail decorations */
+  dt_view_image_info_invalidate();
+
   /* collection hinting */
   gchar message[1024];
   int c = dt_collection_get_count(collection);
@@ -663,35 +914,89 @@ void dt_collection_hint_message(const dt_collection_t *collection)
 
 int dt_collection_image_offset(int imgid)
 {
-  const gchar *qin = dt_collection_get_query (darktable.collection);
-  int offset = 0;
-  sqlite3_stmt *stmt;
+  const dt_collection_t *collection = darktable.collection;
+  dt_collection_cache_t *cache = (dt_collection_cache_t *)&collection->cache;
 
-  if(qin)
-  {
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), qin, -1, &stmt, NULL);
-    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1,  0);
-    DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, -1);
+  /* make sure there is a query before we lock */
+  if(!dt_collection_get_query(collection)) return 0;
 
-    gboolean found = FALSE;
+  dt_pthread_mutex_lock(&cache->lock);
+  _collection_cache_fill(collection);
+  const int offset = GPOINTER_TO_INT(g_hash_table_lookup(_collection_cache_offsets(cache), GINT_TO_POINTER(imgid)));
+  dt_pthread_mutex_unlock(&cache->lock);
 
-    while (sqlite3_step (stmt) == SQLITE_ROW)
-    {
-      int id = sqlite3_column_int(stmt, 0);
-      if (imgid == id)
-      {
-        found = TRUE;
-        break;
-      }
-      offset++;
-    }
+  return offset > 0 ? offset - 1 : 0;
+}
 
-    if (!found)
-      offset = 0;
+void dt_collection_image_changed(const dt_collection_t *collection, int imgid, uint32_t change)
+{
+  if(!collection || collection->clone) return;
+  dt_collection_cache_t *cache = (dt_collection_cache_t *)&collection->cache;
 
-    sqlite3_finalize(stmt);
+  dt_pthread_mutex_lock(&cache->lock);
+  if(cache->batch)
+  {
+    // sorted out once by dt_collection_changes_end()
+    cache->batch_changes |= change;
+    dt_pthread_mutex_unlock(&cache->lock);
+    return;
+  }
+  if(!cache->valid || !(cache->depends & change))
+  {
+    dt_pthread_mutex_unlock(&cache->lock);
+    return;
   }
-  return offset;
+  if(imgid <= 0 || !cache->image_query)
+  {
+    _collection_cache_invalidate(cache);
+    dt_pthread_mutex_unlock(&cache->lock);
+    return;
+  }
+
+  GHashTable *offsets = _collection_cache_offsets(cache);
+  const int offset = GPOINTER_TO_INT(g_hash_table_lookup(offsets, GINT_TO_POINTER(imgid))) - 1;
+
+  sqlite3_stmt *stmt;
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), cache->image_query, -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
+  if(sqlite3_step(stmt) == SQLITE_ROW)
+  {
+    // still in the collection. new images or changed sort keys would need sorting in, run the query again then.
+    const char *key = (const char *)sqlite3_column_text(stmt, 0);
+    if(offset < 0 || g_strcmp0(key, cache->keys[offset]))
+      _collection_cache_invalidate(cache);
+  }
+  else if(offset >= 0)
+  {
+    // dropped out of the collection, the order of the others stays the same
+    memmove(cache->ids + offset, cache->ids + offset + 1, sizeof(int32_t) * (cache->count - offset - 1));
+    memmove(cache->keys + offset, cache->keys + offset + 1, sizeof(gchar *) * (cache->count - offset - 1));
+    cache->count--;
+    g_hash_table_remove(offsets, GINT_TO_POINTER(imgid));
+    for(uint32_t k = offset; k < cache->count; k++)
+      if(GPOINTER_TO_INT(g_hash_table_lookup(offsets, GINT_TO_POINTER(cache->ids[k]))) == (int)k + 2)
+        g_hash_table_insert(offsets, GINT_TO_POINTER(cache->ids[k]), GINT_TO_POINTER(k + 1));
+  }
+  sqlite3_finalize(stmt);
+  dt_pthread_mutex_unlock(&cache->lock);
+}
+
+void dt_collection_changes_begin(const dt_collection_t *collection)
+{
+  if(!collection || collection->clone) return;
+  dt_collection_cache_t *cache = (dt_collection_cache_t *)&collection->cache;
+  dt_pthread_mutex_lock(&cache->lock);
+  if(!cache->batch++) cache->batch_changes = 0;
+  dt_pthread_mutex_unlock(&cache->lock);
+}
+
+void dt_collection_changes_end(const dt_collection_t *collection)
+{
+  if(!collection || collection->clone) return;
+  dt_collection_cache_t *cache = (dt_collection_cache_t *)&collection->cache;
+  dt_pthread_mutex_lock(&cache->lock);
+  if(!--cache->batch && (cache->depends & cache->batch_changes)) _collection_cache_invalidate(cache);
+  dt_pthread_mutex_unlock(&cache->lock);
 }
 
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
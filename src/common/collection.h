@@ -18,6 +18,7 @@
 #ifndef DT_COLLECTION_H
 #define DT_COLLECTION_H
 
+#include "common/dtpthread.h"
 #include <inttypes.h>
 #include <glib.h>
 
@@ -36,6 +37,16 @@
 #define COLLECTION_FILTER_ALTERED               8             // show only altered images
 #define COLLECTION_FILTER_UNALTERED            16             // show only unaltered images
 
+
+#define COLLECTION_CHANGE_IMAGE                 1             // a column of the images table, rating, flags, datetime, ...
+#define COLLECTION_CHANGE_COLORLABEL            2             // color labels were set or removed
+#define COLLECTION_CHANGE_TAG                   4             // tags were attached or detached
+#define COLLECTION_CHANGE_HISTORY               8             // history stack was written or removed
+#define COLLECTION_CHANGE_METADATA             16             // title, description, creator, ...
+
+#define COLLECTION_CHANGE_ALL (COLLECTION_CHANGE_IMAGE|COLLECTION_CHANGE_COLORLABEL|COLLECTION_CHANGE_TAG|\
+                               COLLECTION_CHANGE_HISTORY|COLLECTION_CHANGE_METADATA)
+
 typedef enum dt_collection_filter_t
 {
   DT_COLLECTION_FILTER_ALL = 0,
@@ -101,13 +112,40 @@ typedef struct dt_collection_params_t
 
 } dt_collection_params_t;
 
+/** result of the query of the main collection, filled on demand and kept
+    up to date by dt_collection_image_changed(). */
+typedef struct dt_collection_cache_t
+{
+  int valid;
+  uint32_t count;
+  int32_t *ids;
+  /** sort key of every id, NULL if single image changes can't be tracked */
+  gchar **keys;
+  GStringChunk *key_chunk;
+  /** imgid -> offset + 1, rebuilt on demand */
+  GHashTable *offsets;
+  /** COLLECTION_CHANGE_x flags the result depends on */
+  uint32_t depends;
+  /** fills the cache, and fetches the sort key of one image if it is part of the collection */
+  gchar *fill_query;
+  gchar *image_query;
+  /** nesting depth of dt_collection_changes_begin(), and what changed meanwhile */
+  int batch;
+  uint32_t batch_changes;
+  dt_pthread_mutex_t lock;
+}
+dt_collection_cache_t;
+
 typedef struct dt_collection_t
 {
   int clone;
   gchar *query;
   gchar *where_ext;
+  /** COLLECTION_CHANGE_x flags the extended where part depends on */
+  uint32_t where_ext_depends;
   dt_collection_params_t params;
   dt_collection_params_t store;
+  dt_collection_cache_t cache;
 }
 dt_collection_t;
 
@@ -170,6 +208,14 @@ void dt_collection_hint_message(const dt_collection_t *collection);
 /** returns the image offset in the collection */
 int dt_collection_image_offset(int imgid);
 
+/** tell the collection that an image changed, imgid -1 for all selected images.
+    change is a combination of COLLECTION_CHANGE_x flags. */
+void dt_collection_image_changed(const dt_collection_t *collection, int imgid, uint32_t change);
+/** bracket changes of many images, the cache is then updated once at the end
+    instead of once per image. */
+void dt_collection_changes_begin(const dt_collection_t *collection);
+void dt_collection_changes_end(const dt_collection_t *collection);
+
 /* serialize and deserialize into a string. */
 void dt_collection_deserialize(char *buf);
 int dt_collection_serialize(char *buf, int bufsize);
@@ -23,6 +23,7 @@
 #include "control/control.h"
 #include "control/conf.h"
 #include "gui/gtk.h"
+#include "views/view.h"
 #include <gdk/gdkkeysyms.h>
 
 const char *dt_colorlabels_name[] =
@@ -38,6 +39,8 @@ const char *dt_colorlabels_name[] =
 void dt_colorlabels_remove_labels_selection ()
 {
   DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db), "delete from color_labels where imgid in (select imgid from selected_images)", NULL, NULL, NULL);
+  dt_view_image_info_invalidate();
+  dt_collection_image_changed(darktable.collection, -1, COLLECTION_CHANGE_COLORLABEL);
 }
 
 void dt_colorlabels_remove_labels (const int imgid)
@@ -47,6 +50,8 @@ void dt_colorlabels_remove_labels (const int imgid)
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
   sqlite3_step(stmt);
   sqlite3_finalize(stmt);
+  dt_view_image_info_invalidate();
+  dt_collection_image_changed(darktable.collection, imgid, COLLECTION_CHANGE_COLORLABEL);
 }
 
 void dt_colorlabels_set_label (const int imgid, const int color)
@@ -57,6 +62,8 @@ void dt_colorlabels_set_label (const int imgid, const int color)
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, color);
   sqlite3_step(stmt);
   sqlite3_finalize(stmt);
+  dt_view_image_info_invalidate();
+  dt_collection_image_changed(darktable.collection, imgid, COLLECTION_CHANGE_COLORLABEL);
 }
 
 void dt_colorlabels_remove_label (const int imgid, const int color)
@@ -67,6 +74,8 @@ void dt_colorlabels_remove_label (const int imgid, const int color)
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, color);
   sqlite3_step(stmt);
   sqlite3_finalize(stmt);
+  dt_view_image_info_invalidate();
+  dt_collection_image_changed(darktable.collection, imgid, COLLECTION_CHANGE_COLORLABEL);
 }
 
 
@@ -94,6 +103,7 @@ void dt_colorlabels_toggle_label_selection (const int color)
   // clean up
   DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db), "delete from memory.color_labels_temp", NULL, NULL, NULL);
 
+  dt_collection_image_changed(darktable.collection, -1, COLLECTION_CHANGE_COLORLABEL);
   dt_collection_hint_message(darktable.collection);
 }
 
@@ -122,6 +132,7 @@ void dt_colorlabels_toggle_label (const int imgid, const int color)
   }
   sqlite3_finalize(stmt);
 
+  dt_collection_image_changed(darktable.collection, imgid, COLLECTION_CHANGE_COLORLABEL);
   dt_collection_hint_message(darktable.collection);
 }
 
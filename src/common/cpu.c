@@ -0,0 +1,108 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/cpu.h"
+#include "common/darktable.h"
+#include <stdint.h>
+#include <string.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+static const char *_cpu_isa_names[] = { "sse2", "avx", "avx2" };
+
+const char *dt_cpu_isa_name(const dt_cpu_isa_t isa)
+{
+  return _cpu_isa_names[CLAMP(isa, DT_CPU_ISA_SSE2, DT_CPU_ISA_LAST)];
+}
+
+static uint32_t _cpu_detect_flags(void)
+{
+  uint32_t flags = 0;
+#if defined(__i386__) || defined(__x86_64__)
+  unsigned int a, b, c, d;
+  if(!__get_cpuid(1, &a, &b, &c, &d)) return 0;
+  if(d & (1u << 25)) flags |= DT_CPU_FLAG_SSE;
+  if(d & (1u << 26)) flags |= DT_CPU_FLAG_SSE2;
+  if(c & (1u << 0))  flags |= DT_CPU_FLAG_SSE3;
+
+  // avx needs the os to save the ymm registers on context switches (osxsave, then xcr0 bits 1 and 2)
+  const int avx = (c & (1u << 28)) && (c & (1u << 27));
+  const int fma = (c & (1u << 12)) != 0;
+  if(avx)
+  {
+    uint32_t xcr0_lo, xcr0_hi;
+    __asm__ __volatile__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if((xcr0_lo & 6) == 6)
+    {
+      flags |= DT_CPU_FLAG_AVX;
+      if(fma) flags |= DT_CPU_FLAG_FMA;
+      if(__get_cpuid_max(0, NULL) >= 7)
+      {
+        __cpuid_count(7, 0, a, b, c, d);
+        if(b & (1u << 5)) flags |= DT_CPU_FLAG_AVX2;
+      }
+    }
+  }
+#endif
+  return flags;
+}
+
+static dt_cpu_isa_t _cpu_best_isa(const uint32_t flags)
+{
+  if((flags & DT_CPU_FLAG_AVX2) && (flags & DT_CPU_FLAG_FMA)) return DT_CPU_ISA_AVX2;
+  if(flags & DT_CPU_FLAG_AVX) return DT_CPU_ISA_AVX;
+  return DT_CPU_ISA_SSE2;
+}
+
+void dt_cpu_init(const char *force)
+{
+  darktable.cpu_flags = _cpu_detect_flags();
+  const dt_cpu_isa_t best = _cpu_best_isa(darktable.cpu_flags);
+  darktable.cpu_isa = best;
+
+  if(force)
+  {
+    int found = 0;
+    for(int k=DT_CPU_ISA_SSE2; k<=DT_CPU_ISA_LAST; k++)
+    {
+      if(strcmp(force, _cpu_isa_names[k])) continue;
+      found = 1;
+      // running avx code on a cpu without it would just crash with SIGILL
+      if(k > best)
+        fprintf(stderr, "[cpu] this cpu does not support %s, using %s\n", force, dt_cpu_isa_name(best));
+      else
+        darktable.cpu_isa = k;
+    }
+    if(!found)
+      fprintf(stderr, "[cpu] unknown instruction set `%s', using %s\n", force, dt_cpu_isa_name(best));
+  }
+
+  dt_print(DT_DEBUG_PERF, "[cpu] flags:%s%s%s%s%s%s, kernels use %s%s\n",
+           (darktable.cpu_flags & DT_CPU_FLAG_SSE)  ? " sse"  : "",
+           (darktable.cpu_flags & DT_CPU_FLAG_SSE2) ? " sse2" : "",
+           (darktable.cpu_flags & DT_CPU_FLAG_SSE3) ? " sse3" : "",
+           (darktable.cpu_flags & DT_CPU_FLAG_AVX)  ? " avx"  : "",
+           (darktable.cpu_flags & DT_CPU_FLAG_AVX2) ? " avx2" : "",
+           (darktable.cpu_flags & DT_CPU_FLAG_FMA)  ? " fma"  : "",
+           dt_cpu_isa_name(darktable.cpu_isa), darktable.cpu_isa != best ? " (forced)" : "");
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,64 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DT_COMMON_CPU_H
+#define DT_COMMON_CPU_H
+
+/**
+ * instruction set levels hot kernels are built for. the sources listed in
+ * DT_ISA_KERNELS (src/CMakeLists.txt) are compiled once per level with the
+ * matching -m flags and DT_CPU_ISA_SUFFIX set, the level used at runtime is
+ * the best one the cpu and os support, unless forced with --isa.
+ */
+typedef enum dt_cpu_isa_t
+{
+  DT_CPU_ISA_SSE2 = 0,
+  DT_CPU_ISA_AVX  = 1,
+  DT_CPU_ISA_AVX2 = 2  // avx2 and fma
+}
+dt_cpu_isa_t;
+
+#define DT_CPU_ISA_LAST DT_CPU_ISA_AVX2
+
+// name a function after the level the current file is built for: foo -> foo_avx2
+#define DT_CPU_ISA_CONCAT2(name, suffix) name##_##suffix
+#define DT_CPU_ISA_CONCAT(name, suffix) DT_CPU_ISA_CONCAT2(name, suffix)
+#define DT_CPU_ISA_FUNC(name) DT_CPU_ISA_CONCAT(name, DT_CPU_ISA_SUFFIX)
+
+// declare all variants of a kernel, e.g. DT_CPU_ISA_DECLARE(void, foo, (float *buf, int n))
+#define DT_CPU_ISA_DECLARE(ret, name, args) \
+  ret name##_sse2 args; \
+  ret name##_avx args; \
+  ret name##_avx2 args;
+
+// pick the variant for the level in use, needs darktable.h
+#define DT_CPU_ISA_SELECT(name) \
+  (darktable.cpu_isa >= DT_CPU_ISA_AVX2 ? name##_avx2 : \
+   darktable.cpu_isa >= DT_CPU_ISA_AVX ? name##_avx : name##_sse2)
+
+/** detect the cpu features, fill darktable.cpu_flags and choose darktable.cpu_isa.
+ *  force is the name of a level or NULL. a level the cpu can't run is refused. */
+void dt_cpu_init(const char *force);
+
+/** name of a level as used on the command line */
+const char *dt_cpu_isa_name(const dt_cpu_isa_t isa);
+
+#endif
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
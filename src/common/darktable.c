@@ -33,9 +33,11 @@
 #include "common/image.h"
 #include "common/image_cache.h"
 #include "common/imageio_module.h"
+#include "common/memory_budget.h"
 #include "common/mipmap_cache.h"
 #include "common/opencl.h"
 #include "common/points.h"
+#include "common/profiling.h"
 #include "develop/imageop.h"
 #include "develop/blend.h"
 #include "libs/lib.h"
@@ -102,6 +104,9 @@ static int usage(const char *argv0)
   printf(" [--cachedir <user cache directory>]");
   printf(" [--localedir <locale directory>]");
   printf(" [--conf <key>=<value>]");
+  printf(" [--profile <file.{json,csv}>]");
+  printf(" [--isa {sse2,avx,avx2}]");
+  printf(" [--hotfolder <folder>]");
   printf("\n");
   return 1;
 }
@@ -275,6 +280,23 @@ static gchar * dt_make_path_absolute(const gchar * input)
   return filename;
 }
 
+// film rolls are matched by their folder string, so watch the same absolute path
+// without trailing separator that dt_load_from_string() would import
+static void _add_hotfolder(const gchar *input)
+{
+  gchar *folder = dt_make_path_absolute(input);
+  if(folder == NULL || !g_file_test(folder, G_FILE_TEST_IS_DIR))
+  {
+    fprintf(stderr, "[hotfolder] can't watch `%s', not a folder\n", input);
+    g_free(folder);
+    return;
+  }
+  size_t len = strlen(folder);
+  while(len > 1 && folder[len-1] == G_DIR_SEPARATOR) folder[--len] = '\0';
+  dt_fswatch_add(darktable.fswatch, DT_FSWATCH_DIRECTORY, folder);
+  g_free(folder);
+}
+
 int dt_load_from_string(const gchar* input, gboolean open_image_in_dr)
 {
   int id = 0;
@@ -380,13 +402,15 @@ int dt_init(int argc, char *argv[], const int init_gui)
   char *tmpdir_from_command = NULL;
   char *configdir_from_command = NULL;
   char *cachedir_from_command = NULL;
+  char *profile_from_command = NULL;
+  char *isa_from_command = NULL;
 
   darktable.num_openmp_threads = 1;
 #ifdef _OPENMP
   darktable.num_openmp_threads = omp_get_num_procs();
 #endif
   darktable.unmuted = 0;
-  GSList *images_to_load = NULL, *config_override = NULL;
+  GSList *images_to_load = NULL, *config_override = NULL, *hotfolders = NULL;
   for(int k=1; k<argc; k++)
   {
     if(argv[k][0] == '-')
@@ -432,6 +456,18 @@ int dt_init(int argc, char *argv[], const int init_gui)
       {
         bindtextdomain (GETTEXT_PACKAGE, argv[++k]);
       }
+      else if(!strcmp(argv[k], "--profile") && argc > k+1)
+      {
+        profile_from_command = argv[++k];
+      }
+      else if(!strcmp(argv[k], "--hotfolder") && argc > k+1)
+      {
+        hotfolders = g_slist_append(hotfolders, argv[++k]);
+      }
+      else if(!strcmp(argv[k], "--isa") && argc > k+1)
+      {
+        isa_from_command = argv[++k];
+      }
       else if(argv[k][1] == 'd' && argc > k+1)
       {
         if(!strcmp(argv[k+1], "all"))             darktable.unmuted = 0xffffffff;   // enable all debug information
@@ -491,6 +527,7 @@ int dt_init(int argc, char *argv[], const int init_gui)
 #ifdef _OPENMP
   omp_set_num_threads(darktable.num_openmp_threads);
 #endif
+  dt_cpu_init(isa_from_command);
   dt_loc_init_datadir(datadir_from_command);
   dt_loc_init_plugindir(moduledir_from_command);
   if(dt_loc_init_tmp_dir(tmpdir_from_command))
@@ -614,6 +651,7 @@ int dt_init(int argc, char *argv[], const int init_gui)
 
   // FIXME: move there into dt_database_t
   dt_pthread_mutex_init(&(darktable.db_insert), NULL);
+  dt_pthread_mutex_init(&(darktable.db_transaction), NULL);
   dt_pthread_mutex_init(&(darktable.plugin_threadsafe), NULL);
   dt_pthread_mutex_init(&(darktable.capabilities_threadsafe), NULL);
   darktable.control = (dt_control_t *)malloc(sizeof(dt_control_t));
@@ -662,6 +700,10 @@ int dt_init(int argc, char *argv[], const int init_gui)
   memset(darktable.points, 0, sizeof(dt_points_t));
   dt_points_init(darktable.points, dt_get_num_threads());
 
+  // before any of the caches, they are accounted in there
+  dt_memory_budget_init(init_gui);
+  dt_profiling_init(profile_from_command);
+
   // must come before mipmap_cache, because that one will need to access
   // image dimensions stored in here:
   darktable.image_cache = (dt_image_cache_t *)malloc(sizeof(dt_image_cache_t));
@@ -754,7 +796,18 @@ int dt_init(int argc, char *argv[], const int init_gui)
     }
     else
       dt_ctl_switch_mode_to(DT_LIBRARY);
+
+    // watch the hot folders, new images there are imported while we run
+    gchar *conf_folders = dt_conf_get_string("plugins/lighttable/hotfolders");
+    gchar **folders = g_strsplit(conf_folders ? conf_folders : "", ";", -1);
+    for(int k = 0; folders[k]; k++)
+      if(folders[k][0]) _add_hotfolder(folders[k]);
+    for(GSList *p = hotfolders; p; p = g_slist_next(p))
+      _add_hotfolder((const gchar *)p->data);
+    g_strfreev(folders);
+    g_free(conf_folders);
   }
+  g_slist_free(hotfolders);
 
   if(darktable.unmuted & DT_DEBUG_MEMORY)
   {
@@ -776,6 +829,10 @@ void dt_cleanup()
   dt_ctl_switch_mode_to(DT_MODE_NONE);
   const int init_gui = (darktable.gui != NULL);
 
+  // stop importing from the hot folders before anything goes away
+  dt_fswatch_destroy(darktable.fswatch);
+  darktable.fswatch = NULL;
+
   if(init_gui)
   {
     dt_dbus_destroy(darktable.dbus);
@@ -809,6 +866,8 @@ void dt_cleanup()
   free(darktable.conf);
   dt_points_cleanup(darktable.points);
   free(darktable.points);
+  dt_memory_budget_cleanup();
+  dt_profiling_cleanup();
   dt_iop_unload_modules_so();
   dt_opencl_cleanup(darktable.opencl);
   free(darktable.opencl);
@@ -816,7 +875,6 @@ void dt_cleanup()
   dt_camctl_destroy(darktable.camctl);
 #endif
   dt_pwstorage_destroy(darktable.pwstorage);
-  dt_fswatch_destroy(darktable.fswatch);
 
 #ifdef HAVE_GRAPHICSMAGICK
   DestroyMagick();
@@ -829,6 +887,7 @@ void dt_cleanup()
   dt_capabilities_cleanup();
 
   dt_pthread_mutex_destroy(&(darktable.db_insert));
+  dt_pthread_mutex_destroy(&(darktable.db_transaction));
   dt_pthread_mutex_destroy(&(darktable.plugin_threadsafe));
   dt_pthread_mutex_destroy(&(darktable.capabilities_threadsafe));
 
@@ -30,6 +30,7 @@
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
+#include "common/cpu.h"
 #include "common/dtpthread.h"
 #include "common/database.h"
 #include "common/utility.h"
@@ -158,10 +159,14 @@ dt_debug_thread_t;
 #define DT_CPU_FLAG_SSE    1
 #define DT_CPU_FLAG_SSE2   2
 #define DT_CPU_FLAG_SSE3   4
+#define DT_CPU_FLAG_AVX    8
+#define DT_CPU_FLAG_AVX2   16
+#define DT_CPU_FLAG_FMA    32
 
 typedef struct darktable_t
 {
   uint32_t cpu_flags;
+  dt_cpu_isa_t cpu_isa;
   int32_t num_openmp_threads;
 
   int32_t thumbnail_width, thumbnail_height;
@@ -191,7 +196,12 @@ typedef struct darktable_t
   struct dt_blendop_t            *blendop;
   struct dt_dbus_t               *dbus;
   struct dt_undo_t               *undo;
+  struct dt_memory_budget_t      *memory_budget;
+  struct dt_profiling_t          *profiling;
   dt_pthread_mutex_t db_insert;
+  // held by writers which batch their statements into one transaction on the shared
+  // connection (imports, styles, history paste), which also covers the memory.*_targets tables
+  dt_pthread_mutex_t db_transaction;
   dt_pthread_mutex_t plugin_threadsafe;
   dt_pthread_mutex_t capabilities_threadsafe;
   char *progname;
@@ -49,6 +49,7 @@ extern "C"
 #include <sstream>
 #include <cassert>
 #include <glib.h>
+#include <pthread.h>
 #include <string>
 
 #define DT_XMP_KEYS_NUM 15 // the number of XmpBag XmpSeq keys that dt uses
@@ -757,6 +758,40 @@ int dt_exif_read_from_blob(dt_image_t *img, uint8_t *blob, const int size)
   }
 }
 
+/** metadata of an image and its xmp sidecar, read ahead of time. */
+struct dt_exif_prefetch_t
+{
+  std::string path;
+  Exiv2::Image::AutoPtr image;
+  std::string sidecar_path;
+  Exiv2::Image::AutoPtr sidecar;
+};
+
+static int _exif_read_image(dt_image_t *img, Exiv2::Image::AutoPtr &image)
+{
+  bool res;
+
+  // EXIF metadata
+  Exiv2::ExifData &exifData = image->exifData();
+  res = dt_exif_read_exif_data(img, exifData);
+
+  // IPTC metadata.
+  Exiv2::IptcData &iptcData = image->iptcData();
+  res = dt_exif_read_iptc_data(img, iptcData) && res;
+
+  // XMP metadata
+  Exiv2::XmpData &xmpData = image->xmpData();
+  res = dt_exif_read_xmp_data(img, xmpData, false, true) && res;
+
+  // Initialize size - don't wait for full raw to be loaded to get this
+  // information. If use_embedded_thumbnail is set, it will take a
+  // change in development history to have this information
+  img->height = image->pixelHeight();
+  img->width = image->pixelWidth();
+
+  return res?0:1;
+}
+
 /** read the metadata of an image.
  * XMP data trumps IPTC data trumps EXIF data
  */
@@ -768,27 +803,60 @@ int dt_exif_read(dt_image_t *img, const char* path)
     image = Exiv2::ImageFactory::open(path);
     assert(image.get() != 0);
     image->readMetadata();
-    bool res;
-
-    // EXIF metadata
-    Exiv2::ExifData &exifData = image->exifData();
-    res = dt_exif_read_exif_data(img, exifData);
-
-    // IPTC metadata.
-    Exiv2::IptcData &iptcData = image->iptcData();
-    res = dt_exif_read_iptc_data(img, iptcData) && res;
+    return _exif_read_image(img, image);
+  }
+  catch (Exiv2::AnyError& e)
+  {
+    std::string s(e.what());
+    std::cerr << "[exiv2] " << path << ": " << s << std::endl;
+    return 1;
+  }
+}
 
-    // XMP metadata
-    Exiv2::XmpData &xmpData = image->xmpData();
-    res = dt_exif_read_xmp_data(img, xmpData, false, true) && res;
+dt_exif_prefetch_t *dt_exif_prefetch(const char *path, const char *sidecar)
+{
+  dt_exif_prefetch_t *prefetch = new dt_exif_prefetch_t;
+  prefetch->path = path;
+  try
+  {
+    prefetch->image = Exiv2::ImageFactory::open(path);
+    prefetch->image->readMetadata();
+  }
+  catch (Exiv2::AnyError& e)
+  {
+    std::string s(e.what());
+    std::cerr << "[exiv2] " << path << ": " << s << std::endl;
+    prefetch->image.reset();
+  }
 
-    // Initialize size - don't wait for full raw to be loaded to get this
-    // information. If use_embedded_thumbnail is set, it will take a
-    // change in development history to have this information
-    img->height = image->pixelHeight();
-    img->width = image->pixelWidth();
+  if(sidecar)
+  {
+    prefetch->sidecar_path = sidecar;
+    try
+    {
+      if(g_file_test(sidecar, G_FILE_TEST_EXISTS))
+      {
+        prefetch->sidecar = Exiv2::ImageFactory::open(sidecar);
+        prefetch->sidecar->readMetadata();
+      }
+    }
+    catch (Exiv2::AnyError& e)
+    {
+      prefetch->sidecar.reset();
+    }
+  }
+  return prefetch;
+}
 
-    return res?0:1;
+int dt_exif_read_prefetched(dt_image_t *img, const char* path, dt_exif_prefetch_t *prefetch)
+{
+  if(!prefetch || prefetch->path != path)
+    return dt_exif_read(img, path);
+  if(!prefetch->image.get())
+    return 1;
+  try
+  {
+    return _exif_read_image(img, prefetch->image);
   }
   catch (Exiv2::AnyError& e)
   {
@@ -798,6 +866,11 @@ int dt_exif_read(dt_image_t *img, const char* path)
   }
 }
 
+void dt_exif_prefetch_free(dt_exif_prefetch_t *prefetch)
+{
+  delete prefetch;
+}
+
 int dt_exif_write_blob(uint8_t *blob,uint32_t size, const char* path)
 {
   try
@@ -1346,15 +1419,10 @@ void _lib_exif_read_history(Exiv2::XmpData::iterator ver,
 }
 
 // need a write lock on *img (non-const) to write stars (and soon color labels).
-int dt_exif_xmp_read (dt_image_t *img, const char* filename, const int history_only)
+static void _exif_xmp_read_image(dt_image_t *img, Exiv2::Image::AutoPtr &image, const int history_only)
 {
   try
   {
-    // read xmp sidecar
-    Exiv2::Image::AutoPtr image;
-    image = Exiv2::ImageFactory::open(filename);
-    assert(image.get() != 0);
-    image->readMetadata();
     Exiv2::XmpData &xmpData = image->xmpData();
 
     sqlite3_stmt *stmt;
@@ -1592,6 +1660,24 @@ int dt_exif_xmp_read (dt_image_t *img, const char* filename, const int history_o
     }
   }
   catch (Exiv2::AnyError& e)
+  {
+    // std::string s(e.what());
+    // std::cerr << "[exiv2] " << s << std::endl;
+  }
+}
+
+int dt_exif_xmp_read (dt_image_t *img, const char* filename, const int history_only)
+{
+  try
+  {
+    // read xmp sidecar
+    Exiv2::Image::AutoPtr image;
+    image = Exiv2::ImageFactory::open(filename);
+    assert(image.get() != 0);
+    image->readMetadata();
+    _exif_xmp_read_image(img, image, history_only);
+  }
+  catch (Exiv2::AnyError& e)
   {
     // actually nobody's interested in that if the file doesn't exist:
     // std::string s(e.what());
@@ -1600,6 +1686,16 @@ int dt_exif_xmp_read (dt_image_t *img, const char* filename, const int history_o
   return 0;
 }
 
+int dt_exif_xmp_read_prefetched(dt_image_t *img, const char* filename, dt_exif_prefetch_t *prefetch)
+{
+  if(!prefetch || prefetch->sidecar_path != filename)
+    return dt_exif_xmp_read(img, filename, 0);
+  // no sidecar is fine, same as in dt_exif_xmp_read()
+  if(prefetch->sidecar.get())
+    _exif_xmp_read_image(img, prefetch->sidecar, 0);
+  return 0;
+}
+
 // helper to create an xmp data thing. throws exiv2 exceptions if stuff goes wrong.
 static void
 dt_exif_xmp_read_data(Exiv2::XmpData &xmpData, const int imgid)
@@ -2109,11 +2205,14 @@ int dt_exif_xmp_write (const int imgid, const char* filename)
     {
       throw Exiv2::Error(1, "[xmp_write] failed to serialize xmp data");
     }
-    std::ofstream fout(filename);
-    if(fout.is_open())
+    // written to a temporary file and renamed over the old one, so a crash
+    // or a concurrent reader never sees a half written sidecar
+    GError *error = NULL;
+    if(!g_file_set_contents(filename, xmpPacket.c_str(), xmpPacket.size(), &error))
     {
-      fout << xmpPacket;
-      fout.close();
+      std::cerr << "[xmp_write] failed to write '" << filename << "': " << error->message << "\n";
+      g_error_free(error);
+      return -1;
     }
     return 0;
   }
@@ -2190,12 +2289,29 @@ int dt_exif_thumbnail(
   }
 }
 
+// the xmp toolkit inside exiv2 isn't thread safe on its own, it calls this around
+// everything it does. metadata is read on several threads at once during import.
+static pthread_mutex_t _exif_xmp_mutex;
+
+static void _exif_xmp_lock(void *data, bool lock)
+{
+  if(lock) pthread_mutex_lock((pthread_mutex_t *)data);
+  else pthread_mutex_unlock((pthread_mutex_t *)data);
+}
+
 void dt_exif_init()
 {
   // mute exiv2:
   // Exiv2::LogMsg::setLevel(Exiv2::LogMsg::error);
 
-  Exiv2::XmpParser::initialize();
+  // the toolkit may take the lock again from within a locked call
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&_exif_xmp_mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  Exiv2::XmpParser::initialize(_exif_xmp_lock, &_exif_xmp_mutex);
   // this has te stay with the old url (namespace already propagated outside dt)
   Exiv2::XmpProperties::registerNs("http://darktable.sf.net/", "darktable");
   Exiv2::XmpProperties::registerNs("http://ns.adobe.com/lightroom/1.0/", "lr");
@@ -2204,6 +2320,7 @@ void dt_exif_init()
 void dt_exif_cleanup()
 {
   Exiv2::XmpParser::terminate();
+  pthread_mutex_destroy(&_exif_xmp_mutex);
 }
 
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
@@ -30,6 +30,19 @@ extern "C"
   /** read metadata from file with full path name, XMP data trumps IPTC data trumps EXIF data, store to image struct. returns 0 on success. */
   int dt_exif_read(dt_image_t *img, const char* path);
 
+  /** metadata of a file and its xmp sidecar, parsed ahead of time. */
+  typedef struct dt_exif_prefetch_t dt_exif_prefetch_t;
+
+  /** parse the metadata of the file and its xmp sidecar (may be NULL) without touching the database,
+      so it can run on any thread. free the result with dt_exif_prefetch_free(). */
+  dt_exif_prefetch_t *dt_exif_prefetch(const char *path, const char *sidecar);
+
+  /** dt_exif_read() using what dt_exif_prefetch() parsed for path. reads the file if prefetch is NULL or for another file. */
+  int dt_exif_read_prefetched(dt_image_t *img, const char* path, dt_exif_prefetch_t *prefetch);
+
+  /** free prefetched metadata. */
+  void dt_exif_prefetch_free(dt_exif_prefetch_t *prefetch);
+
   /** read exif data to image struct from given data blob, wherever you got it from. */
   int dt_exif_read_from_blob(dt_image_t *img, uint8_t *blob, const int size);
 
@@ -48,6 +61,9 @@ extern "C"
   /** read xmp sidecar file. */
   int dt_exif_xmp_read (dt_image_t * img, const char* filename, const int history_only);
 
+  /** dt_exif_xmp_read(img, filename, 0) using the sidecar dt_exif_prefetch() parsed, if it was the same file. */
+  int dt_exif_xmp_read_prefetched(dt_image_t *img, const char* filename, dt_exif_prefetch_t *prefetch);
+
   /** load exif thumbnail (these are like 160x120) */
   int dt_exif_thumbnail (const char *filename, uint8_t *out, uint32_t width, uint32_t height, int orientation, uint32_t *wd, uint32_t *ht);
 
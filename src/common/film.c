@@ -23,6 +23,7 @@
 #include "common/film.h"
 #include "common/dtpthread.h"
 #include "common/collection.h"
+#include "common/exif.h"
 #include "common/image_cache.h"
 #include "common/debug.h"
 #include "views/view.h"
@@ -349,6 +350,54 @@ int _film_filename_cmp(gchar *a, gchar *b)
   return g_strcmp0(g_path_get_basename(a), g_path_get_basename(b));
 }
 
+/* number of images parsed ahead and written in one transaction */
+#define DT_FILM_IMPORT_BATCH 64
+
+/* open a transaction for a batch of images, unless there is one already. the connection
+   is shared, so other batch writers wait until _film_import_end_batch() */
+static gboolean _film_import_begin_batch()
+{
+  dt_pthread_mutex_lock(&darktable.db_transaction);
+  sqlite3 *db = dt_database_get(darktable.db);
+  return sqlite3_get_autocommit(db) && sqlite3_exec(db, "begin", NULL, NULL, NULL) == SQLITE_OK;
+}
+
+static void _film_import_end_batch(const gboolean transaction)
+{
+  if(transaction)
+    DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db), "commit", NULL, NULL, NULL);
+  dt_pthread_mutex_unlock(&darktable.db_transaction);
+}
+
+void dt_film_import_batch(const int32_t film_id, const gchar **files, const int num, uint32_t *imgids)
+{
+  for(int start = 0; start < num; start += DT_FILM_IMPORT_BATCH)
+  {
+    const int cnt = MIN(DT_FILM_IMPORT_BATCH, num - start);
+    const gchar **batch = files + start;
+    dt_exif_prefetch_t *prefetch[DT_FILM_IMPORT_BATCH];
+
+#ifdef _OPENMP
+    #pragma omp parallel for default(none) shared(batch, prefetch) schedule(dynamic)
+#endif
+    for(int k = 0; k < cnt; k++)
+    {
+      gchar *sidecar = g_strconcat(batch[k], ".xmp", NULL);
+      prefetch[k] = dt_exif_prefetch(batch[k], sidecar);
+      g_free(sidecar);
+    }
+
+    const gboolean transaction = _film_import_begin_batch();
+    for(int k = 0; k < cnt; k++)
+    {
+      const uint32_t id = dt_image_import_prefetched(film_id, batch[k], FALSE, prefetch[k]);
+      if(imgids) imgids[start + k] = id;
+      dt_exif_prefetch_free(prefetch[k]);
+    }
+    _film_import_end_batch(transaction);
+  }
+}
+
 void dt_film_import1(dt_film_t *film)
 {
   gboolean recursive = dt_conf_get_bool("ui_last/import_recursive");
@@ -372,63 +421,94 @@ void dt_film_import1(dt_film_t *film)
   g_snprintf(message, sizeof(message) - 1,
              ngettext("importing %d image","importing %d images", total), total);
   const guint *jid = dt_control_backgroundjobs_create(darktable.control, 0, message);
+  const double start = dt_get_wtime();
 
   /* loop thru the images and import to current film roll */
   dt_film_t *cfr = film;
   GList *image = g_list_first(images);
-  do
+  const gchar *batch[DT_FILM_IMPORT_BATCH];
+  dt_exif_prefetch_t *prefetch[DT_FILM_IMPORT_BATCH];
+  while(image)
   {
-    gchar *cdn = g_path_get_dirname((const gchar *)image->data);
+    int num = 0;
+    for(; image && num < DT_FILM_IMPORT_BATCH; image = g_list_next(image))
+      batch[num++] = (const gchar *)image->data;
 
-    /* check if we need to initialize a new filmroll */
-    if(!cfr || g_strcmp0(cfr->dirname, cdn) != 0)
+    /* exiv2 is where most of the time goes, parse exif and sidecars of the whole batch in parallel */
+#ifdef _OPENMP
+    #pragma omp parallel for default(none) shared(batch, prefetch, num) schedule(dynamic)
+#endif
+    for(int k = 0; k < num; k++)
     {
+      gchar *sidecar = g_strconcat(batch[k], ".xmp", NULL);
+      prefetch[k] = dt_exif_prefetch(batch[k], sidecar);
+      g_free(sidecar);
+    }
 
-#if GLIB_CHECK_VERSION (2, 26, 0)
-      if(cfr && cfr->dir)
+    /* and write the batch in one go instead of syncing every single insert to disk */
+    const gboolean transaction = _film_import_begin_batch();
+    for(int k = 0; k < num; k++)
+    {
+      gchar *cdn = g_path_get_dirname(batch[k]);
+
+      /* check if we need to initialize a new filmroll */
+      if(!cfr || g_strcmp0(cfr->dirname, cdn) != 0)
       {
-        /* check if we can find a gpx data file to be auto applied
-           to images in the jsut imported filmroll */
-        g_dir_rewind(cfr->dir);
-        const gchar *dfn = NULL;
-        while ((dfn = g_dir_read_name(cfr->dir)) != NULL)
+
+#if GLIB_CHECK_VERSION (2, 26, 0)
+        if(cfr && cfr->dir)
         {
-          /* check if we have a gpx to be auto applied to filmroll */
-          if(strcmp(dfn+strlen(dfn)-4,".gpx") == 0 ||
-              strcmp(dfn+strlen(dfn)-4,".GPX") == 0)
+          /* check if we can find a gpx data file to be auto applied
+             to images in the jsut imported filmroll */
+          g_dir_rewind(cfr->dir);
+          const gchar *dfn = NULL;
+          while ((dfn = g_dir_read_name(cfr->dir)) != NULL)
           {
-            gchar *gpx_file = g_build_path (G_DIR_SEPARATOR_S, cfr->dirname, dfn, NULL);
-            dt_control_gpx_apply(gpx_file, cfr->id, dt_conf_get_string("plugins/lighttable/geotagging/tz"));
-            g_free(gpx_file);
+            /* check if we have a gpx to be auto applied to filmroll */
+            if(strcmp(dfn+strlen(dfn)-4,".gpx") == 0 ||
+                strcmp(dfn+strlen(dfn)-4,".GPX") == 0)
+            {
+              gchar *gpx_file = g_build_path (G_DIR_SEPARATOR_S, cfr->dirname, dfn, NULL);
+              dt_control_gpx_apply(gpx_file, cfr->id, dt_conf_get_string("plugins/lighttable/geotagging/tz"));
+              g_free(gpx_file);
+            }
           }
         }
-      }
 #endif
 
-      /* cleanup previously imported filmroll*/
-      if(cfr && cfr!=film)
-      {
-        dt_film_cleanup(cfr);
-        g_free(cfr);
-        cfr = NULL;
-      }
+        /* cleanup previously imported filmroll*/
+        if(cfr && cfr!=film)
+        {
+          dt_film_cleanup(cfr);
+          g_free(cfr);
+          cfr = NULL;
+        }
 
-      /* initialize and create a new film to import to */
-      cfr = g_malloc(sizeof(dt_film_t));
-      dt_film_init(cfr);
-      dt_film_new(cfr, cdn);
-    }
+        /* initialize and create a new film to import to */
+        cfr = g_malloc(sizeof(dt_film_t));
+        dt_film_init(cfr);
+        dt_film_new(cfr, cdn);
+      }
+      g_free(cdn);
 
-    /* import image */
-    dt_image_import(cfr->id, (const gchar *)image->data, FALSE);
+      /* import image */
+      dt_image_import_prefetched(cfr->id, batch[k], FALSE, prefetch[k]);
+      dt_exif_prefetch_free(prefetch[k]);
 
-    fraction+=1.0/total;
-    dt_control_backgroundjobs_progress(darktable.control, jid, fraction);
+      fraction+=1.0/total;
+      dt_control_backgroundjobs_progress(darktable.control, jid, fraction);
+    }
+    _film_import_end_batch(transaction);
 
+    /* let the film roll fill up while we go */
+    dt_control_queue_redraw_center();
   }
-  while( (image = g_list_next(image)) != NULL);
 
-  // only redraw at the end, to not spam the cpu with exposure events
+  const double elapsed = dt_get_wtime() - start;
+  dt_print(DT_DEBUG_PERF, "[film_import] %d images in %.3f secs, %.1f images/sec\n",
+           total, elapsed, elapsed > 0.0 ? total / elapsed : 0.0);
+
+  // redraw once per batch only, to not spam the cpu with exposure events
   dt_control_queue_redraw_center();
   dt_control_signal_raise(darktable.signals,DT_SIGNAL_TAG_CHANGED);
 
@@ -562,6 +642,7 @@ void dt_film_remove(const int id)
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, id);
   sqlite3_step(stmt);
   sqlite3_finalize(stmt);
+  dt_view_image_info_invalidate();
 
   DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
                               "select id from images where film_id = ?1", -1, &stmt, NULL);
@@ -588,6 +669,7 @@ void dt_film_remove(const int id)
   sqlite3_step(stmt);
   sqlite3_finalize(stmt);
   // dt_control_update_recent_films();
+  dt_collection_image_changed(darktable.collection, -1, COLLECTION_CHANGE_ALL);
   dt_control_signal_raise(darktable.signals , DT_SIGNAL_FILMROLLS_CHANGED);
 }
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
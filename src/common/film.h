@@ -53,6 +53,8 @@ int dt_film_open_recent(const int32_t num);
 int dt_film_import(const char *dirname);
 /** helper for import threads. */
 void dt_film_import1(dt_film_t *film);
+/** import the given files into one film roll, in batches sharing a transaction. imgids may be NULL, 0 marks failures. */
+void dt_film_import_batch(const int32_t film_id, const gchar **files, const int num, uint32_t *imgids);
 /** constructs the lighttable/query setting for this film, respecting stars and filters. */
 void dt_film_set_query(const int32_t id);
 /** removes this film and all its images from db. */
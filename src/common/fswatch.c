@@ -20,40 +20,61 @@
 #endif
 
 #include "common/darktable.h"
+#include "common/debug.h"
 #include "common/dtpthread.h"
 #include "common/image.h"
+#include "common/film.h"
 #include "common/fswatch.h"
+#include "common/mipmap_cache.h"
+#include "control/conf.h"
+#include "control/control.h"
 #include "develop/develop.h"
 
+#include <limits.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <glib.h>
 #include <strings.h>
-#if 0//def  HAVE_INOTIFY
+#include <sys/stat.h>
+#ifdef HAVE_INOTIFY
+#include <poll.h>
 #include <sys/inotify.h>
 #endif
 
+// a file in a watched directory is imported once nothing happened to it for this long (secs).
+// files the writer closed (or that were moved in) are ready sooner, the delay only collects a batch.
+#define DT_FSWATCH_SETTLE        2.0
+#define DT_FSWATCH_SETTLE_CLOSED 0.5
+// how often pending files and thumbnails are looked at (msecs)
+#define DT_FSWATCH_POLL          250
 
 typedef struct _watch_t
 {
   int descriptor;   // Handle
   dt_fswatch_type_t type;        // DT_FSWATCH_* type
-  void *data;				// Assigned data
+  void *data;				// Assigned data, own copy of the path for directories
   int events;				// events occurred..
 } _watch_t;
 
+#ifdef HAVE_INOTIFY
 
-#if 0// def  HAVE_INOTIFY
-
-typedef struct inotify_event_t
+// a file seen in a watched directory, not imported yet
+typedef struct _pending_t
+{
+  double first_seen;  // dt_get_wtime() of its first event
+  double last_event;
+  off_t size;         // at the last look, -1 before that
+  int closed;         // the writer is done with it
+} _pending_t;
+
+// a file that is ready to be imported
+typedef struct _ready_t
 {
-  uint32_t wd;       /* Watch descriptor */
-  uint32_t mask;     /* Mask of events */
-  uint32_t cookie;   /* Unique cookie associating related events (for rename(2)) */
-  uint32_t len;      /* Size of 'name' field */
-  char     name[];   /* Optional null-terminated name */
-} inotify_event_t;
+  gchar *path;
+  double first_seen;
+} _ready_t;
 
 // Compare func for GList
 static gint _fswatch_items_by_data(const void* a,const void *b)
@@ -61,6 +82,13 @@ static gint _fswatch_items_by_data(const void* a,const void *b)
   return (((_watch_t*)a)->data<b)?-1:((((_watch_t*)a)->data==b)?0:1);
 }
 
+// Compare func for GList, directories are found by their path
+static gint _fswatch_items_by_path(const void *a, const void *b)
+{
+  const _watch_t *item = (const _watch_t *)a;
+  return item->type == DT_FSWATCH_DIRECTORY ? g_strcmp0((const char *)item->data, (const char *)b) : -1;
+}
+
 // Compare func for GList
 static gint _fswatch_items_by_descriptor(const void *a,const void *b)
 {
@@ -68,86 +96,333 @@ static gint _fswatch_items_by_descriptor(const void *a,const void *b)
   return result;
 }
 
+// files the import would take. jpegs may be ignored by the import settings,
+// those must not show up as failures later on.
+static int _fswatch_wanted(const char *name)
+{
+  if(name[0] == '.' || !dt_supported_image(name)) return 0;
+  const char *ext = strrchr(name, '.');
+  if(ext && (!g_ascii_strcasecmp(ext, ".jpg") || !g_ascii_strcasecmp(ext, ".jpeg")))
+    return !dt_conf_get_bool("ui_last/import_ignore_jpegs");
+  return 1;
+}
+
+// the file names of a directory which are in the library already
+static GHashTable *_fswatch_in_library(const char *dirname)
+{
+  GHashTable *known = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  sqlite3_stmt *stmt;
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "select filename from images join film_rolls on film_rolls.id = images.film_id "
+                              "where film_rolls.folder = ?1", -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_BIND_TEXT(stmt, 1, dirname, -1, SQLITE_STATIC);
+  while(sqlite3_step(stmt) == SQLITE_ROW)
+    g_hash_table_insert(known, g_strdup((const char *)sqlite3_column_text(stmt, 0)), GINT_TO_POINTER(1));
+  sqlite3_finalize(stmt);
+  return known;
+}
+
+static void _fswatch_wakeup(dt_fswatch_t *fswatch, const char what)
+{
+  if(write(fswatch->wakeup[1], &what, 1) != 1)
+    dt_print(DT_DEBUG_FSWATCH,"[fswatch] could not wake up the thread\n");
+}
+
+// remember a new or changed file of a watched directory. called with the mutex held.
+static void _fswatch_touch(dt_fswatch_t *fswatch, const char *path, const int closed, const double now)
+{
+  _pending_t *p = g_hash_table_lookup(fswatch->pending, path);
+  if(!p)
+  {
+    p = g_malloc(sizeof(_pending_t));
+    p->first_seen = now;
+    p->size = -1;
+    g_hash_table_insert(fswatch->pending, g_strdup(path), p);
+    fswatch->stats.seen++;
+    dt_print(DT_DEBUG_FSWATCH,"[fswatch] new file %s\n", path);
+  }
+  p->last_event = now;
+  p->closed = closed;
+}
+
+static void _fswatch_directory_event(dt_fswatch_t *fswatch, _watch_t *item, const struct inotify_event *event)
+{
+  // events on the directory itself, or on sub directories which aren't watched
+  if(event->len == 0 || (event->mask & IN_ISDIR))
+  {
+    if(event->mask & (IN_DELETE_SELF|IN_MOVE_SELF))
+      dt_print(DT_DEBUG_FSWATCH,"[fswatch] watched directory %s went away\n", (const char *)item->data);
+    return;
+  }
+  // temporary files of copy tools start with a dot, they get renamed when done
+  if(!_fswatch_wanted(event->name)) return;
+
+  gchar *path = g_build_filename((const char *)item->data, event->name, NULL);
+  if(event->mask & (IN_DELETE|IN_MOVED_FROM))
+  {
+    if(g_hash_table_remove(fswatch->pending, path))
+      dt_print(DT_DEBUG_FSWATCH,"[fswatch] %s is gone before it was imported\n", path);
+  }
+  else if(event->mask & (IN_CLOSE_WRITE|IN_MOVED_TO))
+    _fswatch_touch(fswatch, path, 1, dt_get_wtime());
+  else if(event->mask & (IN_CREATE|IN_MODIFY))
+    _fswatch_touch(fswatch, path, 0, dt_get_wtime());
+  g_free(path);
+}
+
+// take the files that settled out of the pending list. called with the mutex held.
+static GArray *_fswatch_settled(dt_fswatch_t *fswatch, const double now)
+{
+  GArray *ready = g_array_new(FALSE, FALSE, sizeof(_ready_t));
+  GHashTableIter it;
+  gpointer key, value;
+  g_hash_table_iter_init(&it, fswatch->pending);
+  while(g_hash_table_iter_next(&it, &key, &value))
+  {
+    _pending_t *p = (_pending_t *)value;
+    if(now - p->last_event < (p->closed ? DT_FSWATCH_SETTLE_CLOSED : DT_FSWATCH_SETTLE)) continue;
+
+    struct stat st;
+    if(stat((const char *)key, &st))
+    {
+      g_hash_table_iter_remove(&it);
+      continue;
+    }
+    // network shares don't always tell us about writes, so an open file has to keep its size for a while
+    if(!p->closed && (st.st_size != p->size || st.st_size == 0))
+    {
+      p->size = st.st_size;
+      p->last_event = now;
+      continue;
+    }
+    const _ready_t r = { g_strdup((const char *)key), p->first_seen };
+    g_array_append_val(ready, r);
+    g_hash_table_iter_remove(&it);
+  }
+  return ready;
+}
+
+static gint _fswatch_ready_by_path(gconstpointer a, gconstpointer b)
+{
+  return g_strcmp0(((const _ready_t *)a)->path, ((const _ready_t *)b)->path);
+}
+
+// import everything that settled, one batch per directory
+static void _fswatch_ingest(dt_fswatch_t *fswatch)
+{
+  dt_pthread_mutex_lock(&fswatch->mutex);
+  GArray *ready = _fswatch_settled(fswatch, dt_get_wtime());
+  fswatch->stats.pending = g_hash_table_size(fswatch->pending);
+  dt_pthread_mutex_unlock(&fswatch->mutex);
+
+  const int num = ready->len;
+  if(num == 0)
+  {
+    g_array_free(ready, TRUE);
+    return;
+  }
+
+  // sorted by path the files of one directory are next to each other
+  g_array_sort(ready, _fswatch_ready_by_path);
+  const gchar **files = g_malloc(sizeof(gchar *) * num);
+  const gchar **todo = g_malloc(sizeof(gchar *) * num);
+  uint32_t *imgids = g_malloc0(sizeof(uint32_t) * num);
+  uint32_t *todo_ids = g_malloc0(sizeof(uint32_t) * num);
+  int *skipped = g_malloc0(sizeof(int) * num);
+  for(int k = 0; k < num; k++) files[k] = g_array_index(ready, _ready_t, k).path;
+
+  const double start = dt_get_wtime();
+  for(int k = 0; k < num;)
+  {
+    gchar *dirname = g_path_get_dirname(files[k]);
+    int cnt = 1;
+    for(; k + cnt < num; cnt++)
+    {
+      gchar *d = g_path_get_dirname(files[k + cnt]);
+      const int same = !g_strcmp0(d, dirname);
+      g_free(d);
+      if(!same) break;
+    }
+
+    // files which are in the library already (rewritten by some tool, say) aren't imported again.
+    // that is decided before the import reads their exif data.
+    GHashTable *known = _fswatch_in_library(dirname);
+    int num_todo = 0;
+    for(int i = k; i < k + cnt; i++)
+    {
+      gchar *name = g_path_get_basename(files[i]);
+      if(g_hash_table_lookup(known, name))
+        skipped[i] = 1;
+      else
+        todo[num_todo++] = files[i];
+      g_free(name);
+    }
+    g_hash_table_destroy(known);
+
+    if(num_todo > 0)
+    {
+      // look the film roll up every time, empty ones may have been cleaned up meanwhile
+      dt_film_t film;
+      dt_film_init(&film);
+      const int32_t film_id = dt_film_new(&film, dirname);
+      dt_pthread_mutex_destroy(&film.images_mutex);
+      if(film_id > 0)
+        dt_film_import_batch(film_id, todo, num_todo, todo_ids);
+      for(int i = k, t = 0; i < k + cnt; i++)
+        if(!skipped[i]) imgids[i] = todo_ids[t++];
+    }
+    g_free(dirname);
+    k += cnt;
+  }
+  const double end = dt_get_wtime();
+
+  dt_pthread_mutex_lock(&fswatch->mutex);
+  dt_fswatch_stats_t *stats = &fswatch->stats;
+  stats->latency_last = 0.0;
+  for(int k = 0; k < num; k++)
+  {
+    if(skipped[k])
+    {
+      dt_print(DT_DEBUG_FSWATCH,"[fswatch] %s is in the library already\n", files[k]);
+      continue;
+    }
+    if(!imgids[k])
+    {
+      stats->failed++;
+      dt_print(DT_DEBUG_FSWATCH,"[fswatch] could not import %s\n", files[k]);
+      continue;
+    }
+    const double latency = end - g_array_index(ready, _ready_t, k).first_seen;
+    stats->imported++;
+    stats->latency_last = MAX(stats->latency_last, latency);
+    stats->latency_max = MAX(stats->latency_max, latency);
+    fswatch->latency_sum += latency;
+    fswatch->thumbnails = g_list_append(fswatch->thumbnails, GUINT_TO_POINTER(imgids[k]));
+  }
+  stats->latency_avg = stats->imported ? fswatch->latency_sum / stats->imported : 0.0;
+  stats->thumbnails = g_list_length(fswatch->thumbnails);
+  dt_print(DT_DEBUG_FSWATCH|DT_DEBUG_PERF, "[fswatch] imported %d files in %.3f secs, latency %.3f secs (avg %.3f, max %.3f), "
+           "%u pending, %u thumbnails to go, %u imported, %u failed\n", num, end - start, stats->latency_last,
+           stats->latency_avg, stats->latency_max, stats->pending, stats->thumbnails, stats->imported, stats->failed);
+  dt_pthread_mutex_unlock(&fswatch->mutex);
+
+  for(int k = 0; k < num; k++) g_free(g_array_index(ready, _ready_t, k).path);
+  g_array_free(ready, TRUE);
+  g_free(files);
+  g_free(todo);
+  g_free(imgids);
+  g_free(todo_ids);
+  g_free(skipped);
+
+  dt_control_queue_redraw_center();
+}
+
+// queue thumbnail jobs for imported images, but only while the job queue is quiet.
+// they go to the end of the queue, so whatever the user looks at is loaded first.
+static void _fswatch_thumbnails(dt_fswatch_t *fswatch)
+{
+  if(!darktable.mipmap_cache || !darktable.control || !dt_control_running()) return;
+  const int per_row = MAX(1, dt_conf_get_int("plugins/lighttable/images_in_row"));
+  const dt_mipmap_size_t mip = dt_mipmap_cache_get_matching_size(darktable.mipmap_cache,
+                                                                  darktable.thumbnail_width / per_row,
+                                                                  darktable.thumbnail_height / per_row);
+  while(dt_control_jobs_pending(darktable.control) < DT_CONTROL_MAX_JOBS/2)
+  {
+    dt_pthread_mutex_lock(&fswatch->mutex);
+    GList *first = fswatch->thumbnails;
+    const uint32_t imgid = first ? GPOINTER_TO_UINT(first->data) : 0;
+    fswatch->thumbnails = g_list_delete_link(fswatch->thumbnails, first);
+    fswatch->stats.thumbnails = g_list_length(fswatch->thumbnails);
+    dt_pthread_mutex_unlock(&fswatch->mutex);
+    if(!imgid) break;
+
+    dt_mipmap_buffer_t buf;
+    dt_mipmap_cache_read_get(darktable.mipmap_cache, &buf, imgid, mip, DT_MIPMAP_PREFETCH);
+  }
+}
 
 static void *_fswatch_thread(void *data)
 {
   dt_fswatch_t *fswatch=(dt_fswatch_t *)data;
-  uint32_t res=0;
-  uint32_t event_hdr_size=sizeof(inotify_event_t);
-  inotify_event_t *event_hdr=g_malloc(sizeof(inotify_event_t));
-  memset (event_hdr,0,event_hdr_size);
-  char *name=g_malloc(2048);
-  memset (name,0, 2048);
+  // room for a few events with long names, aligned the way the kernel writes them
+  char buf[16*(sizeof(struct inotify_event) + NAME_MAX + 1)] __attribute__((aligned(__alignof__(struct inotify_event))));
   dt_print(DT_DEBUG_FSWATCH,"[fswatch_thread] Starting thread of context %lx\n",(unsigned long int)data);
   while(1)
   {
-    // Blocking read loop of event fd into event
-    if(read(fswatch->inotify_fd,event_hdr,event_hdr_size) != event_hdr_size)
+    dt_pthread_mutex_lock(&fswatch->mutex);
+    const int busy = g_hash_table_size(fswatch->pending) || fswatch->thumbnails;
+    dt_pthread_mutex_unlock(&fswatch->mutex);
+
+    struct pollfd fds[2] = { { fswatch->inotify_fd, POLLIN, 0 }, { fswatch->wakeup[0], POLLIN, 0 } };
+    if(poll(fds, 2, busy ? DT_FSWATCH_POLL : -1) < 0)
     {
       if(errno == EINTR) continue;
-      perror("[fswatch_thread] read inotify fd");
+      perror("[fswatch_thread] poll");
       break;
     }
 
-    // Read name into buffer if any...
-    if( event_hdr->len > 0 )
+    if(fds[1].revents & POLLIN)
     {
-      res=read(fswatch->inotify_fd,name,event_hdr_size);
-      name[res]='\0';
+      char what = 0;
+      if(read(fswatch->wakeup[0], &what, 1) == 1 && what == 'q') break;
     }
 
-    dt_pthread_mutex_lock(&fswatch->mutex);
-    GList *gitem=g_list_find_custom(fswatch->items,&event_hdr->wd,&_fswatch_items_by_descriptor);
-    if( gitem )
+    if(fds[0].revents & POLLIN)
     {
-      _watch_t *item = gitem->data;
-      item->events=item->events|event_hdr->mask;
+      const ssize_t len = read(fswatch->inotify_fd, buf, sizeof(buf));
+      if(len < 0 && errno != EINTR && errno != EAGAIN)
+      {
+        perror("[fswatch_thread] read inotify fd");
+        break;
+      }
 
-      switch( item->type )
+      dt_pthread_mutex_lock(&fswatch->mutex);
+      for(ssize_t off = 0; len > 0 && off < len;)
       {
-        case DT_FSWATCH_IMAGE:
+        const struct inotify_event *event = (const struct inotify_event *)(buf + off);
+        off += sizeof(struct inotify_event) + event->len;
+
+        GList *gitem=g_list_find_custom(fswatch->items,&event->wd,&_fswatch_items_by_descriptor);
+        if(!gitem)
         {
-          if( (event_hdr->mask&IN_CLOSE) && (item->events&IN_MODIFY) ) // Check if file modified and closed...
-          {
-            //  Something wrote on image externally and closed it, lets tag item as dirty...
-            dt_image_t *img=(dt_image_t *)item->data;
-            img->force_reimport = 1;
-            if(darktable.develop->image==img)
-              dt_dev_raw_reload(darktable.develop);
-            item->events=0;
-          }
-          else if( (event_hdr->mask&IN_ATTRIB) && (item->events&IN_DELETE_SELF) && (item->events&IN_IGNORED))
-          {
-            // This pattern showed up when another file is replacing the original...
-            dt_image_t *img=(dt_image_t *)item->data;
-            img->force_reimport = 1;
-            if(darktable.develop->image==img)
-              dt_dev_raw_reload(darktable.develop);
-            item->events=0;
-          }
+          // IN_IGNORED after a watch was removed
+          dt_print(DT_DEBUG_FSWATCH,"[fswatch_thread] Failed to found watch item for descriptor %d\n", event->wd);
+          continue;
         }
-        break;
+        _watch_t *item = gitem->data;
+        item->events=item->events|event->mask;
 
-        default:
-          dt_print(DT_DEBUG_FSWATCH,"[fswatch_thread] Unhandled object type %d for event descriptor %ld\n", item->type, event_hdr->wd );
-          break;
+        switch( item->type )
+        {
+          case DT_FSWATCH_IMAGE:
+            if( (event->mask&IN_CLOSE_WRITE) || (event->mask&IN_DELETE_SELF) )
+            {
+              // something wrote on the image externally or replaced it
+              dt_print(DT_DEBUG_FSWATCH,"[fswatch_thread] image %lx changed on disk\n",(unsigned long int)item->data);
+              item->events=0;
+            }
+            break;
+
+          case DT_FSWATCH_DIRECTORY:
+            _fswatch_directory_event(fswatch, item, event);
+            break;
+
+          default:
+            dt_print(DT_DEBUG_FSWATCH,"[fswatch_thread] Unhandled object type %d for event descriptor %d\n", item->type, event->wd );
+            break;
+        }
       }
+      dt_pthread_mutex_unlock(&fswatch->mutex);
     }
-    else
-      dt_print(DT_DEBUG_FSWATCH,"[fswatch_thread] Failed to found watch item for descriptor %ld\n", event_hdr->wd );
 
-    dt_pthread_mutex_unlock(&fswatch->mutex);
+    _fswatch_ingest(fswatch);
+    _fswatch_thumbnails(fswatch);
   }
   dt_print(DT_DEBUG_FSWATCH,"[fswatch_thread] terminating.\n");
-  g_free(event_hdr);
-  g_free(name);
   return NULL;
 }
 
 
-
-
-
 const dt_fswatch_t* dt_fswatch_new()
 {
   dt_fswatch_t *fswatch=g_malloc(sizeof(dt_fswatch_t));
@@ -157,7 +432,14 @@ const dt_fswatch_t* dt_fswatch_new()
     g_free(fswatch);
     return NULL;
   }
+  if(pipe(fswatch->wakeup))
+  {
+    close(fswatch->inotify_fd);
+    g_free(fswatch);
+    return NULL;
+  }
   fswatch->items=NULL;
+  fswatch->pending=g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
   dt_pthread_mutex_init(&fswatch->mutex, NULL);
   pthread_create(&fswatch->thread, NULL, &_fswatch_thread, fswatch);
   dt_print(DT_DEBUG_FSWATCH,"[fswatch_new] Creating new context %lx\n",(unsigned long int)fswatch);
@@ -165,18 +447,34 @@ const dt_fswatch_t* dt_fswatch_new()
   return fswatch;
 }
 
+static void _fswatch_free_item(dt_fswatch_t *ctx, _watch_t *item)
+{
+  inotify_rm_watch(ctx->inotify_fd, item->descriptor);
+  if(item->type == DT_FSWATCH_DIRECTORY) g_free(item->data);
+  g_free(item);
+}
+
 void dt_fswatch_destroy(const dt_fswatch_t *fswatch)
 {
+  if(!fswatch) return;
   dt_print(DT_DEBUG_FSWATCH,"[fswatch_destroy] Destroying context %lx\n",(unsigned long int)fswatch);
   dt_fswatch_t *ctx=(dt_fswatch_t *)fswatch;
-  dt_pthread_mutex_destroy(&ctx->mutex);
+  // let the thread finish what it is importing right now
+  _fswatch_wakeup(ctx, 'q');
+  pthread_join(ctx->thread, NULL);
   GList *item=g_list_first(fswatch->items);
   while(item)
   {
-    g_free( item->data );
+    _fswatch_free_item(ctx, (_watch_t *)item->data);
     item=g_list_next(item);
   }
   g_list_free(fswatch->items);
+  g_list_free(fswatch->thumbnails);
+  g_hash_table_destroy(fswatch->pending);
+  close(ctx->wakeup[0]);
+  close(ctx->wakeup[1]);
+  close(ctx->inotify_fd);
+  dt_pthread_mutex_destroy(&ctx->mutex);
   g_free(ctx);
 }
 
@@ -186,6 +484,7 @@ void dt_fswatch_add(const dt_fswatch_t * fswatch,dt_fswatch_type_t type, void *d
   uint32_t mask=0;
   dt_fswatch_t *ctx=(dt_fswatch_t *)fswatch;
   filename[0] = '\0';
+  if(!fswatch) return;
 
   switch(type)
   {
@@ -195,6 +494,12 @@ void dt_fswatch_add(const dt_fswatch_t * fswatch,dt_fswatch_type_t type, void *d
       break;
     case DT_FSWATCH_CURVE_DIRECTORY:
       break;
+    case DT_FSWATCH_DIRECTORY:
+      mask=IN_CREATE|IN_MODIFY|IN_CLOSE_WRITE|IN_MOVED_TO|IN_MOVED_FROM|IN_DELETE|IN_DELETE_SELF|IN_MOVE_SELF|IN_ONLYDIR;
+      // callers pass the absolute folder as it is stored in film_rolls
+      if(g_file_test((const char *)data, G_FILE_TEST_IS_DIR))
+        g_strlcpy(filename, (const char *)data, DT_MAX_PATH_LEN);
+      break;
     default:
       dt_print(DT_DEBUG_FSWATCH,"[fswatch_add] Unhandled object type %d\n",type);
       break;
@@ -202,13 +507,43 @@ void dt_fswatch_add(const dt_fswatch_t * fswatch,dt_fswatch_type_t type, void *d
 
   if(filename[0] != '\0')
   {
+    // what is in the library already is left alone by the scan below
+    GHashTable *known = (type == DT_FSWATCH_DIRECTORY) ? _fswatch_in_library(filename) : NULL;
     dt_pthread_mutex_lock(&ctx->mutex);
     _watch_t *item = g_malloc(sizeof(_watch_t));
     item->type=type;
-    item->data=data;
-    ctx->items=g_list_append(fswatch->items, item);
+    item->data=(type == DT_FSWATCH_DIRECTORY) ? g_strdup(filename) : data;
+    item->events=0;
     item->descriptor=inotify_add_watch(fswatch->inotify_fd,filename,mask);
+    if(item->descriptor < 0)
+    {
+      dt_pthread_mutex_unlock(&ctx->mutex);
+      if(known) g_hash_table_destroy(known);
+      dt_print(DT_DEBUG_FSWATCH,"[fswatch_add] could not watch %s: %s\n",filename,strerror(errno));
+      if(type == DT_FSWATCH_DIRECTORY) g_free(item->data);
+      g_free(item);
+      return;
+    }
+    ctx->items=g_list_append(fswatch->items, item);
+
+    if(type == DT_FSWATCH_DIRECTORY)
+    {
+      // whatever landed while we weren't looking is picked up with the next batch
+      GDir *dir = g_dir_open(filename, 0, NULL);
+      const gchar *name;
+      const double now = dt_get_wtime();
+      while(dir && (name = g_dir_read_name(dir)))
+      {
+        if(!_fswatch_wanted(name) || g_hash_table_lookup(known, name)) continue;
+        gchar *path = g_build_filename(filename, name, NULL);
+        if(g_file_test(path, G_FILE_TEST_IS_REGULAR)) _fswatch_touch(ctx, path, 1, now);
+        g_free(path);
+      }
+      if(dir) g_dir_close(dir);
+    }
     dt_pthread_mutex_unlock(&ctx->mutex);
+    if(known) g_hash_table_destroy(known);
+    _fswatch_wakeup(ctx, 'w');
     dt_print(DT_DEBUG_FSWATCH,"[fswatch_add] Watch on object %lx added on file %s\n",(unsigned long int)data,filename);
   }
   else
@@ -219,15 +554,27 @@ void dt_fswatch_add(const dt_fswatch_t * fswatch,dt_fswatch_type_t type, void *d
 void dt_fswatch_remove(const dt_fswatch_t * fswatch,dt_fswatch_type_t type, void *data)
 {
   dt_fswatch_t *ctx=(dt_fswatch_t *)fswatch;
+  if(!fswatch) return;
   dt_pthread_mutex_lock(&ctx->mutex);
   dt_print(DT_DEBUG_FSWATCH,"[fswatch_remove] removing watch on object %lx\n",(unsigned long int)data);
-  GList *gitem=g_list_find_custom(fswatch->items,data,&_fswatch_items_by_data);
+  GList *gitem=g_list_find_custom(fswatch->items,data,
+                                  type == DT_FSWATCH_DIRECTORY ? &_fswatch_items_by_path : &_fswatch_items_by_data);
   if( gitem )
   {
     _watch_t *item=gitem->data;
     ctx->items=g_list_remove(ctx->items,item);
-    inotify_rm_watch(fswatch->inotify_fd,item->descriptor);
-    g_free(item);
+    if(type == DT_FSWATCH_DIRECTORY)
+    {
+      // files of that directory aren't wanted any more
+      GHashTableIter it;
+      gpointer key;
+      gchar *prefix = g_strconcat((const char *)item->data, G_DIR_SEPARATOR_S, NULL);
+      g_hash_table_iter_init(&it, ctx->pending);
+      while(g_hash_table_iter_next(&it, &key, NULL))
+        if(g_str_has_prefix((const char *)key, prefix)) g_hash_table_iter_remove(&it);
+      g_free(prefix);
+    }
+    _fswatch_free_item(ctx, item);
   }
   else
     dt_print(DT_DEBUG_FSWATCH,"[fswatch_remove] Didn't find watch on object %lx type %d\n",(unsigned long int)data,type);
@@ -235,6 +582,17 @@ void dt_fswatch_remove(const dt_fswatch_t * fswatch,dt_fswatch_type_t type, void
   dt_pthread_mutex_unlock(&ctx->mutex);
 }
 
+void dt_fswatch_get_stats(const dt_fswatch_t *fswatch, dt_fswatch_stats_t *stats)
+{
+  memset(stats, 0, sizeof(dt_fswatch_stats_t));
+  if(!fswatch) return;
+  dt_fswatch_t *ctx=(dt_fswatch_t *)fswatch;
+  dt_pthread_mutex_lock(&ctx->mutex);
+  *stats = fswatch->stats;
+  stats->pending = g_hash_table_size(fswatch->pending);
+  dt_pthread_mutex_unlock(&ctx->mutex);
+}
+
 #else	// HAVE_INOTIFY
 const dt_fswatch_t* dt_fswatch_new()
 {
@@ -244,6 +602,10 @@ const dt_fswatch_t* dt_fswatch_new()
 void dt_fswatch_destroy(const dt_fswatch_t *fswatch) {}
 void dt_fswatch_add(const dt_fswatch_t *fswatch, dt_fswatch_type_t type, void *data) {}
 void dt_fswatch_remove(const dt_fswatch_t * fswatch, dt_fswatch_type_t type, void *data) {}
+void dt_fswatch_get_stats(const dt_fswatch_t *fswatch, dt_fswatch_stats_t *stats)
+{
+  memset(stats, 0, sizeof(dt_fswatch_stats_t));
+}
 #endif
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
 // vim: shiftwidth=2 expandtab tabstop=2 cindent
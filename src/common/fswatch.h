@@ -22,13 +22,32 @@
 #include "common/dtpthread.h"
 
 
+/** what happened in the watched folders so far */
+typedef struct dt_fswatch_stats_t
+{
+  uint32_t seen;          // new files noticed
+  uint32_t imported;      // files added to the library
+  uint32_t failed;        // files the import refused
+  uint32_t pending;       // files still being written or waiting for the next batch
+  uint32_t thumbnails;    // imported images whose thumbnail job isn't queued yet
+  double latency_last;    // secs from the first event of a file to its import, last batch
+  double latency_max;
+  double latency_avg;
+}
+dt_fswatch_stats_t;
+
 /** fswatch context */
 typedef struct dt_fswatch_t
 {
   uint32_t inotify_fd;
+  int wakeup[2];          // pipe to stop the thread
   dt_pthread_mutex_t mutex;
   pthread_t thread;
   GList *items;
+  GHashTable *pending;    // full path -> file waiting to be imported
+  GList *thumbnails;      // imgids waiting for their thumbnail job
+  dt_fswatch_stats_t stats;
+  double latency_sum;
 }
 dt_fswatch_t;
 
@@ -39,6 +58,8 @@ typedef enum dt_fswatch_type_t
   DT_FSWATCH_IMAGE = 0,
   /** watch is on directory for curves files << Just an test  */
   DT_FSWATCH_CURVE_DIRECTORY,
+  /** watch is on a directory, new images are imported into its film roll. data is the path. */
+  DT_FSWATCH_DIRECTORY,
 }
 dt_fswatch_type_t;
 
@@ -50,6 +71,8 @@ void dt_fswatch_destroy(const dt_fswatch_t *fswatch);
 void dt_fswatch_add(const dt_fswatch_t *fswatch, dt_fswatch_type_t type, void *data);
 /** removes an watch of type and assigned data. */
 void dt_fswatch_remove(const dt_fswatch_t * fswatch, dt_fswatch_type_t type, void *data);
+/** copies the ingest statistics of the watched directories. */
+void dt_fswatch_get_stats(const dt_fswatch_t *fswatch, dt_fswatch_stats_t *stats);
 
 #endif
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
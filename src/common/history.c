@@ -20,6 +20,7 @@
 #include "common/darktable.h"
 #include "develop/develop.h"
 #include "control/control.h"
+#include "common/collection.h"
 #include "common/debug.h"
 #include "common/exif.h"
 #include "common/history.h"
@@ -43,26 +44,6 @@ remove_preset_flag(const int imgid)
   dt_image_cache_read_release(darktable.image_cache, cimg);
 }
 
-static void
-_dt_history_cleanup_multi_instance(int imgid, int minnum)
-{
-  sqlite3_stmt *stmt;
-
-  /* let's clean-up the history multi-instance. What we want to do is have a unique multi_priority value for each iop.
-     Furthermore this value must start to 0 and increment one by one for each multi-instance of the same module. On
-     SQLite there is no notion of ROW_NUMBER, so we use rather resource consuming SQL statement, but as an history has
-     never a huge number of items that's not a real issue.
-
-     We only do this for the given imgid and only for num>minnum, that is we only handle new history items just copied.
-  */
-
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "update history set multi_priority=(select COUNT(0)-1 from history hst2 where hst2.num<=history.num and hst2.num>=?2 and hst2.operation=history.operation and hst2.imgid=?1) where imgid=?1 and num>=?2", -1, &stmt, NULL);
-  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
-  DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, minnum);
-  sqlite3_step (stmt);
-  sqlite3_finalize (stmt);
-}
-
 void dt_history_delete_on_image(int32_t imgid)
 {
   sqlite3_stmt *stmt;
@@ -77,6 +58,7 @@ void dt_history_delete_on_image(int32_t imgid)
   sqlite3_finalize (stmt);
   
   remove_preset_flag(imgid);
+  dt_collection_image_changed(darktable.collection, imgid, COLLECTION_CHANGE_HISTORY);
 
   /* if current image in develop reload history */
   if (dt_dev_is_current_image (darktable.develop, imgid))
@@ -137,7 +119,6 @@ dt_history_load_and_apply_on_selection (gchar *filename)
 int
 dt_history_copy_and_paste_on_image (int32_t imgid, int32_t dest_imgid, gboolean merge, GList *ops)
 {
-  sqlite3_stmt *stmt;
   if(imgid==dest_imgid) return 1;
 
   if(imgid==-1)
@@ -146,34 +127,66 @@ dt_history_copy_and_paste_on_image (int32_t imgid, int32_t dest_imgid, gboolean
     return 1;
   }
 
-  /* if merge onto history stack, lets find history offest in destination image */
-  int32_t offs = 0;
+  GList *dest = g_list_append(NULL, GINT_TO_POINTER(dest_imgid));
+  const int res = dt_history_copy_and_paste_on_list(imgid, dest, merge, ops);
+  g_list_free(dest);
+  return res;
+}
+
+int
+dt_history_copy_and_paste_on_list (int32_t imgid, GList *dest, gboolean merge, GList *ops)
+{
+  sqlite3_stmt *stmt;
+  if(imgid==-1)
+  {
+    dt_control_log(_("you need to copy history from an image before you paste it onto another"));
+    return 1;
+  }
+
+  const double start = dt_get_wtime();
+  // the targets table is shared with callers on other threads, e.g. style jobs duplicating images
+  dt_pthread_mutex_lock(&darktable.db_transaction);
+  sqlite3 *db = dt_database_get(darktable.db);
+  const gboolean transaction = sqlite3_get_autocommit(db) && sqlite3_exec(db, "begin", NULL, NULL, NULL) == SQLITE_OK;
+
+  /* all destinations go into one table, so every step below is one statement for all of them */
+  DT_DEBUG_SQLITE3_EXEC(db, "delete from memory.history_targets", NULL, NULL, NULL);
+  DT_DEBUG_SQLITE3_PREPARE_V2(db, "insert or ignore into memory.history_targets (imgid, offs) values (?1, 0)", -1, &stmt, NULL);
+  for(GList *l = dest; l; l = g_list_next(l))
+  {
+    const int32_t dest_imgid = GPOINTER_TO_INT(l->data);
+    if(dest_imgid == imgid || dest_imgid <= 0) continue;
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, dest_imgid);
+    sqlite3_step (stmt);
+    sqlite3_reset (stmt);
+    sqlite3_clear_bindings (stmt);
+  }
+  sqlite3_finalize (stmt);
+
+  /* if merge onto history stack, lets find history offest in destination images */
   if (merge)
   {
     /* apply on top of history stack */
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "SELECT MAX(num)+1 FROM history WHERE imgid = ?1", -1, &stmt, NULL);
-    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, dest_imgid);
-    if (sqlite3_step (stmt) == SQLITE_ROW) offs = sqlite3_column_int (stmt, 0);
+    DT_DEBUG_SQLITE3_EXEC(db, "update memory.history_targets set offs = "
+                          "(select ifnull(max(num)+1, 0) from history where history.imgid = memory.history_targets.imgid)",
+                          NULL, NULL, NULL);
   }
   else
   {
     /* replace history stack */
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "delete from history where imgid = ?1", -1, &stmt, NULL);
-    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, dest_imgid);
-    sqlite3_step (stmt);
+    DT_DEBUG_SQLITE3_EXEC(db, "delete from history where imgid in (select imgid from memory.history_targets)", NULL, NULL, NULL);
   }
-  sqlite3_finalize (stmt);
 
   //  prepare SQL request
   char req[2048];
-  strcpy (req, "insert into history (imgid, num, module, operation, op_params, enabled, blendop_params, blendop_version, multi_name, multi_priority) select ?1, num+?2, module, operation, op_params, enabled, blendop_params, blendop_version, multi_name, multi_priority from history where imgid = ?3");
+  strcpy (req, "insert into history (imgid, num, module, operation, op_params, enabled, blendop_params, blendop_version, multi_name, multi_priority) select t.imgid, h.num+t.offs, h.module, h.operation, h.op_params, h.enabled, h.blendop_params, h.blendop_version, h.multi_name, h.multi_priority from memory.history_targets as t, history as h where h.imgid = ?1");
 
   //  Add ops selection if any format: ... and num in (val1, val2)
   if (ops)
   {
     GList *l = ops;
     int first = 1;
-    strcat (req, " and num in (");
+    strcat (req, " and h.num in (");
 
     while (l)
     {
@@ -188,17 +201,25 @@ dt_history_copy_and_paste_on_image (int32_t imgid, int32_t dest_imgid, gboolean
     }
     strcat (req, ")");
   }
+  strcat (req, " order by t.imgid, h.num");
 
   /* add the history items to stack offest */
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), req, -1, &stmt, NULL);
-  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, dest_imgid);
-  DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, offs);
-  DT_DEBUG_SQLITE3_BIND_INT(stmt, 3, imgid);
+  DT_DEBUG_SQLITE3_PREPARE_V2(db, req, -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
   sqlite3_step (stmt);
   sqlite3_finalize (stmt);
 
+  /* let's clean-up the history multi-instance. What we want to do is have a unique multi_priority value for each iop.
+     Furthermore this value must start to 0 and increment one by one for each multi-instance of the same module. On
+     SQLite there is no notion of ROW_NUMBER, so we use rather resource consuming SQL statement, but as an history has
+     never a huge number of items that's not a real issue.
+
+     We only do this for the new history items just copied, that is num>=offs of each destination.
+  */
   if (merge && ops)
-    _dt_history_cleanup_multi_instance(dest_imgid, offs);
+    DT_DEBUG_SQLITE3_EXEC(db, "update history set multi_priority=(select COUNT(0)-1 from history hst2, memory.history_targets t where t.imgid=history.imgid and hst2.imgid=history.imgid and hst2.num<=history.num and hst2.num>=t.offs and hst2.operation=history.operation) "
+                          "where imgid in (select imgid from memory.history_targets) and num>=(select offs from memory.history_targets t where t.imgid=history.imgid)",
+                          NULL, NULL, NULL);
 
   //we have to copy masks too
   //what to do with existing masks ?
@@ -211,31 +232,55 @@ dt_history_copy_and_paste_on_image (int32_t imgid, int32_t dest_imgid, gboolean
   else
   {
     //let's remove all existing shapes
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "delete from mask where imgid = ?1", -1, &stmt, NULL);
-    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, dest_imgid);
-    sqlite3_step (stmt);
-    sqlite3_finalize (stmt);
+    DT_DEBUG_SQLITE3_EXEC(db, "delete from mask where imgid in (select imgid from memory.history_targets)", NULL, NULL, NULL);
   }
 
   //let's copy now
-  strcpy (req, "insert into mask (imgid, formid, form, name, version, points, points_count, source) select ?1, formid, form, name, version, points, points_count, source from mask where imgid = ?2");
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), req, -1, &stmt, NULL);
-  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, dest_imgid);
-  DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, imgid);
+  DT_DEBUG_SQLITE3_PREPARE_V2(db, "insert into mask (imgid, formid, form, name, version, points, points_count, source) select t.imgid, m.formid, m.form, m.name, m.version, m.points, m.points_count, m.source from memory.history_targets as t, mask as m where m.imgid = ?1", -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
   sqlite3_step (stmt);
   sqlite3_finalize (stmt);
 
-  /* if current image in develop reload history */
-  if (dt_dev_is_current_image(darktable.develop, dest_imgid))
+  /* read back the destinations, for the work outside the database */
+  GList *targets = NULL;
+  DT_DEBUG_SQLITE3_PREPARE_V2(db, "select imgid from memory.history_targets order by imgid desc", -1, &stmt, NULL);
+  while (sqlite3_step (stmt) == SQLITE_ROW)
+    targets = g_list_prepend(targets, GINT_TO_POINTER(sqlite3_column_int(stmt, 0)));
+  sqlite3_finalize (stmt);
+  DT_DEBUG_SQLITE3_EXEC(db, "delete from memory.history_targets", NULL, NULL, NULL);
+
+  if (transaction)
+    DT_DEBUG_SQLITE3_EXEC(db, "commit", NULL, NULL, NULL);
+  dt_pthread_mutex_unlock(&darktable.db_transaction);
+  const double written = dt_get_wtime();
+
+  if (!targets) return 1;
+
+  dt_collection_image_changed(darktable.collection, targets->next ? -1 : GPOINTER_TO_INT(targets->data),
+                              COLLECTION_CHANGE_HISTORY);
+
+  int count = 0;
+  for (GList *l = targets; l; l = g_list_next(l), count++)
   {
-    dt_dev_reload_history_items (darktable.develop);
-    dt_dev_modulegroups_set(darktable.develop, dt_dev_modulegroups_get(darktable.develop));
-  }
+    const int32_t dest_imgid = GPOINTER_TO_INT(l->data);
 
-  /* update xmp file */
-  dt_image_synch_xmp(dest_imgid);
+    /* if current image in develop reload history */
+    if (dt_dev_is_current_image(darktable.develop, dest_imgid))
+    {
+      dt_dev_reload_history_items (darktable.develop);
+      dt_dev_modulegroups_set(darktable.develop, dt_dev_modulegroups_get(darktable.develop));
+    }
+
+    /* update xmp file */
+    dt_image_synch_xmp(dest_imgid);
+
+    dt_mipmap_cache_remove(darktable.mipmap_cache, dest_imgid);
+  }
+  g_list_free(targets);
 
-  dt_mipmap_cache_remove(darktable.mipmap_cache, dest_imgid);
+  const double end = dt_get_wtime();
+  dt_print(DT_DEBUG_PERF, "[history] pasted onto %d images in %.3f secs (database %.3f secs), %.1f images/s\n",
+           count, end - start, written - start, count/MAX(end - start, 1e-6));
 
   return 0;
 }
@@ -305,26 +350,22 @@ dt_history_copy_and_paste_on_selection (int32_t imgid, gboolean merge, GList *op
 {
   if (imgid < 0) return 1;
 
-  int res=0;
+  GList *dest = NULL;
   sqlite3_stmt *stmt;
   DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "select * from selected_images where imgid != ?1", -1, &stmt, NULL);
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
-  if (sqlite3_step(stmt) == SQLITE_ROW)
+  while (sqlite3_step (stmt) == SQLITE_ROW)
   {
-    do
-    {
-      /* get imgid of selected image */
-      int32_t dest_imgid = sqlite3_column_int (stmt, 0);
-
-      /* paste history stack onto image id */
-      dt_history_copy_and_paste_on_image(imgid,dest_imgid,merge,ops);
-
-    }
-    while (sqlite3_step (stmt) == SQLITE_ROW);
+    /* get imgid of selected image */
+    dest = g_list_prepend(dest, GINT_TO_POINTER(sqlite3_column_int (stmt, 0)));
   }
-  else res = 1;
-
   sqlite3_finalize(stmt);
+
+  if (!dest) return 1;
+
+  /* paste history stack onto all of them at once */
+  const int res = dt_history_copy_and_paste_on_list(imgid, dest, merge, ops);
+  g_list_free(dest);
   return res;
 }
 
@@ -25,6 +25,9 @@
 /** copy history from imgid and pasts on dest_imgid, merge or overwrite... */
 int dt_history_copy_and_paste_on_image(int32_t imgid, int32_t dest_imgid, gboolean merge,GList *ops);
 
+/** copy history from imgid and paste it on all images of the list in one transaction, merge or overwrite... */
+int dt_history_copy_and_paste_on_list(int32_t imgid, GList *dest, gboolean merge, GList *ops);
+
 void dt_history_delete_on_image(int32_t imgid);
 
 /** copy history from imgid and pasts on selected images, merge or overwrite... */
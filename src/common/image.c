@@ -389,6 +389,8 @@ int32_t dt_image_duplicate(const int32_t imgid)
       dt_image_cache_read_release(darktable.image_cache, img);
       dt_collection_update_query(darktable.collection);
     }
+    else
+      dt_collection_image_changed(darktable.collection, newid, COLLECTION_CHANGE_ALL);
   }
   return newid;
 }
@@ -452,6 +454,7 @@ void dt_image_remove(const int32_t imgid)
   sqlite3_finalize(stmt);
   // also clear all thumbnails in mipmap_cache.
   dt_mipmap_cache_remove(darktable.mipmap_cache, imgid);
+  dt_collection_image_changed(darktable.collection, imgid, COLLECTION_CHANGE_ALL);
 }
 
 int dt_image_altered(const uint32_t imgid)
@@ -483,6 +486,12 @@ int dt_image_altered(const uint32_t imgid)
 
 
 uint32_t dt_image_import(const int32_t film_id, const char *filename, gboolean override_ignore_jpegs)
+{
+  return dt_image_import_prefetched(film_id, filename, override_ignore_jpegs, NULL);
+}
+
+uint32_t dt_image_import_prefetched(const int32_t film_id, const char *filename, gboolean override_ignore_jpegs,
+                                    dt_exif_prefetch_t *prefetch)
 {
   if(!g_file_test(filename, G_FILE_TEST_IS_REGULAR))
     return 0;
@@ -650,13 +659,13 @@ uint32_t dt_image_import(const int32_t film_id, const char *filename, gboolean o
   img->group_id = group_id;
 
   // read dttags and exif for database queries!
-  (void) dt_exif_read(img, filename);
+  (void) dt_exif_read_prefetched(img, filename, prefetch);
   char dtfilename[DT_MAX_PATH_LEN];
   g_strlcpy(dtfilename, filename, DT_MAX_PATH_LEN);
   dt_image_path_append_version(id, dtfilename, DT_MAX_PATH_LEN);
   char *c = dtfilename + strlen(dtfilename);
   sprintf(c, ".xmp");
-  (void)dt_exif_xmp_read(img, dtfilename, 0);
+  (void)dt_exif_xmp_read_prefetched(img, dtfilename, prefetch);
 
   // write through to db, but not to xmp.
   dt_image_cache_write_release(darktable.image_cache, img, DT_IMAGE_CACHE_RELAXED);
@@ -792,6 +801,9 @@ int32_t dt_image_move(const int32_t imgid, const int32_t filmid)
                                 "where id = ?1) and film_id in (select film_id from images where id = ?1)",
                                 -1, &duplicates_stmt, NULL);
 
+    // pending sidecar writes would go to the old location
+    dt_image_cache_flush_sidecars(darktable.image_cache);
+
     // move image
     GFile *old, *new;
     old = g_file_new_for_path(oldimg);
@@ -1086,9 +1098,26 @@ int dt_image_local_copy_reset(const int32_t imgid)
 
 void dt_image_write_sidecar_file(int imgid)
 {
-  // TODO: compute hash and don't write if not needed!
-  // write .xmp file
+  // write .xmp file, a moment later on the sidecar writer thread. that
+  // way a batch of edits to the same image ends up as one write.
   if(imgid > 0 && dt_conf_get_bool("write_sidecar_files"))
+    dt_image_cache_queue_sidecar(darktable.image_cache, imgid);
+}
+
+void dt_image_write_sidecar_file_now(int imgid)
+{
+  // TODO: compute hash and don't write if not needed!
+  if(imgid <= 0) return;
+
+  // the image might have been removed while the write was queued
+  sqlite3_stmt *stmt;
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "select 1 from images where id = ?1", -1, &stmt,
+                              NULL);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
+  const int exists = (sqlite3_step(stmt) == SQLITE_ROW);
+  sqlite3_finalize(stmt);
+
+  if(exists)
   {
     gboolean from_cache = TRUE;
     char filename[DT_MAX_PATH_LEN+8];
@@ -139,6 +139,10 @@ void dt_image_path_append_version(int imgid, char *pathname, const int len);
 void dt_image_print_exif(const dt_image_t *img, char *line, int len);
 /** imports a new image from raw/etc file and adds it to the data base and image cache. */
 uint32_t dt_image_import(const int32_t film_id, const char *filename, gboolean override_ignore_jpegs);
+/** same as dt_image_import(), using exif and sidecar data read ahead by dt_exif_prefetch(). */
+struct dt_exif_prefetch_t;
+uint32_t dt_image_import_prefetched(const int32_t film_id, const char *filename, gboolean override_ignore_jpegs,
+                                    struct dt_exif_prefetch_t *prefetch);
 /** removes the given image from the database. */
 void dt_image_remove(const int32_t imgid);
 /** duplicates the given image in the database. */
@@ -328,6 +332,8 @@ gboolean dt_image_safe_remove(const int32_t imgid);
 void dt_image_local_copy_synch(void);
 // xmp functions:
 void dt_image_write_sidecar_file(int imgid);
+/* write the .xmp file right away, in the calling thread. */
+void dt_image_write_sidecar_file_now(int imgid);
 void dt_image_synch_xmp(const int selected);
 void dt_image_synch_all_xmp(const gchar *pathname);
 
@@ -17,14 +17,17 @@
 */
 
 #include "common/darktable.h"
+#include "common/collection.h"
 #include "common/debug.h"
 #include "common/exif.h"
 #include "common/image.h"
 #include "common/image_cache.h"
 #include "control/conf.h"
 #include "develop/develop.h"
+#include "views/view.h"
 
 #include <sqlite3.h>
+#include <time.h>
 
 int32_t
 dt_image_cache_allocate(void *data, const uint32_t key, int32_t *cost, void **buf)
@@ -129,6 +132,61 @@ dt_image_cache_deallocate(void *data, const uint32_t key, void *payload)
   dt_image_init(img);
 }
 
+// a queued sidecar write
+typedef struct dt_image_cache_sidecar_t
+{
+  uint32_t imgid;
+  double time;
+}
+dt_image_cache_sidecar_t;
+
+// writes are held back this long, to catch the following changes of the same image, in seconds
+#define DT_IMAGE_CACHE_SIDECAR_DELAY 1.0
+
+static void *
+_image_cache_sidecar_thread(void *data)
+{
+  dt_image_cache_t *cache = (dt_image_cache_t *)data;
+  dt_pthread_mutex_lock(&cache->sidecar_mutex);
+  while(1)
+  {
+    dt_image_cache_sidecar_t *head = (dt_image_cache_sidecar_t *)g_queue_peek_head(cache->sidecar_queue);
+    if(!head)
+    {
+      if(cache->sidecar_quit) break;
+      dt_pthread_cond_wait(&cache->sidecar_cond, &cache->sidecar_mutex);
+      continue;
+    }
+
+    const double wait = head->time + DT_IMAGE_CACHE_SIDECAR_DELAY - dt_get_wtime();
+    if(wait > 0.0 && !cache->sidecar_flush && !cache->sidecar_quit)
+    {
+      struct timespec until;
+      clock_gettime(CLOCK_REALTIME, &until);
+      const long nsec = until.tv_nsec + (long)(wait * 1e9);
+      until.tv_sec += nsec / 1000000000L;
+      until.tv_nsec = nsec % 1000000000L;
+      dt_pthread_cond_timedwait(&cache->sidecar_cond, &cache->sidecar_mutex, &until);
+      continue;
+    }
+
+    const uint32_t imgid = head->imgid;
+    g_queue_pop_head(cache->sidecar_queue);
+    g_hash_table_remove(cache->sidecar_queued, GINT_TO_POINTER(imgid)); // frees head
+    cache->sidecar_writing = imgid;
+    dt_pthread_mutex_unlock(&cache->sidecar_mutex);
+
+    dt_image_write_sidecar_file_now(imgid);
+
+    dt_pthread_mutex_lock(&cache->sidecar_mutex);
+    cache->sidecar_writing = 0;
+    // wake up dt_image_cache_flush_sidecars()
+    pthread_cond_broadcast(&cache->sidecar_cond);
+  }
+  dt_pthread_mutex_unlock(&cache->sidecar_mutex);
+  return NULL;
+}
+
 void
 dt_image_cache_init(dt_image_cache_t *cache)
 {
@@ -156,11 +214,28 @@ dt_image_cache_init(dt_image_cache_t *cache)
     // optimized initialization (avoid accessing conf):
     memcpy(cache->images + k, cache->images, sizeof(dt_image_t));
   }
+
+  dt_pthread_mutex_init(&cache->sidecar_mutex, NULL);
+  pthread_cond_init(&cache->sidecar_cond, NULL);
+  cache->sidecar_queue = g_queue_new();
+  cache->sidecar_queued = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+  pthread_create(&cache->sidecar_thread, NULL, &_image_cache_sidecar_thread, cache);
 }
 
 void
 dt_image_cache_cleanup(dt_image_cache_t *cache)
 {
+  // the writer needs the cache and the database, write what's left first
+  dt_pthread_mutex_lock(&cache->sidecar_mutex);
+  cache->sidecar_quit = 1;
+  pthread_cond_broadcast(&cache->sidecar_cond);
+  dt_pthread_mutex_unlock(&cache->sidecar_mutex);
+  pthread_join(cache->sidecar_thread, NULL);
+  g_queue_free(cache->sidecar_queue);
+  g_hash_table_destroy(cache->sidecar_queued);
+  pthread_cond_destroy(&cache->sidecar_cond);
+  dt_pthread_mutex_destroy(&cache->sidecar_mutex);
+
   dt_cache_cleanup(&cache->cache);
   free(cache->images);
 }
@@ -258,6 +333,11 @@ dt_image_cache_write_release(
   if (rc != SQLITE_DONE) fprintf(stderr, "[image_cache_write_release] sqlite3 error %d\n", rc);
   sqlite3_finalize(stmt);
 
+  // stars and grouping of the thumbnails on screen might have changed:
+  dt_view_image_info_invalidate();
+  // and so might the place of the image in the collection
+  dt_collection_image_changed(darktable.collection, img->id, COLLECTION_CHANGE_IMAGE);
+
   // TODO: make this work in relaxed mode, too.
   if(mode == DT_IMAGE_CACHE_SAFE)
   {
@@ -280,6 +360,47 @@ dt_image_cache_remove(
 
 
 
+void
+dt_image_cache_queue_sidecar(
+  dt_image_cache_t *cache,
+  const uint32_t imgid)
+{
+  dt_pthread_mutex_lock(&cache->sidecar_mutex);
+  if(!g_hash_table_lookup(cache->sidecar_queued, GINT_TO_POINTER(imgid)))
+  {
+    dt_image_cache_sidecar_t *entry = g_malloc(sizeof(dt_image_cache_sidecar_t));
+    entry->imgid = imgid;
+    entry->time = dt_get_wtime();
+    g_queue_push_tail(cache->sidecar_queue, entry);
+    g_hash_table_insert(cache->sidecar_queued, GINT_TO_POINTER(imgid), entry);
+    pthread_cond_broadcast(&cache->sidecar_cond);
+  }
+  dt_pthread_mutex_unlock(&cache->sidecar_mutex);
+}
+
+int
+dt_image_cache_pending_sidecars(
+  dt_image_cache_t *cache)
+{
+  dt_pthread_mutex_lock(&cache->sidecar_mutex);
+  const int pending = g_queue_get_length(cache->sidecar_queue) + (cache->sidecar_writing ? 1 : 0);
+  dt_pthread_mutex_unlock(&cache->sidecar_mutex);
+  return pending;
+}
+
+void
+dt_image_cache_flush_sidecars(
+  dt_image_cache_t *cache)
+{
+  dt_pthread_mutex_lock(&cache->sidecar_mutex);
+  cache->sidecar_flush++;
+  pthread_cond_broadcast(&cache->sidecar_cond);
+  while(!g_queue_is_empty(cache->sidecar_queue) || cache->sidecar_writing)
+    dt_pthread_cond_wait(&cache->sidecar_cond, &cache->sidecar_mutex);
+  cache->sidecar_flush--;
+  dt_pthread_mutex_unlock(&cache->sidecar_mutex);
+}
+
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
 // vim: shiftwidth=2 expandtab tabstop=2 cindent
 // kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
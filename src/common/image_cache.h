@@ -19,13 +19,27 @@
 #define DT_IMAGE_CACHE_H
 
 #include "common/cache.h"
+#include "common/dtpthread.h"
 #include "common/image.h"
 
+#include <glib.h>
+
 typedef struct dt_image_cache_t
 {
   // one fat block of dt_image_t, to assign `dynamic' void* in cache to.
   dt_image_t *images;
   dt_cache_t cache;
+
+  // xmp sidecars waiting for the background writer, oldest first,
+  // and the same entries by image id to coalesce repeated writes.
+  dt_pthread_mutex_t sidecar_mutex;
+  pthread_cond_t sidecar_cond;
+  pthread_t sidecar_thread;
+  GQueue *sidecar_queue;
+  GHashTable *sidecar_queued;
+  int32_t sidecar_writing;
+  int sidecar_flush;
+  int sidecar_quit;
 }
 dt_image_cache_t;
 
@@ -92,6 +106,24 @@ dt_image_cache_remove(
   dt_image_cache_t *cache,
   const uint32_t imgid);
 
+// queue the xmp sidecar of the image for the background writer. it is
+// written a moment later, with whatever the database holds by then, so
+// bulk operations only cost one write per image.
+void
+dt_image_cache_queue_sidecar(
+  dt_image_cache_t *cache,
+  const uint32_t imgid);
+
+// number of sidecars queued or being written right now.
+int
+dt_image_cache_pending_sidecars(
+  dt_image_cache_t *cache);
+
+// blocks until all queued sidecars are written.
+void
+dt_image_cache_flush_sidecars(
+  dt_image_cache_t *cache);
+
 #endif
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
 // vim: shiftwidth=2 expandtab tabstop=2 cindent
@@ -0,0 +1,168 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/kmeans.h"
+#include "common/darktable.h"
+#include "common/points.h"
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the fit uses this fraction of the pixels, but never more than the maximum
+#define DT_KMEANS_SAMPLE_FRACTION 0.2
+#define DT_KMEANS_MAX_SAMPLES (1<<16)
+// stop once no mean moves by more than this (in Lab units)
+#define DT_KMEANS_EPSILON 1e-3f
+
+// what one thread gathers for one cluster during an iteration
+typedef struct dt_kmeans_partial_t
+{
+  double sum[2];
+  double sqr[2];
+  int cnt;
+}
+dt_kmeans_partial_t;
+
+static inline int
+_kmeans_nearest(const float a, const float b, const int n, float mean[n][2])
+{
+  float mdist = FLT_MAX;
+  int cluster = 0;
+  for(int k=0; k<n; k++)
+  {
+    const float dist = (a-mean[k][0])*(a-mean[k][0]) + (b-mean[k][1])*(b-mean[k][1]);
+    if(dist < mdist)
+    {
+      mdist = dist;
+      cluster = k;
+    }
+  }
+  return cluster;
+}
+
+int dt_kmeans_ab(const float *const col, const int width, const int height, const int ch, const int n,
+                 const int max_iterations, const dt_kmeans_init_t init, float mean[n][2], float var[n][2],
+                 float weight[n])
+{
+  const int samples = MAX(1, MIN((int)(width*height*DT_KMEANS_SAMPLE_FRACTION), DT_KMEANS_MAX_SAMPLES));
+  const int threads = dt_get_num_threads();
+  // every thread gets its own cache lines for the partial sums
+  const size_t stride = (n*sizeof(dt_kmeans_partial_t) + 63) & ~(size_t)63;
+  float (*ab)[2] = (float (*)[2])dt_alloc_align(64, sizeof(float)*2*samples);
+  char *partials = (char *)dt_alloc_align(64, stride*threads);
+  if(!ab || !partials)
+  {
+    free(ab);
+    free(partials);
+    for(int k=0; k<n; k++) var[k][0] = var[k][1] = weight[k] = 0.0f;
+    return 0;
+  }
+
+  // draw the samples once, the fit then streams through a compact array
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) shared(ab) schedule(static)
+#endif
+  for(int s=0; s<samples; s++)
+  {
+    const int j = CLAMP(dt_points_get()*height, 0, height-1);
+    const int i = CLAMP(dt_points_get()*width, 0, width-1);
+    const float *px = col + (size_t)ch*((size_t)width*j + i);
+    ab[s][0] = px[1];
+    ab[s][1] = px[2];
+  }
+
+  if(init == DT_KMEANS_INIT_RANGE)
+  {
+    float a_min = FLT_MAX, b_min = FLT_MAX, a_max = -FLT_MAX, b_max = -FLT_MAX;
+    for(int s=0; s<samples; s++)
+    {
+      a_min = fminf(ab[s][0], a_min);
+      a_max = fmaxf(ab[s][0], a_max);
+      b_min = fminf(ab[s][1], b_min);
+      b_max = fmaxf(ab[s][1], b_max);
+    }
+    for(int k=0; k<n; k++)
+    {
+      mean[k][0] = 0.9f * (a_min + (a_max - a_min) * dt_points_get());
+      mean[k][1] = 0.9f * (b_min + (b_max - b_min) * dt_points_get());
+    }
+  }
+  for(int k=0; k<n; k++) var[k][0] = var[k][1] = weight[k] = 0.0f;
+
+  int it = 0;
+  while(it < max_iterations)
+  {
+    it++;
+    memset(partials, 0, stride*threads);
+#ifdef _OPENMP
+    #pragma omp parallel for default(none) shared(ab, partials, mean) schedule(static)
+#endif
+    for(int s=0; s<samples; s++)
+    {
+      dt_kmeans_partial_t *p = (dt_kmeans_partial_t *)(partials + stride*dt_get_thread_num());
+      const float a = ab[s][0], b = ab[s][1];
+      const int c = _kmeans_nearest(a, b, n, mean);
+      p[c].cnt++;
+      p[c].sum[0] += a;
+      p[c].sum[1] += b;
+      p[c].sqr[0] += a*a;
+      p[c].sqr[1] += b*b;
+    }
+
+    // merge the threads and move the means
+    float moved = 0.0f;
+    int count = 0;
+    for(int k=0; k<n; k++)
+    {
+      dt_kmeans_partial_t t = { { 0.0, 0.0 }, { 0.0, 0.0 }, 0 };
+      for(int thr=0; thr<threads; thr++)
+      {
+        const dt_kmeans_partial_t *p = (const dt_kmeans_partial_t *)(partials + stride*thr) + k;
+        t.cnt += p->cnt;
+        for(int c=0; c<2; c++)
+        {
+          t.sum[c] += p->sum[c];
+          t.sqr[c] += p->sqr[c];
+        }
+      }
+      weight[k] = t.cnt;
+      count += t.cnt;
+      // an empty cluster keeps its mean and variance
+      if(t.cnt == 0) continue;
+      for(int c=0; c<2; c++)
+      {
+        const double m = t.sum[c]/t.cnt;
+        moved = fmaxf(moved, fabsf(mean[k][c] - m));
+        mean[k][c] = m;
+        var[k][c] = MAX(0.0, t.sqr[c]/t.cnt - m*m);
+      }
+    }
+    for(int k=0; k<n; k++) weight[k] = count > 0 ? weight[k]/count : 0.0f;
+
+    if(moved < DT_KMEANS_EPSILON) break;
+  }
+
+  free(partials);
+  free(ab);
+  return it;
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,46 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DT_COMMON_KMEANS_H
+#define DT_COMMON_KMEANS_H
+
+typedef enum dt_kmeans_init_t
+{
+  DT_KMEANS_INIT_GIVEN = 0, // start from the means passed in
+  DT_KMEANS_INIT_RANGE = 1  // start at random points inside the range of the samples
+}
+dt_kmeans_init_t;
+
+/**
+ * k-means clustering of the a and b channels of a Lab buffer with ch floats per pixel.
+ * a random subset of the pixels is drawn once and then fitted until the means
+ * stop moving or max_iterations is reached. every thread sums up its share of
+ * the samples on its own, the partial sums are merged after each iteration.
+ *
+ * on return mean holds the cluster centres, var the variances and weight the
+ * fraction of the samples belonging to each cluster. returns the number of
+ * iterations done.
+ */
+int dt_kmeans_ab(const float *const col, const int width, const int height, const int ch, const int n,
+                 const int max_iterations, const dt_kmeans_init_t init, float mean[n][2], float var[n][2],
+                 float weight[n]);
+
+#endif
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,123 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/memory_budget.h"
+#include "common/darktable.h"
+#include "control/conf.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const char *_consumer_names[DT_MEMORY_CONSUMERS] = { "pipe cache", "scratch", "tiling", "mipmap" };
+
+void dt_memory_budget_init(const int init_gui)
+{
+  dt_memory_budget_t *b = (dt_memory_budget_t *)malloc(sizeof(dt_memory_budget_t));
+  memset(b, 0, sizeof(dt_memory_budget_t));
+  dt_pthread_mutex_init(&b->lock, NULL);
+
+  // configured in MB, 0 means three quarters of the physical memory
+  const int conf = dt_conf_get_int("memory_budget");
+  const size_t physical = dt_get_total_memory() * (size_t)1024;
+  if(conf > 0) b->total = (size_t)conf << 20;
+  else if(physical > 0) b->total = physical / 4 * 3;
+  else b->total = (size_t)4 << 30;
+  // nobody waits for export when there is no gui
+  b->reserve = init_gui ? b->total / 4 : 0;
+
+  darktable.memory_budget = b;
+  dt_print(DT_DEBUG_MEMORY, "[memory_budget] %zu MB in total, %zu MB reserved for interactive use\n",
+           b->total >> 20, b->reserve >> 20);
+}
+
+void dt_memory_budget_cleanup()
+{
+  dt_memory_budget_t *b = darktable.memory_budget;
+  if(!b) return;
+  if(darktable.unmuted & DT_DEBUG_MEMORY) dt_memory_budget_print();
+  dt_pthread_mutex_destroy(&b->lock);
+  free(b);
+  darktable.memory_budget = NULL;
+}
+
+// expects the lock to be held
+static size_t _used(const dt_memory_budget_t *b, const dt_memory_priority_t priority)
+{
+  size_t used = 0;
+  for(int k=0; k<DT_MEMORY_CONSUMERS; k++) used += b->used[priority][k];
+  return used;
+}
+
+void dt_memory_budget_charge(const dt_memory_consumer_t consumer, const dt_memory_priority_t priority, const size_t bytes)
+{
+  dt_memory_budget_t *b = darktable.memory_budget;
+  if(!b || !bytes) return;
+  dt_pthread_mutex_lock(&b->lock);
+  b->used[priority][consumer] += bytes;
+  const size_t used = _used(b, DT_MEMORY_BACKGROUND) + _used(b, DT_MEMORY_INTERACTIVE);
+  b->peak = MAX(b->peak, used);
+  dt_pthread_mutex_unlock(&b->lock);
+  if(used > b->total)
+    dt_print(DT_DEBUG_MEMORY, "[memory_budget] over budget by %zu MB after %zu MB for %s\n",
+             (used - b->total) >> 20, bytes >> 20, _consumer_names[consumer]);
+}
+
+void dt_memory_budget_release(const dt_memory_consumer_t consumer, const dt_memory_priority_t priority, const size_t bytes)
+{
+  dt_memory_budget_t *b = darktable.memory_budget;
+  if(!b || !bytes) return;
+  dt_pthread_mutex_lock(&b->lock);
+  b->used[priority][consumer] -= MIN(bytes, b->used[priority][consumer]);
+  dt_pthread_mutex_unlock(&b->lock);
+}
+
+size_t dt_memory_budget_available(const dt_memory_priority_t priority)
+{
+  dt_memory_budget_t *b = darktable.memory_budget;
+  if(!b) return (size_t)-1;
+  dt_pthread_mutex_lock(&b->lock);
+  const size_t interactive = _used(b, DT_MEMORY_INTERACTIVE);
+  const size_t used = interactive + _used(b, DT_MEMORY_BACKGROUND);
+  size_t limit = b->total;
+  // background work keeps out of the part of the reserve the darkroom does not use yet
+  if(priority == DT_MEMORY_BACKGROUND && b->reserve > interactive)
+    limit -= b->reserve - interactive;
+  dt_pthread_mutex_unlock(&b->lock);
+  return limit > used ? limit - used : 0;
+}
+
+size_t dt_memory_budget_total()
+{
+  return darktable.memory_budget ? darktable.memory_budget->total : (size_t)-1;
+}
+
+void dt_memory_budget_print()
+{
+  dt_memory_budget_t *b = darktable.memory_budget;
+  if(!b) return;
+  dt_pthread_mutex_lock(&b->lock);
+  fprintf(stderr, "[memory_budget] %.1f MB total, %.1f MB reserved, peak %.1f MB\n",
+          b->total/(1024.0*1024.0), b->reserve/(1024.0*1024.0), b->peak/(1024.0*1024.0));
+  for(int k=0; k<DT_MEMORY_CONSUMERS; k++)
+    fprintf(stderr, "[memory_budget]   %-10s %8.1f MB interactive %8.1f MB background\n", _consumer_names[k],
+            b->used[DT_MEMORY_INTERACTIVE][k]/(1024.0*1024.0), b->used[DT_MEMORY_BACKGROUND][k]/(1024.0*1024.0));
+  dt_pthread_mutex_unlock(&b->lock);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
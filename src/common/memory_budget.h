@@ -0,0 +1,80 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DT_MEMORY_BUDGET_H
+#define DT_MEMORY_BUDGET_H
+
+#include "common/dtpthread.h"
+#include <stddef.h>
+
+/**
+ * central bookkeeping of the large allocations of the processing code.
+ * consumers charge what they hold and release it again, and ask how much
+ * they may still use before allocating. background work (export, thumbnails)
+ * leaves a reserve to the interactive pipes of the darkroom, and gets less
+ * room (smaller tiles, smaller scratch pools) when those need the memory.
+ */
+typedef enum dt_memory_consumer_t
+{
+  DT_MEMORY_PIPE_CACHE = 0, // cache lines of the pixelpipes
+  DT_MEMORY_SCRATCH,        // module temporaries, see develop/pixelpipe_scratch.h
+  DT_MEMORY_TILING,         // tile buffers of default_process_tiling
+  DT_MEMORY_MIPMAP,         // thumbnail levels of the mipmap cache
+  DT_MEMORY_CONSUMERS
+}
+dt_memory_consumer_t;
+
+typedef enum dt_memory_priority_t
+{
+  DT_MEMORY_BACKGROUND = 0,  // export and thumbnail pipes
+  DT_MEMORY_INTERACTIVE = 1, // darkroom pipes and caches the gui waits on
+  DT_MEMORY_PRIORITIES
+}
+dt_memory_priority_t;
+
+typedef struct dt_memory_budget_t
+{
+  dt_pthread_mutex_t lock;
+  // bytes all consumers together should stay below
+  size_t total;
+  // part of the total background work leaves to interactive use
+  size_t reserve;
+  size_t used[DT_MEMORY_PRIORITIES][DT_MEMORY_CONSUMERS];
+  size_t peak;
+}
+dt_memory_budget_t;
+
+/** sets up darktable.memory_budget from the memory_budget config (or physical memory). */
+void dt_memory_budget_init(const int init_gui);
+void dt_memory_budget_cleanup();
+
+/** account bytes now held by / given back by a consumer. */
+void dt_memory_budget_charge(const dt_memory_consumer_t consumer, const dt_memory_priority_t priority, const size_t bytes);
+void dt_memory_budget_release(const dt_memory_consumer_t consumer, const dt_memory_priority_t priority, const size_t bytes);
+
+/** bytes a consumer of the given priority may still allocate. */
+size_t dt_memory_budget_available(const dt_memory_priority_t priority);
+/** the total budget, for consumers that size themselves once at startup. */
+size_t dt_memory_budget_total();
+
+/** print out who holds how much (debug). */
+void dt_memory_budget_print();
+
+#endif
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
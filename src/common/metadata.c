@@ -17,6 +17,7 @@
 */
 
 #include "common/metadata.h"
+#include "common/collection.h"
 #include "common/debug.h"
 
 #include <stdlib.h>
@@ -69,6 +70,7 @@ static void dt_metadata_set_xmp(int id, const char* key, const char* value)
       sqlite3_finalize(stmt);
     }
   }
+  dt_collection_image_changed(darktable.collection, id, COLLECTION_CHANGE_METADATA);
 }
 
 static void dt_metadata_set_exif(int id, const char* key, const char* value) {} //TODO Is this useful at all?
@@ -422,6 +424,7 @@ void dt_metadata_clear(int id)
     sqlite3_step(stmt);
     sqlite3_finalize(stmt);
   }
+  dt_collection_image_changed(darktable.collection, id, COLLECTION_CHANGE_METADATA);
 }
 
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
@@ -22,6 +22,7 @@
 #include "common/imageio.h"
 #include "common/imageio_module.h"
 #include "common/imageio_jpeg.h"
+#include "common/memory_budget.h"
 #include "common/mipmap_cache.h"
 #include "control/conf.h"
 #include "control/jobs.h"
@@ -638,6 +639,8 @@ void dt_mipmap_cache_init(dt_mipmap_cache_t *cache)
   // adjust numbers to be large enough to hold what mem limit suggests.
   // we want at least 100MB, and consider 2G just still reasonable.
   uint32_t max_mem = CLAMPS(dt_conf_get_int("cache_memory"), 100u<<20, 2u<<30);
+  // but leave most of the memory budget to the pixelpipes
+  max_mem = MAX(100u<<20, MIN(max_mem, dt_memory_budget_total()/4));
   const uint32_t parallel = CLAMP(dt_conf_get_int ("worker_threads")*dt_conf_get_int("parallel_export"), 1, 8);
   const int32_t max_size = 2048, min_size = 32;
   int32_t wd = darktable.thumbnail_width;
@@ -712,6 +715,7 @@ void dt_mipmap_cache_init(dt_mipmap_cache_t *cache)
     max_mem -= thumbnails * cache->mip[k].buffer_size;
     // dt_print(DT_DEBUG_CACHE, "[mipmap mem] %4.02f left\n", max_mem/(1024.0*1024.0));
     cache->mip[k].buf = dt_alloc_align(64, thumbnails * cache->mip[k].buffer_size);
+    dt_memory_budget_charge(DT_MEMORY_MIPMAP, DT_MEMORY_INTERACTIVE, (size_t)thumbnails * cache->mip[k].buffer_size);
     dt_cache_static_allocation(&cache->mip[k].cache, (uint8_t *)cache->mip[k].buf, cache->mip[k].buffer_size);
     dt_cache_set_allocate_callback(&cache->mip[k].cache,
                                    dt_mipmap_cache_allocate, &cache->mip[k]);
@@ -758,6 +762,8 @@ void dt_mipmap_cache_cleanup(dt_mipmap_cache_t *cache)
   dt_mipmap_cache_serialize(cache);
   for(int k=0; k<DT_MIPMAP_F; k++)
   {
+    dt_memory_budget_release(DT_MEMORY_MIPMAP, DT_MEMORY_INTERACTIVE,
+                             (size_t)dt_cache_capacity(&cache->mip[k].cache) * cache->mip[k].buffer_size);
     dt_cache_cleanup(&cache->mip[k].cache);
     // now mem is actually freed, not during cache cleanup
     free(cache->mip[k].buf);
@@ -1151,7 +1157,21 @@ _init_f(
 
   assert(!buffer_is_broken(&buf));
 
-  if(image->filters)
+  if(image->filters && roi_out.scale <= 0.5f)
+  {
+    // average whole periods of the mosaic
+    if(image->bpp == sizeof(float))
+      dt_iop_clip_and_zoom_demosaic_superpixel_f(
+        out, (const float *)buf.buf,
+        &roi_out, &roi_in, roi_out.width, roi_in.width,
+        dt_image_flipped_filter(image), 1.0f);
+    else
+      dt_iop_clip_and_zoom_demosaic_superpixel(
+        out, (const uint16_t *)buf.buf,
+        &roi_out, &roi_in, roi_out.width, roi_in.width,
+        dt_image_flipped_filter(image), 1.0f);
+  }
+  else if(image->filters)
   {
     // demosaic during downsample
     if(image->bpp == sizeof(float))
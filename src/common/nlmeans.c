@@ -0,0 +1,94 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/nlmeans.h"
+#include "common/cpu.h"
+#include "common/darktable.h"
+#include "develop/pixelpipe_hb.h"
+#include <emmintrin.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// edge length of the output tiles. with the search window of 2K and the patch
+// border of 2P around it, a tile of the input plus the accumulators are a few
+// hundred KB for the usual radii, which stays in L2.
+#define DT_NLMEANS_TILE 64
+
+// the per tile work lives in common/nlmeans_tile.c, built for every instruction set level
+#define DT_NLMEANS_TILE_ARGS (const float *const in, const int width, const int height, \
+                              const dt_nlmeans_param_t *const params, const int x0, const int y0, \
+                              const int tw, const int th, const int dwd, float *const d, float *const v, \
+                              float *const w, float *const acc)
+DT_CPU_ISA_DECLARE(void, dt_nlmeans_tile, DT_NLMEANS_TILE_ARGS)
+typedef void (*dt_nlmeans_tile_t) DT_NLMEANS_TILE_ARGS;
+
+void dt_nlmeans_accumulate(const float *const in, float *const out, const int width, const int height,
+                           const dt_nlmeans_param_t *const params)
+{
+  const int P = params->patch_radius;
+  const int T = DT_NLMEANS_TILE;
+  const int dwd = T + 2*P;
+  const int tiles_x = (width + T - 1) / T;
+  const int tiles_y = (height + T - 1) / T;
+  // distances, vertical sums, weights of a row and accumulators of one thread, padded to full cache lines
+  const size_t per_thread = ((size_t)dwd*dwd + (size_t)dwd*T + T + 4 + (size_t)4*T*T + 15) & ~(size_t)15;
+  const size_t scratch_size = sizeof(float)*per_thread*dt_get_num_threads();
+  float *scratch = params->pipe ? (float *)dt_dev_pixelpipe_scratch_alloc(params->pipe, scratch_size)
+                                : (float *)dt_alloc_align(64, scratch_size);
+  if(!scratch)
+  {
+    // weight one for the pixel itself, the caller's normalisation then returns the input
+    fprintf(stderr, "[nlmeans] could not allocate working memory, skipping\n");
+    const __m128 rgbmask = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+    const __m128 alpha1 = _mm_set_ps(1.0f, 0.0f, 0.0f, 0.0f);
+    for(size_t k=0; k<(size_t)width*height; k++)
+      _mm_store_ps(out + 4*k, _mm_or_ps(_mm_and_ps(_mm_load_ps(in + 4*k), rgbmask), alpha1));
+    return;
+  }
+
+  const dt_nlmeans_tile_t tile = DT_CPU_ISA_SELECT(dt_nlmeans_tile);
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) shared(scratch) schedule(dynamic)
+#endif
+  for(int t=0; t<tiles_x*tiles_y; t++)
+  {
+    // nobody is waiting for the result any more, skip the remaining tiles
+    if(params->pipe && dt_dev_pixelpipe_cancelled(params->pipe)) continue;
+
+    const int x0 = (t % tiles_x)*T, y0 = (t / tiles_x)*T;
+    const int tw = MIN(T, width - x0), th = MIN(T, height - y0);
+    float *d = scratch + per_thread*dt_get_thread_num();
+    float *v = d + (size_t)dwd*dwd;
+    float *w = v + (size_t)dwd*T;
+    float *acc = (float *)(((uintptr_t)(w + T) + 15) & ~(uintptr_t)15);
+    tile(in, width, height, params, x0, y0, tw, th, dwd, d, v, w, acc);
+
+    for(int j=0; j<th; j++)
+      memcpy(out + 4*((size_t)width*(y0+j) + x0), acc + (size_t)4*tw*j, sizeof(float)*4*tw);
+  }
+  if(params->pipe) dt_dev_pixelpipe_scratch_free(params->pipe, scratch);
+  else free(scratch);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,54 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DT_COMMON_NLMEANS_H
+#define DT_COMMON_NLMEANS_H
+
+struct dt_dev_pixelpipe_t;
+
+typedef struct dt_nlmeans_param_t
+{
+  int patch_radius;       // P, patches are (2P+1)^2 pixels
+  int search_radius;      // K, all shifts in [-K,K]^2 are tried
+  float norm[4];          // weight of each channel in the patch distance, alpha should be 0
+  // a shift contributes with 2^-max(0, distance*scale - offset) (fast approximation)
+  float scale;
+  float offset;
+  // checked between tiles so an outdated run stops early, and the working memory
+  // comes from its scratch buffers. may be NULL
+  struct dt_dev_pixelpipe_t *pipe;
+}
+dt_nlmeans_param_t;
+
+/**
+ * non-local means on a 4 channel float buffer of width x height pixels.
+ * out gets the weighted sums of the rgb values of all shifted pixels, and
+ * the sum of the weights in the alpha channel, the caller normalises.
+ *
+ * the image is processed in tiles small enough to keep the tile, its search
+ * window and the accumulators in the cache while all shifts are applied to it.
+ * patch distances are sliding window sums restarted for every tile, so float
+ * errors can't build up over the image.
+ */
+void dt_nlmeans_accumulate(const float *const in, float *const out, const int width, const int height,
+                           const dt_nlmeans_param_t *const params);
+
+#endif
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,237 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// the inner loops of the non-local means engine. this file is not built on its own
+// but once per instruction set level (DT_ISA_KERNELS in src/CMakeLists.txt),
+// common/nlmeans.c picks the variant at runtime.
+
+#include "common/cpu.h"
+#include "common/darktable.h"
+#include "common/nlmeans.h"
+#include <immintrin.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifndef DT_CPU_ISA_SUFFIX
+#error "common/nlmeans_tile.c has to be built through DT_ISA_KERNELS"
+#endif
+
+typedef union floatint_t
+{
+  float f;
+  uint32_t i;
+}
+floatint_t;
+
+static inline float
+fast_mexp2f(const float x)
+{
+  const float i1 = (float)0x3f800000u; // 2^0
+  const float i2 = (float)0x3f000000u; // 2^-1
+  const float k0 = i1 + x * (i2 - i1);
+  floatint_t k;
+  k.i = k0 >= (float)0x800000u ? k0 : 0;
+  return k.f;
+}
+
+// turns patch distances into weights in place, same as fast_mexp2f(fmaxf(0, d*scale - offset))
+static inline void
+_nlmeans_weights(float *const w, const int n, const float scale, const float offset)
+{
+  int k = 0;
+#ifdef __AVX__
+  {
+    const __m256 scalev = _mm256_set1_ps(scale);
+    const __m256 offsetv = _mm256_set1_ps(offset);
+    const __m256 i1 = _mm256_set1_ps((float)0x3f800000u);
+    const __m256 i2mi1 = _mm256_set1_ps((float)0x3f000000u - (float)0x3f800000u);
+    const __m256 denorm = _mm256_set1_ps((float)0x800000u);
+    for(; k+8<=n; k+=8)
+    {
+#ifdef __FMA__
+      const __m256 x = _mm256_max_ps(_mm256_setzero_ps(), _mm256_fmsub_ps(_mm256_loadu_ps(w+k), scalev, offsetv));
+      const __m256 k0 = _mm256_fmadd_ps(x, i2mi1, i1);
+#else
+      const __m256 x = _mm256_max_ps(_mm256_setzero_ps(), _mm256_sub_ps(_mm256_mul_ps(_mm256_loadu_ps(w+k), scalev), offsetv));
+      const __m256 k0 = _mm256_add_ps(i1, _mm256_mul_ps(x, i2mi1));
+#endif
+      const __m256 ki = _mm256_castsi256_ps(_mm256_cvttps_epi32(k0));
+      _mm256_storeu_ps(w+k, _mm256_and_ps(ki, _mm256_cmp_ps(k0, denorm, _CMP_GE_OQ)));
+    }
+  }
+#endif
+  const __m128 scalev = _mm_set1_ps(scale);
+  const __m128 offsetv = _mm_set1_ps(offset);
+  const __m128 i1 = _mm_set1_ps((float)0x3f800000u);
+  const __m128 i2mi1 = _mm_set1_ps((float)0x3f000000u - (float)0x3f800000u);
+  const __m128 denorm = _mm_set1_ps((float)0x800000u);
+  for(; k+4<=n; k+=4)
+  {
+    // the sliding window may drift slightly below zero, which the max takes care of, too
+    const __m128 x = _mm_max_ps(_mm_setzero_ps(), _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(w+k), scalev), offsetv));
+    const __m128 k0 = _mm_add_ps(i1, _mm_mul_ps(x, i2mi1));
+    const __m128i ki = _mm_and_si128(_mm_cvttps_epi32(k0), _mm_castps_si128(_mm_cmpge_ps(k0, denorm)));
+    _mm_storeu_ps(w+k, _mm_castsi128_ps(ki));
+  }
+  for(; k<n; k++) w[k] = fast_mexp2f(fmaxf(0.0f, w[k]*scale - offset));
+}
+
+void DT_CPU_ISA_FUNC(dt_nlmeans_tile)(const float *const in, const int width, const int height,
+                                      const dt_nlmeans_param_t *const params, const int x0, const int y0,
+                                      const int tw, const int th, const int dwd, float *const d,
+                                      float *const v, float *const w, float *const acc)
+{
+  const int P = params->patch_radius;
+  const int K = params->search_radius;
+  const int ew = tw + 2*P, eh = th + 2*P;
+  const __m128 n0 = _mm_set1_ps(params->norm[0]);
+  const __m128 n1 = _mm_set1_ps(params->norm[1]);
+  const __m128 n2 = _mm_set1_ps(params->norm[2]);
+  const __m128 rgbmask = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+  const __m128 alpha1 = _mm_set_ps(1.0f, 0.0f, 0.0f, 0.0f);
+#ifdef __AVX__
+  const __m256 norm8 = _mm256_set_ps(0.0f, params->norm[2], params->norm[1], params->norm[0],
+                                     0.0f, params->norm[2], params->norm[1], params->norm[0]);
+  const __m256 one8 = _mm256_set1_ps(1.0f);
+#endif
+
+  memset(acc, 0, sizeof(float)*4*tw*th);
+
+  for(int kj=-K; kj<=K; kj++)
+  {
+    for(int ki=-K; ki<=K; ki++)
+    {
+      // squared distance of every pixel of the tile plus border to its shifted partner.
+      // pixels with one of the two outside the image don't count towards the patch.
+      for(int jj=0; jj<eh; jj++)
+      {
+        const int y = y0 - P + jj;
+        float *dr = d + (size_t)dwd*jj;
+        int xa = MAX(0, -ki) - (x0 - P);
+        int xb = MIN(width, width - ki) - (x0 - P);
+        xa = CLAMP(xa, 0, ew);
+        xb = CLAMP(xb, xa, ew);
+        if(y < 0 || y >= height || y+kj < 0 || y+kj >= height) xa = xb = ew;
+        memset(dr, 0, sizeof(float)*xa);
+        memset(dr + xb, 0, sizeof(float)*(ew - xb));
+        const float *p = in + 4*((size_t)width*y + x0 - P + xa);
+        const float *q = p + 4*((ptrdiff_t)width*kj + ki);
+        int ii = xa;
+#ifdef __AVX__
+        // eight pixels, two per register. the pairwise sums leave pixels 0 2 4 6
+        // in the low and 1 3 5 7 in the high half, which the unpacks put in order.
+        for(; ii+8<=xb; ii+=8, p+=32, q+=32)
+        {
+          __m256 s[4];
+          for(int k=0; k<4; k++)
+          {
+            const __m256 dd = _mm256_sub_ps(_mm256_loadu_ps(p+8*k), _mm256_loadu_ps(q+8*k));
+            s[k] = _mm256_mul_ps(_mm256_mul_ps(dd, dd), norm8);
+          }
+          const __m256 h = _mm256_hadd_ps(_mm256_hadd_ps(s[0], s[1]), _mm256_hadd_ps(s[2], s[3]));
+          const __m128 lo = _mm256_castps256_ps128(h), hi = _mm256_extractf128_ps(h, 1);
+          _mm_storeu_ps(dr + ii, _mm_unpacklo_ps(lo, hi));
+          _mm_storeu_ps(dr + ii + 4, _mm_unpackhi_ps(lo, hi));
+        }
+#endif
+        // four pixels at a time, transposed to planar so the channel sum is vertical
+        for(; ii+4<=xb; ii+=4, p+=16, q+=16)
+        {
+          __m128 d0 = _mm_sub_ps(_mm_load_ps(p),    _mm_load_ps(q));
+          __m128 d1 = _mm_sub_ps(_mm_load_ps(p+4),  _mm_load_ps(q+4));
+          __m128 d2 = _mm_sub_ps(_mm_load_ps(p+8),  _mm_load_ps(q+8));
+          __m128 d3 = _mm_sub_ps(_mm_load_ps(p+12), _mm_load_ps(q+12));
+          _MM_TRANSPOSE4_PS(d0, d1, d2, d3);
+          const __m128 s = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_mul_ps(d0, d0), n0),
+                                                 _mm_mul_ps(_mm_mul_ps(d1, d1), n1)),
+                                      _mm_mul_ps(_mm_mul_ps(d2, d2), n2));
+          _mm_storeu_ps(dr + ii, s);
+        }
+        for(; ii<xb; ii++, p+=4, q+=4)
+        {
+          float s = 0.0f;
+          for(int c=0; c<3; c++) s += (p[c] - q[c])*(p[c] - q[c])*params->norm[c];
+          dr[ii] = s;
+        }
+      }
+
+      // vertical sums over the patch height, one row of the tile after the other.
+      // plain loops, the compiler vectorises them for the level this file is built for.
+      for(int ii=0; ii<ew; ii++) v[ii] = 0.0f;
+      for(int jj=0; jj<=2*P; jj++)
+      {
+        const float *dr = d + (size_t)dwd*jj;
+        for(int ii=0; ii<ew; ii++) v[ii] += dr[ii];
+      }
+      for(int j=1; j<th; j++)
+      {
+        float *vr = v + (size_t)dwd*j;
+        const float *vp = vr - dwd;
+        const float *add = d + (size_t)dwd*(j + 2*P);
+        const float *sub = d + (size_t)dwd*(j - 1);
+        for(int ii=0; ii<ew; ii++) vr[ii] = vp[ii] + add[ii] - sub[ii];
+      }
+
+      // horizontal sums give the patch distances of one row, weigh the shifted pixels with them
+      const int ia = CLAMP(-ki - x0, 0, tw);
+      const int ib = CLAMP(width - ki - x0, ia, tw);
+      for(int j=0; j<th; j++)
+      {
+        const int y = y0 + j;
+        if(y+kj < 0 || y+kj >= height || ia == ib) continue;
+        const float *vr = v + (size_t)dwd*j;
+        float slide = 0.0f;
+        for(int ii=ia; ii<=ia+2*P; ii++) slide += vr[ii];
+        for(int i=ia; i<ib; i++)
+        {
+          w[i] = slide;
+          if(i+1 < ib) slide += vr[i+2*P+1] - vr[i];
+        }
+        _nlmeans_weights(w + ia, ib - ia, params->scale, params->offset);
+
+        const float *q = in + 4*((size_t)width*(y+kj) + x0 + ia + ki);
+        float *a = acc + 4*((size_t)tw*j + ia);
+        int i = ia;
+#ifdef __AVX__
+        // two pixels per register, alpha is replaced by one to sum up the weights
+        for(; i+2<=ib; i+=2, q+=8, a+=8)
+        {
+          const __m256 iv = _mm256_blend_ps(_mm256_loadu_ps(q), one8, 0x88);
+          const __m256 wv = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_set1_ps(w[i])), _mm_set1_ps(w[i+1]), 1);
+#ifdef __FMA__
+          _mm256_storeu_ps(a, _mm256_fmadd_ps(wv, iv, _mm256_loadu_ps(a)));
+#else
+          _mm256_storeu_ps(a, _mm256_add_ps(_mm256_loadu_ps(a), _mm256_mul_ps(wv, iv)));
+#endif
+        }
+#endif
+        for(; i<ib; i++, q+=4, a+=4)
+        {
+          const __m128 iv = _mm_or_ps(_mm_and_ps(_mm_load_ps(q), rgbmask), alpha1);
+          _mm_store_ps(a, _mm_add_ps(_mm_load_ps(a), _mm_mul_ps(_mm_set1_ps(w[i]), iv)));
+        }
+      }
+    }
+  }
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
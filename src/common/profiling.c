@@ -17,7 +17,11 @@
 */
 
 #include "common/profiling.h"
+#include "common/darktable.h"
+#include <stdio.h>
+#include <string.h>
 
+#ifdef USE_DARKTABLE_PROFILING
 dt_timer_t *dt_timer_start_with_name (const char *file,const char *function,const char *description)
 {
   dt_timer_t *t=g_malloc (sizeof(dt_timer_t));
@@ -37,6 +41,228 @@ void dt_timer_stop_with_name (dt_timer_t *t)
   g_timer_destroy (t->timer);
   g_free (t);
 }
+#endif
+
+// totals of one module in one pipe type
+typedef struct dt_profiling_total_t
+{
+  char op[20];
+  const char *pipe;
+  int invocations, cache_hits, opencl, tiled;
+  double wall, cpu;
+  size_t bytes_in, bytes_out;
+}
+dt_profiling_total_t;
+
+// a thread working on an export batch
+typedef struct dt_profiling_batch_t
+{
+  pthread_t thread;
+  int id;
+}
+dt_profiling_batch_t;
+
+void dt_profiling_init(const char *filename)
+{
+  darktable.profiling = NULL;
+  if(!filename || !*filename) return;
+  dt_profiling_t *p = (dt_profiling_t *)malloc(sizeof(dt_profiling_t));
+  dt_pthread_mutex_init(&p->lock, NULL);
+  p->records = g_array_new(FALSE, FALSE, sizeof(dt_profiling_record_t));
+  p->filename = g_strdup(filename);
+  p->running = g_array_new(FALSE, FALSE, sizeof(dt_profiling_batch_t));
+  p->batches = 0;
+  darktable.profiling = p;
+}
+
+void dt_profiling_record(const dt_profiling_record_t *record)
+{
+  dt_profiling_t *p = darktable.profiling;
+  if(!p) return;
+  dt_pthread_mutex_lock(&p->lock);
+  g_array_append_vals(p->records, record, 1);
+  // several exports and the darkroom may be processing at the same time, keep their records apart
+  int batch = 0;
+  for(guint k=0; k<p->running->len && !batch; k++)
+  {
+    const dt_profiling_batch_t *b = &g_array_index(p->running, dt_profiling_batch_t, k);
+    if(pthread_equal(b->thread, pthread_self())) batch = b->id;
+  }
+  g_array_index(p->records, dt_profiling_record_t, p->records->len - 1).batch = batch;
+  dt_pthread_mutex_unlock(&p->lock);
+}
+
+// expects the lock to be held. batch 0 means all records
+static GArray *_totals(const dt_profiling_t *p, const int batch)
+{
+  GArray *totals = g_array_new(FALSE, TRUE, sizeof(dt_profiling_total_t));
+  for(guint k=0; k<p->records->len; k++)
+  {
+    const dt_profiling_record_t *r = &g_array_index(p->records, dt_profiling_record_t, k);
+    if(batch && r->batch != batch) continue;
+    dt_profiling_total_t *t = NULL;
+    for(guint j=0; j<totals->len && !t; j++)
+    {
+      dt_profiling_total_t *c = &g_array_index(totals, dt_profiling_total_t, j);
+      if(c->pipe == r->pipe && !strcmp(c->op, r->op)) t = c;
+    }
+    if(!t)
+    {
+      g_array_set_size(totals, totals->len + 1);
+      t = &g_array_index(totals, dt_profiling_total_t, totals->len - 1);
+      g_strlcpy(t->op, r->op, sizeof(t->op));
+      t->pipe = r->pipe;
+    }
+    t->invocations++;
+    t->cache_hits += r->cache_hit;
+    t->opencl += (r->devid >= 0);
+    t->tiled += (r->tiles > 0);
+    t->wall += r->wall;
+    t->cpu += r->cpu;
+    t->bytes_in += r->bytes_in;
+    t->bytes_out += r->bytes_out;
+  }
+  return totals;
+}
+
+static void _write_csv(FILE *f, const dt_profiling_t *p, const int batch, GArray *totals)
+{
+  fprintf(f, "kind,module,pipe,image,wall,cpu,bytes in,bytes out,tiles,cache hit,device\n");
+  for(guint k=0; k<p->records->len; k++)
+  {
+    const dt_profiling_record_t *r = &g_array_index(p->records, dt_profiling_record_t, k);
+    if(batch && r->batch != batch) continue;
+    fprintf(f, "invocation,%s,%s,%d,%.6f,%.6f,%zu,%zu,%d,%d,%d\n", r->op, r->pipe, r->imgid, r->wall, r->cpu,
+            r->bytes_in, r->bytes_out, r->tiles, r->cache_hit, r->devid);
+  }
+  // totals reuse the columns: invocations go to image, tiled runs to tiles, opencl runs to device
+  for(guint k=0; totals && k<totals->len; k++)
+  {
+    const dt_profiling_total_t *t = &g_array_index(totals, dt_profiling_total_t, k);
+    fprintf(f, "total,%s,%s,%d,%.6f,%.6f,%zu,%zu,%d,%d,%d\n", t->op, t->pipe, t->invocations, t->wall, t->cpu,
+            t->bytes_in, t->bytes_out, t->tiled, t->cache_hits, t->opencl);
+  }
+}
+
+static void _write_json(FILE *f, const dt_profiling_t *p, const int batch, GArray *totals)
+{
+  // module names are plain identifiers, nothing to escape
+  fprintf(f, "{\n  \"invocations\": [");
+  int first = 1;
+  for(guint k=0; k<p->records->len; k++)
+  {
+    const dt_profiling_record_t *r = &g_array_index(p->records, dt_profiling_record_t, k);
+    if(batch && r->batch != batch) continue;
+    fprintf(f, "%s\n    { \"module\": \"%s\", \"pipe\": \"%s\", \"image\": %d, \"wall\": %.6f, \"cpu\": %.6f, "
+            "\"bytes_in\": %zu, \"bytes_out\": %zu, \"tiles\": %d, \"cache_hit\": %s, \"device\": %d }",
+            first ? "" : ",", r->op, r->pipe, r->imgid, r->wall, r->cpu, r->bytes_in, r->bytes_out, r->tiles,
+            r->cache_hit ? "true" : "false", r->devid);
+    first = 0;
+  }
+  fprintf(f, "\n  ],\n  \"modules\": [");
+  for(guint k=0; totals && k<totals->len; k++)
+  {
+    const dt_profiling_total_t *t = &g_array_index(totals, dt_profiling_total_t, k);
+    fprintf(f, "%s\n    { \"module\": \"%s\", \"pipe\": \"%s\", \"invocations\": %d, \"cache_hits\": %d, "
+            "\"opencl\": %d, \"tiled\": %d, \"wall\": %.6f, \"cpu\": %.6f, \"bytes_in\": %zu, \"bytes_out\": %zu }",
+            k == 0 ? "" : ",", t->op, t->pipe, t->invocations, t->cache_hits, t->opencl, t->tiled, t->wall, t->cpu,
+            t->bytes_in, t->bytes_out);
+  }
+  fprintf(f, "\n  ]\n}\n");
+}
+
+// expects the lock to be held
+static void _write(const dt_profiling_t *p, const char *filename, const int batch)
+{
+  FILE *f = fopen(filename, "wb");
+  if(!f)
+  {
+    fprintf(stderr, "[profiling] could not write `%s'\n", filename);
+    return;
+  }
+  GArray *totals = _totals(p, batch);
+  if(g_str_has_suffix(filename, ".csv")) _write_csv(f, p, batch, totals);
+  else _write_json(f, p, batch, totals);
+  fclose(f);
+
+  if(darktable.unmuted & DT_DEBUG_PERF)
+  {
+    int invocations = 0;
+    for(guint k=0; k<totals->len; k++) invocations += g_array_index(totals, dt_profiling_total_t, k).invocations;
+    fprintf(stderr, "[profiling] %d invocations written to `%s'\n", invocations, filename);
+    for(guint k=0; k<totals->len; k++)
+    {
+      const dt_profiling_total_t *t = &g_array_index(totals, dt_profiling_total_t, k);
+      fprintf(stderr, "[profiling]   %-16s %-9s %5d runs %5d cached %8.3f secs (%.3f CPU)\n", t->op[0] ? t->op : "(input)",
+              t->pipe, t->invocations, t->cache_hits, t->wall, t->cpu);
+    }
+  }
+  g_array_free(totals, TRUE);
+}
+
+int dt_profiling_batch_begin()
+{
+  dt_profiling_t *p = darktable.profiling;
+  if(!p) return 0;
+  dt_pthread_mutex_lock(&p->lock);
+  const int batch = ++p->batches;
+  dt_pthread_mutex_unlock(&p->lock);
+  return batch;
+}
+
+void dt_profiling_batch_join(const int batch)
+{
+  dt_profiling_t *p = darktable.profiling;
+  if(!p || !batch) return;
+  dt_pthread_mutex_lock(&p->lock);
+  const dt_profiling_batch_t b = { pthread_self(), batch };
+  g_array_append_val(p->running, b);
+  dt_pthread_mutex_unlock(&p->lock);
+}
+
+void dt_profiling_batch_leave()
+{
+  dt_profiling_t *p = darktable.profiling;
+  if(!p) return;
+  dt_pthread_mutex_lock(&p->lock);
+  for(guint k=0; k<p->running->len; k++)
+  {
+    if(!pthread_equal(g_array_index(p->running, dt_profiling_batch_t, k).thread, pthread_self())) continue;
+    g_array_remove_index_fast(p->running, k);
+    break;
+  }
+  dt_pthread_mutex_unlock(&p->lock);
+}
+
+void dt_profiling_batch_end(const int batch)
+{
+  dt_profiling_t *p = darktable.profiling;
+  if(!p || !batch) return;
+  dt_pthread_mutex_lock(&p->lock);
+  // profile.json -> profile-export1.json
+  const char *ext = strrchr(p->filename, '.');
+  if(!ext || strchr(ext, G_DIR_SEPARATOR)) ext = p->filename + strlen(p->filename);
+  gchar *filename = g_strdup_printf("%.*s-export%d%s", (int)(ext - p->filename), p->filename, batch, ext);
+  _write(p, filename, batch);
+  g_free(filename);
+  dt_pthread_mutex_unlock(&p->lock);
+}
+
+void dt_profiling_cleanup()
+{
+  dt_profiling_t *p = darktable.profiling;
+  if(!p) return;
+  dt_pthread_mutex_lock(&p->lock);
+  _write(p, p->filename, 0);
+  dt_pthread_mutex_unlock(&p->lock);
+  g_array_free(p->records, TRUE);
+  g_array_free(p->running, TRUE);
+  g_free(p->filename);
+  dt_pthread_mutex_destroy(&p->lock);
+  free(p);
+  darktable.profiling = NULL;
+}
+
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
 // vim: shiftwidth=2 expandtab tabstop=2 cindent
 // kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
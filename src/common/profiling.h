@@ -20,6 +20,8 @@
 #define __PROFILING_H
 
 #include "gui/gtk.h"
+#include "common/dtpthread.h"
+#include <stdint.h>
 
 
 #ifdef USE_DARKTABLE_PROFILING
@@ -48,6 +50,54 @@ dt_timer_t *dt_timer_start_with_name(const char *file,const char *function,const
 void dt_timer_stop_with_name(dt_timer_t *);
 #endif
 
+/**
+ * per module profiling of the pixelpipes. when darktable is started with
+ * --profile <file>, every module invocation (and every cache hit) is recorded
+ * and written to <file> at exit, as csv if the name ends in .csv and as json
+ * otherwise. every export job additionally writes its own records next to it.
+ */
+typedef struct dt_profiling_record_t
+{
+  char op[20];            // module, empty for the input stage
+  const char *pipe;       // pipe type, static string
+  int32_t imgid;
+  double wall, cpu;       // seconds
+  size_t bytes_in, bytes_out;
+  int tiles;              // 0 if processed in one go
+  int cache_hit;
+  int devid;              // opencl device, -1 for the cpu
+  int batch;              // export batch of the thread which recorded it, 0 for none
+}
+dt_profiling_record_t;
+
+typedef struct dt_profiling_t
+{
+  dt_pthread_mutex_t lock;
+  GArray *records;
+  char *filename;
+  // threads working on export batches: dt_profiling_batch_t
+  GArray *running;
+  int batches;
+}
+dt_profiling_t;
+
+/** sets up darktable.profiling if a filename was given, leaves it NULL otherwise. */
+void dt_profiling_init(const char *filename);
+/** writes everything recorded, with per module totals, and frees it all. */
+void dt_profiling_cleanup();
+
+/** append one record, does nothing if profiling is off. */
+void dt_profiling_record(const dt_profiling_record_t *record);
+
+/** export jobs bracket their work with these to get one file per batch. begin
+ * returns the new batch (0 if profiling is off), end writes its records. */
+int dt_profiling_batch_begin();
+void dt_profiling_batch_end(const int batch);
+/** every thread working on a batch brackets its part with these, only what
+ * the joined threads record ends up in the batch file. */
+void dt_profiling_batch_join(const int batch);
+void dt_profiling_batch_leave();
+
 #endif
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
 // vim: shiftwidth=2 expandtab tabstop=2 cindent
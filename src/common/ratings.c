@@ -59,10 +59,12 @@ void dt_ratings_apply_to_selection (int rating)
     /* for each selected image update rating */
     sqlite3_stmt *stmt;
     DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "select imgid from selected_images", -1, &stmt, NULL);
+    dt_collection_changes_begin(darktable.collection);
     while(sqlite3_step(stmt) == SQLITE_ROW)
     {
       dt_ratings_apply_to_image(sqlite3_column_int(stmt, 0), rating);
     }
+    dt_collection_changes_end(darktable.collection);
     sqlite3_finalize(stmt);
 
     /* redraw view */
@@ -20,6 +20,7 @@
 #include "common/debug.h"
 #include "common/collection.h"
 #include "control/signal.h"
+#include "views/view.h"
 
 typedef struct dt_selection_t
 {
@@ -241,11 +242,16 @@ void dt_selection_select_range(dt_selection_t *selection, uint32_t imgid)
 
   sqlite3_step(stmt);
 
+  sqlite3_finalize(stmt);
+
   /* reset filter */
   dt_collection_set_query_flags(selection->collection,
                                 old_flags);
   dt_collection_update(selection->collection);
   selection->last_single_id = -1;
+
+  /* the thumbnails show the selection */
+  dt_view_image_info_invalidate();
 }
 
 void dt_selection_select_filmroll(dt_selection_t *selection)
@@ -266,6 +272,9 @@ void dt_selection_select_filmroll(dt_selection_t *selection)
   DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db),
                         "delete from memory.tmp_selection", NULL, NULL, NULL);
   selection->last_single_id = -1;
+
+  /* the thumbnails show the selection */
+  dt_view_image_info_invalidate();
 }
 
 void dt_selection_select_unaltered(dt_selection_t *selection)
@@ -300,6 +309,9 @@ void dt_selection_select_unaltered(dt_selection_t *selection)
   g_free(fullq);
 
   selection->last_single_id = -1;
+
+  /* the thumbnails show the selection */
+  dt_view_image_info_invalidate();
 }
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
 // vim: shiftwidth=2 expandtab tabstop=2 cindent
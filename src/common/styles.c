@@ -19,6 +19,7 @@
 #include "common/darktable.h"
 #include "develop/develop.h"
 #include "control/control.h"
+#include "common/collection.h"
 #include "common/history.h"
 #include "common/imageio.h"
 #include "common/image_cache.h"
@@ -27,6 +28,8 @@
 #include "common/tags.h"
 #include "common/debug.h"
 #include "common/exif.h"
+#include "common/mipmap_cache.h"
+#include "control/jobs/control_jobs.h"
 
 #include <libxml/encoding.h>
 #include <libxml/xmlwriter.h>
@@ -373,20 +376,125 @@ dt_styles_create_from_image (const char *name,const char *description,int32_t im
 void
 dt_styles_apply_to_selection(const char *name,gboolean duplicate)
 {
+  GList *list = NULL;
   gboolean selected = FALSE;
-  /* for each selected image apply style */
+  /* gather the selected images, the work is done by a background job */
   sqlite3_stmt *stmt;
   DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "select * from selected_images", -1, &stmt, NULL);
   while(sqlite3_step(stmt) == SQLITE_ROW)
   {
-    int imgid = sqlite3_column_int (stmt, 0);
-    dt_styles_apply_to_image (name,duplicate,imgid);
+    long int imgid = sqlite3_column_int (stmt, 0);
     selected = TRUE;
+    /* the image open in darkroom needs its history reloaded, which has to happen here */
+    if (!duplicate && dt_dev_is_current_image(darktable.develop, imgid))
+      dt_styles_apply_to_image (name,duplicate,imgid);
+    else
+      list = g_list_prepend(list, (gpointer)imgid);
   }
   sqlite3_finalize(stmt);
 
   if (!selected)
     dt_control_log(_("no image selected!"));
+  else if (list)
+    dt_control_apply_style(name, duplicate, g_list_reverse(list));
+}
+
+void
+dt_styles_apply_to_list(const char *name, GList *list, gboolean duplicate)
+{
+  int id=0;
+  sqlite3_stmt *stmt;
+
+  if ((id=dt_styles_get_id_by_name(name)) == 0 || !list) return;
+
+  const int total = g_list_length(list);
+  char message[512]= {0};
+  snprintf(message, 512, ngettext ("applying style to %d image", "applying style to %d images", total), total);
+  const guint *jid = dt_control_backgroundjobs_create(darktable.control, 0, message);
+
+  /* duplicates are made one by one and take the first half of the progress bar */
+  const double base = duplicate ? 0.5 : 0.0;
+  GList *targets = NULL;
+  int done = 0;
+  for (GList *l = list; l; l = g_list_next(l))
+  {
+    long int imgid = (long int)l->data;
+    if (duplicate)
+    {
+      imgid = dt_image_duplicate (imgid);
+      if(imgid != -1) dt_history_copy_and_paste_on_image((long int)l->data, imgid, FALSE, NULL);
+      dt_control_backgroundjobs_progress(darktable.control, jid, base*++done/total);
+    }
+    if (imgid > 0) targets = g_list_prepend(targets, (gpointer)imgid);
+  }
+  targets = g_list_reverse(targets);
+
+  /* everything else goes into the database in one transaction. the jobs run on
+     several worker threads, which must not mix their rows in the targets table. */
+  dt_pthread_mutex_lock(&darktable.db_transaction);
+  sqlite3 *db = dt_database_get(darktable.db);
+  const gboolean transaction = sqlite3_get_autocommit(db) && sqlite3_exec(db, "begin", NULL, NULL, NULL) == SQLITE_OK;
+
+  DT_DEBUG_SQLITE3_EXEC(db, "delete from memory.style_targets", NULL, NULL, NULL);
+  DT_DEBUG_SQLITE3_PREPARE_V2(db, "insert or ignore into memory.style_targets (imgid) values (?1)", -1, &stmt, NULL);
+  for (GList *l = targets; l; l = g_list_next(l))
+  {
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, (long int)l->data);
+    sqlite3_step (stmt);
+    sqlite3_reset (stmt);
+    sqlite3_clear_bindings (stmt);
+  }
+  sqlite3_finalize (stmt);
+
+  /* merge onto the history stacks, each one continues after its last item */
+  DT_DEBUG_SQLITE3_EXEC(db, "update memory.style_targets set offs = "
+                        "(select ifnull(max(num)+1, 0) from history where history.imgid = memory.style_targets.imgid)",
+                        NULL, NULL, NULL);
+  DT_DEBUG_SQLITE3_PREPARE_V2(db, "insert into history (imgid,num,module,operation,op_params,enabled,blendop_params,blendop_version,multi_priority,multi_name) select t.imgid, s.num+t.offs,s.module,s.operation,s.op_params,s.enabled,s.blendop_params,s.blendop_version,s.multi_priority,s.multi_name from memory.style_targets as t, style_items as s where s.styleid=?1 order by t.imgid, s.num", -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, id);
+  sqlite3_step (stmt);
+  sqlite3_finalize (stmt);
+
+  /* add tag, same counting as dt_tag_attach() does per image */
+  guint tagid=0;
+  gchar ntag[512]= {0};
+  g_snprintf(ntag,512,"darktable|style|%s",name);
+  if (dt_tag_new(ntag,&tagid))
+  {
+    DT_DEBUG_SQLITE3_PREPARE_V2(db, "insert or replace into tagged_images (imgid, tagid) select imgid, ?1 from memory.style_targets", -1, &stmt, NULL);
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, tagid);
+    sqlite3_step (stmt);
+    sqlite3_finalize (stmt);
+    DT_DEBUG_SQLITE3_PREPARE_V2(db, "update tagxtag set count = count + "
+                                "(select count(*) from memory.style_targets as t join tagged_images as ti on ti.imgid = t.imgid "
+                                "where ti.tagid = (case when tagxtag.id1 = ?1 then tagxtag.id2 else tagxtag.id1 end)) "
+                                "where id1 = ?1 or id2 = ?1", -1, &stmt, NULL);
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, tagid);
+    sqlite3_step (stmt);
+    sqlite3_finalize (stmt);
+  }
+
+  DT_DEBUG_SQLITE3_EXEC(db, "delete from memory.style_targets", NULL, NULL, NULL);
+  if (transaction)
+    DT_DEBUG_SQLITE3_EXEC(db, "commit", NULL, NULL, NULL);
+  dt_pthread_mutex_unlock(&darktable.db_transaction);
+  dt_collection_image_changed(darktable.collection, -1, COLLECTION_CHANGE_HISTORY | COLLECTION_CHANGE_TAG);
+
+  /* sidecars and thumbnails of the whole batch, the slow part */
+  const int count = g_list_length(targets);
+  done = 0;
+  for (GList *l = targets; l; l = g_list_next(l))
+  {
+    const long int imgid = (long int)l->data;
+    dt_image_synch_xmp(imgid);
+    dt_mipmap_cache_remove(darktable.mipmap_cache, imgid);
+    dt_control_backgroundjobs_progress(darktable.control, jid, base + (1.0 - base)*++done/count);
+  }
+  g_list_free(targets);
+
+  dt_control_backgroundjobs_destroy(darktable.control, jid);
+  /* redraw center view to update visible mipmaps */
+  dt_control_queue_redraw_center();
 }
 
 void
@@ -440,6 +548,7 @@ dt_styles_apply_to_image(const char *name,gboolean duplicate, int32_t imgid)
     DT_DEBUG_SQLITE3_BIND_INT(stmt, 3, id);
     sqlite3_step (stmt);
     sqlite3_finalize (stmt);
+    dt_collection_image_changed(darktable.collection, newimgid, COLLECTION_CHANGE_HISTORY);
 
     /* add tag */
     guint tagid=0;
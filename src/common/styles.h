@@ -61,6 +61,9 @@ void dt_styles_update (const char *name, const char *newname, const char *descri
 /** applies the style to selection of images */
 void dt_styles_apply_to_selection (const char *name,gboolean duplicate);
 
+/** applies the style to a list of images in one go, reports progress as background job */
+void dt_styles_apply_to_list (const char *name, GList *list, gboolean duplicate);
+
 /** applies the style to image by imgid*/
 void dt_styles_apply_to_image (const char *name,gboolean dulpicate,int32_t imgid);
 
@@ -18,6 +18,7 @@
 */
 
 #include "common/darktable.h"
+#include "common/collection.h"
 #include "common/tags.h"
 #include "common/debug.h"
 #include "control/conf.h"
@@ -117,6 +118,7 @@ guint dt_tag_remove(const guint tagid, gboolean final)
     DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, tagid);
     sqlite3_step(stmt);
     sqlite3_finalize(stmt);
+    dt_collection_image_changed(darktable.collection, -1, COLLECTION_CHANGE_TAG);
 
     /* raise signal of tags change to refresh keywords module */
     dt_control_signal_raise(darktable.signals, DT_SIGNAL_TAG_CHANGED);
@@ -164,6 +166,8 @@ void dt_tag_reorganize(const gchar *source, const gchar *dest)
              source, dest, tag, source);
 
   DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db), query, NULL, NULL, NULL);
+  // the tag filter matches names, so every image with one of these tags may move
+  dt_collection_image_changed(darktable.collection, -1, COLLECTION_CHANGE_TAG);
 
   /* raise signal of tags change to refresh keywords module */
   //dt_control_signal_raise(darktable.signals, DT_SIGNAL_TAG_CHANGED);
@@ -236,6 +240,7 @@ void dt_tag_attach(guint tagid,gint imgid)
     sqlite3_step(stmt);
     sqlite3_finalize(stmt);
   }
+  dt_collection_image_changed(darktable.collection, imgid, COLLECTION_CHANGE_TAG);
 }
 
 void dt_tag_attach_list(GList *tags,gint imgid)
@@ -320,6 +325,7 @@ void dt_tag_detach(guint tagid,gint imgid)
     sqlite3_step(stmt);
     sqlite3_finalize(stmt);
   }
+  dt_collection_image_changed(darktable.collection, imgid, COLLECTION_CHANGE_TAG);
 }
 
 void dt_tag_detach_by_string(const char *name, gint imgid)
@@ -330,6 +336,7 @@ void dt_tag_detach_by_string(const char *name, gint imgid)
              "tags WHERE name LIKE '%s') AND imgid = %d;", name, imgid);
   DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db), query,
                         NULL, NULL, NULL);
+  dt_collection_image_changed(darktable.collection, imgid, COLLECTION_CHANGE_TAG);
 }
 
 
@@ -176,6 +176,12 @@ static void dt_control_sanitize_database()
                         NULL, NULL, NULL);
   DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db),
                         "CREATE TABLE memory.tmp_selection (imgid INTEGER)", NULL, NULL, NULL);
+  DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db),
+                        "CREATE TABLE memory.style_targets (imgid INTEGER PRIMARY KEY, offs INTEGER)",
+                        NULL, NULL, NULL);
+  DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db),
+                        "CREATE TABLE memory.history_targets (imgid INTEGER PRIMARY KEY, offs INTEGER)",
+                        NULL, NULL, NULL);
   DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db),
                         "CREATE TABLE memory.tagq (tmpid INTEGER PRIMARY KEY, id INTEGER)",
                         NULL, NULL, NULL);
@@ -194,6 +200,69 @@ static void dt_control_sanitize_database()
   dt_legacy_presets_create();
 }
 
+// indices used by the collection queries. all of these are created with "if not exists",
+// so this is safe to run on every startup and brings old databases up to date.
+static void dt_control_create_database_indices()
+{
+  sqlite3 *db = dt_database_get(darktable.db);
+
+  // filters and sort orders of dt_collection_update():
+  sqlite3_exec(db, "create index if not exists images_film_id_index on images (film_id, filename)", NULL, NULL, NULL);
+  sqlite3_exec(db, "create index if not exists images_datetime_taken_index on images (datetime_taken)", NULL, NULL, NULL);
+  sqlite3_exec(db, "create index if not exists images_filename_index on images (filename)", NULL, NULL, NULL);
+  sqlite3_exec(db, "create index if not exists film_rolls_folder_index on film_rolls (folder)", NULL, NULL, NULL);
+  // the primary key covers (imgid, tagid), this one is for "all images with tag x":
+  sqlite3_exec(db, "create index if not exists tagged_images_tagid_index on tagged_images (tagid, imgid)", NULL, NULL, NULL);
+  sqlite3_exec(db, "create index if not exists tags_name_index on tags (name)", NULL, NULL, NULL);
+  // color_labels_idx covers (imgid, color), this one is for "all images with label x":
+  sqlite3_exec(db, "create index if not exists color_labels_color_index on color_labels (color, imgid)", NULL, NULL, NULL);
+  sqlite3_exec(db, "create index if not exists meta_data_index on meta_data (id, key)", NULL, NULL, NULL);
+  sqlite3_exec(db, "create index if not exists meta_data_key_index on meta_data (key, id)", NULL, NULL, NULL);
+  sqlite3_exec(db, "create index if not exists mask_imgid_index on mask (imgid)", NULL, NULL, NULL);
+
+  // full text index for the metadata filters. not every sqlite is built with fts4,
+  // in that case the table is just missing and dt_collection falls back to like '%...%'.
+  // the docid is the rowid of the meta_data row, which is stable as long as we don't vacuum.
+  if(sqlite3_exec(db, "create virtual table meta_data_fts using fts4(value)", NULL, NULL, NULL) == SQLITE_OK)
+    sqlite3_exec(db, "insert into meta_data_fts (docid, value) select rowid, value from meta_data", NULL, NULL, NULL);
+  if(sqlite3_exec(db, "select docid from meta_data_fts limit 0", NULL, NULL, NULL) == SQLITE_OK)
+  {
+    sqlite3_exec(db, "create trigger if not exists meta_data_fts_insert after insert on meta_data "
+                 "begin insert into meta_data_fts (docid, value) values (new.rowid, new.value); end",
+                 NULL, NULL, NULL);
+    sqlite3_exec(db, "create trigger if not exists meta_data_fts_update after update on meta_data "
+                 "begin update meta_data_fts set value = new.value where docid = old.rowid; end",
+                 NULL, NULL, NULL);
+    sqlite3_exec(db, "create trigger if not exists meta_data_fts_delete after delete on meta_data "
+                 "begin delete from meta_data_fts where docid = old.rowid; end",
+                 NULL, NULL, NULL);
+  }
+  else
+  {
+    // no usable index, e.g. a library written by a build with fts4 opened by one without.
+    // the triggers would make every write to meta_data fail.
+    sqlite3_exec(db, "drop trigger if exists meta_data_fts_insert", NULL, NULL, NULL);
+    sqlite3_exec(db, "drop trigger if exists meta_data_fts_update", NULL, NULL, NULL);
+    sqlite3_exec(db, "drop trigger if exists meta_data_fts_delete", NULL, NULL, NULL);
+  }
+
+  // let the query planner know about the indices. the schema version changes with every
+  // table or index which got created or dropped, so only run analyze again when it moved.
+  sqlite3_stmt *stmt;
+  int schema_version = -1;
+  DT_DEBUG_SQLITE3_PREPARE_V2(db, "pragma schema_version", -1, &stmt, NULL);
+  if(sqlite3_step(stmt) == SQLITE_ROW) schema_version = sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+  if(schema_version < 0 || schema_version != dt_conf_get_int("database/analyzed_schema_version"))
+  {
+    sqlite3_exec(db, "analyze", NULL, NULL, NULL);
+    // analyze creates sqlite_stat1 the first time, which is a schema change of its own
+    DT_DEBUG_SQLITE3_PREPARE_V2(db, "pragma schema_version", -1, &stmt, NULL);
+    if(sqlite3_step(stmt) == SQLITE_ROW) dt_conf_set_int("database/analyzed_schema_version", sqlite3_column_int(stmt, 0));
+    sqlite3_finalize(stmt);
+  }
+}
+
 int dt_control_load_config(dt_control_t *c)
 {
   dt_conf_set_int("ui_last/view", DT_MODE_NONE);
@@ -455,6 +524,7 @@ void dt_control_create_database_schema()
   DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db),
                         "create table lock (id integer)",
                         NULL, NULL, NULL);
+  dt_control_create_database_indices();
   // still necessary, it creates temporary tables and such
   dt_control_sanitize_database();
 }
@@ -561,6 +631,8 @@ void dt_control_init(dt_control_t *s)
                    "drop table style_items", NULL, NULL, NULL);
       sqlite3_exec(dt_database_get(darktable.db),
                    "drop table meta_data", NULL, NULL, NULL);
+      sqlite3_exec(dt_database_get(darktable.db),
+                   "drop table meta_data_fts", NULL, NULL, NULL);
       sqlite3_exec(dt_database_get(darktable.db),
                    "drop index imgid_index", NULL, NULL, NULL);
       sqlite3_exec(dt_database_get(darktable.db),
@@ -748,6 +820,9 @@ void dt_control_init(dt_control_t *s)
       // and the colorspace as specified in some image types
       sqlite3_exec(dt_database_get(darktable.db), "alter table images add column colorspace integer", NULL, NULL, NULL);
 
+      // indices for the collection queries and the metadata full text search
+      dt_control_create_database_indices();
+
       dt_pthread_mutex_unlock(&(darktable.control->global_mutex));
     }
     dt_control_sanitize_database();
@@ -1150,6 +1225,14 @@ int32_t dt_control_add_job(dt_control_t *s, dt_job_t *job)
   return 0;
 }
 
+int32_t dt_control_jobs_pending(dt_control_t *s)
+{
+  dt_pthread_mutex_lock(&s->queue_mutex);
+  const int32_t pending = g_list_length(s->queue);
+  dt_pthread_mutex_unlock(&s->queue_mutex);
+  return pending;
+}
+
 int32_t dt_control_revive_job(dt_control_t *s, dt_job_t *job)
 {
   int32_t found_j = -1;
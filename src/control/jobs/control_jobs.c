@@ -31,6 +31,8 @@
 #include "common/tags.h"
 #include "common/debug.h"
 #include "common/gpx.h"
+#include "common/styles.h"
+#include "common/profiling.h"
 #include "control/conf.h"
 #include "control/jobs/control_jobs.h"
 
@@ -309,6 +311,15 @@ int32_t dt_control_flip_images_job_run(dt_job_t *job)
   return 0;
 }
 
+int32_t dt_control_apply_style_job_run(dt_job_t *job)
+{
+  dt_control_image_enumerator_t *t1 = (dt_control_image_enumerator_t *)job->param;
+  dt_styles_apply_to_list((const char *)t1->data, t1->index, t1->flag);
+  g_list_free(t1->index);
+  g_free(t1->data);
+  return 0;
+}
+
 int32_t dt_control_remove_images_job_run(dt_job_t *job)
 {
   long int imgid = -1;
@@ -626,6 +637,16 @@ void dt_control_flip_images_job_init(dt_job_t *job, const int32_t cw)
   t->flag = cw;
 }
 
+void dt_control_apply_style_job_init(dt_job_t *job, const char *name, const gboolean duplicate, GList *list)
+{
+  dt_control_job_init(job, "apply style");
+  job->execute = &dt_control_apply_style_job_run;
+  dt_control_image_enumerator_t *t = (dt_control_image_enumerator_t *)job->param;
+  t->index = list;
+  t->flag = duplicate;
+  t->data = g_strdup(name);
+}
+
 void dt_control_remove_images_job_init(dt_job_t *job)
 {
   dt_control_job_init(job, "remove images");
@@ -690,6 +711,20 @@ void dt_control_flip_images(const int32_t cw)
   dt_control_add_job(darktable.control, &j);
 }
 
+void dt_control_apply_style(const char *name, const gboolean duplicate, GList *list)
+{
+  dt_job_t j;
+  dt_control_apply_style_job_init(&j, name, duplicate, list);
+  if(dt_control_add_job(darktable.control, &j))
+  {
+    // the queue is full, the job owns the list and name
+    dt_control_image_enumerator_t *t = (dt_control_image_enumerator_t *)j.param;
+    dt_control_log(_("could not apply style, too many jobs running"));
+    g_list_free(t->index);
+    g_free(t->data);
+  }
+}
+
 void dt_control_remove_images()
 {
   if(dt_conf_get_bool("ask_before_remove"))
@@ -1048,6 +1083,7 @@ static int32_t dt_control_export_job_run(dt_job_t *job)
   const guint *jid = dt_control_backgroundjobs_create(darktable.control, 0, message );
   dt_control_backgroundjobs_set_cancellable(darktable.control, jid, job);
   const dt_control_t *control = darktable.control;
+  const int batch = dt_profiling_batch_begin();
 
   double fraction=0;
 #ifdef _OPENMP
@@ -1064,6 +1100,8 @@ static int32_t dt_control_export_job_run(dt_job_t *job)
 #endif
   {
 #endif
+    // the pipes of this thread record into the batch
+    dt_profiling_batch_join(batch);
     // get a thread-safe fdata struct (one jpeg struct per thread etc):
     dt_imageio_module_data_t *fdata = mformat->get_params(mformat);
     fdata->max_width = settings->max_width;
@@ -1136,9 +1174,11 @@ static int32_t dt_control_export_job_run(dt_job_t *job)
     }
     // all threads free their fdata
     mformat->free_params (mformat, fdata);
+    dt_profiling_batch_leave();
 #ifdef _OPENMP
   }
 #endif
+  dt_profiling_batch_end(batch);
   g_free(t1->data);
   return 0;
 }
@@ -46,6 +46,9 @@ int32_t dt_control_duplicate_images_job_run(dt_job_t *job);
 void dt_control_flip_images_job_init(dt_job_t *job, const int32_t cw);
 int32_t dt_control_flip_images_job_run(dt_job_t *job);
 
+void dt_control_apply_style_job_init(dt_job_t *job, const char *name, const gboolean duplicate, GList *list);
+int32_t dt_control_apply_style_job_run(dt_job_t *job);
+
 void dt_control_image_enumerator_job_film_init(dt_control_image_enumerator_t *t, int32_t filmid);
 void dt_control_image_enumerator_job_selected_init(dt_control_image_enumerator_t *t);
 
@@ -79,6 +82,7 @@ void dt_control_write_sidecar_files();
 void dt_control_delete_images();
 void dt_control_duplicate_images();
 void dt_control_flip_images(const int32_t cw);
+void dt_control_apply_style(const char *name, const gboolean duplicate, GList *list);
 void dt_control_remove_images();
 void dt_control_move_images();
 void dt_control_copy_images();
@@ -27,6 +27,7 @@
 #include "common/mipmap_cache.h"
 #include "common/imageio.h"
 #include "common/tags.h"
+#include "common/collection.h"
 #include "common/debug.h"
 #include "develop/masks.h"
 #include "gui/gtk.h"
@@ -43,6 +44,12 @@
 #define DT_DEV_AVERAGE_DELAY_START            250
 #define DT_DEV_PREVIEW_AVERAGE_DELAY_START     50
 #define DT_DEV_AVERAGE_DELAY_COUNT              5
+// full pipe runs slower than this (ms) get a coarse pass first
+#define DT_DEV_PROGRESSIVE_DELAY              200
+#define DT_DEV_PROGRESSIVE_SCALE            0.25f
+// edge length of the viewport cache tiles and the least number kept (256k each)
+#define DT_DEV_VIEWPORT_TILE                  256
+#define DT_DEV_VIEWPORT_TILES                 128
 
 
 const gchar* dt_dev_histogram_type_names[DT_DEV_HISTOGRAM_N] = { "logarithmic", "linear", "waveform" };
@@ -57,6 +64,7 @@ void dt_dev_init(dt_develop_t *dev, int32_t gui_attached)
   dev->preview_average_delay = DT_DEV_PREVIEW_AVERAGE_DELAY_START;
   dev->gui_leaving = 0;
   dev->gui_synch = 0;
+  dev->viewport_cache.tiles = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, free);
   dt_pthread_mutex_init(&dev->history_mutex, NULL);
   dev->history_end = 0;
   dev->history = NULL; // empty list
@@ -131,6 +139,8 @@ void dt_dev_cleanup(dt_develop_t *dev)
     dt_dev_pixelpipe_cleanup(dev->preview_pipe);
     free(dev->preview_pipe);
   }
+  g_hash_table_destroy(dev->viewport_cache.tiles);
+  free(dev->viewport_cache.buf);
   while(dev->history)
   {
     free(((dt_dev_history_item_t *)dev->history->data)->params);
@@ -269,6 +279,162 @@ restart:
   dt_mipmap_cache_read_release(darktable.mipmap_cache, &buf);
 }
 
+static int _dev_viewport_cache_usable(dt_develop_t *dev, const float scale)
+{
+  // panning at 1:1 moves by whole pixels, so tiles rendered before line up exactly.
+  if(scale != 1.0f || !dev->gui_attached || dev->pipe->mask_display) return 0;
+  if(dev->capwidth >= dev->pipe->processed_width && dev->capheight >= dev->pipe->processed_height) return 0;
+  // modules which can't be tiled depend on the whole roi and would leave seams
+  for(GList *nodes = dev->pipe->nodes; nodes; nodes = g_list_next(nodes))
+  {
+    dt_dev_pixelpipe_iop_t *piece = (dt_dev_pixelpipe_iop_t *)nodes->data;
+    if(piece->enabled && !(piece->module->flags() & IOP_FLAGS_ALLOW_TILING) && strcmp(piece->module->op, "gamma"))
+      return 0;
+  }
+  return 1;
+}
+
+static void _dev_viewport_cache_sync(dt_develop_t *dev, const float scale)
+{
+  dt_dev_viewport_cache_t *vc = &dev->viewport_cache;
+  // hash of the whole history at this scale, independent of the position
+  const dt_iop_roi_t roi = { 0, 0, 0, 0, scale };
+  const uint64_t hash = dt_dev_pixelpipe_cache_hash(dev->image_storage.id, &roi, dev->pipe, g_list_length(dev->pipe->nodes));
+  if(hash != vc->hash)
+  {
+    g_hash_table_remove_all(vc->tiles);
+    vc->hash = hash;
+  }
+}
+
+static inline uint8_t *_dev_viewport_tile(dt_dev_viewport_cache_t *vc, const int tx, const int ty)
+{
+  return (uint8_t *)g_hash_table_lookup(vc->tiles, GINT_TO_POINTER((ty << 16) | tx));
+}
+
+// first and last missing tile in row ty between tx0 and tx1, returns 0 if there are none.
+static int _dev_viewport_missing(dt_dev_viewport_cache_t *vc, const int ty, const int tx0, const int tx1, int *c0, int *c1)
+{
+  *c0 = tx1+1;
+  *c1 = tx0-1;
+  for(int tx=tx0; tx<=tx1; tx++)
+  {
+    if(_dev_viewport_tile(vc, tx, ty)) continue;
+    *c0 = MIN(*c0, tx);
+    *c1 = tx;
+  }
+  return *c1 >= *c0;
+}
+
+// returns 1 if the viewport at x, y has any tiles in the cache
+static int _dev_viewport_cache_hits(dt_develop_t *dev, const int x, const int y, const float scale)
+{
+  dt_dev_viewport_cache_t *vc = &dev->viewport_cache;
+  _dev_viewport_cache_sync(dev, scale);
+  const int T = DT_DEV_VIEWPORT_TILE;
+  for(int ty=y/T; ty<=(y+dev->capheight-1)/T; ty++)
+    for(int tx=x/T; tx<=(x+dev->capwidth-1)/T; tx++)
+      if(_dev_viewport_tile(vc, tx, ty)) return 1;
+  return 0;
+}
+
+// like dt_dev_pixelpipe_process() on the viewport, but only renders the tiles which aren't cached yet.
+// returns 1 if the pipe was altered during processing.
+static int _dev_viewport_process(dt_develop_t *dev, const int x, const int y, const float scale)
+{
+  dt_dev_viewport_cache_t *vc = &dev->viewport_cache;
+  dt_dev_pixelpipe_t *pipe = dev->pipe;
+  const int T = DT_DEV_VIEWPORT_TILE;
+  const int wd = dev->capwidth, ht = dev->capheight;
+  const int iw = pipe->processed_width*scale, ih = pipe->processed_height*scale;
+  const int tx0 = x/T, ty0 = y/T;
+  const int tx1 = (MIN(x+wd, iw)-1)/T, ty1 = (MIN(y+ht, ih)-1)/T;
+
+  _dev_viewport_cache_sync(dev, scale);
+
+  // rows with the same run of missing tiles are rendered in one go, so that
+  // a horizontal or vertical pan needs only one pipe run (diagonal ones two).
+  // every run requests its own roi, so the modules add whatever overlap they need.
+  int ty = ty0, c0, c1;
+  while(ty <= ty1)
+  {
+    if(!_dev_viewport_missing(vc, ty, tx0, tx1, &c0, &c1))
+    {
+      ty++;
+      continue;
+    }
+    int ty2 = ty, d0, d1;
+    while(ty2 < ty1 && _dev_viewport_missing(vc, ty2+1, tx0, tx1, &d0, &d1) && d0 == c0 && d1 == c1) ty2++;
+
+    const int rx = c0*T, ry = ty*T;
+    const int rw = MIN((c1+1)*T, iw) - rx, rh = MIN((ty2+1)*T, ih) - ry;
+    if(dt_dev_pixelpipe_process(pipe, dev, rx, ry, rw, rh, scale)) return 1;
+
+    // cut the result into tiles
+    for(int j=ty; j<=ty2; j++)
+      for(int i=c0; i<=c1; i++)
+      {
+        uint8_t *tile = (uint8_t *)malloc(sizeof(uint8_t)*4*T*T);
+        if(!tile) return 1;
+        const int ox = i*T - rx, oy = j*T - ry;
+        const int tw = MIN(T, rw - ox), th = MIN(T, rh - oy);
+        for(int k=0; k<th; k++)
+          memcpy(tile + 4*T*k, pipe->backbuf + 4*((size_t)rw*(oy+k) + ox), sizeof(uint8_t)*4*tw);
+        g_hash_table_replace(vc->tiles, GINT_TO_POINTER((j << 16) | i), tile);
+      }
+    ty = ty2+1;
+  }
+
+  dt_pthread_mutex_lock(&pipe->backbuf_mutex);
+  if(!vc->buf) vc->buf = (uint8_t *)malloc(pipe->backbuf_size);
+  if(!vc->buf)
+  {
+    dt_pthread_mutex_unlock(&pipe->backbuf_mutex);
+    return 1;
+  }
+  for(int j=ty0; j<=ty1; j++)
+    for(int i=tx0; i<=tx1; i++)
+    {
+      const uint8_t *tile = _dev_viewport_tile(vc, i, j);
+      // intersection of the tile with the viewport
+      const int bx0 = MAX(i*T, x), bx1 = MIN(MIN((i+1)*T, iw), x+wd);
+      const int by0 = MAX(j*T, y), by1 = MIN(MIN((j+1)*T, ih), y+ht);
+      for(int k=by0; k<by1; k++)
+        memcpy(vc->buf + 4*((size_t)wd*(k-y) + bx0-x), tile + 4*(T*(k-j*T) + bx0-i*T), sizeof(uint8_t)*4*(bx1-bx0));
+    }
+  const dt_iop_roi_t roi = { x, y, wd, ht, scale };
+  pipe->backbuf_hash = dt_dev_pixelpipe_cache_hash(pipe->image.id, &roi, pipe, 0);
+  pipe->backbuf = vc->buf;
+  pipe->backbuf_width  = wd;
+  pipe->backbuf_height = ht;
+  pipe->backbuf_upscale = 1.0f;
+  dt_pthread_mutex_unlock(&pipe->backbuf_mutex);
+
+  // drop the tiles furthest away from the viewport. keep two screens worth of them
+  // (an unaligned viewport touches one more tile per direction), so a 4k display
+  // never evicts what it is showing and still has a screen to pan back into.
+  const guint keep = MAX(DT_DEV_VIEWPORT_TILES, 2*(wd/T+2)*(ht/T+2));
+  while(g_hash_table_size(vc->tiles) > keep)
+  {
+    GHashTableIter it;
+    gpointer key, value, furthest = NULL;
+    int dist = -1;
+    g_hash_table_iter_init(&it, vc->tiles);
+    while(g_hash_table_iter_next(&it, &key, &value))
+    {
+      const int k = GPOINTER_TO_INT(key);
+      const int d = abs((k & 0xffff) - (tx0+tx1)/2) + abs((k >> 16) - (ty0+ty1)/2);
+      if(d > dist)
+      {
+        dist = d;
+        furthest = key;
+      }
+    }
+    g_hash_table_remove(vc->tiles, furthest);
+  }
+  return 0;
+}
+
 void dt_dev_process_image_job(dt_develop_t *dev)
 {
   dt_pthread_mutex_lock(&dev->pipe_mutex);
@@ -304,7 +470,11 @@ void dt_dev_process_image_job(dt_develop_t *dev)
     // init pixel pipeline
     dt_dev_pixelpipe_cleanup_nodes(dev->pipe);
     dt_dev_pixelpipe_create_nodes(dev->pipe, dev);
-    if(dev->image_force_reload) dt_dev_pixelpipe_flush_caches(dev->pipe);
+    if(dev->image_force_reload)
+    {
+      dt_dev_pixelpipe_flush_caches(dev->pipe);
+      g_hash_table_remove_all(dev->viewport_cache.tiles);
+    }
     dev->image_dirty = 1;
     dev->image_force_reload = 0;
     if(dev->gui_attached)
@@ -345,8 +515,42 @@ restart:
   x = MAX(0, scale*dev->pipe->processed_width *(.5+zoom_x)-dev->capwidth/2);
   y = MAX(0, scale*dev->pipe->processed_height*(.5+zoom_y)-dev->capheight/2);
 
+  const int tiled = _dev_viewport_cache_usable(dev, scale);
+
+  // slow pipe: show a coarse render of the viewport first and refine it afterwards.
+  // moving a slider restarts the job, so the user keeps getting quick feedback.
+  // not needed when panning, most of the viewport comes from the tile cache then.
+  if(dev->gui_attached && dev->average_delay > DT_DEV_PROGRESSIVE_DELAY
+     && dt_conf_get_bool("darkroom/ui/progressive_rendering")
+     && !(tiled && _dev_viewport_cache_hits(dev, x, y, scale)))
+  {
+    const float s = DT_DEV_PROGRESSIVE_SCALE;
+    dt_get_times(&start);
+    // runs on its own cache lines and sets the upscale along with the backbuffer
+    dev->pipe->upscale = 1.0f/s;
+    const int err = dt_dev_pixelpipe_process(dev->pipe, dev, x*s, y*s, dev->capwidth*s, dev->capheight*s, scale*s);
+    dev->pipe->upscale = 1.0f;
+    if(err)
+    {
+      if(dev->image_force_reload)
+      {
+        dt_mipmap_cache_read_release(darktable.mipmap_cache, &buf);
+        dt_control_log_busy_leave();
+        dt_pthread_mutex_unlock(&dev->pipe_mutex);
+        return;
+      }
+      else goto restart;
+    }
+    dt_show_times(&start, "[dev_process_image] coarse pixel pipeline processing", NULL);
+    if(dev->pipe->changed != DT_DEV_PIPE_UNCHANGED) goto restart;
+
+    dev->image_dirty = 0;
+    dt_control_queue_redraw_center();
+  }
+
   dt_get_times(&start);
-  if(dt_dev_pixelpipe_process(dev->pipe, dev, x, y, dev->capwidth, dev->capheight, scale))
+  if(tiled ? _dev_viewport_process(dev, x, y, scale)
+           : dt_dev_pixelpipe_process(dev->pipe, dev, x, y, dev->capwidth, dev->capheight, scale))
   {
     // interrupted because image changed?
     if(dev->image_force_reload)
@@ -493,6 +697,7 @@ int dt_dev_write_history_item(const dt_image_t *image, dt_dev_history_item_t *h,
 
   sqlite3_step (stmt);
   sqlite3_finalize (stmt);
+  dt_collection_image_changed(darktable.collection, image->id, COLLECTION_CHANGE_HISTORY);
   return 0;
 }
 
@@ -790,6 +995,8 @@ void dt_dev_write_history(dt_develop_t *dev)
     history = g_list_next(history);
     changed = TRUE;
   }
+  if(!changed)
+    dt_collection_image_changed(darktable.collection, dev->image_storage.id, COLLECTION_CHANGE_HISTORY);
 
   /* attach / detach changed tag reflecting actual change */
   guint tagid = 0;
@@ -59,6 +59,16 @@ typedef enum dt_dev_histogram_type_t
 
 extern const gchar* dt_dev_histogram_type_names[];
 
+// final output of the full pipe at 1:1, kept in image space tiles so panning
+// only needs to process the newly exposed part of the viewport.
+typedef struct dt_dev_viewport_cache_t
+{
+  uint64_t hash;      // history and scale the tiles belong to
+  GHashTable *tiles;  // (ty << 16 | tx) -> DT_DEV_VIEWPORT_TILE^2 pixels of 8-bit bgra
+  uint8_t *buf;       // viewport assembled from the tiles, used as backbuffer of the full pipe
+}
+dt_dev_viewport_cache_t;
+
 struct dt_dev_pixelpipe_t;
 typedef struct dt_develop_t
 {
@@ -81,6 +91,7 @@ typedef struct dt_develop_t
   // image processing pipeline with caching
   struct dt_dev_pixelpipe_t *pipe, *preview_pipe;
   dt_pthread_mutex_t pipe_mutex, preview_pipe_mutex; // these are locked while the pipes are still in use
+  dt_dev_viewport_cache_t viewport_cache;
 
   // image under consideration, which
   // is copied each time an image is changed. this means we have some information
@@ -666,6 +666,7 @@ int dt_iop_load_module_so(dt_iop_module_so_t *module, const char *libname, const
   if(!g_module_symbol(module->module, "process_tiling_cl",      (gpointer)&(module->process_tiling_cl)))      module->process_tiling_cl = darktable.opencl->inited ? default_process_tiling_cl : NULL;
   if(!g_module_symbol(module->module, "distort_transform",      (gpointer)&(module->distort_transform)))      module->distort_transform = default_distort_transform;
   if(!g_module_symbol(module->module, "distort_backtransform",  (gpointer)&(module->distort_backtransform)))  module->distort_backtransform = default_distort_backtransform;
+  if(!g_module_symbol(module->module, "warp_backtransform",     (gpointer)&(module->warp_backtransform)))     module->warp_backtransform = NULL;
 
   if(!g_module_symbol(module->module, "modify_roi_in",          (gpointer)&(module->modify_roi_in)))          module->modify_roi_in = dt_iop_modify_roi_in;
   if(!g_module_symbol(module->module, "modify_roi_out",         (gpointer)&(module->modify_roi_out)))         module->modify_roi_out = dt_iop_modify_roi_out;
@@ -746,6 +747,7 @@ dt_iop_load_module_by_so(dt_iop_module_t *module, dt_iop_module_so_t *so, dt_dev
   module->process_tiling_cl = so->process_tiling_cl;
   module->distort_transform = so->distort_transform;
   module->distort_backtransform = so->distort_backtransform;
+  module->warp_backtransform = so->warp_backtransform;
   module->modify_roi_in   = so->modify_roi_in;
   module->modify_roi_out  = so->modify_roi_out;
   module->legacy_params   = so->legacy_params;
@@ -2630,6 +2632,222 @@ dt_iop_clip_and_zoom_demosaic_half_size_f(
 }
 #endif
 
+/**
+ * find the rows in one period of the mosaic and a weight for every photosite of
+ * such a 2 x period block, so that the weighted sum of one block is its average colour.
+ * the fourth colour of cmyg/rgbe sensors is averaged into green. (ox, oy) is the
+ * position of the buffer origin in the full image, so the weights follow the pattern.
+ */
+static int
+_superpixel_weights(const unsigned int filters, const int ox, const int oy, __m128 *const weights)
+{
+  int period = 8;
+  for(int p=2; p<8; p*=2)
+  {
+    int repeats = 1;
+    for(int r=0; r<8; r++)
+      for(int c=0; c<2; c++)
+        if(FC(r, c, filters) != FC(r+p, c, filters)) repeats = 0;
+    if(repeats)
+    {
+      period = p;
+      break;
+    }
+  }
+
+  int channel[16];
+  float count[4] = {0.0f};
+  for(int k=0; k<2*period; k++)
+  {
+    channel[k] = FC(k/2 + oy, (k&1) + ox, filters);
+    if(channel[k] == 3) channel[k] = 1;
+    count[channel[k]] += 1.0f;
+  }
+  for(int k=0; k<2*period; k++)
+  {
+    float w[4] = {0.0f};
+    w[channel[k]] = 1.0f/count[channel[k]];
+    weights[k] = _mm_loadu_ps(w);
+  }
+  return period;
+}
+
+// a 2x2 pattern of three colours, which the half size versions above know how to sample
+static int
+_superpixel_is_bayer(const unsigned int filters, const int period)
+{
+  if(period != 2) return 0;
+  for(int r=0; r<2; r++)
+    for(int c=0; c<2; c++)
+      if(FC(r, c, filters) == 3) return 0;
+  return 1;
+}
+
+/**
+ * downscales a mosaiced buffer (in) for scales <= 0.5 by averaging whole periods of the
+ * colour filter array (superpixels), and writes it to out in float4 format.
+ * unlike the half size versions above this handles any pattern filters can describe.
+ * plain bayer patterns are handed to those, they only read the 2x2 blocks they need.
+ * other patterns average all superpixels under the footprint of an output pixel, and
+ * don't mix clipped with unclipped ones, to keep blown highlights neutral.
+ */
+void
+dt_iop_clip_and_zoom_demosaic_superpixel_f(
+  float *out,
+  const float *const in,
+  const dt_iop_roi_t *const roi_out,
+  const dt_iop_roi_t *const roi_in,
+  const int32_t out_stride,
+  const int32_t in_stride,
+  const unsigned int filters,
+  const float clip)
+{
+  __m128 weights[16];
+  const int period = _superpixel_weights(filters, roi_in->x, roi_in->y, weights);
+  if(_superpixel_is_bayer(filters, period))
+  {
+    dt_iop_clip_and_zoom_demosaic_half_size_f(out, in, roi_out, roi_in, out_stride, in_stride, filters, clip);
+    return;
+  }
+  // not even one whole superpixel in the buffer, nothing to average
+  if(roi_in->width < 2 || roi_in->height < period)
+  {
+    for(int y=0; y<roi_out->height; y++)
+      memset(out + 4*(size_t)out_stride*y, 0, sizeof(float)*4*roi_out->width);
+    return;
+  }
+
+  const float px_footprint = 1.f/roi_out->scale;
+  // last superpixel which still lies inside the buffer
+  const int max_x = (roi_in->width-2) & ~1, max_y = (roi_in->height-period)/period*period;
+
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) shared(out, weights) schedule(static)
+#endif
+  for(int y=0; y<roi_out->height; y++)
+  {
+    float *outc = out + 4*(out_stride*y);
+    // superpixel rows under the footprint of this output row
+    const int py = MIN(max_y, (int)((y + roi_out->y)*px_footprint)/period*period);
+    const int maxj = MIN(max_y, MAX(py, (int)((y + 1 + roi_out->y)*px_footprint) - period));
+
+    for(int x=0; x<roi_out->width; x++)
+    {
+      const int px = MIN(max_x, (int)((x + roi_out->x)*px_footprint) & ~1);
+      const int maxi = MIN(max_x, MAX(px, (int)((x + 1 + roi_out->x)*px_footprint) - 2));
+
+      // the first superpixel decides whether we average clipped or unclipped ones
+      float pc = 0.0f;
+      for(int k=0; k<period; k++)
+        pc = MAX(pc, MAX(in[px + (size_t)in_stride*(py+k)], in[px+1 + (size_t)in_stride*(py+k)]));
+      const int clipped = pc >= clip;
+
+      __m128 col = _mm_setzero_ps();
+      int num = 0;
+      for(int j=py; j<=maxj; j+=period)
+        for(int i=px; i<=maxi; i+=2)
+        {
+          const float *p = in + (size_t)in_stride*j + i;
+          __m128 sum = _mm_setzero_ps();
+          float m = 0.0f;
+          for(int k=0; k<period; k++, p+=in_stride)
+          {
+            sum = _mm_add_ps(sum, _mm_mul_ps(weights[2*k],   _mm_set1_ps(p[0])));
+            sum = _mm_add_ps(sum, _mm_mul_ps(weights[2*k+1], _mm_set1_ps(p[1])));
+            m = MAX(m, MAX(p[0], p[1]));
+          }
+          if(clipped == (m >= clip))
+          {
+            col = _mm_add_ps(col, sum);
+            num++;
+          }
+        }
+
+      _mm_stream_ps(outc, _mm_mul_ps(col, _mm_set1_ps(1.0f/num)));
+      outc += 4;
+    }
+  }
+  _mm_sfence();
+}
+
+void
+dt_iop_clip_and_zoom_demosaic_superpixel(
+  float *out,
+  const uint16_t *const in,
+  const dt_iop_roi_t *const roi_out,
+  const dt_iop_roi_t *const roi_in,
+  const int32_t out_stride,
+  const int32_t in_stride,
+  const unsigned int filters,
+  const float clip)
+{
+  __m128 weights[16];
+  const int period = _superpixel_weights(filters, roi_in->x, roi_in->y, weights);
+  if(_superpixel_is_bayer(filters, period))
+  {
+    dt_iop_clip_and_zoom_demosaic_half_size(out, in, roi_out, roi_in, out_stride, in_stride, filters);
+    return;
+  }
+  // not even one whole superpixel in the buffer, nothing to average
+  if(roi_in->width < 2 || roi_in->height < period)
+  {
+    for(int y=0; y<roi_out->height; y++)
+      memset(out + 4*(size_t)out_stride*y, 0, sizeof(float)*4*roi_out->width);
+    return;
+  }
+
+  const float px_footprint = 1.f/roi_out->scale;
+  const int max_x = (roi_in->width-2) & ~1, max_y = (roi_in->height-period)/period*period;
+  // clip is given in the normalised range of the output
+  const float clip16 = clip*65535.0f;
+
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) shared(out, weights) schedule(static)
+#endif
+  for(int y=0; y<roi_out->height; y++)
+  {
+    float *outc = out + 4*(out_stride*y);
+    const int py = MIN(max_y, (int)((y + roi_out->y)*px_footprint)/period*period);
+    const int maxj = MIN(max_y, MAX(py, (int)((y + 1 + roi_out->y)*px_footprint) - period));
+
+    for(int x=0; x<roi_out->width; x++)
+    {
+      const int px = MIN(max_x, (int)((x + roi_out->x)*px_footprint) & ~1);
+      const int maxi = MIN(max_x, MAX(px, (int)((x + 1 + roi_out->x)*px_footprint) - 2));
+
+      uint16_t pc = 0;
+      for(int k=0; k<period; k++)
+        pc = MAX(pc, MAX(in[px + (size_t)in_stride*(py+k)], in[px+1 + (size_t)in_stride*(py+k)]));
+      const int clipped = pc >= clip16;
+
+      __m128 col = _mm_setzero_ps();
+      int num = 0;
+      for(int j=py; j<=maxj; j+=period)
+        for(int i=px; i<=maxi; i+=2)
+        {
+          const uint16_t *p = in + (size_t)in_stride*j + i;
+          __m128 sum = _mm_setzero_ps();
+          uint16_t m = 0;
+          for(int k=0; k<period; k++, p+=in_stride)
+          {
+            sum = _mm_add_ps(sum, _mm_mul_ps(weights[2*k],   _mm_set1_ps(p[0])));
+            sum = _mm_add_ps(sum, _mm_mul_ps(weights[2*k+1], _mm_set1_ps(p[1])));
+            m = MAX(m, MAX(p[0], p[1]));
+          }
+          if(clipped == (m >= clip16))
+          {
+            col = _mm_add_ps(col, sum);
+            num++;
+          }
+        }
+
+      _mm_stream_ps(outc, _mm_mul_ps(col, _mm_set1_ps(1.0f/(65535.0f*num))));
+      outc += 4;
+    }
+  }
+  _mm_sfence();
+}
+
 void dt_iop_RGB_to_YCbCr(const float *rgb, float *yuv)
 {
   yuv[0] =  0.299*rgb[0] + 0.587*rgb[1] + 0.114*rgb[2];
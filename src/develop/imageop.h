@@ -157,6 +157,7 @@ typedef struct dt_iop_module_so_t
 
   int (*distort_transform) (struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece, float *points, int points_count);
   int (*distort_backtransform) (struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece, float *points, int points_count);
+  int (*warp_backtransform) (struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece, const struct dt_iop_roi_t *roi_in, const struct dt_iop_roi_t *roi_out, float *points, size_t points_count);
 }
 dt_iop_module_so_t;
 
@@ -321,6 +322,12 @@ typedef struct dt_iop_module_t
   int (*distort_transform) (struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece, float *points, int points_count);
   /** reverse points after the iop is applied => point before process */
   int (*distort_backtransform) (struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece, float *points, int points_count);
+  /** optional, for modules which only move pixels around: maps points in roi_out pixel coordinates
+   * to the roi_in coordinates process() would sample them from, per color channel, so points holds
+   * {rx,ry,gx,gy,bx,by} for each of the points_count points. lets the pipe resample a run of such
+   * modules in one go. with points == NULL only returns whether the current params are a pure warp;
+   * the pipe does that once for the rois of a run, before it maps the strips of the run in parallel. */
+  int (*warp_backtransform) (struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece, const struct dt_iop_roi_t *roi_in, const struct dt_iop_roi_t *roi_out, float *points, size_t points_count);
 
   /** Key accelerator registration callbacks */
   void (*connect_key_accels)(struct dt_iop_module_t *self);
@@ -420,6 +427,29 @@ dt_iop_clip_and_zoom_demosaic_half_size_f(
   const uint32_t filters,
   const float clip);
 
+/** clip and zoom mosaiced image by averaging whole periods of any filter pattern, for scales <= 0.5. uint16_t -> float4 */
+void
+dt_iop_clip_and_zoom_demosaic_superpixel(
+  float *out,
+  const uint16_t *const in,
+  const struct dt_iop_roi_t *const roi_out,
+  const struct dt_iop_roi_t *const roi_in,
+  const int32_t out_stride,
+  const int32_t in_stride,
+  const uint32_t filters,
+  const float clip);
+
+void
+dt_iop_clip_and_zoom_demosaic_superpixel_f(
+  float *out,
+  const float *const in,
+  const struct dt_iop_roi_t *const roi_out,
+  const struct dt_iop_roi_t *const roi_in,
+  const int32_t out_stride,
+  const int32_t in_stride,
+  const uint32_t filters,
+  const float clip);
+
 /** as dt_iop_clip_and_zoom, but for rgba 8-bit channels. */
 void dt_iop_clip_and_zoom_8(const uint8_t *i, int32_t ix, int32_t iy, int32_t iw, int32_t ih, int32_t ibw, int32_t ibh,
                             uint8_t *o, int32_t ox, int32_t oy, int32_t ow, int32_t oh, int32_t obw, int32_t obh);
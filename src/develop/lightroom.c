@@ -23,6 +23,7 @@
 #include "common/curve_tools.h"
 #include "common/ratings.h"
 #include "common/colorlabels.h"
+#include "common/collection.h"
 #include "common/debug.h"
 #include "develop/lightroom.h"
 #include "control/control.h"
@@ -390,6 +391,7 @@ static void dt_add_hist (int imgid, char *operation, dt_iop_params_t *params, in
 
   sqlite3_step (stmt);
   sqlite3_finalize (stmt);
+  dt_collection_image_changed(darktable.collection, imgid, COLLECTION_CHANGE_HISTORY);
 
   if (imported[0]) strcat(imported, ", ");
   strcat(imported, dt_iop_get_localized_name(operation));
@@ -204,6 +204,13 @@ void dt_dev_pixelpipe_cache_invalidate(dt_dev_pixelpipe_cache_t *cache, void *da
   }
 }
 
+size_t dt_dev_pixelpipe_cache_memory(dt_dev_pixelpipe_cache_t *cache)
+{
+  size_t mem = 0;
+  for(int k=0; k<cache->entries; k++) mem += cache->size[k];
+  return mem;
+}
+
 void dt_dev_pixelpipe_cache_print(dt_dev_pixelpipe_cache_t *cache)
 {
   for(int k=0; k<cache->entries; k++)
@@ -70,6 +70,9 @@ void dt_dev_pixelpipe_cache_reweight(dt_dev_pixelpipe_cache_t *cache, void *data
 /** mark the given cache line pointer as invalid. */
 void dt_dev_pixelpipe_cache_invalidate(dt_dev_pixelpipe_cache_t *cache, void *data);
 
+/** bytes currently allocated for all cache lines. */
+size_t dt_dev_pixelpipe_cache_memory(dt_dev_pixelpipe_cache_t *cache);
+
 /** print out cache lines/hashes (debug). */
 void dt_dev_pixelpipe_cache_print(dt_dev_pixelpipe_cache_t *cache);
 
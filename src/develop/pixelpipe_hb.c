@@ -24,6 +24,8 @@
 #include "control/signal.h"
 #include "common/opencl.h"
 #include "common/imageio.h"
+#include "common/interpolation.h"
+#include "common/profiling.h"
 #include "libs/lib.h"
 #include "libs/colorpicker.h"
 #include "iop/colorout.h"
@@ -37,6 +39,7 @@
 
 // this is to ensure compatibility with pixelpipe_gegl.c, which does not need to build the other module:
 #include "develop/pixelpipe_cache.c"
+#include "develop/pixelpipe_scratch.c"
 
 #define max(a,b) ((a) > (b) ? (a) : (b))
 
@@ -64,32 +67,63 @@ static char *_pipe_type_to_str(int pipe_type)
   return r;
 }
 
+// one entry for --profile. start is NULL for cache hits, devid -1 for the cpu.
+static void _profiling_record(const dt_dev_pixelpipe_t *pipe, const dt_iop_module_t *module, const dt_times_t *start,
+                              const size_t bytes_in, const size_t bytes_out, const int devid)
+{
+  if(!darktable.profiling) return;
+  dt_profiling_record_t r;
+  memset(&r, 0, sizeof(r));
+  if(module) g_strlcpy(r.op, module->op, sizeof(r.op));
+  r.pipe = _pipe_type_to_str(pipe->type);
+  r.imgid = pipe->image.id;
+  if(start)
+  {
+    dt_times_t end;
+    dt_get_times(&end);
+    r.wall = end.clock - start->clock;
+    r.cpu = end.user - start->user;
+  }
+  r.bytes_in = bytes_in;
+  r.bytes_out = bytes_out;
+  r.tiles = pipe->tiles;
+  r.cache_hit = (start == NULL);
+  r.devid = devid;
+  dt_profiling_record(&r);
+}
+
+// the cache lines of the current run
+static inline dt_dev_pixelpipe_cache_t *_pipe_cache(dt_dev_pixelpipe_t *pipe)
+{
+  return pipe->upscale > 1.0f ? &pipe->coarse_cache : &pipe->cache;
+}
+
 int dt_dev_pixelpipe_init_export(dt_dev_pixelpipe_t *pipe, int32_t width, int32_t height, int levels)
 {
-  int res = dt_dev_pixelpipe_init_cached(pipe, 4*sizeof(float)*width*height, 2);
   pipe->type = DT_DEV_PIXELPIPE_EXPORT;
+  int res = dt_dev_pixelpipe_init_cached(pipe, 4*sizeof(float)*width*height, 2);
   pipe->levels = levels;
   return res;
 }
 
 int dt_dev_pixelpipe_init_thumbnail(dt_dev_pixelpipe_t *pipe, int32_t width, int32_t height)
 {
-  int res = dt_dev_pixelpipe_init_cached(pipe, 4*sizeof(float)*width*height, 2);
   pipe->type = DT_DEV_PIXELPIPE_THUMBNAIL;
+  int res = dt_dev_pixelpipe_init_cached(pipe, 4*sizeof(float)*width*height, 2);
   return res;
 }
 
 int dt_dev_pixelpipe_init_preview(dt_dev_pixelpipe_t *pipe)
 {
-  int res = dt_dev_pixelpipe_init_cached(pipe, 4*sizeof(float)*darktable.thumbnail_width*darktable.thumbnail_height, 5);
   pipe->type = DT_DEV_PIXELPIPE_PREVIEW;
+  int res = dt_dev_pixelpipe_init_cached(pipe, 4*sizeof(float)*darktable.thumbnail_width*darktable.thumbnail_height, 5);
   return res;
 }
 
 int dt_dev_pixelpipe_init(dt_dev_pixelpipe_t *pipe)
 {
-  int res = dt_dev_pixelpipe_init_cached(pipe, 4*sizeof(float)*darktable.thumbnail_width*darktable.thumbnail_height, 5);
   pipe->type = DT_DEV_PIXELPIPE_FULL;
+  int res = dt_dev_pixelpipe_init_cached(pipe, 4*sizeof(float)*darktable.thumbnail_width*darktable.thumbnail_height, 5);
   return res;
 }
 
@@ -103,15 +137,28 @@ int dt_dev_pixelpipe_init_cached(dt_dev_pixelpipe_t *pipe, int32_t size, int32_t
   pipe->backbuf_size = size;
   if(!dt_dev_pixelpipe_cache_init(&(pipe->cache), entries, pipe->backbuf_size))
     return 0;
+  // coarse lines grow on first use, most pipes never need them
+  if(!dt_dev_pixelpipe_cache_init(&(pipe->coarse_cache), entries, 4*sizeof(float)))
+  {
+    dt_dev_pixelpipe_cache_cleanup(&(pipe->cache));
+    return 0;
+  }
+  // the type has been set by the dt_dev_pixelpipe_init_*() wrappers already
+  pipe->cache_charged = dt_dev_pixelpipe_cache_memory(&pipe->cache) + dt_dev_pixelpipe_cache_memory(&pipe->coarse_cache);
+  dt_memory_budget_charge(DT_MEMORY_PIPE_CACHE, dt_dev_pixelpipe_memory_priority(pipe), pipe->cache_charged);
   pipe->cache_obsolete = 0;
   pipe->backbuf = NULL;
+  pipe->backbuf_upscale = pipe->upscale = 1.0f;
   pipe->processing = 0;
   pipe->shutdown = 0;
   pipe->opencl_error = 0;
   pipe->tiling = 0;
+  pipe->tiles = 0;
   pipe->mask_display = 0;
   pipe->input_timestamp = 0;
   pipe->levels = IMAGEIO_RGB | IMAGEIO_INT8;
+  dt_dev_pixelpipe_scratch_init(&(pipe->scratch));
+  pipe->scratch.priority = dt_dev_pixelpipe_memory_priority(pipe);
   dt_pthread_mutex_init(&(pipe->backbuf_mutex), NULL);
   dt_pthread_mutex_init(&(pipe->busy_mutex), NULL);
   return 1;
@@ -135,6 +182,10 @@ void dt_dev_pixelpipe_cleanup(dt_dev_pixelpipe_t *pipe)
   dt_dev_pixelpipe_cleanup_nodes(pipe);
   // so now it's safe to clean up cache:
   dt_dev_pixelpipe_cache_cleanup(&(pipe->cache));
+  dt_dev_pixelpipe_cache_cleanup(&(pipe->coarse_cache));
+  dt_memory_budget_release(DT_MEMORY_PIPE_CACHE, dt_dev_pixelpipe_memory_priority(pipe), pipe->cache_charged);
+  pipe->cache_charged = 0;
+  dt_dev_pixelpipe_scratch_cleanup(&(pipe->scratch));
   dt_pthread_mutex_unlock(&pipe->backbuf_mutex);
   dt_pthread_mutex_destroy(&(pipe->backbuf_mutex));
   dt_pthread_mutex_destroy(&(pipe->busy_mutex));
@@ -649,6 +700,177 @@ pixelpipe_picker_cl(int devid, dt_iop_module_t *module, cl_mem img, const dt_iop
 
 
 // recursive helper for process:
+static int
+dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void **output, void **cl_mem_output, int *out_bpp,
+                             const dt_iop_roi_t *roi_out, GList *modules, GList *pieces, int pos);
+
+// at most that many geometric modules are resampled in one pass
+#define DT_DEV_PIXELPIPE_WARP_MAX 8
+// output rows mapped through the chain at a time
+#define DT_DEV_PIXELPIPE_WARP_ROWS 16
+
+static int
+_warp_fusable(dt_dev_pixelpipe_iop_t *piece, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out)
+{
+  dt_iop_module_t *module = piece->module;
+  if(!module->warp_backtransform || piece->colors != 4) return 0;
+  // blending needs the input of the module itself
+  const dt_develop_blend_params_t *b = (const dt_develop_blend_params_t *)piece->blendop_data;
+  if(b && (b->mask_mode & DEVELOP_MASK_ENABLED)) return 0;
+  return module->warp_backtransform(module, piece, roi_in, roi_out, NULL, 0);
+}
+
+// runs of geometric modules (lens correction, orientation, crop and rotate, ..) are
+// not processed one by one: their coordinate mappings are chained and the output is
+// interpolated once, from the input of the first module of the run. that saves a
+// full buffer pass and an interpolation per module, and keeps the detail.
+// returns -1 if the module can't be fused with the ones in front of it.
+static int
+dt_dev_pixelpipe_process_warp(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void **output,
+                              const dt_iop_roi_t *roi_out, GList *modules, GList *pieces, int pos,
+                              const uint64_t hash, const size_t bufsize)
+{
+  // the gui pipes want the intermediate buffers for pickers and histograms
+  if(pipe->type != DT_DEV_PIXELPIPE_EXPORT && pipe->type != DT_DEV_PIXELPIPE_THUMBNAIL) return -1;
+  if(pipe->mask_display) return -1;
+
+  // chain[0] is this module, roi[k] the output of chain[k] and roi[k+1] its input
+  dt_dev_pixelpipe_iop_t *chain[DT_DEV_PIXELPIPE_WARP_MAX];
+  dt_iop_roi_t roi[DT_DEV_PIXELPIPE_WARP_MAX + 1];
+  int n = 0;
+  roi[0] = *roi_out;
+
+  dt_pthread_mutex_lock(&pipe->busy_mutex);
+  if(pipe->shutdown)
+  {
+    dt_pthread_mutex_unlock(&pipe->busy_mutex);
+    return 1;
+  }
+  while(modules && n < DT_DEV_PIXELPIPE_WARP_MAX)
+  {
+    dt_iop_module_t *module = (dt_iop_module_t *)modules->data;
+    dt_dev_pixelpipe_iop_t *piece = (dt_dev_pixelpipe_iop_t *)pieces->data;
+    if(piece->enabled && !(dev->gui_module && dev->gui_module->operation_tags_filter() & module->operation_tags()))
+    {
+      module->modify_roi_in(module, piece, roi + n, roi + n + 1);
+      if(!_warp_fusable(piece, roi + n + 1, roi + n)) break;
+      chain[n++] = piece;
+    }
+    modules = g_list_previous(modules);
+    pieces = g_list_previous(pieces);
+    pos--;
+  }
+  dt_pthread_mutex_unlock(&pipe->busy_mutex);
+  if(n < 2) return -1;
+
+  // input of the first module in the run
+  const dt_iop_roi_t *roi_in = roi + n;
+  void *input = NULL;
+  void *cl_mem_input = NULL;
+  int in_bpp;
+  if(dt_dev_pixelpipe_process_rec(pipe, dev, &input, &cl_mem_input, &in_bpp, roi_in, modules, pieces, pos)) return 1;
+
+  dt_pthread_mutex_lock(&pipe->busy_mutex);
+  if(pipe->shutdown)
+  {
+#ifdef HAVE_OPENCL
+    if(cl_mem_input != NULL) dt_opencl_release_mem_object(cl_mem_input);
+#endif
+    dt_pthread_mutex_unlock(&pipe->busy_mutex);
+    return 1;
+  }
+#ifdef HAVE_OPENCL
+  // resampling runs on the cpu
+  if(cl_mem_input != NULL)
+  {
+    cl_int err = dt_opencl_copy_device_to_host(pipe->devid, input, cl_mem_input, roi_in->width, roi_in->height, in_bpp);
+    if(err != CL_SUCCESS)
+    {
+      /* late opencl error */
+      dt_print(DT_DEBUG_OPENCL, "[opencl_pixelpipe (warp)] late opencl error detected while copying back to cpu buffer: %d\n", err);
+      dt_opencl_release_mem_object(cl_mem_input);
+      pipe->opencl_error = 1;
+      dt_pthread_mutex_unlock(&pipe->busy_mutex);
+      return 1;
+    }
+    (void)dt_opencl_finish(pipe->devid);
+    dt_opencl_release_mem_object(cl_mem_input);
+  }
+#endif
+
+  (void) dt_dev_pixelpipe_cache_get(_pipe_cache(pipe), hash, bufsize, output);
+
+  dt_times_t start;
+  dt_get_times(&start);
+
+  const struct dt_interpolation* interpolation = dt_interpolation_new(DT_INTERPOLATION_USERPREF);
+  const float *const in = (const float *)input;
+  float *const out = (float *)*output;
+  const int ch = 4;
+  const int ch_width = ch*roi_in->width;
+  const size_t strip = (size_t)6*roi_out->width*DT_DEV_PIXELPIPE_WARP_ROWS;
+  float *points = (float *)dt_alloc_align(16, sizeof(float)*strip*dt_get_num_threads());
+  if(!points)
+  {
+    dt_pthread_mutex_unlock(&pipe->busy_mutex);
+    return 1;
+  }
+
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) shared(chain, roi, roi_in, roi_out, n, points, interpolation) schedule(dynamic)
+#endif
+  for(int y0 = 0; y0 < roi_out->height; y0 += DT_DEV_PIXELPIPE_WARP_ROWS)
+  {
+    const int y1 = MIN(y0 + DT_DEV_PIXELPIPE_WARP_ROWS, roi_out->height);
+    const size_t count = (size_t)(y1 - y0)*roi_out->width;
+    float *p = points + strip*dt_get_thread_num();
+
+    // start with the output pixel positions, the same for r, g and b
+    for(int j=y0; j<y1; j++)
+    {
+      float *pp = p + (size_t)6*(j-y0)*roi_out->width;
+      for(int i=0; i<roi_out->width; i++, pp+=6)
+        for(int c=0; c<6; c+=2)
+        {
+          pp[c] = i;
+          pp[c+1] = j;
+        }
+    }
+
+    // and walk them back to the input of the run, last module first
+    for(int k=0; k<n; k++)
+      chain[k]->module->warp_backtransform(chain[k]->module, chain[k], roi + k + 1, roi + k, p, count);
+
+    float *o = out + (size_t)ch*y0*roi_out->width;
+    for(size_t l=0; l<count; l++, o+=ch)
+    {
+      const float *pp = p + 6*l;
+      if(pp[0] == pp[2] && pp[0] == pp[4] && pp[1] == pp[3] && pp[1] == pp[5])
+        dt_interpolation_compute_pixel4c(interpolation, in, o, pp[0], pp[1], roi_in->width, roi_in->height, ch_width);
+      else
+      {
+        // lateral chromatic aberration: channels are sampled at different positions
+        for(int c=0; c<3; c++)
+          o[c] = dt_interpolation_compute_sample(interpolation, in+c, pp[2*c], pp[2*c+1], roi_in->width, roi_in->height, ch, ch_width);
+        // take green channel distortion also for alpha channel
+        o[3] = dt_interpolation_compute_sample(interpolation, in+3, pp[2], pp[3], roi_in->width, roi_in->height, ch, ch_width);
+      }
+    }
+  }
+  free(points);
+
+  dt_show_times(&start, "[dev_pixelpipe]", "processing `%s' and %d geometric modules before it in one pass [%s]",
+                chain[0]->module->name(), n-1, _pipe_type_to_str(pipe->type));
+  // the whole run is booked on the last module of it
+  pipe->tiles = 0;
+  _profiling_record(pipe, chain[0]->module, &start, (size_t)in_bpp*roi_in->width*roi_in->height, bufsize, -1);
+  // the buffer might be picked up from the cache later on, set the processed max for all of them:
+  for(int k=0; k<n; k++)
+    for(int c=0; c<3; c++) chain[k]->processed_maximum[c] = pipe->processed_maximum[c];
+  dt_pthread_mutex_unlock(&pipe->busy_mutex);
+  return 0;
+}
+
 static int
 dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void **output, void **cl_mem_output, int *out_bpp,
                              const dt_iop_roi_t *roi_out, GList *modules, GList *pieces, int pos)
@@ -682,14 +904,16 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
     return 1;
   }
   uint64_t hash = dt_dev_pixelpipe_cache_hash(pipe->image.id, roi_out, pipe, pos);
-  if(dt_dev_pixelpipe_cache_available(&(pipe->cache), hash))
+  if(dt_dev_pixelpipe_cache_available(_pipe_cache(pipe), hash))
   {
     // if(module) printf("found valid buf pos %d in cache for module %s %s %lu\n", pos, module->op, pipe == dev->preview_pipe ? "[preview]" : "", hash);
     // copy over cached processed max for clipping:
     if(piece) for(int k=0; k<3; k++) pipe->processed_maximum[k] = piece->processed_maximum[k];
     else      for(int k=0; k<3; k++) pipe->processed_maximum[k] = 1.0f;
-    (void) dt_dev_pixelpipe_cache_get(&(pipe->cache), hash, bufsize, output);
+    (void) dt_dev_pixelpipe_cache_get(_pipe_cache(pipe), hash, bufsize, output);
     dt_pthread_mutex_unlock(&pipe->busy_mutex);
+    pipe->tiles = 0;
+    _profiling_record(pipe, module, NULL, 0, bufsize, -1);
     if(!modules) return 0;
     // go to post-collect directly:
     goto post_process_collect_info;
@@ -724,9 +948,9 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
       {
         *output = pipe->input;
       }
-      else if(dt_dev_pixelpipe_cache_get(&(pipe->cache), hash, bufsize, output))
+      else if(dt_dev_pixelpipe_cache_get(_pipe_cache(pipe), hash, bufsize, output))
       {
-        memset(*output, 0, pipe->backbuf_size);
+        memset(*output, 0, bufsize);
         if(roi_in.scale == 1.0f)
         {
           // fast branch for 1:1 pixel copies.
@@ -763,7 +987,7 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
     else
     {
       // reserve new cache line: output
-      if(dt_dev_pixelpipe_cache_get(&(pipe->cache), hash, bufsize, output))
+      if(dt_dev_pixelpipe_cache_get(_pipe_cache(pipe), hash, bufsize, output))
       {
         roi_in.x /= roi_out->scale;
         roi_in.y /= roi_out->scale;
@@ -774,12 +998,18 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
       }
     }
     dt_show_times(&start, "[dev_pixelpipe]", "initing base buffer [%s]", _pipe_type_to_str(pipe->type));
+    pipe->tiles = 0;
+    _profiling_record(pipe, NULL, &start, (size_t)pipe->iwidth*pipe->iheight*bpp, bufsize, -1);
     dt_pthread_mutex_unlock(&pipe->busy_mutex);
   }
   else
   {
     // 3b) recurse and obtain output array in &input
 
+    // geometric modules directly in front of this one might be resampled along with it
+    const int warp = dt_dev_pixelpipe_process_warp(pipe, dev, output, roi_out, modules, pieces, pos, hash, bufsize);
+    if(warp >= 0) return warp;
+
     // get region of interest which is needed in input
     dt_pthread_mutex_lock(&pipe->busy_mutex);
     if(pipe->shutdown)
@@ -803,9 +1033,9 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
       return 1;
     }
     if(!strcmp(module->op, "gamma"))
-      (void) dt_dev_pixelpipe_cache_get_important(&(pipe->cache), hash, bufsize, output);
+      (void) dt_dev_pixelpipe_cache_get_important(_pipe_cache(pipe), hash, bufsize, output);
     else
-      (void) dt_dev_pixelpipe_cache_get(&(pipe->cache), hash, bufsize, output);
+      (void) dt_dev_pixelpipe_cache_get(_pipe_cache(pipe), hash, bufsize, output);
     dt_pthread_mutex_unlock(&pipe->busy_mutex);
 
     // if(module) printf("reserving new buf in cache for module %s %s: %ld buf %lX\n", module->op, pipe == dev->preview_pipe ? "[preview]" : "", hash, (long int)*output);
@@ -860,6 +1090,9 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
 
     dt_times_t start;
     dt_get_times(&start);
+    // where the module ended up running, and in how many tiles, for profiling
+    int profiling_devid = -1;
+    pipe->tiles = 0;
 
     dt_develop_tiling_t tiling = { 0 };
     dt_develop_tiling_t tiling_blendop = { 0 };
@@ -1152,6 +1385,7 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
         if (success_opencl)
         {
           /* Nice, everything went fine */
+          profiling_devid = pipe->devid;
 
           /* this is reasonable on slow GPUs only, where it's more expensive to reprocess the whole pixelpipe than
              regularly copying device buffers back to host. This would slow down fast GPUs considerably. */
@@ -1242,7 +1476,7 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
 
           /* process module on cpu. use tiling if needed and possible. */
           if((module->flags() & IOP_FLAGS_ALLOW_TILING) &&
-              !dt_tiling_piece_fits_host_memory(max(roi_in.width, roi_out->width), max(roi_in.height, roi_out->height),
+              !dt_tiling_piece_fits_host_memory(pipe, max(roi_in.width, roi_out->width), max(roi_in.height, roi_out->height),
                                                 max(in_bpp, bpp), tiling.factor, tiling.overhead))
             module->process_tiling(module, piece, input, *output, &roi_in, roi_out, in_bpp);
           else
@@ -1346,7 +1580,7 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
 
         /* process module on cpu. use tiling if needed and possible. */
         if((module->flags() & IOP_FLAGS_ALLOW_TILING) &&
-            !dt_tiling_piece_fits_host_memory(max(roi_in.width, roi_out->width), max(roi_in.height, roi_out->height),
+            !dt_tiling_piece_fits_host_memory(pipe, max(roi_in.width, roi_out->width), max(roi_in.height, roi_out->height),
                                               max(in_bpp, bpp), tiling.factor, tiling.overhead))
           module->process_tiling(module, piece, input, *output, &roi_in, roi_out, in_bpp);
         else
@@ -1410,7 +1644,7 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
       }
 
       /* input is still only on GPU? Let's invalidate CPU input buffer then */
-      if (valid_input_on_gpu_only) dt_dev_pixelpipe_cache_invalidate(&(pipe->cache), input);
+      if (valid_input_on_gpu_only) dt_dev_pixelpipe_cache_invalidate(_pipe_cache(pipe), input);
     }
     else
     {
@@ -1418,7 +1652,7 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
 
       /* process module on cpu. use tiling if needed and possible. */
       if((module->flags() & IOP_FLAGS_ALLOW_TILING) &&
-          !dt_tiling_piece_fits_host_memory(max(roi_in.width, roi_out->width), max(roi_in.height, roi_out->height),
+          !dt_tiling_piece_fits_host_memory(pipe, max(roi_in.width, roi_out->width), max(roi_in.height, roi_out->height),
                                             max(in_bpp, bpp), tiling.factor, tiling.overhead))
         module->process_tiling(module, piece, input, *output, &roi_in, roi_out, in_bpp);
       else
@@ -1476,7 +1710,7 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
 #else
     /* process module on cpu. use tiling if needed and possible. */
     if((module->flags() & IOP_FLAGS_ALLOW_TILING) &&
-        !dt_tiling_piece_fits_host_memory(max(roi_in.width, roi_out->width), max(roi_in.height, roi_out->height),
+        !dt_tiling_piece_fits_host_memory(pipe, max(roi_in.width, roi_out->width), max(roi_in.height, roi_out->height),
                                           max(in_bpp, bpp), tiling.factor, tiling.overhead))
       module->process_tiling(module, piece, input, *output, &roi_in, roi_out, in_bpp);
     else
@@ -1534,6 +1768,15 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
 
     dt_show_times(&start, "[dev_pixelpipe]", "processing `%s' [%s]", module->name(),
                   _pipe_type_to_str(pipe->type));
+    _profiling_record(pipe, module, &start, (size_t)in_bpp*roi_in.width*roi_in.height, bufsize, profiling_devid);
+    // the module might have bailed out early because the pipe changed underneath it.
+    // its output is incomplete then, so make sure it never gets picked up from the cache.
+    if(dt_dev_pixelpipe_cancelled(pipe))
+    {
+      dt_dev_pixelpipe_cache_invalidate(_pipe_cache(pipe), *output);
+      dt_pthread_mutex_unlock(&pipe->busy_mutex);
+      return 1;
+    }
     // in case we get this buffer from the cache, also get the processed max:
     for(int k=0; k<3; k++) piece->processed_maximum[k] = pipe->processed_maximum[k];
     dt_pthread_mutex_unlock(&pipe->busy_mutex);
@@ -1541,7 +1784,7 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
     {
       // give the input buffer to the currently focussed plugin more weight.
       // the user is likely to change that one soon, so keep it in cache.
-      dt_dev_pixelpipe_cache_reweight(&(pipe->cache), input);
+      dt_dev_pixelpipe_cache_reweight(_pipe_cache(pipe), input);
     }
 #ifndef _DEBUG
     if(darktable.unmuted & DT_DEBUG_NAN)
@@ -2106,7 +2349,7 @@ int dt_dev_pixelpipe_process(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, int x,
   };
   // printf("pixelpipe homebrew process start\n");
   if(darktable.unmuted & DT_DEBUG_DEV)
-    dt_dev_pixelpipe_cache_print(&pipe->cache);
+    dt_dev_pixelpipe_cache_print(_pipe_cache(pipe));
 
   //  go through list of modules from the end:
   int pos = g_list_length(dev->iop);
@@ -2120,7 +2363,7 @@ restart:
   for(int k=0; k<3; k++) pipe->processed_maximum[k] = 1.0f; // dev->image->maximum;
 
   // check if we should obsolete caches
-  if(pipe->cache_obsolete) dt_dev_pixelpipe_cache_flush(&(pipe->cache));
+  if(pipe->cache_obsolete) dt_dev_pixelpipe_flush_caches(pipe);
   pipe->cache_obsolete = 0;
 
   // mask display off as a starting point
@@ -2133,6 +2376,29 @@ restart:
   // run pixelpipe recursively and get error status
   int err = dt_dev_pixelpipe_process_rec_and_backcopy(pipe, dev, &buf, &cl_mem_out, &out_bpp, &roi, modules, pieces, pos);
 
+  // take back scratch buffers modules did not return (early outs) and keep a
+  // quarter of the host memory limit around for the next run, less if the
+  // memory budget is tight.
+  const dt_memory_priority_t priority = dt_dev_pixelpipe_memory_priority(pipe);
+  dt_dev_pixelpipe_scratch_reset(&pipe->scratch);
+  const int host_memory_limit = dt_conf_get_int("host_memory_limit");
+  const size_t keep = (size_t)(host_memory_limit > 0 ? host_memory_limit : 2000) * 1024 * 1024 / 4;
+  dt_dev_pixelpipe_scratch_trim(&pipe->scratch, MIN(keep, pipe->scratch.idle_bytes + dt_memory_budget_available(priority)));
+
+  // cache lines grow when larger buffers are requested, keep the budget up to date
+  const size_t cache_mem = dt_dev_pixelpipe_cache_memory(&pipe->cache) + dt_dev_pixelpipe_cache_memory(&pipe->coarse_cache);
+  if(cache_mem > pipe->cache_charged)
+    dt_memory_budget_charge(DT_MEMORY_PIPE_CACHE, priority, cache_mem - pipe->cache_charged);
+  else
+    dt_memory_budget_release(DT_MEMORY_PIPE_CACHE, priority, pipe->cache_charged - cache_mem);
+  pipe->cache_charged = cache_mem;
+
+  if(darktable.unmuted & DT_DEBUG_MEMORY)
+  {
+    dt_dev_pixelpipe_scratch_print(&pipe->scratch);
+    dt_memory_budget_print();
+  }
+
   // get status summary of opencl queue by checking the eventlist
   int oclerr = (pipe->devid >= 0) ? (dt_opencl_events_flush(pipe->devid, 1) != 0) : 0;
 
@@ -2183,6 +2449,7 @@ restart:
   pipe->backbuf = buf;
   pipe->backbuf_width  = width;
   pipe->backbuf_height = height;
+  pipe->backbuf_upscale = MAX(pipe->upscale, 1.0f);
   dt_pthread_mutex_unlock(&pipe->backbuf_mutex);
 
   // printf("pixelpipe homebrew process end\n");
@@ -2193,6 +2460,7 @@ restart:
 void dt_dev_pixelpipe_flush_caches(dt_dev_pixelpipe_t *pipe)
 {
   dt_dev_pixelpipe_cache_flush(&pipe->cache);
+  dt_dev_pixelpipe_cache_flush(&pipe->coarse_cache);
 }
 
 void dt_dev_pixelpipe_get_dimensions(dt_dev_pixelpipe_t *pipe, struct dt_develop_t *dev, int width_in, int height_in, int *width, int *height)
@@ -24,6 +24,7 @@
 #include "develop/imageop.h"
 #include "develop/develop.h"
 #include "develop/pixelpipe_cache.h"
+#include "develop/pixelpipe_scratch.h"
 
 /**
  * struct used by iop modules to connect to pixelpipe.
@@ -88,6 +89,12 @@ typedef struct dt_dev_pixelpipe_t
 {
   // store history/zoom caches
   dt_dev_pixelpipe_cache_t cache;
+  // the same for coarse renders, so these don't evict the lines of the full one
+  dt_dev_pixelpipe_cache_t coarse_cache;
+  // temporary buffers for the modules' process() calls
+  dt_dev_pixelpipe_scratch_t scratch;
+  // bytes of cache lines accounted in the memory budget
+  size_t cache_charged;
   // set to non-zero in order to obsolete old cache entries on next pixelpipe run
   int cache_obsolete;
   // input buffer
@@ -111,7 +118,11 @@ typedef struct dt_dev_pixelpipe_t
   int backbuf_size;
   int backbuf_width, backbuf_height;
   uint64_t backbuf_hash;
+  // > 1.0: the backbuffer holds a coarse render to be stretched by this factor
+  float backbuf_upscale;
   dt_pthread_mutex_t backbuf_mutex, busy_mutex;
+  // > 1.0: the next run is such a coarse render, set by the caller
+  float upscale;
   // working?
   int processing;
   // shutting down?
@@ -122,6 +133,8 @@ typedef struct dt_dev_pixelpipe_t
   int opencl_error;
   // running in a tiling context?
   int tiling;
+  // tiles processed for the current module, for profiling
+  int tiles;
   // should this pixelpipe display a mask in the end?
   int mask_display;
   // input data based on this timestamp:
@@ -188,6 +201,13 @@ void dt_dev_pixelpipe_add_node(dt_dev_pixelpipe_t *pipe, struct dt_develop_t *de
 // TODO: remove n-th module from gegl pipeline
 void dt_dev_pixelpipe_remove_node(dt_dev_pixelpipe_t *pipe, struct dt_develop_t *dev, int n);
 
+// the darkroom pipes are waited on by the user, everything else runs in the background
+static inline dt_memory_priority_t dt_dev_pixelpipe_memory_priority(const dt_dev_pixelpipe_t *pipe)
+{
+  return (pipe->type == DT_DEV_PIXELPIPE_FULL || pipe->type == DT_DEV_PIXELPIPE_PREVIEW) ?
+         DT_MEMORY_INTERACTIVE : DT_MEMORY_BACKGROUND;
+}
+
 // signifies that this pipeline uses the MIP_F buffer instead of MIP_FULL
 // i.e. four floats per pixel already demosaiced/downsampled
 static inline int dt_dev_pixelpipe_uses_downsampled_input(dt_dev_pixelpipe_t *pipe)
@@ -199,6 +219,18 @@ static inline int dt_dev_pixelpipe_uses_downsampled_input(dt_dev_pixelpipe_t *pi
            (pipe->type == DT_DEV_PIXELPIPE_THUMBNAIL);
 }
 
+// returns non-zero if the result of the running process() call is not needed any more, because
+// the pipe is shutting down or its parameters changed (zooming only matters for the full pipe).
+// modules may poll this once per row block or tile and return early, the pipe then discards
+// their output instead of caching it.
+static inline int dt_dev_pixelpipe_cancelled(const dt_dev_pixelpipe_t *pipe)
+{
+  if(pipe->shutdown) return 1;
+  if(pipe->type == DT_DEV_PIXELPIPE_PREVIEW)
+    return (pipe->changed & ~DT_DEV_PIPE_ZOOMED) != 0;
+  return pipe->changed != DT_DEV_PIPE_UNCHANGED;
+}
+
 #endif
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
 // vim: shiftwidth=2 expandtab tabstop=2 cindent
@@ -0,0 +1,183 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "develop/pixelpipe_scratch.h"
+#include "develop/pixelpipe_hb.h"
+#include <stdlib.h>
+
+// smallest size class, everything below is rounded up to this
+#define DT_DEV_SCRATCH_MIN_SIZE (64*1024)
+
+// rounds size up to a multiple of a quarter of its largest power of two,
+// which wastes at most 25% while still matching buffers of slightly different sizes.
+static size_t _scratch_class(const size_t size)
+{
+  const size_t s = MAX(size, DT_DEV_SCRATCH_MIN_SIZE);
+  size_t q = 1;
+  while((q << 3) <= s) q <<= 1;
+  return (s + q - 1) / q * q;
+}
+
+void dt_dev_pixelpipe_scratch_init(dt_dev_pixelpipe_scratch_t *scratch)
+{
+  dt_pthread_mutex_init(&scratch->lock, NULL);
+  scratch->idle = g_hash_table_new(g_direct_hash, g_direct_equal);
+  scratch->borrowed = g_hash_table_new(g_direct_hash, g_direct_equal);
+  scratch->idle_bytes = scratch->borrowed_bytes = 0;
+  scratch->hits = scratch->misses = 0;
+  scratch->priority = DT_MEMORY_INTERACTIVE;
+}
+
+void dt_dev_pixelpipe_scratch_cleanup(dt_dev_pixelpipe_scratch_t *scratch)
+{
+  dt_dev_pixelpipe_scratch_reset(scratch);
+  dt_dev_pixelpipe_scratch_trim(scratch, 0);
+  g_hash_table_destroy(scratch->idle);
+  g_hash_table_destroy(scratch->borrowed);
+  dt_pthread_mutex_destroy(&scratch->lock);
+}
+
+void *dt_dev_pixelpipe_scratch_alloc(dt_dev_pixelpipe_t *pipe, const size_t size)
+{
+  dt_dev_pixelpipe_scratch_t *scratch = &pipe->scratch;
+  const size_t cls = _scratch_class(size);
+  void *buf = NULL;
+
+  dt_pthread_mutex_lock(&scratch->lock);
+  GSList *list = (GSList *)g_hash_table_lookup(scratch->idle, GSIZE_TO_POINTER(cls));
+  if(list)
+  {
+    buf = list->data;
+    list = g_slist_delete_link(list, list);
+    if(list) g_hash_table_insert(scratch->idle, GSIZE_TO_POINTER(cls), list);
+    else g_hash_table_remove(scratch->idle, GSIZE_TO_POINTER(cls));
+    scratch->idle_bytes -= cls;
+    scratch->hits++;
+  }
+  dt_pthread_mutex_unlock(&scratch->lock);
+
+  // nothing idle in this class, go to the system without holding the lock
+  const int miss = !buf;
+  if(miss) buf = dt_alloc_align(64, cls);
+  if(!buf) return NULL;
+  if(miss) dt_memory_budget_charge(DT_MEMORY_SCRATCH, scratch->priority, cls);
+
+  dt_pthread_mutex_lock(&scratch->lock);
+  if(miss) scratch->misses++;
+  g_hash_table_insert(scratch->borrowed, buf, GSIZE_TO_POINTER(cls));
+  scratch->borrowed_bytes += cls;
+  dt_pthread_mutex_unlock(&scratch->lock);
+  return buf;
+}
+
+// expects the lock to be held
+static void _scratch_put(dt_dev_pixelpipe_scratch_t *scratch, void *buf, const size_t cls)
+{
+  GSList *list = (GSList *)g_hash_table_lookup(scratch->idle, GSIZE_TO_POINTER(cls));
+  g_hash_table_insert(scratch->idle, GSIZE_TO_POINTER(cls), g_slist_prepend(list, buf));
+  scratch->idle_bytes += cls;
+  scratch->borrowed_bytes -= cls;
+}
+
+void dt_dev_pixelpipe_scratch_free(dt_dev_pixelpipe_t *pipe, void *buf)
+{
+  if(!buf) return;
+  dt_dev_pixelpipe_scratch_t *scratch = &pipe->scratch;
+
+  dt_pthread_mutex_lock(&scratch->lock);
+  gpointer cls;
+  if(g_hash_table_lookup_extended(scratch->borrowed, buf, NULL, &cls))
+  {
+    g_hash_table_remove(scratch->borrowed, buf);
+    _scratch_put(scratch, buf, GPOINTER_TO_SIZE(cls));
+    buf = NULL;
+  }
+  dt_pthread_mutex_unlock(&scratch->lock);
+
+  // not one of ours, don't leak it either.
+  if(buf)
+  {
+    fprintf(stderr, "[pixelpipe_scratch] freeing a buffer that was not borrowed from this pipe\n");
+    free(buf);
+  }
+}
+
+void dt_dev_pixelpipe_scratch_reset(dt_dev_pixelpipe_scratch_t *scratch)
+{
+  dt_pthread_mutex_lock(&scratch->lock);
+  if(g_hash_table_size(scratch->borrowed))
+  {
+    GHashTableIter it;
+    gpointer buf, cls;
+    g_hash_table_iter_init(&it, scratch->borrowed);
+    while(g_hash_table_iter_next(&it, &buf, &cls))
+    {
+      _scratch_put(scratch, buf, GPOINTER_TO_SIZE(cls));
+      g_hash_table_iter_remove(&it);
+    }
+  }
+  dt_pthread_mutex_unlock(&scratch->lock);
+}
+
+void dt_dev_pixelpipe_scratch_trim(dt_dev_pixelpipe_scratch_t *scratch, const size_t keep)
+{
+  size_t freed = 0;
+  dt_pthread_mutex_lock(&scratch->lock);
+  if(scratch->idle_bytes > keep)
+  {
+    // drop whole size classes, largest first, they are the least likely to fit the next request
+    GList *classes = g_hash_table_get_keys(scratch->idle);
+    for(GList *c = classes; c && scratch->idle_bytes > keep; c = g_list_next(c))
+    {
+      GList *largest = c;
+      for(GList *d = g_list_next(c); d; d = g_list_next(d))
+        if(GPOINTER_TO_SIZE(d->data) > GPOINTER_TO_SIZE(largest->data)) largest = d;
+      gpointer tmp = c->data;
+      c->data = largest->data;
+      largest->data = tmp;
+
+      const size_t cls = GPOINTER_TO_SIZE(c->data);
+      GSList *list = (GSList *)g_hash_table_lookup(scratch->idle, c->data);
+      while(list && scratch->idle_bytes > keep)
+      {
+        free(list->data);
+        list = g_slist_delete_link(list, list);
+        scratch->idle_bytes -= cls;
+        freed += cls;
+      }
+      if(list) g_hash_table_insert(scratch->idle, c->data, list);
+      else g_hash_table_remove(scratch->idle, c->data);
+    }
+    g_list_free(classes);
+  }
+  dt_pthread_mutex_unlock(&scratch->lock);
+  dt_memory_budget_release(DT_MEMORY_SCRATCH, scratch->priority, freed);
+}
+
+void dt_dev_pixelpipe_scratch_print(dt_dev_pixelpipe_scratch_t *scratch)
+{
+  dt_pthread_mutex_lock(&scratch->lock);
+  fprintf(stderr, "[memory] pipe scratch: %.1f MB idle, %.1f MB borrowed, %"PRIu64" reused, %"PRIu64" allocated\n",
+          scratch->idle_bytes/(1024.0*1024.0), scratch->borrowed_bytes/(1024.0*1024.0),
+          scratch->hits, scratch->misses);
+  dt_pthread_mutex_unlock(&scratch->lock);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,66 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DT_PIXELPIPE_SCRATCH_H
+#define DT_PIXELPIPE_SCRATCH_H
+
+#include "common/dtpthread.h"
+#include "common/memory_budget.h"
+#include <glib.h>
+#include <inttypes.h>
+
+/**
+ * scratch memory for the temporary buffers modules need during process().
+ * every pipe owns one of these. buffers handed back are kept on free lists
+ * per size class (quarter powers of two), so the next run of the pipe gets
+ * the same, already mapped pages instead of fresh ones from the system.
+ */
+struct dt_dev_pixelpipe_t;
+typedef struct dt_dev_pixelpipe_scratch_t
+{
+  dt_pthread_mutex_t lock;
+  GHashTable *idle;      // size class -> GSList of free buffers
+  GHashTable *borrowed;  // buffer -> size class
+  size_t idle_bytes, borrowed_bytes;
+  // all of it is accounted in the memory budget with this priority
+  dt_memory_priority_t priority;
+  // profiling:
+  uint64_t hits;
+  uint64_t misses;
+}
+dt_dev_pixelpipe_scratch_t;
+
+void dt_dev_pixelpipe_scratch_init(dt_dev_pixelpipe_scratch_t *scratch);
+void dt_dev_pixelpipe_scratch_cleanup(dt_dev_pixelpipe_scratch_t *scratch);
+
+/** borrow a 64 byte aligned buffer of at least size bytes for the duration of process(). */
+void *dt_dev_pixelpipe_scratch_alloc(struct dt_dev_pixelpipe_t *pipe, const size_t size);
+/** hand a buffer back. passing NULL is fine, as for free(). */
+void dt_dev_pixelpipe_scratch_free(struct dt_dev_pixelpipe_t *pipe, void *buf);
+
+/** takes back everything still borrowed. free if all buffers have been handed back already. */
+void dt_dev_pixelpipe_scratch_reset(dt_dev_pixelpipe_scratch_t *scratch);
+/** releases idle buffers to the system until at most keep bytes are left. */
+void dt_dev_pixelpipe_scratch_trim(dt_dev_pixelpipe_scratch_t *scratch, const size_t keep);
+
+/** print out usage statistics (debug). */
+void dt_dev_pixelpipe_scratch_print(dt_dev_pixelpipe_scratch_t *scratch);
+
+#endif
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
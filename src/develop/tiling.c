@@ -592,12 +592,26 @@ _fit_output_to_input_roi(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_i
 }
 
 
+/* memory a pipe may use for one module: the host memory limit, cut down to what the
+   memory budget has left for the pipe's priority. never below a minimum that still
+   gives us sensibly sized tiles. */
+static float
+_host_memory_available(struct dt_dev_pixelpipe_t *pipe)
+{
+  const float limit = (float)dt_conf_get_int("host_memory_limit")*1024.0f*1024.0f;
+  assert(limit >= 500.0f*1024.0f*1024.0f);
+  const float budget = (float)dt_memory_budget_available(dt_dev_pixelpipe_memory_priority(pipe));
+  return fmaxf(fminf(limit, budget), 100.0f*1024.0f*1024.0f);
+}
+
 /* simple tiling algorithm for roi_in == roi_out, i.e. for pixel to pixel modules/operations */
 static void
 _default_process_tiling_ptp (struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece, void *ivoid, void *ovoid, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out, const int in_bpp)
 {
   void *input = NULL;
   void *output = NULL;
+  size_t charged = 0;
+  const dt_memory_priority_t priority = dt_dev_pixelpipe_memory_priority(piece->pipe);
 
   const int out_bpp = self->output_bpp(self, piece->pipe, piece);
   const int ipitch = roi_in->width * in_bpp;
@@ -616,8 +630,7 @@ _default_process_tiling_ptp (struct dt_iop_module_t *self, struct dt_dev_pixelpi
   }
 
   /* calculate optimal size of tiles */
-  float available = (float)dt_conf_get_int("host_memory_limit")*1024.0f*1024.0f;
-  assert(available >= 500.0f*1024.0f*1024.0f);
+  float available = _host_memory_available(piece->pipe);
   /* correct for size of ivoid and ovoid which are needed on top of tiling */
   available = fmax(available - (roi_out->width*roi_out->height*out_bpp) - (roi_in->width*roi_in->height*in_bpp) - tiling.overhead, 0);
 
@@ -710,6 +723,8 @@ _default_process_tiling_ptp (struct dt_iop_module_t *self, struct dt_dev_pixelpi
     dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] could not alloc output buffer for module '%s'\n", self->op);
     goto error;
   }
+  charged = (size_t)width*height*(in_bpp+out_bpp);
+  dt_memory_budget_charge(DT_MEMORY_TILING, priority, charged);
 
   /* store processed_maximum to be re-used and aggregated */
   float processed_maximum_saved[3];
@@ -722,7 +737,11 @@ _default_process_tiling_ptp (struct dt_iop_module_t *self, struct dt_dev_pixelpi
   for(int tx=0; tx<tiles_x; tx++)
     for(int ty=0; ty<tiles_y; ty++)
     {
+      /* nobody is waiting for the result any more, skip the remaining tiles */
+      if(dt_dev_pixelpipe_cancelled(piece->pipe)) continue;
+
       piece->pipe->tiling = 1;
+      piece->pipe->tiles++;
 
       size_t wd = tx * tile_wd + width > roi_in->width  ? roi_in->width - tx * tile_wd : width;
       size_t ht = ty * tile_ht + height > roi_in->height ? roi_in->height- ty * tile_ht : height;
@@ -798,6 +817,7 @@ _default_process_tiling_ptp (struct dt_iop_module_t *self, struct dt_dev_pixelpi
 
   if(input != NULL) free(input);
   if(output != NULL) free(output);
+  dt_memory_budget_release(DT_MEMORY_TILING, priority, charged);
   piece->pipe->tiling = 0;
   return;
 
@@ -808,6 +828,7 @@ error:
 fallback:
   if(input != NULL) free(input);
   if(output != NULL) free(output);
+  dt_memory_budget_release(DT_MEMORY_TILING, priority, charged);
   piece->pipe->tiling = 0;
   dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] fall back to standard processing for module '%s'\n", self->op);
   self->process(self, piece, ivoid, ovoid, roi_in, roi_out);
@@ -824,6 +845,8 @@ _default_process_tiling_roi (struct dt_iop_module_t *self, struct dt_dev_pixelpi
 {
   void *input = NULL;
   void *output = NULL;
+  size_t charged = 0;
+  const dt_memory_priority_t priority = dt_dev_pixelpipe_memory_priority(piece->pipe);
 
   //_print_roi(roi_in, "module roi_in");
   //_print_roi(roi_out, "module roi_out");
@@ -853,8 +876,7 @@ _default_process_tiling_roi (struct dt_iop_module_t *self, struct dt_dev_pixelpi
   }
 
   /* calculate optimal size of tiles */
-  float available = (float)dt_conf_get_int("host_memory_limit")*1024.0f*1024.0f;
-  assert(available >= 500.0f*1024.0f*1024.0f);
+  float available = _host_memory_available(piece->pipe);
   /* correct for size of ivoid and ovoid which are needed on top of tiling */
   available = fmax(available - (roi_out->width*roi_out->height*out_bpp) - (roi_in->width*roi_in->height*in_bpp) - tiling.overhead, 0);
 
@@ -953,7 +975,11 @@ _default_process_tiling_roi (struct dt_iop_module_t *self, struct dt_dev_pixelpi
   for(int tx=0; tx<tiles_x; tx++)
     for(int ty=0; ty<tiles_y; ty++)
     {
+      /* nobody is waiting for the result any more, skip the remaining tiles */
+      if(dt_dev_pixelpipe_cancelled(piece->pipe)) continue;
+
       piece->pipe->tiling = 1;
+      piece->pipe->tiles++;
 
       /* the output dimensions of the good part of this specific tile */
       size_t wd = (tx + 1) * tile_wd > roi_out->width  ? roi_out->width - tx * tile_wd : tile_wd;
@@ -1050,6 +1076,8 @@ _default_process_tiling_roi (struct dt_iop_module_t *self, struct dt_dev_pixelpi
         dt_print(DT_DEBUG_DEV, "[default_process_tiling_roi] could not alloc output buffer for module '%s'\n", self->op);
         goto error;
       }
+      charged = (size_t)iroi_full.width*iroi_full.height*in_bpp + (size_t)oroi_full.width*oroi_full.height*out_bpp;
+      dt_memory_budget_charge(DT_MEMORY_TILING, priority, charged);
 
 #ifdef _OPENMP
       #pragma omp parallel for default(none) shared(input,ivoid,ioffs,iroi_full) schedule(static)
@@ -1086,6 +1114,8 @@ _default_process_tiling_roi (struct dt_iop_module_t *self, struct dt_dev_pixelpi
       free(input);
       free(output);
       input = output = NULL;
+      dt_memory_budget_release(DT_MEMORY_TILING, priority, charged);
+      charged = 0;
     }
 
   /* copy back final processed_maximum */
@@ -1094,6 +1124,7 @@ _default_process_tiling_roi (struct dt_iop_module_t *self, struct dt_dev_pixelpi
 
   if(input != NULL) free(input);
   if(output != NULL) free(output);
+  dt_memory_budget_release(DT_MEMORY_TILING, priority, charged);
   piece->pipe->tiling = 0;
   return;
 
@@ -1104,6 +1135,7 @@ error:
 fallback:
   if(input != NULL) free(input);
   if(output != NULL) free(output);
+  dt_memory_budget_release(DT_MEMORY_TILING, priority, charged);
   piece->pipe->tiling = 0;
   dt_print(DT_DEBUG_DEV, "[default_process_tiling_roi] fall back to standard processing for module '%s'\n", self->op);
   self->process(self, piece, ivoid, ovoid, roi_in, roi_out);
@@ -1292,7 +1324,11 @@ _default_process_tiling_cl_ptp (struct dt_iop_module_t *self, struct dt_dev_pixe
   for(int tx=0; tx<tiles_x; tx++)
     for(int ty=0; ty<tiles_y; ty++)
     {
+      /* nobody is waiting for the result any more, skip the remaining tiles */
+      if(dt_dev_pixelpipe_cancelled(piece->pipe)) continue;
+
       piece->pipe->tiling = 1;
+      piece->pipe->tiles++;
 
       size_t wd = tx * tile_wd + width > roi_in->width  ? roi_in->width - tx * tile_wd : width;
       size_t ht = ty * tile_ht + height > roi_in->height ? roi_in->height- ty * tile_ht : height;
@@ -1617,7 +1653,11 @@ _default_process_tiling_cl_roi (struct dt_iop_module_t *self, struct dt_dev_pixe
   for(int tx=0; tx<tiles_x; tx++)
     for(int ty=0; ty<tiles_y; ty++)
     {
+      /* nobody is waiting for the result any more, skip the remaining tiles */
+      if(dt_dev_pixelpipe_cancelled(piece->pipe)) continue;
+
       piece->pipe->tiling = 1;
+      piece->pipe->tiles++;
 
       /* the output dimensions of the good part of this specific tile */
       size_t wd = (tx + 1) * tile_wd > roi_out->width  ? roi_out->width - tx * tile_wd : tile_wd;
@@ -1855,7 +1895,7 @@ void default_tiling_callback  (struct dt_iop_module_t *self, struct dt_dev_pixel
 }
 
 int
-dt_tiling_piece_fits_host_memory(const size_t width, const size_t height, const unsigned bpp, const float factor, const size_t overhead)
+dt_tiling_piece_fits_host_memory(struct dt_dev_pixelpipe_t *pipe, const size_t width, const size_t height, const unsigned bpp, const float factor, const size_t overhead)
 {
   static int host_memory_limit = -1;
 
@@ -1871,7 +1911,7 @@ dt_tiling_piece_fits_host_memory(const size_t width, const size_t height, const
 
   float requirement = factor * width * height * bpp + overhead;
 
-  if(host_memory_limit == 0 || requirement <= host_memory_limit * 1024.0f * 1024.0f) return TRUE;
+  if(host_memory_limit == 0 || requirement <= _host_memory_available(pipe)) return TRUE;
 
   return FALSE;
 }
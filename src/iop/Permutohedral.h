@@ -51,6 +51,7 @@ public:
     capacity = 1 << 15;
     capacity_bits = 0x7fff;
     filled = 0;
+    maxProbe = 0;
     entries = new Entry[capacity];
     keys = new short[KD*capacity/2];
     values = new float[VD*capacity/2];
@@ -82,20 +83,23 @@ public:
     return values;
   }
 
-  /* Returns the index into the hash table for a given key.
+  /* Returns the index into the values array for a given key.
    *     key: a pointer to the position vector.
-   *       h: hash of the position vector.
+   *       h: hash of the position vector, as returned by hash().
    *  create: a flag specifying whether an entry should be created,
    *          should an entry with the given key not found.
    */
   int lookupOffset(const short *key, size_t h, bool create = true)
   {
 
-    // Double hash table size if necessary
-    if (filled >= (capacity/2)-1)
+    // Double hash table size if necessary. Only when inserting, lookups
+    // must not touch the table: the blur reads it from many threads.
+    if (create && filled >= (capacity/2)-1)
     {
       grow();
     }
+    h &= capacity_bits;
+    size_t probe = 0;
 
     // Find the entry with the given key
     while (1)
@@ -112,6 +116,7 @@ public:
         e.valueIdx = filled*VD;
         entries[h] = e;
         filled++;
+        if (probe > maxProbe) maxProbe = probe;
         return e.valueIdx;
       }
 
@@ -125,23 +130,43 @@ public:
       // increment the bucket with wraparound
       h++;
       if (h == capacity) h = 0;
+      probe++;
     }
   }
 
+  /* Longest run of occupied buckets an insertion had to walk, to spot clustering. */
+  size_t maxProbeLength()
+  {
+    return maxProbe;
+  }
+
   /* Looks up the value vector associated with a given key vector.
    *        k : pointer to the key vector to be looked up.
    *   create : true if a non-existing key should be created.
    */
   float *lookup(const short *k, bool create = true)
   {
-    size_t h = hash(k) & capacity_bits;
-    int offset = lookupOffset(k, h, create);
+    int offset = lookupOffset(k, hash(k), create);
     if (offset < 0) return NULL;
     else return values + offset;
   };
 
+  /* Makes room for n vectors, so filling the table up to that doesn't grow it. */
+  void reserve(size_t n)
+  {
+    while (n >= (capacity/2)-1) grow();
+  }
+
+  /* Bytes used by a table holding n vectors, on average over the growth steps. */
+  static size_t memory_use(size_t n)
+  {
+    // capacity is between two and four times the number of vectors, half of it
+    // is allocated for keys and values
+    return (size_t)(3*n*(sizeof(Entry) + (sizeof(short)*KD + sizeof(float)*VD)/2.0f));
+  }
+
   /* Hash function used in this implementation. A simple base conversion. */
-  size_t hash(const short *key)
+  static size_t hash(const short *key)
   {
     size_t k = 0;
     for (int i = 0; i < KD; i++)
@@ -202,7 +227,7 @@ private:
   short *keys;
   float *values;
   Entry *entries;
-  size_t capacity, filled;
+  size_t capacity, filled, maxProbe;
   unsigned long capacity_bits;
 };
 
@@ -229,7 +254,7 @@ public:
     float *scaleFactorTmp = new float[D];
     int *canonicalTmp = new int[(D+1)*(D+1)];
 
-    replay = new ReplayEntry[nData*(D+1)];
+    replay = new ReplayEntry[(size_t)nData*(D+1)];
 
     // compute the coordinates of the canonical simplex, in which
     // the difference between a contained point and the zero
@@ -279,7 +304,7 @@ public:
 
 
   /* Performs splatting with given position and value vectors */
-  void splat(float *position, float *value, int replay_index, int thread_index=0)
+  void splat(float *position, float *value, size_t replay_index, int thread_index=0)
   {
     float elevated[D+1];
     int greedy[D+1];
@@ -382,53 +407,111 @@ public:
     }
   }
 
-  /* Merge the multiple threads' hash tables into the totals. */
+  /* Merge the multiple threads' hash tables into the totals.
+   *
+   * The merged lattice is split into nThreads shards by the hash of the keys,
+   * so every shard can be filled by its own thread without locking, and the
+   * blur and slice below work on the shards directly.
+   */
   void merge_splat_threads(void)
   {
     if (nThreads <= 1)
       return;
 
-    /* Merge the multiple hash tables into one, creating an offset remap table. */
+    HashTablePermutohedral<D,VD> *shards = new HashTablePermutohedral<D,VD>[nThreads];
+    HashTablePermutohedral<D,VD> *threadTables = hashTables;
     int *offset_remap[nThreads];
-    for (int i = 1; i < nThreads; i++)
+    unsigned short *shard_remap[nThreads];
+    size_t total = 0;
+    for (int i = 0; i < nThreads; i++)
     {
-      const short *oldKeys = hashTables[i].getKeys();
-      const float *oldVals = hashTables[i].getValues();
-      const int filled = hashTables[i].size();
+      const size_t filled = threadTables[i].size();
       offset_remap[i] = new int[filled];
+      shard_remap[i] = new unsigned short[filled];
+      total += filled;
+    }
+
+    // find the shard of every vertex
+    for (int i = 0; i < nThreads; i++)
+    {
+      const short *keys = threadTables[i].getKeys();
+      unsigned short *sr = shard_remap[i];
+      const int filled = threadTables[i].size();
+#ifdef _OPENMP
+      #pragma omp parallel for schedule(static) shared(keys, sr)
+#endif
       for (int j = 0; j < filled; j++)
+        sr[j] = shardOf(HashTablePermutohedral<D,VD>::hash(keys+j*D));
+    }
+
+    // sum up the vertices of each shard, creating an offset remap table
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic, 1) shared(shards, threadTables, offset_remap, shard_remap, total)
+#endif
+    for (int s = 0; s < nThreads; s++)
+    {
+      shards[s].reserve(total/nThreads);
+      for (int i = 0; i < nThreads; i++)
       {
-        float *val = hashTables[0].lookup(oldKeys+j*D, true);
-        const float *oldVal = oldVals + j*VD;
-        for (int k = 0; k < VD; k++)
-          val[k] += oldVal[k];
-        offset_remap[i][j] = val - hashTables[0].getValues();
+        const short *oldKeys = threadTables[i].getKeys();
+        const float *oldVals = threadTables[i].getValues();
+        const unsigned short *sr = shard_remap[i];
+        const int filled = threadTables[i].size();
+        for (int j = 0; j < filled; j++)
+        {
+          if (sr[j] != s) continue;
+          float *val = shards[s].lookup(oldKeys+j*D, true);
+          const float *oldVal = oldVals + j*VD;
+          for (int k = 0; k < VD; k++)
+            val[k] += oldVal[k];
+          offset_remap[i][j] = val - shards[s].getValues();
+        }
       }
     }
 
-    /* Rewrite the offsets in the replay structure from the above generated table. */
-    for (int i = 0; i < nData*(D+1); i++)
-      if (replay[i].table > 0)
-        replay[i].offset = offset_remap[replay[i].table][replay[i].offset/VD];
+    /* Rewrite the table and offsets in the replay structure from the above generated tables. */
+    const size_t nReplay = (size_t)nData*(D+1);
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static) shared(offset_remap, shard_remap)
+#endif
+    for (size_t i = 0; i < nReplay; i++)
+    {
+      const int t = replay[i].table, j = replay[i].offset/VD;
+      replay[i].table = shard_remap[t][j];
+      replay[i].offset = offset_remap[t][j];
+    }
 
-    for (int i = 1; i < nThreads; i++)
+    for (int i = 0; i < nThreads; i++)
+    {
       delete[] offset_remap[i];
+      delete[] shard_remap[i];
+    }
+    delete[] threadTables;
+    hashTables = shards;
+
+#ifndef NDEBUG
+    // with a poor split of the hash between shard and bucket, keys pile up in long clusters
+    for (int s = 0; s < nThreads; s++)
+      if (hashTables[s].maxProbeLength() > 256)
+        fprintf(stderr, "[permutohedral] shard %d of %d: %zu vertices, insertions probed up to %zu buckets\n",
+                s, nThreads, (size_t)hashTables[s].size(), hashTables[s].maxProbeLength());
+#endif
   }
 
   /* Performs slicing out of position vectors. Note that the barycentric weights and the simplex
    * containing each position vector were calculated and stored in the splatting step.
    * We may reuse this to accelerate the algorithm. (See pg. 6 in paper.)
    */
-  void slice(float *col, int replay_index)
+  void slice(float *col, size_t replay_index)
   {
-    float *base = hashTables[0].getValues();
     for (int j = 0; j < VD; j++) col[j] = 0;
     for (int i = 0; i <= D; i++)
     {
-      ReplayEntry r = replay[replay_index*(D+1)+i];
+      const ReplayEntry r = replay[replay_index*(D+1)+i];
+      const float *base = hashTables[r.table].getValues() + r.offset;
       for (int j = 0; j < VD; j++)
       {
-        col[j] += r.weight*base[r.offset + j];
+        col[j] += r.weight*base[j];
       }
     }
   }
@@ -436,10 +519,16 @@ public:
   /* Performs a Gaussian blur along each projected axis in the hyperplane. */
   void blur()
   {
-    // Prepare arrays
-    float *newValue = new float[VD*hashTables[0].size()];
-    float *oldValue = hashTables[0].getValues();
-    float *hashTableBase = oldValue;
+    // Prepare arrays, one per shard. Each thread blurs whole shards, the neighbours
+    // are looked up in whichever shard they live in.
+    float *newValue[nThreads];
+    float *oldValue[nThreads];
+    float *hashTableBase[nThreads];
+    for (int s = 0; s < nThreads; s++)
+    {
+      newValue[s] = new float[VD*hashTables[s].size()];
+      oldValue[s] = hashTableBase[s] = hashTables[s].getValues();
+    }
 
     float zero[VD];
     for (int k = 0; k < VD; k++) zero[k] = 0;
@@ -448,59 +537,90 @@ public:
     for (int j = 0; j <= D; j++)
     {
 #ifdef _OPENMP
-      #pragma omp parallel for shared(j, oldValue, newValue, hashTableBase, zero)
+      #pragma omp parallel for schedule(dynamic, 1) shared(j, oldValue, newValue, zero)
 #endif
-      // For each vertex in the lattice,
-      for (int i = 0; i < hashTables[0].size(); i++)   // blur point i in dimension j
+      for (int s = 0; s < nThreads; s++)
       {
-        const short *key    = hashTables[0].getKeys() + i*(D); // keys to current vertex
-        short neighbor1[D+1];
-        short neighbor2[D+1];
-        for (int k = 0; k < D; k++)
+        // For each vertex in the shard,
+        for (int i = 0; i < hashTables[s].size(); i++)   // blur point i in dimension j
         {
-          neighbor1[k] = key[k] + 1;
-          neighbor2[k] = key[k] - 1;
+          const short *key    = hashTables[s].getKeys() + i*(D); // keys to current vertex
+          short neighbor1[D+1];
+          short neighbor2[D+1];
+          for (int k = 0; k < D; k++)
+          {
+            neighbor1[k] = key[k] + 1;
+            neighbor2[k] = key[k] - 1;
+          }
+          neighbor1[j] = key[j] - D;
+          neighbor2[j] = key[j] + D; // keys to the neighbors along the given axis.
+
+          const float *oldVal = oldValue[s] + i*VD;
+          float *newVal = newValue[s] + i*VD;
+
+          const float *vm1 = neighbor(neighbor1, oldValue, zero); // look up first neighbor
+          const float *vp1 = neighbor(neighbor2, oldValue, zero); // look up second neighbor
+
+          // Mix values of the three vertices
+          for (int k = 0; k < VD; k++)
+            newVal[k] = (0.25f*vm1[k] + 0.5f*oldVal[k] + 0.25f*vp1[k]);
         }
-        neighbor1[j] = key[j] - D;
-        neighbor2[j] = key[j] + D; // keys to the neighbors along the given axis.
-
-        float *oldVal = oldValue + i*VD;
-        float *newVal = newValue + i*VD;
-
-        float *vm1, *vp1;
-
-        vm1 = hashTables[0].lookup(neighbor1, false); // look up first neighbor
-        if (vm1) vm1 = vm1 - hashTableBase + oldValue;
-        else vm1 = zero;
-
-        vp1 = hashTables[0].lookup(neighbor2, false); // look up second neighbor
-        if (vp1) vp1 = vp1 - hashTableBase + oldValue;
-        else vp1 = zero;
-
-        // Mix values of the three vertices
-        for (int k = 0; k < VD; k++)
-          newVal[k] = (0.25f*vm1[k] + 0.5f*oldVal[k] + 0.25f*vp1[k]);
       }
-      float *tmp = newValue;
-      newValue = oldValue;
-      oldValue = tmp;
+      for (int s = 0; s < nThreads; s++)
+      {
+        float *tmp = newValue[s];
+        newValue[s] = oldValue[s];
+        oldValue[s] = tmp;
+      }
       // the freshest data is now in oldValue, and newValue is ready to be written over
     }
 
     // depending where we ended up, we may have to copy data
-    if (oldValue != hashTableBase)
+    for (int s = 0; s < nThreads; s++)
     {
-      memcpy(hashTableBase, oldValue, hashTables[0].size()*VD*sizeof(float));
-      delete[] oldValue;
-    }
-    else
-    {
-      delete[] newValue;
+      if (oldValue[s] != hashTableBase[s])
+      {
+        memcpy(hashTableBase[s], oldValue[s], hashTables[s].size()*VD*sizeof(float));
+        delete[] oldValue[s];
+      }
+      else
+      {
+        delete[] newValue[s];
+      }
     }
   }
 
+  /* Estimates the peak memory in bytes used to filter nData points, if the
+   * lattice ends up with nVertices vertices. This is reached while merging,
+   * when the tables of the threads and the merged shards coexist.
+   */
+  static size_t memory_use(size_t nData, size_t nVertices)
+  {
+    return nData*(D+1)*sizeof(ReplayEntry)
+           + 2*HashTablePermutohedral<D,VD>::memory_use(nVertices)
+           + nVertices*(sizeof(int) + sizeof(unsigned short));
+  }
+
 private:
 
+  /* The shard a key with hash h lives in. The buckets inside a shard use the low bits
+   * of h, so mix all bits into the top ones and take the shard from there. */
+  int shardOf(size_t h)
+  {
+    const size_t m = h * (size_t)0x9e3779b97f4a7c15ull;
+    return (m >> (8*sizeof(size_t) - 16)) % nThreads;
+  }
+
+  /* Values of a neighbouring vertex in the current blur pass, or zero if it doesn't exist. */
+  const float *neighbor(const short *key, float *const *values, const float *zero)
+  {
+    const size_t h = HashTablePermutohedral<D,VD>::hash(key);
+    const int s = shardOf(h);
+    const int offset = hashTables[s].lookupOffset(key, h, false);
+    if (offset < 0) return zero;
+    return values[s] + offset;
+  }
+
   int nData;
   int nThreads;
   const float *scaleFactor;
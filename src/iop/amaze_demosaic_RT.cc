@@ -27,6 +27,7 @@
 
 
 #include <math.h>
+#include <emmintrin.h>
 
 static inline
 float clampnan(const float x, const float m, const float M)
@@ -76,6 +77,27 @@ __inline float xdivf( float d, int n)
   return d;
 }
 
+// sse helpers for amaze
+#define LVFU(x) _mm_loadu_ps(&(x))
+#define STVFU(x, y) _mm_storeu_ps(&(x), y)
+// select a where mask is set, b otherwise
+#define SELV(mask, a, b) _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b))
+// load the two directional weights of four consecutive pixels of the interleaved dirwts array
+#define LDIRWTS(v, h, i) do { \
+    const __m128 lo_ = LVFU(dirwts[i][0]), hi_ = LVFU(dirwts[(i)+2][0]); \
+    v = _mm_shuffle_ps(lo_, hi_, _MM_SHUFFLE(2,0,2,0)); \
+    h = _mm_shuffle_ps(lo_, hi_, _MM_SHUFFLE(3,1,3,1)); \
+  } while(0)
+
+// xdiv2f() on four values: subtract one from the exponent of all non-zero ones
+static inline __m128 xdiv2fv(const __m128 d)
+{
+  const __m128i i = _mm_castps_si128(d);
+  const __m128i nonzero = _mm_xor_si128(_mm_cmpeq_epi32(_mm_and_si128(i, _mm_set1_epi32(0x7FFFFFFF)), _mm_setzero_si128()),
+                                        _mm_set1_epi32(-1));
+  return _mm_castsi128_ps(_mm_sub_epi32(i, _mm_and_si128(nonzero, _mm_set1_epi32(1 << 23))));
+}
+
 ////////////////////////////////////////////////////////////////
 //
 //			AMaZE demosaic algorithm
@@ -255,9 +277,21 @@ amaze_demosaic_RT(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, c
     // nyquist texture flag 1=nyquist, 0=not nyquist
     char   (*nyquist);
 
+    // constants for the sse code paths
+    const __m128 signmask = _mm_set1_ps(-0.0f);
+    const __m128 zerov = _mm_setzero_ps();
+    const __m128 onev = _mm_set1_ps(1.0f);
+    const __m128 epsv = _mm_set1_ps(eps);
+    const __m128 arthreshv = _mm_set1_ps(arthresh);
+    // the scalar code compares against 0.8*clip_pt in double precision. the largest float
+    // not above that gives the same result for all float values.
+    float clipf = 0.8*clip_pt;
+    if(clipf > 0.8*clip_pt) clipf = nextafterf(clipf, -INFINITY);
+    const __m128 clipv = _mm_set1_ps(clipf);
+
 #define CLF 1
-    // assign working space
-    buffer = (char *) malloc(29*sizeof(float)*TS*TS - sizeof(float)*TS*TSH + sizeof(char)*TS*TSH+23*CLF*64);
+    // assign working space, reused across runs
+    buffer = amaze_buffer_get((dt_iop_demosaic_global_data_t *)self->data);
     char 	*data;
     data = (char *)( ((uintptr_t)buffer + 63) / 64 * 64);
 
@@ -364,12 +398,17 @@ amaze_demosaic_RT(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, c
 // use collapse(2) to collapse the 2 loops to one large loop, so there is better scaling
 // WARNING: we don't use collapse(2) as this seems to trigger an issue in some versions of gcc 4.8
 
+// so the tiles are numbered by hand instead, which also gives dynamic scheduling
+// enough tiles to balance the threads on images only a few tiles high.
+    const int tiles_x = (width+16 + TS-33)/(TS-32);
+    const int tiles_y = (height+16 + TS-33)/(TS-32);
 #ifdef _OPENMP
     #pragma omp for schedule(dynamic) nowait
 #endif
-    for (top=winy-16; top < winy+height; top += TS-32)
-      for (left=winx-16; left < winx+width; left += TS-32)
+    for (int tile=0; tile < tiles_x*tiles_y; tile++)
       {
+        top  = winy-16 + (tile / tiles_x)*(TS-32);
+        left = winx-16 + (tile % tiles_x)*(TS-32);
         memset(nyquist, 0, sizeof(char)*TS*TSH);
         memset(rbint, 0, sizeof(float)*TS*TSH);
         //location of tile bottom edge
@@ -595,7 +634,17 @@ amaze_demosaic_RT(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, c
         // %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
 
         for (rr=1; rr < rr1-1; rr++)
-          for (cc=1, indx=(rr)*TS+cc; cc < cc1-1; cc++, indx++)
+        {
+          for (cc=1, indx=(rr)*TS+cc; cc < cc1-4; cc+=4, indx+=4)
+          {
+            const __m128 dh = _mm_andnot_ps(signmask, _mm_sub_ps(LVFU(cfa[indx+1]), LVFU(cfa[indx-1])));
+            const __m128 dv = _mm_andnot_ps(signmask, _mm_sub_ps(LVFU(cfa[indx+v1]), LVFU(cfa[indx-v1])));
+            STVFU(delh[indx], dh);
+            STVFU(delv[indx], dv);
+            STVFU(delhsq[indx], _mm_mul_ps(dh, dh));
+            STVFU(delvsq[indx], _mm_mul_ps(dv, dv));
+          }
+          for (; cc < cc1-1; cc++, indx++)
           {
 
             delh[indx] = fabsf(cfa[indx+1]-cfa[indx-1]);
@@ -605,9 +654,18 @@ amaze_demosaic_RT(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, c
 //					delp[indx] = fabsf(cfa[indx+p1]-cfa[indx-p1]);
 //					delm[indx] = fabsf(cfa[indx+m1]-cfa[indx-m1]);
           }
+        }
 
         for (rr=2; rr < rr1-2; rr++)
-          for (cc=2,indx=(rr)*TS+cc; cc < cc1-2; cc++, indx++)
+        {
+          for (cc=2,indx=(rr)*TS+cc; cc < cc1-5; cc+=4, indx+=4)
+          {
+            const __m128 wv = _mm_add_ps(_mm_add_ps(_mm_add_ps(epsv, LVFU(delv[indx+v1])), LVFU(delv[indx-v1])), LVFU(delv[indx]));
+            const __m128 wh = _mm_add_ps(_mm_add_ps(_mm_add_ps(epsv, LVFU(delh[indx+1])), LVFU(delh[indx-1])), LVFU(delh[indx]));
+            STVFU(dirwts[indx][0],   _mm_unpacklo_ps(wv, wh));
+            STVFU(dirwts[indx+2][0], _mm_unpackhi_ps(wv, wh));
+          }
+          for (; cc < cc1-2; cc++, indx++)
           {
             dirwts[indx][0] = eps+delv[indx+v1]+delv[indx-v1]+delv[indx];//+fabsf(cfa[indx+v2]-cfa[indx-v2]);
             //vert directional averaging weights
@@ -615,6 +673,7 @@ amaze_demosaic_RT(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, c
             //horizontal weights
 
           }
+        }
 
         for (rr=6; rr < rr1-6; rr++)
           for (cc=6+(FC(rr,2,filters)&1), indx=(rr)*TS+cc; cc < cc1-6; cc+=2, indx+=2)
@@ -640,8 +699,84 @@ amaze_demosaic_RT(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, c
         //t1_vcdhcd = clock();
 
         for (rr=4; rr<rr1-4; rr++)
-          //for (cc=4+(FC(rr,2,filters)&1),indx=rr*TS+cc,c=FC(rr,cc,filters); cc<cc1-4; cc+=2,indx+=2) {
-          for (cc=4,indx=rr*TS+cc; cc<cc1-4; cc++,indx++)
+        {
+          // four pixels at a time, with the same operations in the same order as the scalar code below.
+          // the mask selects the lanes at green sites, the pattern repeats every two columns.
+          const __m128 isgreen = _mm_cmpneq_ps(_mm_set_ps(FC(rr,7,filters)&1, FC(rr,6,filters)&1,
+                                                          FC(rr,5,filters)&1, FC(rr,4,filters)&1), zerov);
+          for (cc=4,indx=rr*TS+cc; cc<cc1-7; cc+=4,indx+=4)
+          {
+            const __m128 cfav = LVFU(cfa[indx]);
+            const __m128 cfam1 = LVFU(cfa[indx-1]), cfap1 = LVFU(cfa[indx+1]);
+            const __m128 cfam2 = LVFU(cfa[indx-2]), cfap2 = LVFU(cfa[indx+2]);
+            const __m128 cfamv1 = LVFU(cfa[indx-v1]), cfapv1 = LVFU(cfa[indx+v1]);
+            const __m128 cfamv2 = LVFU(cfa[indx-v2]), cfapv2 = LVFU(cfa[indx+v2]);
+            __m128 dv0, dh0, dvm2, dhm2, dvp2, dhp2, dvm1, dhm1, dvp1, dhp1, dummy;
+            LDIRWTS(dv0, dh0, indx);
+            LDIRWTS(dvm2, dummy, indx-v2);
+            LDIRWTS(dvp2, dummy, indx+v2);
+            LDIRWTS(dummy, dhm2, indx-2);
+            LDIRWTS(dummy, dhp2, indx+2);
+            LDIRWTS(dvm1, dummy, indx-v1);
+            LDIRWTS(dvp1, dummy, indx+v1);
+            LDIRWTS(dummy, dhm1, indx-1);
+            LDIRWTS(dummy, dhp1, indx+1);
+
+            const __m128 epscfa = _mm_add_ps(epsv, cfav);
+            const __m128 cruv = _mm_div_ps(_mm_mul_ps(cfamv1, _mm_add_ps(dvm2, dv0)),
+                                           _mm_add_ps(_mm_mul_ps(dvm2, epscfa), _mm_mul_ps(dv0, _mm_add_ps(epsv, cfamv2))));
+            const __m128 crdv = _mm_div_ps(_mm_mul_ps(cfapv1, _mm_add_ps(dvp2, dv0)),
+                                           _mm_add_ps(_mm_mul_ps(dvp2, epscfa), _mm_mul_ps(dv0, _mm_add_ps(epsv, cfapv2))));
+            const __m128 crlv = _mm_div_ps(_mm_mul_ps(cfam1, _mm_add_ps(dhm2, dh0)),
+                                           _mm_add_ps(_mm_mul_ps(dhm2, epscfa), _mm_mul_ps(dh0, _mm_add_ps(epsv, cfam2))));
+            const __m128 crrv = _mm_div_ps(_mm_mul_ps(cfap1, _mm_add_ps(dhp2, dh0)),
+                                           _mm_add_ps(_mm_mul_ps(dhp2, epscfa), _mm_mul_ps(dh0, _mm_add_ps(epsv, cfap2))));
+
+            const __m128 guhav = _mm_add_ps(cfamv1, xdiv2fv(_mm_sub_ps(cfav, cfamv2)));
+            const __m128 gdhav = _mm_add_ps(cfapv1, xdiv2fv(_mm_sub_ps(cfav, cfapv2)));
+            const __m128 glhav = _mm_add_ps(cfam1, xdiv2fv(_mm_sub_ps(cfav, cfam2)));
+            const __m128 grhav = _mm_add_ps(cfap1, xdiv2fv(_mm_sub_ps(cfav, cfap2)));
+
+#define ADAPTIVE(cr, ha) SELV(_mm_cmplt_ps(_mm_andnot_ps(signmask, _mm_sub_ps(onev, cr)), arthreshv), _mm_mul_ps(cfav, cr), ha)
+            __m128 guarv = ADAPTIVE(cruv, guhav);
+            __m128 gdarv = ADAPTIVE(crdv, gdhav);
+            __m128 glarv = ADAPTIVE(crlv, glhav);
+            __m128 grarv = ADAPTIVE(crrv, grhav);
+#undef ADAPTIVE
+
+            const __m128 hwtv = _mm_div_ps(dhm1, _mm_add_ps(dhm1, dhp1));
+            const __m128 vwtv = _mm_div_ps(dvm1, _mm_add_ps(dvp1, dvm1));
+
+            const __m128 Gintvarv = _mm_add_ps(_mm_mul_ps(vwtv, gdarv), _mm_mul_ps(_mm_sub_ps(onev, vwtv), guarv));
+            const __m128 Gintharv = _mm_add_ps(_mm_mul_ps(hwtv, grarv), _mm_mul_ps(_mm_sub_ps(onev, hwtv), glarv));
+            const __m128 Gintvhav = _mm_add_ps(_mm_mul_ps(vwtv, gdhav), _mm_mul_ps(_mm_sub_ps(onev, vwtv), guhav));
+            const __m128 Ginthhav = _mm_add_ps(_mm_mul_ps(hwtv, grhav), _mm_mul_ps(_mm_sub_ps(onev, hwtv), glhav));
+
+            const __m128 vcdaltv = SELV(isgreen, _mm_sub_ps(cfav, Gintvhav), _mm_sub_ps(Gintvhav, cfav));
+            const __m128 hcdaltv = SELV(isgreen, _mm_sub_ps(cfav, Ginthhav), _mm_sub_ps(Ginthhav, cfav));
+            __m128 vcdv = SELV(isgreen, _mm_sub_ps(cfav, Gintvarv), _mm_sub_ps(Gintvarv, cfav));
+            __m128 hcdv = SELV(isgreen, _mm_sub_ps(cfav, Gintharv), _mm_sub_ps(Gintharv, cfav));
+
+            // use HA if highlights are (nearly) clipped
+            const __m128 clipped = _mm_or_ps(_mm_cmpgt_ps(cfav, clipv),
+                                             _mm_or_ps(_mm_cmpgt_ps(Gintvhav, clipv), _mm_cmpgt_ps(Ginthhav, clipv)));
+            guarv = SELV(clipped, guhav, guarv);
+            gdarv = SELV(clipped, gdhav, gdarv);
+            glarv = SELV(clipped, glhav, glarv);
+            grarv = SELV(clipped, grhav, grarv);
+            vcdv = SELV(clipped, vcdaltv, vcdv);
+            hcdv = SELV(clipped, hcdaltv, hcdv);
+
+            STVFU(vcd[indx], vcdv);
+            STVFU(hcd[indx], hcdv);
+            STVFU(vcdalt[indx], vcdaltv);
+            STVFU(hcdalt[indx], hcdaltv);
+            const __m128 dguv = _mm_sub_ps(guhav, gdhav), dgaruv = _mm_sub_ps(guarv, gdarv);
+            const __m128 dglv = _mm_sub_ps(glhav, grhav), dgarlv = _mm_sub_ps(glarv, grarv);
+            STVFU(dgintv[indx], _mm_min_ps(_mm_mul_ps(dguv, dguv), _mm_mul_ps(dgaruv, dgaruv)));
+            STVFU(dginth[indx], _mm_min_ps(_mm_mul_ps(dglv, dglv), _mm_mul_ps(dgarlv, dgarlv)));
+          }
+          for (; cc<cc1-4; cc++,indx++)
           {
 //					c=FC(rr,cc,filters);
 //					if (c&1) {sgn=-1;} else {sgn=1;}
@@ -746,6 +881,7 @@ amaze_demosaic_RT(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, c
             dginth[indx]=MIN(SQR(glha-grha),SQR(glar-grar));
 
           }
+        }
         //t2_vcdhcd += clock() - t1_vcdhcd;
 
         //t1_cdvar = clock();
@@ -1380,7 +1516,7 @@ amaze_demosaic_RT(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, c
 
 
     // clean up
-    free(buffer);
+    amaze_buffer_put((dt_iop_demosaic_global_data_t *)self->data, buffer);
   }
   // done
 
@@ -1391,6 +1527,10 @@ amaze_demosaic_RT(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, c
  * end of raw therapee code
  *==================================================================================*/
 #undef SQR
+#undef LVFU
+#undef STVFU
+#undef SELV
+#undef LDIRWTS
 #undef LIM
 #undef ULIM
 #undef HCLIP
@@ -293,7 +293,17 @@ extern "C"
     sigma[0] = data->sigma[0] * roi_in->scale / piece->iscale;
     sigma[1] = data->sigma[1] * roi_in->scale / piece->iscale;
     const int rad = (int)(3.0*fmaxf(sigma[0],sigma[1])+1.0);
-    tiling->factor = 2 + 50;
+    if(rad <= 6)
+    {
+      // the naive version only needs input and output
+      tiling->factor = 2;
+    }
+    else
+    {
+      // assume every pixel adds its own vertices to the lattice, with the
+      // small default color sigmas noisy images get close to that.
+      tiling->factor = 2 + PermutohedralLattice<5,4>::memory_use(1, 5+1)/(4.0f*sizeof(float));
+    }
     tiling->overhead = 0;
     tiling->overlap = rad;
     tiling->xalign = 1;
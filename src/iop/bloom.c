@@ -101,7 +101,7 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
   const int ch = piece->colors;
 
   /* gather light by threshold */
-  float *blurlightness = malloc(roi_out->width*roi_out->height*sizeof(float));
+  float *blurlightness = dt_dev_pixelpipe_scratch_alloc(piece->pipe, roi_out->width*roi_out->height*sizeof(float));
   memset(blurlightness,0,(roi_out->width*roi_out->height*sizeof(float)));
   memcpy(out,in,roi_out->width*roi_out->height*ch*sizeof(float));
 
@@ -131,7 +131,7 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
   const int hr = range/2;
 
   const int size = roi_out->width>roi_out->height?roi_out->width:roi_out->height;
-  float *scanline = malloc(size*sizeof(float));
+  float *scanline = dt_dev_pixelpipe_scratch_alloc(piece->pipe, size*sizeof(float));
 
   for(int iteration=0; iteration<8; iteration++)
   {
@@ -215,10 +215,8 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
   if(piece->pipe->mask_display)
     dt_iop_alpha_copy(ivoid, ovoid, roi_out->width, roi_out->height);
 
-  if(scanline)
-    free(scanline);
-  if(blurlightness)
-    free(blurlightness);
+  dt_dev_pixelpipe_scratch_free(piece->pipe, scanline);
+  dt_dev_pixelpipe_scratch_free(piece->pipe, blurlightness);
 }
 
 static void
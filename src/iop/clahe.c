@@ -22,6 +22,7 @@
 #include "common/colorspaces.h"
 #include "develop/develop.h"
 #include "develop/imageop.h"
+#include "develop/tiling.h"
 #include "control/control.h"
 #include "dtgtk/slider.h"
 #include "dtgtk/resetlabel.h"
@@ -32,6 +33,7 @@
 #include <math.h>
 #include <assert.h>
 #include <string.h>
+#include <xmmintrin.h>
 
 #define CLIP(x) ((x<0)?0.0:(x>1.0)?1.0:x)
 
@@ -74,166 +76,202 @@ groups ()
 
 int flags()
 {
-  return IOP_FLAGS_INCLUDE_IN_STYLES | IOP_FLAGS_DEPRECATED;
+  return IOP_FLAGS_INCLUDE_IN_STYLES | IOP_FLAGS_DEPRECATED | IOP_FLAGS_ALLOW_TILING;
+}
+
+// tiles are at least this large, smaller ones would cost more for their mappings than they save
+#define CLAHE_MIN_TILE 16
+#define CLAHE_BINS 256
+
+// edge length of the contextual regions, about the size of the window around each pixel
+static int
+clahe_tile_size(const dt_iop_rlce_data_t *data, const dt_iop_roi_t *roi_in, const dt_dev_pixelpipe_iop_t *piece)
+{
+  const int rad = data->radius*roi_in->scale/piece->iscale;
+  return MAX(2*rad+1, CLAHE_MIN_TILE);
+}
+
+void tiling_callback (struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out, struct dt_develop_tiling_t *tiling)
+{
+  dt_iop_rlce_data_t *data = (dt_iop_rlce_data_t *)piece->data;
+  const int tile = clahe_tile_size(data, roi_in, piece);
+  const size_t tiles = (size_t)(roi_in->width/tile + 2) * (roi_in->height/tile + 2);
+
+  tiling->factor = 2.25f; // in + out + luminance
+  tiling->maxbuf = 1.0f;
+  tiling->overhead = tiles*(CLAHE_BINS+1)*sizeof(float);
+  // a pixel is mapped with the histograms of the four regions around it
+  tiling->overlap = 2*tile;
+  tiling->xalign = 1;
+  tiling->yalign = 1;
+}
+
+/* clip histogram and redistribute clipped entries */
+static void
+clahe_clip_histogram(int *clippedhist, const int limit)
+{
+  const int bins = CLAHE_BINS;
+  int ce = 0, ceb=0;
+  do
+  {
+    ceb = ce;
+    ce = 0;
+    for ( int b = 0; b <= bins; b++ )
+    {
+      int d = clippedhist[ b ] - limit;
+      if ( d > 0 )
+      {
+        ce += d;
+        clippedhist[ b ] = limit;
+      }
+    }
+
+    int d = (ce / (float) ( bins + 1 ));
+    int m = ce % ( bins + 1 );
+    for ( int h = 0; h <= bins; h++)
+      clippedhist[ h ] += d;
+
+    if ( m != 0 )
+    {
+      int s = bins / (float)m;
+      for ( int h = 0; h <= bins; h += s )
+        ++clippedhist[ h ];
+    }
+  }
+  while ( ce != ceb);
+}
+
+/* the equalising tone curve of one region, from the cdf of its clipped histogram */
+static void
+clahe_tile_mapping(const float *luminance, const int width, const int x0, const int x1, const int y0, const int y1,
+                   const float slope, float *map)
+{
+  const int bins = CLAHE_BINS;
+  int hist[CLAHE_BINS+1] = { 0 };
+  for ( int yi = y0; yi < y1; ++yi )
+    for ( int xi = x0; xi < x1; ++xi )
+      ++hist[ ROUND_POSISTIVE(luminance[(size_t)yi*width+xi] * (float)bins) ];
+
+  const int n = (x1 - x0)*(y1 - y0);
+  const int limit = ( int )( slope * n /  bins + 0.5f );
+  clahe_clip_histogram(hist, limit);
+
+  int hMin = bins;
+  for ( int h = 0; h < hMin; h++ )
+    if ( hist[ h ] != 0 ) hMin = h;
+  const int cdfMin = hist[ hMin ];
+  int cdfMax = 0;
+  for ( int h = hMin; h <= bins; h++ )
+    cdfMax += hist[ h ];
+
+  int cdf = 0;
+  for ( int v = 0; v <= bins; v++ )
+  {
+    if ( v >= hMin ) cdf += hist[ v ];
+    // a flat region has nothing to equalise
+    map[ v ] = cdfMax > cdfMin ? CLIP(( cdf - cdfMin ) / ( float )( cdfMax - cdfMin )) : v / (float)bins;
+  }
 }
 
 void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoid, void *ovoid, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out)
 {
   dt_iop_rlce_data_t *data = (dt_iop_rlce_data_t *)piece->data;
   const int ch = piece->colors;
+  const int width = roi_out->width, height = roi_out->height;
 
   // PASS1: Get a luminance map of image...
-  float *luminance=(float *)malloc((roi_out->width*roi_out->height)*sizeof(float));
-  //double lsmax=0.0,lsmin=1.0;
+  float *luminance = (float *)dt_alloc_align(64, (size_t)width*height*sizeof(float));
 #ifdef _OPENMP
-  #pragma omp parallel for default(none) schedule(static) shared(luminance,roi_in,roi_out,ivoid)
+  #pragma omp parallel for default(none) schedule(static) shared(luminance,ivoid)
 #endif
-  for(int j=0; j<roi_out->height; j++)
+  for(int j=0; j<height; j++)
   {
-    float *in=(float *)ivoid+j*roi_out->width*ch;
-    float *lm=luminance+j*roi_out->width;
-    for(int i=0; i<roi_out->width; i++)
+    const float *in = (const float *)ivoid + (size_t)j*width*ch;
+    float *lm = luminance + (size_t)j*width;
+    for(int i=0; i<width; i++, in+=ch, lm++)
     {
-      double pmax=CLIP(fmax(in[0],fmax(in[1],in[2]))); // Max value in RGB set
-      double pmin=CLIP(fmin(in[0],fmin(in[1],in[2]))); // Min value in RGB set
-      *lm=(pmax+pmin)/2.0;        // Pixel luminocity
-      in+=ch;
-      lm++;
+      // (max + min)/2 of the clipped rgb values, the shuffles put r, g and b in every lane
+      const __m128 v = _mm_min_ps(_mm_max_ps(_mm_load_ps(in), _mm_setzero_ps()), _mm_set1_ps(1.0f));
+      const __m128 v1 = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 0, 2, 1));
+      const __m128 v2 = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 1, 0, 2));
+      const __m128 l = _mm_add_ss(_mm_max_ps(v, _mm_max_ps(v1, v2)), _mm_min_ps(v, _mm_min_ps(v1, v2)));
+      _mm_store_ss(lm, _mm_mul_ss(l, _mm_set_ss(0.5f)));
     }
   }
 
+  // PASS2: the contextual regions sit on a grid in image coordinates, so tiles of the pixelpipe line up
+  const int tile = clahe_tile_size(data, roi_in, piece);
+  const float slope = data->slope;
+  const int tx_first = roi_in->x / tile, ty_first = roi_in->y / tile;
+  const int ntx = (roi_in->x + width - 1) / tile - tx_first + 1;
+  const int nty = (roi_in->y + height - 1) / tile - ty_first + 1;
+  float *maps = (float *)dt_alloc_align(64, (size_t)ntx*nty*(CLAHE_BINS+1)*sizeof(float));
 
-  // Params
-  const int rad=data->radius*roi_in->scale/piece->iscale;
-
-  const int bins=256;
-  const float slope=data->slope;
-
-  // CLAHE
 #ifdef _OPENMP
-  #pragma omp parallel for default(none) schedule(static) shared(luminance,roi_in,roi_out,ivoid,ovoid)
+  #pragma omp parallel for default(none) schedule(dynamic) shared(luminance,maps,roi_in)
 #endif
-  for(int j=0; j<roi_out->height; j++)
+  for(int t=0; t<ntx*nty; t++)
   {
-    int yMin = fmax( 0, j - rad );
-    int yMax = fmin( roi_in->height, j + rad + 1 );
-    int h = yMax - yMin;
-
-    int xMin0 = fmax( 0, 0-rad );
-    int xMax0 = fmin( roi_in->width - 1, rad );
-
-    int hist[bins+1];
-    int clippedhist[bins+1];
-    float dest[roi_out->width];
-
-    /* initially fill histogram */
-    memset(hist,0,(bins+1)*sizeof(int));
-    for ( int yi = yMin; yi < yMax; ++yi )
-      for ( int xi = xMin0; xi < xMax0; ++xi )
-        ++hist[ ROUND_POSISTIVE(luminance[yi*roi_in->width+xi] * (float)bins) ];
-
-    // Destination row
-    memset(dest,0,roi_out->width*sizeof(float));
-    float *ld=dest;
-
-    for(int i=0; i<roi_out->width; i++)
-    {
-
-      int v = ROUND_POSISTIVE(luminance[j*roi_in->width+i] * (float)bins);
-
-      int xMin = fmax( 0, i - rad );
-      int xMax = i + rad + 1;
-      int w = fmin( roi_in->width, xMax ) - xMin;
-      int n = h * w;
-
-      int limit = ( int )( slope * n /  bins + 0.5f );
-
-      /* remove left behind values from histogram */
-      if ( xMin > 0 )
-      {
-        int xMin1 = xMin - 1;
-        for ( int yi = yMin; yi < yMax; ++yi )
-          --hist[  ROUND_POSISTIVE(luminance[yi*roi_in->width+xMin1] * (float)bins) ];
-      }
-
-      /* add newly included values to histogram */
-      if ( xMax <= roi_in->width )
-      {
-        int xMax1 = xMax - 1;
-        for ( int yi = yMin; yi < yMax; ++yi )
-          ++hist[  ROUND_POSISTIVE(luminance[yi*roi_in->width+xMax1] * (float)bins) ];
-      }
-
-      /* clip histogram and redistribute clipped entries */
-      memcpy(clippedhist,hist,(bins+1)*sizeof(int));
-      int ce = 0, ceb=0;
-      do
-      {
-        ceb = ce;
-        ce = 0;
-        for ( int b = 0; b <= bins; b++ )
-        {
-          int d = clippedhist[ b ] - limit;
-          if ( d > 0 )
-          {
-            ce += d;
-            clippedhist[ b ] = limit;
-          }
-        }
-
-        int d = (ce / (float) ( bins + 1 ));
-        int m = ce % ( bins + 1 );
-        for ( int h = 0; h <= bins; h++)
-          clippedhist[ h ] += d;
-
-        if ( m != 0 )
-        {
-          int s = bins / (float)m;
-          for ( int h = 0; h <= bins; h += s )
-            ++clippedhist[ h ];
-        }
-      }
-      while ( ce != ceb);
-
-      /* build cdf of clipped histogram */
-      int hMin = bins;
-      for ( int h = 0; h < hMin; h++ )
-        if ( clippedhist[ h ] != 0 ) hMin = h;
-
-      int cdf = 0;
-      for ( int h = hMin; h <= v; h++ )
-        cdf += clippedhist[ h ];
-
-      int cdfMax = cdf;
-      for ( int h = v + 1; h <= bins; h++ )
-        cdfMax += clippedhist[ h ];
-
-      int cdfMin = clippedhist[ hMin ];
-
-      *ld=( cdf - cdfMin ) / ( float )( cdfMax - cdfMin );
+    const int tx = t % ntx, ty = t / ntx;
+    const int x0 = MAX(0, (tx_first + tx)*tile - roi_in->x), x1 = MIN(width, (tx_first + tx + 1)*tile - roi_in->x);
+    const int y0 = MAX(0, (ty_first + ty)*tile - roi_in->y), y1 = MIN(height, (ty_first + ty + 1)*tile - roi_in->y);
+    clahe_tile_mapping(luminance, width, x0, x1, y0, y1, slope, maps + (size_t)t*(CLAHE_BINS+1));
+  }
 
-      ld++;
-    }
+  // PASS3: bilinear blend of the mappings of the four closest region centres
+  int *tx0 = (int *)malloc(sizeof(int)*2*width);
+  int *tx1 = tx0 + width;
+  float *wx = (float *)malloc(sizeof(float)*width);
+  for(int i=0; i<width; i++)
+  {
+    const float fx = (roi_in->x + i + 0.5f)/tile - 0.5f - tx_first;
+    const int t = CLAMP((int)floorf(fx), 0, ntx-1);
+    tx0[i] = t*(CLAHE_BINS+1);
+    tx1[i] = MIN(t+1, ntx-1)*(CLAHE_BINS+1);
+    wx[i] = CLAMP(fx - t, 0.0f, 1.0f);
+  }
 
-    // Apply row
-    float *in = ((float *)ivoid) + j*roi_out->width*ch;
-    float *out = ((float *)ovoid) + j*roi_out->width*ch;
-    for(int r=0; r<roi_out->width; r++)
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) schedule(static) shared(luminance,maps,roi_in,ivoid,ovoid,tx0,tx1,wx)
+#endif
+  for(int j=0; j<height; j++)
+  {
+    const float fy = (roi_in->y + j + 0.5f)/tile - 0.5f - ty_first;
+    const int ty = CLAMP((int)floorf(fy), 0, nty-1);
+    const float wy = CLAMP(fy - ty, 0.0f, 1.0f);
+    const float *m0 = maps + (size_t)ty*ntx*(CLAHE_BINS+1);
+    const float *m1 = maps + (size_t)MIN(ty+1, nty-1)*ntx*(CLAHE_BINS+1);
+    const float *lm = luminance + (size_t)j*width;
+    const float *in = (const float *)ivoid + (size_t)j*width*ch;
+    float *out = (float *)ovoid + (size_t)j*width*ch;
+
+    for(int i=0; i<width; i++, in+=ch, out+=ch)
     {
-      float H, S, L;
-      rgb2hsl(in,&H,&S,&L);
-      //hsl2rgb(out,H,S,( L / dest[r] ) * (L-lsmin) + lsmin );
-      hsl2rgb(out,H,S,dest[r] );
-      out += ch;
-      in += ch;
-      ld++;
+      const int v = ROUND_POSISTIVE(lm[i] * (float)CLAHE_BINS);
+      const float top = m0[tx0[i]+v] + wx[i]*(m0[tx1[i]+v] - m0[tx0[i]+v]);
+      const float bot = m1[tx0[i]+v] + wx[i]*(m1[tx1[i]+v] - m1[tx0[i]+v]);
+      const float L1 = top + wy*(bot - top);
+
+      // same as rgb2hsl() and hsl2rgb() with the new lightness: hue and saturation stay,
+      // so the distance of every channel from the lightness scales with the chroma.
+      const __m128 p = _mm_load_ps(in);
+      const __m128 p1 = _mm_shuffle_ps(p, p, _MM_SHUFFLE(3, 0, 2, 1));
+      const __m128 p2 = _mm_shuffle_ps(p, p, _MM_SHUFFLE(3, 1, 0, 2));
+      float L0;
+      _mm_store_ss(&L0, _mm_mul_ss(_mm_add_ss(_mm_max_ps(p, _mm_max_ps(p1, p2)), _mm_min_ps(p, _mm_min_ps(p1, p2))),
+                                   _mm_set_ss(0.5f)));
+      const float c0 = 1.0f - fabsf(2.0f*L0 - 1.0f);
+      const float k = c0 != 0.0f ? (1.0f - fabsf(2.0f*L1 - 1.0f))/c0 : 0.0f;
+      _mm_store_ps(out, _mm_add_ps(_mm_set1_ps(L1), _mm_mul_ps(_mm_sub_ps(p, _mm_set1_ps(L0)), _mm_set1_ps(k))));
+      out[3] = in[3];
     }
-
   }
 
   // Cleanup
+  free(tx0);
+  free(wx);
+  free(maps);
   free(luminance);
-
 }
 
 static void
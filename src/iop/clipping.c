@@ -745,6 +745,64 @@ void modify_roi_in(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *
   roi_in->height = CLAMP(roi_in->height, 1, scheight - roi_in->y);
 }
 
+// keystone correction at the scale of roi_in
+typedef struct dt_iop_clipping_keystone_t
+{
+  float k_space[4];
+  float kxa, kya;
+  float a, b, d, e, g, h;
+}
+dt_iop_clipping_keystone_t;
+
+static void
+keystone_get_roi(const dt_iop_clipping_data_t *d, dt_dev_pixelpipe_iop_t *piece, const dt_iop_roi_t *roi_in, dt_iop_clipping_keystone_t *k)
+{
+  const float rx = piece->buf_in.width*roi_in->scale;
+  const float ry = piece->buf_in.height*roi_in->scale;
+  k->k_space[0] = d->k_space[0]*rx;
+  k->k_space[1] = d->k_space[1]*ry;
+  k->k_space[2] = d->k_space[2]*rx;
+  k->k_space[3] = d->k_space[3]*ry;
+  k->kxa = d->kxa*rx;
+  k->kya = d->kya*ry;
+  const float kxb = d->kxb*rx, kxc = d->kxc*rx, kxd = d->kxd*rx;
+  const float kyb = d->kyb*ry, kyc = d->kyc*ry, kyd = d->kyd*ry;
+  keystone_get_matrix(k->k_space,k->kxa,kxb,kxc,kxd,k->kya,kyb,kyc,kyd,&k->a,&k->b,&k->d,&k->e,&k->g,&k->h);
+}
+
+// maps the point p of roi_out to the position in roi_in it is interpolated from
+static inline void
+backtransform_roi(const dt_iop_clipping_data_t *d, const dt_iop_clipping_keystone_t *k,
+                  const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out, float *p)
+{
+  float pi[2], po[2];
+
+  pi[0] = roi_out->x - roi_out->scale*d->enlarge_x + roi_out->scale*d->cix + p[0];
+  pi[1] = roi_out->y - roi_out->scale*d->enlarge_y + roi_out->scale*d->ciy + p[1];
+
+  // transform this point using matrix m
+  if(d->flip)
+  {
+    pi[1] -= d->tx*roi_out->scale;
+    pi[0] -= d->ty*roi_out->scale;
+  }
+  else
+  {
+    pi[0] -= d->tx*roi_out->scale;
+    pi[1] -= d->ty*roi_out->scale;
+  }
+  pi[0] /= roi_out->scale;
+  pi[1] /= roi_out->scale;
+  backtransform(pi, po, d->m, d->k_h, d->k_v);
+  po[0] *= roi_in->scale;
+  po[1] *= roi_in->scale;
+  po[0] += d->tx*roi_in->scale;
+  po[1] += d->ty*roi_in->scale;
+  if (d->k_apply==1) keystone_backtransform(po,(float *)k->k_space,k->a,k->b,k->d,k->e,k->g,k->h,k->kxa,k->kya);
+  p[0] = po[0] - roi_in->x;
+  p[1] = po[1] - roi_in->y;
+}
+
 // 3rd (final) pass: you get this input region (may be different from what was requested above),
 // do your best to fill the output region!
 void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoid, void *ovoid, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out)
@@ -777,16 +835,11 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
   else
   {
     const struct dt_interpolation* interpolation = dt_interpolation_new(DT_INTERPOLATION_USERPREF);
-    const float rx = piece->buf_in.width*roi_in->scale;
-    const float ry = piece->buf_in.height*roi_in->scale;
-    float k_space[4] = {d->k_space[0]*rx,d->k_space[1]*ry,d->k_space[2]*rx,d->k_space[3]*ry};
-    const float kxa = d->kxa*rx, kxb = d->kxb*rx, kxc = d->kxc*rx, kxd = d->kxd*rx;
-    const float kya = d->kya*ry, kyb = d->kyb*ry, kyc = d->kyc*ry, kyd = d->kyd*ry;
-    float ma,mb,md,me,mg,mh;
-    keystone_get_matrix(k_space,kxa,kxb,kxc,kxd,kya,kyb,kyc,kyd,&ma,&mb,&md,&me,&mg,&mh);
+    dt_iop_clipping_keystone_t k;
+    keystone_get_roi(d, piece, roi_in, &k);
 
 #ifdef _OPENMP
-    #pragma omp parallel for schedule(static) default(none) shared(d,ivoid,ovoid,roi_in,roi_out,interpolation,k_space,ma,mb,md,me,mg,mh)
+    #pragma omp parallel for schedule(static) default(none) shared(d,ivoid,ovoid,roi_in,roi_out,interpolation,k)
 #endif
     // (slow) point-by-point transformation.
     // TODO: optimize with scanlines and linear steps between?
@@ -795,39 +848,24 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
       float *out = ((float *)ovoid)+ch*j*roi_out->width;
       for(int i=0; i<roi_out->width; i++,out+=ch)
       {
-        float pi[2], po[2];
-
-        pi[0] = roi_out->x - roi_out->scale*d->enlarge_x + roi_out->scale*d->cix + i;
-        pi[1] = roi_out->y - roi_out->scale*d->enlarge_y + roi_out->scale*d->ciy + j;
-
-        // transform this point using matrix m
-        if(d->flip)
-        {
-          pi[1] -= d->tx*roi_out->scale;
-          pi[0] -= d->ty*roi_out->scale;
-        }
-        else
-        {
-          pi[0] -= d->tx*roi_out->scale;
-          pi[1] -= d->ty*roi_out->scale;
-        }
-        pi[0] /= roi_out->scale;
-        pi[1] /= roi_out->scale;
-        backtransform(pi, po, d->m, d->k_h, d->k_v);
-        po[0] *= roi_in->scale;
-        po[1] *= roi_in->scale;
-        po[0] += d->tx*roi_in->scale;
-        po[1] += d->ty*roi_in->scale;
-        if (d->k_apply==1) keystone_backtransform(po,k_space,ma,mb,md,me,mg,mh,kxa,kya);
-        po[0] -= roi_in->x;
-        po[1] -= roi_in->y;
-
+        float po[2] = {i, j};
+        backtransform_roi(d, &k, roi_in, roi_out, po);
         dt_interpolation_compute_pixel4c(interpolation, (float *)ivoid, out, po[0], po[1], roi_in->width, roi_in->height, ch_width);
       }
     }
   }
 }
 
+int warp_backtransform(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out, float *points, size_t points_count)
+{
+  if(!points) return 1;
+  dt_iop_clipping_data_t *d = (dt_iop_clipping_data_t *)piece->data;
+  dt_iop_clipping_keystone_t k;
+  keystone_get_roi(d, piece, roi_in, &k);
+  for(size_t i=0; i<3*points_count; i++) backtransform_roi(d, &k, roi_in, roi_out, points + 2*i);
+  return 1;
+}
+
 
 
 #ifdef HAVE_OPENCL
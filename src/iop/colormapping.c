@@ -24,7 +24,7 @@
 #include "develop/imageop.h"
 #include "develop/tiling.h"
 #include "control/control.h"
-#include "common/points.h"
+#include "common/kmeans.h"
 #include "common/opencl.h"
 #include "gui/accelerators.h"
 #include "gui/gtk.h"
@@ -272,116 +272,13 @@ get_clusters(const float *col, const int n, float mean[n][2], float *weight)
 }
 
 
-static int
-get_cluster(const float *col, const int n, float mean[n][2])
-{
-  float mdist = FLT_MAX;
-  int cluster = 0;
-  for(int k=0; k<n; k++)
-  {
-    const float dist = (col[1]-mean[k][0])*(col[1]-mean[k][0]) + (col[2]-mean[k][1])*(col[2]-mean[k][1]);
-    if(dist < mdist)
-    {
-      mdist = dist;
-      cluster = k;
-    }
-  }
-  return cluster;
-}
-
 static void
 kmeans(const float *col, const int width, const int height, const int n, float mean_out[n][2], float var_out[n][2], float weight_out[n])
 {
-  const int nit = 40; // number of iterations
-  const int samples = width*height * 0.2; // samples: only a fraction of the buffer.
-
-  float mean[n][2], var[n][2];
-  int cnt[n], count;
-
-  float a_min = FLT_MAX, b_min = FLT_MAX, a_max = FLT_MIN, b_max = FLT_MIN;
+  const int nit = 40; // maximum number of iterations
 
-  for(int s=0; s<samples; s++)
-  {
-    const int j = CLAMP(dt_points_get()*height, 0, height-1);
-    const int i = CLAMP(dt_points_get()*width, 0, width-1);
-
-    const float a = col[4*(width*j + i)+1];
-    const float b = col[4*(width*j + i)+2];
-
-    a_min = fmin(a, a_min);
-    a_max = fmax(a, a_max);
-    b_min = fmin(b, b_min);
-    b_max = fmax(b, b_max);
-  }
-
-  // init n clusters for a, b channels at random
-  for(int k=0; k<n; k++)
-  {
-    mean_out[k][0] = 0.9f * (a_min + (a_max - a_min) * dt_points_get());
-    mean_out[k][1] = 0.9f * (b_min + (b_max - b_min) * dt_points_get());
-    var_out[k][0] = var_out[k][1] = weight_out[k] = 0.0f;
-    mean[k][0] = mean[k][1] = var[k][0] = var[k][1] = 0.0f;
-  }
-  for(int it=0; it<nit; it++)
-  {
-    for(int k=0; k<n; k++) cnt[k] = 0;
-    // randomly sample col positions inside roi
-#ifdef _OPENMP
-    #pragma omp parallel for default(none) schedule(static) shared(col,var,mean,mean_out,cnt)
-#endif
-    for(int s=0; s<samples; s++)
-    {
-      const int j = CLAMP(dt_points_get()*height, 0, height-1);
-      const int i = CLAMP(dt_points_get()*width, 0, width-1);
-      // for each sample: determine cluster, update new mean, update var
-      for(int k=0; k<n; k++)
-      {
-        const float L = col[4*(width*j+i)];
-        const float Lab[3] = {L, col[4*(width*j + i)+1], col[4*(width*j + i)+2]};
-        // determine dist to mean_out
-        const int c = get_cluster(Lab, n, mean_out);
-#ifdef _OPENMP
-        #pragma omp atomic
-#endif
-        cnt[c]++;
-        // update mean, var
-#ifdef _OPENMP
-        #pragma omp atomic
-#endif
-        var[c][0]  += Lab[1]*Lab[1];
-#ifdef _OPENMP
-        #pragma omp atomic
-#endif
-        var[c][1]  += Lab[2]*Lab[2];
-#ifdef _OPENMP
-        #pragma omp atomic
-#endif
-        mean[c][0] += Lab[1];
-#ifdef _OPENMP
-        #pragma omp atomic
-#endif
-        mean[c][1] += Lab[2];
-      }
-    }
-    // swap old/new means
-    for(int k=0; k<n; k++)
-    {
-      if(cnt [k] == 0) continue;
-      mean_out[k][0] = mean[k][0]/cnt[k];
-      mean_out[k][1] = mean[k][1]/cnt[k];
-      var_out[k][0] = var[k][0]/cnt[k] - mean_out[k][0]*mean_out[k][0];
-      var_out[k][1] = var[k][1]/cnt[k] - mean_out[k][1]*mean_out[k][1];
-      mean[k][0] = mean[k][1] = var[k][0] = var[k][1] = 0.0f;
-    }
-
-    // determine weight of clusters
-    count = 0;
-    for(int k=0; k<n; k++) count += cnt[k];
-    for(int k=0; k<n; k++) weight_out[k] = (count > 0) ? (float)cnt[k]/count : 0.0f;
-
-    // printf("it %d  %d means:\n", it, n);
-    // for(int k=0;k<n;k++) printf("mean %f %f -- var %f %f -- weight %f\n", mean_out[k][0], mean_out[k][1], var_out[k][0], var_out[k][1], weight_out[k]);
-  }
+  // init n clusters for a, b channels at random and fit them
+  dt_kmeans_ab(col, width, height, 4, n, nit, DT_KMEANS_INIT_RANGE, mean_out, var_out, weight_out);
 
   for(int k=0; k<n; k++)
   {
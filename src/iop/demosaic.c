@@ -33,6 +33,9 @@
 #include <xmmintrin.h>
 
 #define BLOCKSIZE  2048		/* maximum blocksize. must be a power of 2 and will be automatically reduced if needed */
+#define DEMOSAIC_PPG_BAND 32 /* rows per band of the ppg passes */
+/* working space of one amaze thread, for its 512x512 tiles (see amaze_demosaic_RT.cc) */
+#define DEMOSAIC_AMAZE_BUFFER_SIZE (29*sizeof(float)*512*512 - sizeof(float)*512*256 + sizeof(char)*512*256 + 23*64)
 
 DT_MODULE(3)
 
@@ -67,6 +70,10 @@ typedef struct dt_iop_demosaic_global_data_t
   int kernel_downsample;
   int kernel_border_interpolate;
   int kernel_color_smoothing;
+  // amaze working space, kept around between runs
+  dt_pthread_mutex_t amaze_lock;
+  char **amaze_buffer;
+  int amaze_buffers, amaze_buffers_max;
 }
 dt_iop_demosaic_global_data_t;
 
@@ -98,6 +105,30 @@ typedef enum dt_iop_demosaic_greeneq_t
 }
 dt_iop_demosaic_greeneq_t;
 
+static char *
+amaze_buffer_get(dt_iop_demosaic_global_data_t *gd)
+{
+  char *buf = NULL;
+  dt_pthread_mutex_lock(&gd->amaze_lock);
+  if(gd->amaze_buffers > 0) buf = gd->amaze_buffer[--gd->amaze_buffers];
+  dt_pthread_mutex_unlock(&gd->amaze_lock);
+  if(!buf) buf = (char *)malloc(DEMOSAIC_AMAZE_BUFFER_SIZE);
+  return buf;
+}
+
+static void
+amaze_buffer_put(dt_iop_demosaic_global_data_t *gd, char *buf)
+{
+  dt_pthread_mutex_lock(&gd->amaze_lock);
+  if(gd->amaze_buffers < gd->amaze_buffers_max)
+  {
+    gd->amaze_buffer[gd->amaze_buffers++] = buf;
+    buf = NULL;
+  }
+  dt_pthread_mutex_unlock(&gd->amaze_lock);
+  free(buf);
+}
+
 static void
 amaze_demosaic_RT(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const float *const in, float *out, const dt_iop_roi_t *const roi_in, const dt_iop_roi_t *const roi_out, const int filters);
 
@@ -321,34 +352,80 @@ color_smoothing(float *out, const dt_iop_roi_t *const roi_out, const int num_pas
 }
 #undef SWAP
 
+// value of the mosaic at (j, i) after the full average equilibration, which divides
+// one of the green channels by gr_ratio (see green_equilibration() for the set of pixels).
+static inline float
+green_equilibration_favg_get(const float *const in, const int width, const int height, const int j, const int i,
+                             const int oi, const int g2_offset, const double gr_ratio)
+{
+  const float v = in[j*width+i];
+  if(gr_ratio == 1.0 || (j & 1) || j >= height-1 || i < oi || i >= width-1-g2_offset || ((i-oi) & 1)) return v;
+  return v / gr_ratio;
+}
+
+// equalizes the two green channels of the mosaic, by their averages over the whole image (full),
+// by local averages (local) or both. all of it is done in one pass over the image, both
+// equilibrations read from the input and the local one sees the result of the full one.
 static void
-green_equilibration_lavg(float *out, const float *const in, const int width, const int height, const uint32_t filters, const int x, const int y, const int in_place, const float thr)
+green_equilibration(float *out, const float *const in, const int width, const int height, const uint32_t filters,
+                    const int x, const int y, const dt_iop_demosaic_greeneq_t mode, const float thr)
 {
   const float maximum = 1.0f;
 
-  int oj = 2, oi = 2;
-  if(FC(oj+y, oi+x, filters) != 1) oj++;
-  if(FC(oj+y, oi+x, filters) != 1) oi++;
-  if(FC(oj+y, oi+x, filters) != 1) oj--;
+  // full average: ratio of the sums of both green channels
+  double gr_ratio = 1.0;
+  int oi = 0;
+  if((FC(y, oi+x, filters) & 1) != 1) oi++;
+  const int g2_offset = oi ? -1:1;
+  if(mode == DT_IOP_GREEN_EQ_FULL || mode == DT_IOP_GREEN_EQ_BOTH)
+  {
+    double sum1 = 0.0, sum2 = 0.0;
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static) default(none) reduction(+: sum1, sum2) shared(oi)
+#endif
+    for(int j=0; j<(height-1); j+=2)
+    {
+      for(int i=oi; i<(width-1-g2_offset); i+=2)
+      {
+        sum1 += in[j*width+i];
+        sum2 += in[(j+1) * width + i + g2_offset];
+      }
+    }
+    if (sum1 > 0.0 && sum2 > 0.0)
+      gr_ratio = sum1/sum2;
+  }
 
-  if(!in_place)
-    memcpy(out,in,height*width*sizeof(float));
+  // local average: first green pixel away from the border
+  const int local = mode == DT_IOP_GREEN_EQ_LOCAL || mode == DT_IOP_GREEN_EQ_BOTH;
+  int lj = 2, li = 2;
+  if(FC(lj+y, li+x, filters) != 1) lj++;
+  if(FC(lj+y, li+x, filters) != 1) li++;
+  if(FC(lj+y, li+x, filters) != 1) lj--;
 
 #ifdef _OPENMP
-  #pragma omp parallel for schedule(static) default(none) shared(out,oi,oj)
+  #pragma omp parallel for schedule(static) default(none) shared(out, oi, lj, li, gr_ratio)
 #endif
-  for(int j=oj; j<height-2; j+=2)
+  for(int j=0; j<height; j++)
   {
-    for(int i=oi; i<width-2; i+=2)
+    if(gr_ratio == 1.0)
+      memcpy(out+j*width, in+j*width, width*sizeof(float));
+    else for(int i=0; i<width; i++)
+      out[j*width+i] = green_equilibration_favg_get(in, width, height, j, i, oi, g2_offset, gr_ratio);
+
+    if(!local || j < lj || j >= height-2 || ((j-lj) & 1)) continue;
+
+#define GET(jj, ii) green_equilibration_favg_get(in, width, height, jj, ii, oi, g2_offset, gr_ratio)
+    for(int i=li; i<width-2; i+=2)
     {
-      const float o1_1 = in[(j-1)*width+i-1];
-      const float o1_2 = in[(j-1)*width+i+1];
-      const float o1_3 = in[(j+1)*width+i-1];
-      const float o1_4 = in[(j+1)*width+i+1];
-      const float o2_1 = in[(j-2)*width+i];
-      const float o2_2 = in[(j+2)*width+i];
-      const float o2_3 = in[j*width+i-2];
-      const float o2_4 = in[j*width+i+2];
+      const float o1_1 = GET(j-1, i-1);
+      const float o1_2 = GET(j-1, i+1);
+      const float o1_3 = GET(j+1, i-1);
+      const float o1_4 = GET(j+1, i+1);
+      const float o2_1 = GET(j-2, i);
+      const float o2_2 = GET(j+2, i);
+      const float o2_3 = GET(j, i-2);
+      const float o2_4 = GET(j, i+2);
+      const float pc = GET(j, i);
 
       const float m1 = (o1_1+o1_2+o1_3+o1_4)/4.0f;
       const float m2 = (o2_1+o2_2+o2_3+o2_4)/4.0f;
@@ -359,51 +436,210 @@ green_equilibration_lavg(float *out, const float *const in, const int width, con
       {
         const float c1 = (fabsf(o1_1-o1_2)+fabsf(o1_1-o1_3)+fabsf(o1_1-o1_4)+fabsf(o1_2-o1_3)+fabsf(o1_3-o1_4)+fabsf(o1_2-o1_4))/6.0f;
         const float c2 = (fabsf(o2_1-o2_2)+fabsf(o2_1-o2_3)+fabsf(o2_1-o2_4)+fabsf(o2_2-o2_3)+fabsf(o2_3-o2_4)+fabsf(o2_2-o2_4))/6.0f;
-        if((in[j*width+i]<maximum*0.95f)&&(c1<maximum*thr)&&(c2<maximum*thr))
+        if((pc<maximum*0.95f)&&(c1<maximum*thr)&&(c2<maximum*thr))
         {
-          out[j*width+i] = in[j*width+i]*m1/m2;
+          out[j*width+i] = pc*m1/m2;
         }
       }
     }
+#undef GET
   }
 }
 
-static void
-green_equilibration_favg(float *out, const float *const in, const int width, const int height, const uint32_t filters, const int x, const int y)
+static inline int ppg_threads()
 {
-  int oj = 0, oi = 0;
-  //const float ratio_max = 1.1f;
-  double sum1 = 0.0, sum2 = 0.0, gr_ratio;
-
-  if( (FC(oj+y, oi+x, filters) & 1) != 1) oi++;
-  int g2_offset = oi ? -1:1;
-  memcpy(out,in,height*width*sizeof(float));
 #ifdef _OPENMP
-  #pragma omp parallel for schedule(static) default(none) reduction(+: sum1, sum2) shared(oi, oj, g2_offset)
+  return omp_get_max_threads();
+#else
+  return 1;
 #endif
-  for(int j=oj; j<(height-1); j+=2)
+}
+
+// ppg, first pass on row j: interpolate green, copy the other colour.
+static inline void
+ppg_green_row(float *const out, const float *const in, const int j, const dt_iop_roi_t *const roi_out,
+              const dt_iop_roi_t *const roi_in, const int filters, const int offx, const int offX)
+{
+  const int w = roi_in->width;
+  float *buf = out + 4*roi_out->width*j + 4*offx;
+  const float *buf_in = in + w*(j + roi_out->y) + offx + roi_out->x;
+  int i = offx;
+
+  // four pixels at a time. they alternate between green and red or blue, the mask selects the green ones.
+  // same operations in the same order as the scalar code below, so the results are identical.
+  const __m128 isgreen = _mm_cmpneq_ps(_mm_set_ps(FC(j, i+3, filters) & 1, FC(j, i+2, filters) & 1,
+                                                  FC(j, i+1, filters) & 1, FC(j, i, filters) & 1), _mm_setzero_ps());
+  const __m128 sign = _mm_set1_ps(-0.0f);
+  const __m128 two = _mm_set1_ps(2.0f), three = _mm_set1_ps(3.0f), quarter = _mm_set1_ps(.25f);
+  for (; i < roi_out->width-offX-3; i+=4)
+  {
+    const __m128 pc   = _mm_loadu_ps(buf_in);
+    const __m128 pym  = _mm_loadu_ps(buf_in - w*1);
+    const __m128 pym2 = _mm_loadu_ps(buf_in - w*2);
+    const __m128 pym3 = _mm_loadu_ps(buf_in - w*3);
+    const __m128 pyM  = _mm_loadu_ps(buf_in + w*1);
+    const __m128 pyM2 = _mm_loadu_ps(buf_in + w*2);
+    const __m128 pyM3 = _mm_loadu_ps(buf_in + w*3);
+    const __m128 pxm  = _mm_loadu_ps(buf_in - 1);
+    const __m128 pxm2 = _mm_loadu_ps(buf_in - 2);
+    const __m128 pxm3 = _mm_loadu_ps(buf_in - 3);
+    const __m128 pxM  = _mm_loadu_ps(buf_in + 1);
+    const __m128 pxM2 = _mm_loadu_ps(buf_in + 2);
+    const __m128 pxM3 = _mm_loadu_ps(buf_in + 3);
+
+#define ABSDIFF(a, b) _mm_andnot_ps(sign, _mm_sub_ps(a, b))
+    const __m128 guessx = _mm_sub_ps(_mm_sub_ps(_mm_mul_ps(_mm_add_ps(_mm_add_ps(pxm, pc), pxM), two), pxM2), pxm2);
+    const __m128 diffx  = _mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_add_ps(ABSDIFF(pxm2, pc), ABSDIFF(pxM2, pc)), ABSDIFF(pxm, pxM)), three),
+                                     _mm_mul_ps(_mm_add_ps(ABSDIFF(pxM3, pxM), ABSDIFF(pxm3, pxm)), two));
+    const __m128 guessy = _mm_sub_ps(_mm_sub_ps(_mm_mul_ps(_mm_add_ps(_mm_add_ps(pym, pc), pyM), two), pyM2), pym2);
+    const __m128 diffy  = _mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_add_ps(ABSDIFF(pym2, pc), ABSDIFF(pyM2, pc)), ABSDIFF(pym, pyM)), three),
+                                     _mm_mul_ps(_mm_add_ps(ABSDIFF(pyM3, pyM), ABSDIFF(pym3, pym)), two));
+#undef ABSDIFF
+    const __m128 gx = _mm_max_ps(_mm_min_ps(_mm_mul_ps(guessx, quarter), _mm_max_ps(pxm, pxM)), _mm_min_ps(pxm, pxM));
+    const __m128 gy = _mm_max_ps(_mm_min_ps(_mm_mul_ps(guessy, quarter), _mm_max_ps(pym, pyM)), _mm_min_ps(pym, pyM));
+    const __m128 usey = _mm_cmpgt_ps(diffx, diffy);
+    __m128 g = _mm_or_ps(_mm_and_ps(usey, gy), _mm_andnot_ps(usey, gx));
+    g = _mm_or_ps(_mm_and_ps(isgreen, pc), _mm_andnot_ps(isgreen, g));
+
+    // write (pc, g, pc, 0) for each pixel, the second pass overwrites the missing colours.
+    const __m128 lo = _mm_unpacklo_ps(pc, g), hi = _mm_unpackhi_ps(pc, g);
+    const __m128 pclo = _mm_unpacklo_ps(pc, _mm_setzero_ps()), pchi = _mm_unpackhi_ps(pc, _mm_setzero_ps());
+    _mm_store_ps(buf,    _mm_movelh_ps(lo, pclo));
+    _mm_store_ps(buf+4,  _mm_movehl_ps(pclo, lo));
+    _mm_store_ps(buf+8,  _mm_movelh_ps(hi, pchi));
+    _mm_store_ps(buf+12, _mm_movehl_ps(pchi, hi));
+    buf += 16;
+    buf_in += 4;
+  }
+  for (; i < roi_out->width-offX; i++)
   {
-    for(int i=oi; i<(width-1-g2_offset); i+=2)
+    const int c = FC(j,i,filters);
+    __m128 col = _mm_load_ps(buf);
+    float *color = (float*)&col;
+    const float pc = buf_in[0];
+    // if(__builtin_expect(c == 0 || c == 2, 1))
+    if(c == 0 || c == 2)
     {
-      sum1 += in[j*width+i];
-      sum2 += in[(j+1) * width + i + g2_offset];
+      color[c] = pc;
+      // get stuff (hopefully from cache)
+      const float pym  = buf_in[ - roi_in->width*1];
+      const float pym2 = buf_in[ - roi_in->width*2];
+      const float pym3 = buf_in[ - roi_in->width*3];
+      const float pyM  = buf_in[ + roi_in->width*1];
+      const float pyM2 = buf_in[ + roi_in->width*2];
+      const float pyM3 = buf_in[ + roi_in->width*3];
+      const float pxm  = buf_in[ - 1];
+      const float pxm2 = buf_in[ - 2];
+      const float pxm3 = buf_in[ - 3];
+      const float pxM  = buf_in[ + 1];
+      const float pxM2 = buf_in[ + 2];
+      const float pxM3 = buf_in[ + 3];
+
+      const float guessx = (pxm + pc + pxM) * 2.0f - pxM2 - pxm2;
+      const float diffx  = (fabsf(pxm2 - pc) +
+                            fabsf(pxM2 - pc) +
+                            fabsf(pxm  - pxM)) * 3.0f +
+                           (fabsf(pxM3 - pxM) + fabsf(pxm3 - pxm)) * 2.0f;
+      const float guessy = (pym + pc + pyM) * 2.0f - pyM2 - pym2;
+      const float diffy  = (fabsf(pym2 - pc) +
+                            fabsf(pyM2 - pc) +
+                            fabsf(pym  - pyM)) * 3.0f +
+                           (fabsf(pyM3 - pyM) + fabsf(pym3 - pym)) * 2.0f;
+      if(diffx > diffy)
+      {
+        // use guessy
+        const float m = fminf(pym, pyM);
+        const float M = fmaxf(pym, pyM);
+        color[1] = fmaxf(fminf(guessy*.25f, M), m);
+      }
+      else
+      {
+        const float m = fminf(pxm, pxM);
+        const float M = fmaxf(pxm, pxM);
+        color[1] = fmaxf(fminf(guessx*.25f, M), m);
+      }
     }
-  }
+    else color[1] = pc;
 
-  if (sum1 > 0.0 && sum2 > 0.0)
-    gr_ratio = sum1/sum2;
-  else
-    return;
+    // write using MOVNTPS (write combine omitting caches)
+    // _mm_stream_ps(buf, col);
+    memcpy(buf, color, 4*sizeof(float));
+    buf += 4;
+    buf_in ++;
+  }
+}
 
-#ifdef _OPENMP
-  #pragma omp parallel for schedule(static) default(none) shared(out, oi, oj, gr_ratio, g2_offset)
-#endif
-  for(int j=oj; j<(height-1); j+=2)
+// ppg, second pass on row j: interpolate red and blue. reads the green and the
+// copied colours of rows j-1..j+1 and only writes the interpolated ones.
+static inline void
+ppg_redblue_row(float *const out, const int j, const dt_iop_roi_t *const roi_out, const int filters)
+{
+  float *buf = out + 4*roi_out->width*j + 4;
+  for (int i=1; i < roi_out->width-1; i++)
   {
-    for(int i=oi; i<(width-1-g2_offset); i+=2)
+    // also prefetch direct nbs top/bottom
+    _mm_prefetch((char *)buf + 256, _MM_HINT_NTA);
+    _mm_prefetch((char *)buf - roi_out->width*4*sizeof(float) + 256, _MM_HINT_NTA);
+    _mm_prefetch((char *)buf + roi_out->width*4*sizeof(float) + 256, _MM_HINT_NTA);
+
+    const int c = FC(j, i, filters);
+    __m128 col = _mm_load_ps(buf);
+    float *color = (float *)&col;
+    // fill all four pixels with correctly interpolated stuff: r/b for green1/2
+    // b for r and r for b
+    if(__builtin_expect(c & 1, 1)) // c == 1 || c == 3)
     {
-      out[j*width+i] = in[j*width+i] / gr_ratio;
+      // calculate red and blue for green pixels:
+      // need 4-nbhood:
+      const float* nt = buf - 4*roi_out->width;
+      const float* nb = buf + 4*roi_out->width;
+      const float* nl = buf - 4;
+      const float* nr = buf + 4;
+      if(FC(j, i+1, filters) == 0) // red nb in same row
+      {
+        color[2] = (nt[2] + nb[2] + 2.0f*color[1] - nt[1] - nb[1])*.5f;
+        color[0] = (nl[0] + nr[0] + 2.0f*color[1] - nl[1] - nr[1])*.5f;
+      }
+      else
+      {
+        // blue nb
+        color[0] = (nt[0] + nb[0] + 2.0f*color[1] - nt[1] - nb[1])*.5f;
+        color[2] = (nl[2] + nr[2] + 2.0f*color[1] - nl[1] - nr[1])*.5f;
+      }
     }
+    else
+    {
+      // get 4-star-nbhood:
+      const float* ntl = buf - 4 - 4*roi_out->width;
+      const float* ntr = buf + 4 - 4*roi_out->width;
+      const float* nbl = buf - 4 + 4*roi_out->width;
+      const float* nbr = buf + 4 + 4*roi_out->width;
+
+      if(c == 0)
+      {
+        // red pixel, fill blue:
+        const float diff1  = fabsf(ntl[2] - nbr[2]) + fabsf(ntl[1] - color[1]) + fabsf(nbr[1] - color[1]);
+        const float guess1 = ntl[2] + nbr[2] + 2.0f*color[1] - ntl[1] - nbr[1];
+        const float diff2  = fabsf(ntr[2] - nbl[2]) + fabsf(ntr[1] - color[1]) + fabsf(nbl[1] - color[1]);
+        const float guess2 = ntr[2] + nbl[2] + 2.0f*color[1] - ntr[1] - nbl[1];
+        if     (diff1 > diff2) color[2] = guess2 * .5f;
+        else if(diff1 < diff2) color[2] = guess1 * .5f;
+        else color[2] = (guess1 + guess2)*.25f;
+      }
+      else // c == 2, blue pixel, fill red:
+      {
+        const float diff1  = fabsf(ntl[0] - nbr[0]) + fabsf(ntl[1] - color[1]) + fabsf(nbr[1] - color[1]);
+        const float guess1 = ntl[0] + nbr[0] + 2.0f*color[1] - ntl[1] - nbr[1];
+        const float diff2  = fabsf(ntr[0] - nbl[0]) + fabsf(ntr[1] - color[1]) + fabsf(nbl[1] - color[1]);
+        const float guess2 = ntr[0] + nbl[0] + 2.0f*color[1] - ntr[1] - nbl[1];
+        if     (diff1 > diff2) color[0] = guess2 * .5f;
+        else if(diff1 < diff2) color[0] = guess1 * .5f;
+        else color[0] = (guess1 + guess2)*.25f;
+      }
+    }
+    // _mm_stream_ps(buf, col);
+    memcpy(buf, color, 4*sizeof(float));
+    buf += 4;
   }
 }
 
@@ -420,6 +656,9 @@ demosaic_ppg(float *out, const float *in, dt_iop_roi_t *roi_out, const dt_iop_ro
   const int offX = 3; //MAX(0, 3 - (roi_in->width  - (roi_out->x + roi_out->width)));
   const int offY = 3; //MAX(0, 3 - (roi_in->height - (roi_out->y + roi_out->height)));
 
+  dt_times_t start;
+  dt_get_times(&start);
+
   // border interpolate
   float sum[8];
   for (int j=0; j < roi_out->height; j++) for (int i=0; i < roi_out->width; i++)
@@ -455,159 +694,38 @@ demosaic_ppg(float *out, const float *in, dt_iop_roi_t *roi_out, const dt_iop_ro
     pre_median(med_in, in, roi_in, filters, 1, thrs);
     in = med_in;
   }
-  // for all pixels: interpolate green into float array, or copy color.
+  // both passes run band by band, so the second one finds the output of the first still in cache.
+  // it needs the green of the rows above and below, so it lags one row behind.
 #ifdef _OPENMP
-  #pragma omp parallel for default(none) shared(roi_in, roi_out, in, out) schedule(static)
+  #pragma omp parallel default(none) shared(roi_in, roi_out, in, out)
 #endif
-  for (int j=offy; j < roi_out->height-offY; j++)
+  for (int band=offy; band < roi_out->height-offY; band += DEMOSAIC_PPG_BAND)
   {
-    float *buf = out + 4*roi_out->width*j + 4*offx;
-    const float *buf_in = in + roi_in->width*(j + roi_out->y) + offx + roi_out->x;
-    for (int i=offx; i < roi_out->width-offX; i++)
-    {
-      const int c = FC(j,i,filters);
-      // prefetch what we need soon (load to cpu caches)
-      _mm_prefetch((char *)buf_in + 256, _MM_HINT_NTA); // TODO: try HINT_T0-3
-      _mm_prefetch((char *)buf_in +   roi_in->width + 256, _MM_HINT_NTA);
-      _mm_prefetch((char *)buf_in + 2*roi_in->width + 256, _MM_HINT_NTA);
-      _mm_prefetch((char *)buf_in + 3*roi_in->width + 256, _MM_HINT_NTA);
-      _mm_prefetch((char *)buf_in -   roi_in->width + 256, _MM_HINT_NTA);
-      _mm_prefetch((char *)buf_in - 2*roi_in->width + 256, _MM_HINT_NTA);
-      _mm_prefetch((char *)buf_in - 3*roi_in->width + 256, _MM_HINT_NTA);
-      __m128 col = _mm_load_ps(buf);
-      float *color = (float*)&col;
-      const float pc = buf_in[0];
-      // if(__builtin_expect(c == 0 || c == 2, 1))
-      if(c == 0 || c == 2)
-      {
-        color[c] = pc;
-        // get stuff (hopefully from cache)
-        const float pym  = buf_in[ - roi_in->width*1];
-        const float pym2 = buf_in[ - roi_in->width*2];
-        const float pym3 = buf_in[ - roi_in->width*3];
-        const float pyM  = buf_in[ + roi_in->width*1];
-        const float pyM2 = buf_in[ + roi_in->width*2];
-        const float pyM3 = buf_in[ + roi_in->width*3];
-        const float pxm  = buf_in[ - 1];
-        const float pxm2 = buf_in[ - 2];
-        const float pxm3 = buf_in[ - 3];
-        const float pxM  = buf_in[ + 1];
-        const float pxM2 = buf_in[ + 2];
-        const float pxM3 = buf_in[ + 3];
-
-        const float guessx = (pxm + pc + pxM) * 2.0f - pxM2 - pxm2;
-        const float diffx  = (fabsf(pxm2 - pc) +
-                              fabsf(pxM2 - pc) +
-                              fabsf(pxm  - pxM)) * 3.0f +
-                             (fabsf(pxM3 - pxM) + fabsf(pxm3 - pxm)) * 2.0f;
-        const float guessy = (pym + pc + pyM) * 2.0f - pyM2 - pym2;
-        const float diffy  = (fabsf(pym2 - pc) +
-                              fabsf(pyM2 - pc) +
-                              fabsf(pym  - pyM)) * 3.0f +
-                             (fabsf(pyM3 - pyM) + fabsf(pym3 - pym)) * 2.0f;
-        if(diffx > diffy)
-        {
-          // use guessy
-          const float m = fminf(pym, pyM);
-          const float M = fmaxf(pym, pyM);
-          color[1] = fmaxf(fminf(guessy*.25f, M), m);
-        }
-        else
-        {
-          const float m = fminf(pxm, pxM);
-          const float M = fmaxf(pxm, pxM);
-          color[1] = fmaxf(fminf(guessx*.25f, M), m);
-        }
-      }
-      else color[1] = pc;
-
-      // write using MOVNTPS (write combine omitting caches)
-      // _mm_stream_ps(buf, col);
-      memcpy(buf, color, 4*sizeof(float));
-      buf += 4;
-      buf_in ++;
-    }
-  }
-  // SFENCE (make sure stuff is stored now)
-  // _mm_sfence();
-
-  // for all pixels: interpolate colors into float array
+    const int end = MIN(band + DEMOSAIC_PPG_BAND, roi_out->height-offY);
 #ifdef _OPENMP
-  #pragma omp parallel for default(none) shared(roi_in, roi_out, out) schedule(static)
+    #pragma omp for schedule(static)
 #endif
-  for (int j=1; j < roi_out->height-1; j++)
-  {
-    float *buf = out + 4*roi_out->width*j + 4;
-    for (int i=1; i < roi_out->width-1; i++)
-    {
-      // also prefetch direct nbs top/bottom
-      _mm_prefetch((char *)buf + 256, _MM_HINT_NTA);
-      _mm_prefetch((char *)buf - roi_out->width*4*sizeof(float) + 256, _MM_HINT_NTA);
-      _mm_prefetch((char *)buf + roi_out->width*4*sizeof(float) + 256, _MM_HINT_NTA);
-
-      const int c = FC(j, i, filters);
-      __m128 col = _mm_load_ps(buf);
-      float *color = (float *)&col;
-      // fill all four pixels with correctly interpolated stuff: r/b for green1/2
-      // b for r and r for b
-      if(__builtin_expect(c & 1, 1)) // c == 1 || c == 3)
-      {
-        // calculate red and blue for green pixels:
-        // need 4-nbhood:
-        const float* nt = buf - 4*roi_out->width;
-        const float* nb = buf + 4*roi_out->width;
-        const float* nl = buf - 4;
-        const float* nr = buf + 4;
-        if(FC(j, i+1, filters) == 0) // red nb in same row
-        {
-          color[2] = (nt[2] + nb[2] + 2.0f*color[1] - nt[1] - nb[1])*.5f;
-          color[0] = (nl[0] + nr[0] + 2.0f*color[1] - nl[1] - nr[1])*.5f;
-        }
-        else
-        {
-          // blue nb
-          color[0] = (nt[0] + nb[0] + 2.0f*color[1] - nt[1] - nb[1])*.5f;
-          color[2] = (nl[2] + nr[2] + 2.0f*color[1] - nl[1] - nr[1])*.5f;
-        }
-      }
-      else
-      {
-        // get 4-star-nbhood:
-        const float* ntl = buf - 4 - 4*roi_out->width;
-        const float* ntr = buf + 4 - 4*roi_out->width;
-        const float* nbl = buf - 4 + 4*roi_out->width;
-        const float* nbr = buf + 4 + 4*roi_out->width;
+    for (int j=band; j < end; j++)
+      ppg_green_row(out, in, j, roi_out, roi_in, filters, offx, offX);
 
-        if(c == 0)
-        {
-          // red pixel, fill blue:
-          const float diff1  = fabsf(ntl[2] - nbr[2]) + fabsf(ntl[1] - color[1]) + fabsf(nbr[1] - color[1]);
-          const float guess1 = ntl[2] + nbr[2] + 2.0f*color[1] - ntl[1] - nbr[1];
-          const float diff2  = fabsf(ntr[2] - nbl[2]) + fabsf(ntr[1] - color[1]) + fabsf(nbl[1] - color[1]);
-          const float guess2 = ntr[2] + nbl[2] + 2.0f*color[1] - ntr[1] - nbl[1];
-          if     (diff1 > diff2) color[2] = guess2 * .5f;
-          else if(diff1 < diff2) color[2] = guess1 * .5f;
-          else color[2] = (guess1 + guess2)*.25f;
-        }
-        else // c == 2, blue pixel, fill red:
-        {
-          const float diff1  = fabsf(ntl[0] - nbr[0]) + fabsf(ntl[1] - color[1]) + fabsf(nbr[1] - color[1]);
-          const float guess1 = ntl[0] + nbr[0] + 2.0f*color[1] - ntl[1] - nbr[1];
-          const float diff2  = fabsf(ntr[0] - nbl[0]) + fabsf(ntr[1] - color[1]) + fabsf(nbl[1] - color[1]);
-          const float guess2 = ntr[0] + nbl[0] + 2.0f*color[1] - ntr[1] - nbl[1];
-          if     (diff1 > diff2) color[0] = guess2 * .5f;
-          else if(diff1 < diff2) color[0] = guess1 * .5f;
-          else color[0] = (guess1 + guess2)*.25f;
-        }
-      }
-      // _mm_stream_ps(buf, col);
-      memcpy(buf, color, 4*sizeof(float));
-      buf += 4;
-    }
+    const int first = band == offy ? 1 : band-1;
+    const int last = end == roi_out->height-offY ? roi_out->height-1 : end-1;
+#ifdef _OPENMP
+    #pragma omp for schedule(static)
+#endif
+    for (int j=first; j < last; j++)
+      ppg_redblue_row(out, j, roi_out, filters);
   }
-  // _mm_sfence();
   if (median)
     free((float*)in);
+
+  if(darktable.unmuted & DT_DEBUG_PERF)
+  {
+    dt_times_t end;
+    dt_get_times(&end);
+    dt_print(DT_DEBUG_PERF, "[demosaic] ppg: %.1f MP/s with %d threads\n",
+             roi_out->width*roi_out->height/(1e6*(end.clock - start.clock)), ppg_threads());
+  }
 }
 
 
@@ -679,23 +797,8 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *i, v
     if(data->green_eq != DT_IOP_GREEN_EQ_NO)
     {
       float *in = (float *)dt_alloc_align(16, roi_in->height*roi_in->width*sizeof(float));
-      switch(data->green_eq)
-      {
-        case DT_IOP_GREEN_EQ_FULL:
-          green_equilibration_favg(in, pixels, roi_in->width, roi_in->height,
-                                   data->filters,  roi_in->x, roi_in->y);
-          break;
-        case DT_IOP_GREEN_EQ_LOCAL:
-          green_equilibration_lavg(in, pixels, roi_in->width, roi_in->height,
-                                   data->filters, roi_in->x, roi_in->y, 0, threshold);
-          break;
-        case DT_IOP_GREEN_EQ_BOTH:
-          green_equilibration_favg(in, pixels, roi_in->width, roi_in->height,
-                                   data->filters,  roi_in->x, roi_in->y);
-          green_equilibration_lavg(in, in, roi_in->width, roi_in->height,
-                                   data->filters, roi_in->x, roi_in->y, 1, threshold);
-          break;
-      }
+      green_equilibration(in, pixels, roi_in->width, roi_in->height,
+                          data->filters, roi_in->x, roi_in->y, data->green_eq, threshold);
       if (demosaicing_method != DT_IOP_DEMOSAIC_AMAZE)
         demosaic_ppg((float *)o, in, &roo, &roi, data->filters, data->median_thrs);
       else
@@ -725,23 +828,8 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *i, v
     if(data->green_eq != DT_IOP_GREEN_EQ_NO)
     {
       float *in = (float *)dt_alloc_align(16, roi_in->height*roi_in->width*sizeof(float));
-      switch(data->green_eq)
-      {
-        case DT_IOP_GREEN_EQ_FULL:
-          green_equilibration_favg(in, pixels, roi_in->width, roi_in->height,
-                                   data->filters,  roi_in->x, roi_in->y);
-          break;
-        case DT_IOP_GREEN_EQ_LOCAL:
-          green_equilibration_lavg(in, pixels, roi_in->width, roi_in->height,
-                                   data->filters, roi_in->x, roi_in->y, 0, threshold);
-          break;
-        case DT_IOP_GREEN_EQ_BOTH:
-          green_equilibration_favg(in, pixels, roi_in->width, roi_in->height,
-                                   data->filters,  roi_in->x, roi_in->y);
-          green_equilibration_lavg(in, in, roi_in->width, roi_in->height,
-                                   data->filters, roi_in->x, roi_in->y, 1, threshold);
-          break;
-      }
+      green_equilibration(in, pixels, roi_in->width, roi_in->height,
+                          data->filters, roi_in->x, roi_in->y, data->green_eq, threshold);
       // wanted ppg or zoomed out a lot and quality is limited to 1
       if(demosaicing_method != DT_IOP_DEMOSAIC_AMAZE)
         demosaic_ppg(tmp, in, &roo, &roi, data->filters, data->median_thrs);
@@ -773,6 +861,8 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *i, v
       dt_iop_clip_and_zoom_demosaic_half_size_f((float *)o, tmp, &roo, &roi, roo.width, roi.width, data->filters, clip);
       free(tmp);
     }
+    else if(piece->pipe->type == DT_DEV_PIXELPIPE_PREVIEW || piece->pipe->type == DT_DEV_PIXELPIPE_THUMBNAIL)
+      dt_iop_clip_and_zoom_demosaic_superpixel_f((float *)o, pixels, &roo, &roi, roo.width, roi.width, data->filters, clip);
     else
       dt_iop_clip_and_zoom_demosaic_half_size_f((float *)o, pixels, &roo, &roi, roo.width, roi.width, data->filters, clip);
   }
@@ -1132,6 +1222,13 @@ void tiling_callback  (struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop
 
   tiling->maxbuf = 1.0f;
   tiling->overhead = 0;
+  // amaze needs a fixed working space per thread, independent of the tile size
+  const int amaze = data->demosaicing_method == DT_IOP_DEMOSAIC_AMAZE &&
+                    !(piece->pipe->type == DT_DEV_PIXELPIPE_FULL && qual < 2);
+  if(amaze &&
+     (roi_out->scale > 0.5f || (piece->pipe->type == DT_DEV_PIXELPIPE_FULL && qual > 0) ||
+      piece->pipe->type == DT_DEV_PIXELPIPE_EXPORT))
+    tiling->overhead = (unsigned)dt_get_num_threads() * DEMOSAIC_AMAZE_BUFFER_SIZE;
   tiling->overlap = 5; // take care of border handling
   tiling->xalign = 2; // Bayer pattern
   tiling->yalign = 2; // Bayer pattern
@@ -1170,6 +1267,10 @@ void init_global(dt_iop_module_so_t *module)
   gd->kernel_downsample         = dt_opencl_create_kernel(program, "clip_and_zoom");
   gd->kernel_border_interpolate = dt_opencl_create_kernel(program, "border_interpolate");
   gd->kernel_color_smoothing    = dt_opencl_create_kernel(program, "color_smoothing");
+  gd->amaze_buffers = 0;
+  gd->amaze_buffers_max = dt_get_num_threads();
+  gd->amaze_buffer = (char **)calloc(gd->amaze_buffers_max, sizeof(char *));
+  dt_pthread_mutex_init(&gd->amaze_lock, NULL);
 }
 
 void cleanup(dt_iop_module_t *module)
@@ -1192,6 +1293,9 @@ void cleanup_global(dt_iop_module_so_t *module)
   dt_opencl_free_kernel(gd->kernel_downsample);
   dt_opencl_free_kernel(gd->kernel_border_interpolate);
   dt_opencl_free_kernel(gd->kernel_color_smoothing);
+  for(int k=0; k<gd->amaze_buffers; k++) free(gd->amaze_buffer[k]);
+  free(gd->amaze_buffer);
+  dt_pthread_mutex_destroy(&gd->amaze_lock);
   free(module->data);
   module->data = NULL;
 }
@@ -22,6 +22,8 @@
 #include "develop/tiling.h"
 #include "bauhaus/bauhaus.h"
 #include "control/control.h"
+#include "common/memory_budget.h"
+#include "common/nlmeans.h"
 #include "common/noiseprofiles.h"
 #include "common/opencl.h"
 #include "gui/accelerators.h"
@@ -40,6 +42,9 @@
 #define MODE_NLMEANS 0
 #define MODE_WAVELETS 1
 
+#define MAX_MAX_SCALE 5   // hard limit on the number of wavelet scales
+#define WAVELET_BAND 32   // rows of the input preconditioned at once for the finest scale
+
 // this is the version of the modules parameters,
 // and includes version information about compile-time dt
 DT_MODULE(3)
@@ -65,7 +70,20 @@ typedef struct dt_iop_denoiseprofile_gui_data_t
 }
 dt_iop_denoiseprofile_gui_data_t;
 
-typedef dt_iop_denoiseprofile_params_t dt_iop_denoiseprofile_data_t;
+typedef struct dt_iop_denoiseprofile_data_t
+{
+  float radius;      // search radius
+  float strength;    // noise level after equalization
+  float a[3], b[3];  // fit for poissonian-gaussian noise per color channel.
+  uint32_t mode;     // switch between nlmeans and wavelets
+  // wavelet buffers, kept between runs of the pipe: one detail buffer per scale and
+  // one for the coarse image, each buf_size pixels.
+  float *buf[MAX_MAX_SCALE];
+  float *tmp;
+  size_t buf_size;
+  size_t charged;    // bytes of them accounted in the memory budget
+}
+dt_iop_denoiseprofile_data_t;
 
 typedef struct dt_iop_denoiseprofile_global_data_t
 {
@@ -162,7 +180,7 @@ fast_mexp2f(const float x)
 
 void tiling_callback  (struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out, struct dt_develop_tiling_t *tiling)
 {
-  dt_iop_denoiseprofile_params_t *d = (dt_iop_denoiseprofile_params_t *)piece->data;
+  dt_iop_denoiseprofile_data_t *d = (dt_iop_denoiseprofile_data_t *)piece->data;
 
   if(d->mode == MODE_NLMEANS)
   {
@@ -178,7 +196,7 @@ void tiling_callback  (struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop
   }
   else
   {
-    const int max_max_scale = 5; // hard limit
+    const int max_max_scale = MAX_MAX_SCALE;
     int max_scale = 0;
     const float scale = roi_in->scale/piece->iscale;
     // largest desired filter on input buffer (20% of input dim)
@@ -209,6 +227,29 @@ void tiling_callback  (struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop
   return;
 }
 
+// generalized anscombe transform of one row, maps the noise to unit variance
+static inline void
+precondition_row(
+  const float *in,
+  float *buf,
+  const int wd,
+  const float a[3],
+  const float sigma2[3])
+{
+  for(int i=0; i<wd; i++)
+  {
+    for(int c=0; c<3; c++)
+    {
+      buf[c] = in[c] / a[c];
+      const float d = fmaxf(0.0f, buf[c] + 3./8. + sigma2[c]);
+      buf[c] = 2.0f*sqrtf(d);
+    }
+    buf[3] = in[3];
+    buf += 4;
+    in += 4;
+  }
+}
+
 static inline void
 precondition(
   const float *const in,
@@ -229,20 +270,25 @@ precondition(
   #  pragma omp parallel for schedule(static) default(none) shared(a)
 #endif
   for(int j=0; j<ht; j++)
+    precondition_row(in + (size_t)4*j*wd, buf + (size_t)4*j*wd, wd, a, sigma2);
+}
+
+static inline void
+backtransform_pixel(
+  float *const buf2,
+  const float a[3],
+  const float sigma2[3])
+{
+  for(int c=0; c<3; c++)
   {
-    float *buf2 = buf + 4*j*wd;
-    const float *in2 = in + 4*j*wd;
-    for(int i=0; i<wd; i++)
-    {
-      for(int c=0; c<3; c++)
-      {
-        buf2[c] = in2[c] / a[c];
-        const float d = fmaxf(0.0f, buf2[c] + 3./8. + sigma2[c]);
-        buf2[c] = 2.0f*sqrtf(d);
-      }
-      buf2 += 4;
-      in2 += 4;
-    }
+    const float x = buf2[c];
+    // closed form approximation to unbiased inverse (input range was 0..200 for fit, not 0..1)
+    if(x < .5f) buf2[c] = 0.0f;
+    else
+      buf2[c] = 1./4.*x*x + 1./4.*sqrtf(3./2.)/x - 11./8.*1.0/(x*x) + 5./8.*sqrtf(3./2.)*1.0/(x*x*x) - 1./8. - sigma2[c];
+    // asymptotic form:
+    // buf2[c] = fmaxf(0.0f, 1./4.*x*x - 1./8. - sigma2[c]);
+    buf2[c] *= a[c];
   }
 }
 
@@ -266,20 +312,10 @@ backtransform(
 #endif
   for(int j=0; j<ht; j++)
   {
-    float *buf2 = buf + 4*j*wd;
+    float *buf2 = buf + (size_t)4*j*wd;
     for(int i=0; i<wd; i++)
     {
-      for(int c=0; c<3; c++)
-      {
-        const float x = buf2[c];
-        // closed form approximation to unbiased inverse (input range was 0..200 for fit, not 0..1)
-        if(x < .5f) buf2[c] = 0.0f;
-        else
-          buf2[c] = 1./4.*x*x + 1./4.*sqrtf(3./2.)/x - 11./8.*1.0/(x*x) + 5./8.*sqrtf(3./2.)*1.0/(x*x*x) - 1./8. - sigma2[c];
-        // asymptotic form:
-        // buf2[c] = fmaxf(0.0f, 1./4.*x*x - 1./8. - sigma2[c]);
-        buf2[c] *= a[c];
-      }
+      backtransform_pixel(buf2, a, sigma2);
       buf2 += 4;
     }
   }
@@ -327,16 +363,16 @@ weight_sse(const __m128 *c1, const __m128 *c2, const float inv_sigma2)
     if(y < 0)       y = 0; \
     if(y >= height) y = height - 1; \
     \
-    px2 = ((__m128 *)in) + x + y*width; \
+    px2 = ((__m128 *)in) + x + (size_t)(y - in_y0)*width; \
     \
     SUM_PIXEL_CONTRIBUTION_COMMON(ii, jj); \
   } while (0)
 
 #define ROW_PROLOGUE \
-  const __m128 *px = ((__m128 *)in) + j*width; \
+  const __m128 *px = ((__m128 *)in) + (size_t)(j - in_y0)*width; \
   const __m128 *px2; \
-  float *pdetail = detail + 4*j*width; \
-  float *pcoarse = out + 4*j*width;
+  float *pdetail = detail + (size_t)4*j*width; \
+  float *pcoarse = out + (size_t)4*j*width;
 
 #define SUM_PIXEL_PROLOGUE \
   __m128 sum = _mm_setzero_ps(); \
@@ -345,28 +381,31 @@ weight_sse(const __m128 *c1, const __m128 *c2, const float inv_sigma2)
 #define SUM_PIXEL_EPILOGUE \
   sum = _mm_div_ps(sum, wgt); \
   \
-  _mm_stream_ps(pdetail, _mm_sub_ps(*px, sum)); \
+  const __m128 dd = _mm_sub_ps(*px, sum); \
+  sum2 = _mm_add_ps(sum2, _mm_mul_ps(dd, dd)); \
+  _mm_stream_ps(pdetail, dd); \
   _mm_stream_ps(pcoarse, sum); \
   px++; \
   pdetail+=4; \
   pcoarse+=4;
 
-static void
-eaw_decompose (float *const out, const float *const in, float *const detail, const int scale,
-               const float inv_sigma2, const int32_t width, const int32_t height)
+// decomposes row j. in holds the image from row in_y0 on, which allows to work on
+// a band of it. returns the sum of the squared details of the row.
+static inline __m128
+eaw_decompose_row (float *const out, const float *const in, const int in_y0, float *const detail,
+                   const int scale, const float inv_sigma2, const int32_t width, const int32_t height,
+                   const int j)
 {
   const int mult = 1<<scale;
   static const float filter[5] = {1.0f/16.0f, 4.0f/16.0f, 6.0f/16.0f, 4.0f/16.0f, 1.0f/16.0f};
+  __m128 sum2 = _mm_setzero_ps();
+
+  ROW_PROLOGUE
 
-  /* The first "2*mult" lines use the macro with tests because the 5x5 kernel
+  /* The first and last "2*mult" lines use the macro with tests because the 5x5 kernel
    * requires nearest pixel interpolation for at least a pixel in the sum */
-#ifdef _OPENMP
-  #pragma omp parallel for default(none) schedule(static)
-#endif
-  for (int j=0; j<2*mult; j++)
+  if(j < 2*mult || j >= height-2*mult)
   {
-    ROW_PROLOGUE
-
     for(int i=0; i<width; i++)
     {
       SUM_PIXEL_PROLOGUE
@@ -379,130 +418,204 @@ eaw_decompose (float *const out, const float *const in, float *const detail, con
       }
       SUM_PIXEL_EPILOGUE
     }
+    return sum2;
   }
 
-#ifdef _OPENMP
-  #pragma omp parallel for default(none) schedule(static)
-#endif
-  for(int j=2*mult; j<height-2*mult; j++)
+  /* The first "2*mult" pixels use the macro with tests because the 5x5 kernel
+   * requires nearest pixel interpolation for at least a pixel in the sum */
+  const int i0 = MIN(2*mult, width), i1 = MAX(i0, width-2*mult);
+  for (int i=0; i<i0; i++)
   {
-    ROW_PROLOGUE
-
-    /* The first "2*mult" pixels use the macro with tests because the 5x5 kernel
-     * requires nearest pixel interpolation for at least a pixel in the sum */
-    for (int i=0; i<2*mult; i++)
+    SUM_PIXEL_PROLOGUE
+    for (int jj=0; jj<5; jj++)
     {
-      SUM_PIXEL_PROLOGUE
-      for (int jj=0; jj<5; jj++)
+      for (int ii=0; ii<5; ii++)
       {
-        for (int ii=0; ii<5; ii++)
-        {
-          SUM_PIXEL_CONTRIBUTION_WITH_TEST(ii, jj);
-        }
+        SUM_PIXEL_CONTRIBUTION_WITH_TEST(ii, jj);
       }
-      SUM_PIXEL_EPILOGUE
     }
+    SUM_PIXEL_EPILOGUE
+  }
 
-    /* For pixels [2*mult, width-2*mult], we can safely use macro w/o tests
-     * to avoid unneeded branching in the inner loops */
-    for(int i=2*mult; i<width-2*mult; i++)
+  /* For pixels [2*mult, width-2*mult], we can safely use macro w/o tests
+   * to avoid unneeded branching in the inner loops */
+  for(int i=i0; i<i1; i++)
+  {
+    SUM_PIXEL_PROLOGUE
+    px2 = ((__m128*)in) + i-2*mult + (size_t)(j-2*mult-in_y0)*width;
+    for (int jj=0; jj<5; jj++)
     {
-      SUM_PIXEL_PROLOGUE
-      px2 = ((__m128*)in) + i-2*mult + (j-2*mult)*width;
-      for (int jj=0; jj<5; jj++)
+      for (int ii=0; ii<5; ii++)
       {
-        for (int ii=0; ii<5; ii++)
-        {
-          SUM_PIXEL_CONTRIBUTION_COMMON(ii, jj);
-          px2 += mult;
-        }
-        px2 += (width-5)*mult;
+        SUM_PIXEL_CONTRIBUTION_COMMON(ii, jj);
+        px2 += mult;
       }
-      SUM_PIXEL_EPILOGUE
+      px2 += (width-5)*mult;
     }
+    SUM_PIXEL_EPILOGUE
+  }
 
-    /* Last two pixels in the row require a slow variant... blablabla */
-    for (int i=width-2*mult; i<width; i++)
+  /* Last two pixels in the row require a slow variant... blablabla */
+  for (int i=i1; i<width; i++)
+  {
+    SUM_PIXEL_PROLOGUE
+    for (int jj=0; jj<5; jj++)
     {
-      SUM_PIXEL_PROLOGUE
-      for (int jj=0; jj<5; jj++)
+      for (int ii=0; ii<5; ii++)
       {
-        for (int ii=0; ii<5; ii++)
-        {
-          SUM_PIXEL_CONTRIBUTION_WITH_TEST(ii, jj);
-        }
+        SUM_PIXEL_CONTRIBUTION_WITH_TEST(ii, jj);
       }
-      SUM_PIXEL_EPILOGUE
     }
+    SUM_PIXEL_EPILOGUE
   }
+  return sum2;
+}
 
-  /* The last "2*mult" lines use the macro with tests because the 5x5 kernel
-   * requires nearest pixel interpolation for at least a pixel in the sum */
+#undef SUM_PIXEL_CONTRIBUTION_COMMON
+#undef SUM_PIXEL_CONTRIBUTION_WITH_TEST
+#undef ROW_PROLOGUE
+#undef SUM_PIXEL_PROLOGUE
+#undef SUM_PIXEL_EPILOGUE
+
+// decomposes one scale, the squared details per channel end up in sum_y2 for the thresholds
+static void
+eaw_decompose (float *const out, const float *const in, float *const detail, const int scale,
+               const float inv_sigma2, const int32_t width, const int32_t height, float *const sum_y2)
+{
+  float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f;
 #ifdef _OPENMP
-  #pragma omp parallel for default(none) schedule(static)
+  #pragma omp parallel for default(none) schedule(static) reduction(+:s0,s1,s2)
 #endif
-  for (int j=height-2*mult; j<height; j++)
+  for(int j=0; j<height; j++)
   {
-    ROW_PROLOGUE
+    const __m128 s = eaw_decompose_row(out, in, 0, detail, scale, inv_sigma2, width, height, j);
+    const float *fs = (const float *)&s;
+    s0 += fs[0];
+    s1 += fs[1];
+    s2 += fs[2];
+  }
+  _mm_sfence();
+  sum_y2[0] = s0;
+  sum_y2[1] = s1;
+  sum_y2[2] = s2;
+}
 
-    for(int i=0; i<width; i++)
+// the finest scale, straight from the input: the variance stabilizing transform is done
+// for a band of rows at a time into a small buffer per thread (strips, WAVELET_BAND+4
+// rows each), the decomposition of the band then finds all it needs in cache.
+static void
+eaw_decompose_precondition (float *const out, const float *const in, float *const detail,
+                            const float inv_sigma2, const int32_t width, const int32_t height,
+                            const float a[3], const float sigma2[3], float *const strips, float *const sum_y2)
+{
+  const int nbands = (height + WAVELET_BAND - 1)/WAVELET_BAND;
+  float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f;
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) schedule(dynamic) shared(a, sigma2) reduction(+:s0,s1,s2)
+#endif
+  for(int band=0; band<nbands; band++)
+  {
+    const int j0 = band*WAVELET_BAND, j1 = MIN(height, j0 + WAVELET_BAND);
+    // the 5x5 kernel of the finest scale reaches two rows up and down
+    const int y0 = MAX(0, j0 - 2), y1 = MIN(height, j1 + 2);
+    float *strip = strips + (size_t)4*width*(WAVELET_BAND+4)*dt_get_thread_num();
+    for(int y=y0; y<y1; y++)
+      precondition_row(in + (size_t)4*width*y, strip + (size_t)4*width*(y-y0), width, a, sigma2);
+    for(int j=j0; j<j1; j++)
     {
-      SUM_PIXEL_PROLOGUE
-      for (int jj=0; jj<5; jj++)
-      {
-        for (int ii=0; ii<5; ii++)
-        {
-          SUM_PIXEL_CONTRIBUTION_WITH_TEST(ii, jj);
-        }
-      }
-      SUM_PIXEL_EPILOGUE
+      const __m128 s = eaw_decompose_row(out, strip, y0, detail, 0, inv_sigma2, width, height, j);
+      const float *fs = (const float *)&s;
+      s0 += fs[0];
+      s1 += fs[1];
+      s2 += fs[2];
     }
   }
-
   _mm_sfence();
+  sum_y2[0] = s0;
+  sum_y2[1] = s1;
+  sum_y2[2] = s2;
 }
 
-#undef SUM_PIXEL_CONTRIBUTION_COMMON
-#undef SUM_PIXEL_CONTRIBUTION_WITH_TEST
-#undef ROW_PROLOGUE
-#undef SUM_PIXEL_PROLOGUE
-#undef SUM_PIXEL_EPILOGUE
+// determine the threshold of one scale as bayesshrink, from the sum of its squared details
+static inline __m128
+eaw_threshold (const float *const sum_y2, const int n, const int scale)
+{
+  // variance stabilizing transform maps sigma to unity.
+  const float sigma = 1.0f;
+  // it is then transformed by wavelet scales via the 5 tap a-trous filter:
+  const float varf = sqrtf(2.0f + 2.0f * 4.0f*4.0f + 6.0f*6.0f)/16.0f; // about 0.5
+  const float sigma_band = powf(varf, scale) *sigma;
+  const float sb2 = sigma_band*sigma_band;
+  const float var_y[3] =
+  {
+    sum_y2[0]/(n-1.0f),
+    sum_y2[1]/(n-1.0f),
+    sum_y2[2]/(n-1.0f)
+  };
+  const float std_x[3] =
+  {
+    sqrtf(MAX(1e-6f, var_y[0] - sb2)),
+    sqrtf(MAX(1e-6f, var_y[1] - sb2)),
+    sqrtf(MAX(1e-6f, var_y[2] - sb2))
+  };
+  // add 8.0 here because it seemed a little weak
+  const float adjt = 8.0f;
+  // fprintf(stderr, "scale %d thrs %f %f %f = %f / %f %f %f \n", scale, adjt*sb2/std_x[0], adjt*sb2/std_x[1], adjt*sb2/std_x[2], sb2, std_x[0], std_x[1], std_x[2]);
+  return _mm_set_ps(0.0f, adjt * sb2/std_x[2], adjt * sb2/std_x[1], adjt * sb2/std_x[0]);
+}
 
+// synthesizes all scales at once: the shrunk details are added to the coarse image,
+// coarsest scale first, and the variance stabilizing transform is undone right away.
+// out may be the same buffer as coarse.
 static void
-eaw_synthesize (float *const out, const float *const in, const float *const detail,
-                const float *thrsf, const float *boostf, const int32_t width, const int32_t height)
+eaw_synthesize_backtransform (float *const out, const float *const coarse, float *const *const detail,
+                              const __m128 *const thrs, const int max_scale, const int32_t width,
+                              const int32_t height, const float a[3], const float sigma2[3])
 {
-  const __m128 threshold = _mm_set_ps(thrsf[3], thrsf[2], thrsf[1], thrsf[0]);
-  const __m128 boost     = _mm_set_ps(boostf[3], boostf[2], boostf[1], boostf[0]);
-
 #ifdef _OPENMP
-  #pragma omp parallel for default(none) schedule(static)
+  #pragma omp parallel for default(none) schedule(static) shared(a, sigma2)
 #endif
   for(int j=0; j<height; j++)
   {
-    // TODO: prefetch? _mm_prefetch()
-    const __m128 *pin = (__m128 *)in + j*width;
-    __m128 *pdetail = (__m128 *)detail + j*width;
-    float *pout = out + 4*j*width;
+    const __m128 mask = _mm_castsi128_ps(_mm_set1_epi32(0x80000000u));
+    const size_t offs = (size_t)4*j*width;
+    const float *pin = coarse + offs;
+    float *pout = out + offs;
     for(int i=0; i<width; i++)
     {
-#if 1
-      const __m128i maski = _mm_set1_epi32(0x80000000u);
-      const __m128 *mask = (__m128*)&maski;
-      const __m128 absamt = _mm_max_ps(_mm_setzero_ps(), _mm_sub_ps(_mm_andnot_ps(*mask, *pdetail), threshold));
-      const __m128 amount = _mm_or_ps(_mm_and_ps(*pdetail, *mask), absamt);
-      _mm_stream_ps(pout, _mm_add_ps(*pin, _mm_mul_ps(boost, amount)));
-#endif
-      // _mm_stream_ps(pout, _mm_add_ps(*pin, *pdetail));
-      pdetail ++;
-      pin ++;
+      __m128 sum = _mm_load_ps(pin);
+      for(int scale=max_scale-1; scale>=0; scale--)
+      {
+        const __m128 pdetail = _mm_load_ps(detail[scale] + offs + 4*i);
+        const __m128 absamt = _mm_max_ps(_mm_setzero_ps(), _mm_sub_ps(_mm_andnot_ps(mask, pdetail), thrs[scale]));
+        const __m128 amount = _mm_or_ps(_mm_and_ps(pdetail, mask), absamt);
+        sum = _mm_add_ps(sum, amount);
+      }
+      _mm_store_ps(pout, sum);
+      backtransform_pixel(pout, a, sigma2);
+      pin += 4;
       pout += 4;
     }
   }
-  _mm_sfence();
 }
 // =====================================================================================
 
+// give the wavelet buffers back, to the system and to the memory budget
+static void
+free_wavelet_buffers(dt_iop_denoiseprofile_data_t *d, const dt_dev_pixelpipe_t *pipe)
+{
+  for(int k=0; k<MAX_MAX_SCALE; k++)
+  {
+    free(d->buf[k]);
+    d->buf[k] = NULL;
+  }
+  free(d->tmp);
+  d->tmp = NULL;
+  d->buf_size = 0;
+  dt_memory_budget_release(DT_MEMORY_SCRATCH, dt_dev_pixelpipe_memory_priority(pipe), d->charged);
+  d->charged = 0;
+}
+
 void process_wavelets(
   struct dt_iop_module_t *self,
   dt_dev_pixelpipe_iop_t *piece,
@@ -513,9 +626,9 @@ void process_wavelets(
 {
   // this is called for preview and full pipe separately, each with its own pixelpipe piece.
   // get our data struct:
-  dt_iop_denoiseprofile_params_t *d = (dt_iop_denoiseprofile_params_t *)piece->data;
+  dt_iop_denoiseprofile_data_t *d = (dt_iop_denoiseprofile_data_t *)piece->data;
 
-  const int max_max_scale = 5; // hard limit
+  const int max_max_scale = MAX_MAX_SCALE;
   int max_scale = 0;
   const float scale = roi_in->scale/piece->iscale;
   // largest desired filter on input buffer (20% of input dim)
@@ -533,12 +646,43 @@ void process_wavelets(
     if(t < 0.0f) break;
   }
 
-  float *buf[max_max_scale];
-  float *tmp = NULL;
-  float *buf1 = NULL, *buf2 = NULL;
+  const int width = roi_in->width, height = roi_in->height;
+  const size_t npixels = (size_t)width*height;
+
+  // the detail and coarse buffers stay with the piece, so tweaking the sliders
+  // doesn't allocate and fault in all of them again. they are dropped when the
+  // roi grows or shrinks to less than half.
+  if(d->buf_size < npixels || d->buf_size > 2*npixels)
+  {
+    free_wavelet_buffers(d, piece->pipe);
+    d->buf_size = npixels;
+  }
+  const size_t buf_bytes = 4*sizeof(float)*d->buf_size;
+  const dt_memory_priority_t priority = dt_dev_pixelpipe_memory_priority(piece->pipe);
+  float *strips = NULL;
   for(int k=0; k<max_scale; k++)
-    buf[k] = dt_alloc_align(64, 4*sizeof(float)*roi_in->width*roi_in->height);
-  tmp = dt_alloc_align(64, 4*sizeof(float)*roi_in->width*roi_in->height);
+  {
+    if(d->buf[k]) continue;
+    d->buf[k] = dt_alloc_align(64, buf_bytes);
+    if(!d->buf[k])
+    {
+      fprintf(stderr, "[denoiseprofile] failed to allocate one of the detail buffers!\n");
+      goto error;
+    }
+    dt_memory_budget_charge(DT_MEMORY_SCRATCH, priority, buf_bytes);
+    d->charged += buf_bytes;
+  }
+  if(!d->tmp && (d->tmp = dt_alloc_align(64, buf_bytes)))
+  {
+    dt_memory_budget_charge(DT_MEMORY_SCRATCH, priority, buf_bytes);
+    d->charged += buf_bytes;
+  }
+  strips = dt_alloc_align(64, 4*sizeof(float)*width*(WAVELET_BAND+4)*dt_get_num_threads());
+  if(!d->tmp || !strips)
+  {
+    fprintf(stderr, "[denoiseprofile] failed to allocate coarse buffer!\n");
+    goto error;
+  }
 
   const float wb[3] =
   {
@@ -560,31 +704,33 @@ void process_wavelets(
     d->b[1]*wb[1],
     d->b[1]*wb[2]
   };
-
-  const int width = roi_in->width, height = roi_in->height;
-  precondition((float *)ivoid, (float *)ovoid, width, height, aa, bb);
-# if 0 // DEBUG: see what variance we have after transform
-  if(piece->pipe->type != DT_DEV_PIXELPIPE_PREVIEW)
+  const float sigma2[3] =
   {
-    const int n = width*height;
-    FILE *f = fopen("/tmp/transformed.pfm", "wb");
-    fprintf(f, "PF\n%d %d\n-1.0\n", width, height);
-    for(int k=0; k<n; k++)
-      fwrite(((float*)ovoid)+4*k, sizeof(float), 3, f);
-    fclose(f);
-  }
-#endif
-  buf1 = (float *)ovoid;
-  buf2 = tmp;
+    (bb[0]/aa[0])*(bb[0]/aa[0]),
+    (bb[1]/aa[1])*(bb[1]/aa[1]),
+    (bb[2]/aa[1])*(bb[2]/aa[1])
+  };
+
+  float sum_y2[MAX_MAX_SCALE][3];
+  float *buf1 = (float *)ovoid;
+  float *buf2 = d->tmp;
+
+  if(max_scale == 0)
+    precondition((float *)ivoid, (float *)ovoid, width, height, aa, bb);
 
   for(int scale=0; scale<max_scale; scale++)
   {
+    // the pipe changed, don't bother finishing this one
+    if(dt_dev_pixelpipe_cancelled(piece->pipe)) goto cleanup;
     const float sigma = 1.0f;
     const float varf = sqrtf(2.0f + 2.0f * 4.0f*4.0f + 6.0f*6.0f)/16.0f; // about 0.5
     const float sigma_band = powf(varf, scale) *sigma;
-    eaw_decompose (buf2, buf1, buf[scale], scale, 1.0f/(sigma_band*sigma_band), width, height);
-    // DEBUG: clean out temporary memory:
-    // memset(buf1, 0, sizeof(float)*4*width*height);
+    // the finest scale does the variance stabilizing transform on the way
+    if(scale == 0)
+      eaw_decompose_precondition (buf2, (float *)ivoid, d->buf[0], 1.0f/(sigma_band*sigma_band), width, height,
+                                  aa, sigma2, strips, sum_y2[0]);
+    else
+      eaw_decompose (buf2, buf1, d->buf[scale], scale, 1.0f/(sigma_band*sigma_band), width, height, sum_y2[scale]);
 # if 0 // DEBUG: print wavelet scales:
     if(piece->pipe->type != DT_DEV_PIXELPIPE_PREVIEW)
     {
@@ -600,7 +746,7 @@ void process_wavelets(
       f = fopen(filename, "wb");
       fprintf(f, "PF\n%d %d\n-1.0\n", width, height);
       for(int k=0; k<n; k++)
-        fwrite(buf[scale]+4*k, sizeof(float), 3, f);
+        fwrite(d->buf[scale]+4*k, sizeof(float), 3, f);
       fclose(f);
     }
 #endif
@@ -609,62 +755,24 @@ void process_wavelets(
     buf1 = buf3;
   }
 
-  // now do everything backwards, so the result will end up in *ovoid
-  for(int scale=max_scale-1; scale>=0; scale--)
-  {
-#if 1
-    // variance stabilizing transform maps sigma to unity.
-    const float sigma = 1.0f;
-    // it is then transformed by wavelet scales via the 5 tap a-trous filter:
-    const float varf = sqrtf(2.0f + 2.0f * 4.0f*4.0f + 6.0f*6.0f)/16.0f; // about 0.5
-    const float sigma_band = powf(varf, scale) *sigma;
-    // determine thrs as bayesshrink
-    // TODO: parallelize!
-    float sum_y2[3] = {0.0f};
-    const int n = width*height;
-    for(int k=0; k<n; k++)
-      for(int c=0; c<3; c++)
-        sum_y2[c] += buf[scale][4*k+c]*buf[scale][4*k+c];
-
-    const float sb2 = sigma_band*sigma_band;
-    const float var_y[3] =
-    {
-      sum_y2[0]/(n-1.0f),
-      sum_y2[1]/(n-1.0f),
-      sum_y2[2]/(n-1.0f)
-    };
-    const float std_x[3] =
-    {
-      sqrtf(MAX(1e-6f, var_y[0] - sb2)),
-      sqrtf(MAX(1e-6f, var_y[1] - sb2)),
-      sqrtf(MAX(1e-6f, var_y[2] - sb2))
-    };
-    // add 8.0 here because it seemed a little weak
-    const float adjt = 8.0f;
-    const float thrs[4] = { adjt * sb2/std_x[0], adjt * sb2/std_x[1], adjt * sb2/std_x[2], 0.0f};
-    // const float std = (std_x[0] + std_x[1] + std_x[2])/3.0f;
-    // const float thrs[4] = { adjt*sigma*sigma/std, adjt*sigma*sigma/std, adjt*sigma*sigma/std, 0.0f};
-    // fprintf(stderr, "scale %d thrs %f %f %f = %f / %f %f %f \n", scale, thrs[0], thrs[1], thrs[2], sb2, std_x[0], std_x[1], std_x[2]);
-#endif
-    const float boost[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
-    // const float thrs[4] = { 0.0, 0.0, 0.0, 0.0 };
-    eaw_synthesize (buf2, buf1, buf[scale], thrs, boost, width, height);
-    // DEBUG: clean out temporary memory:
-    // memset(buf1, 0, sizeof(float)*4*width*height);
+  if(dt_dev_pixelpipe_cancelled(piece->pipe)) goto cleanup;
 
-    float *buf3 = buf2;
-    buf2 = buf1;
-    buf1 = buf3;
-  }
-
-  backtransform((float *)ovoid, width, height, aa, bb);
+  // now do everything backwards, so the result will end up in *ovoid
+  __m128 thrs[MAX_MAX_SCALE];
+  for(int scale=0; scale<max_scale; scale++)
+    thrs[scale] = eaw_threshold(sum_y2[scale], width*height, scale);
+  eaw_synthesize_backtransform ((float *)ovoid, buf1, d->buf, thrs, max_scale, width, height, aa, sigma2);
 
-  for(int k=0; k<max_scale; k++)
-    free(buf[k]);
-  free(tmp);
+cleanup:
+  free(strips);
 
   if(piece->pipe->mask_display)
     dt_iop_alpha_copy(ivoid, ovoid, width, height);
+  return;
+
+error:
+  free(strips);
+  memcpy(ovoid, ivoid, sizeof(float)*4*npixels);
 }
 
 void process_nlmeans(
@@ -677,7 +785,7 @@ void process_nlmeans(
 {
   // this is called for preview and full pipe separately, each with its own pixelpipe piece.
   // get our data struct:
-  dt_iop_denoiseprofile_params_t *d = (dt_iop_denoiseprofile_params_t *)piece->data;
+  dt_iop_denoiseprofile_data_t *d = (dt_iop_denoiseprofile_data_t *)piece->data;
 
   // TODO: fixed K to use adaptive size trading variance and bias!
   // adjust to zoom size:
@@ -687,9 +795,6 @@ void process_nlmeans(
 
   // P == 0 : this will degenerate to a (fast) bilateral filter.
 
-  float *Sa = dt_alloc_align(64, sizeof(float)*roi_out->width*dt_get_num_threads());
-  // we want to sum up weights in col[3], so need to init to 0:
-  memset(ovoid, 0x0, sizeof(float)*roi_out->width*roi_out->height*4);
   float *in = dt_alloc_align(64, 4*sizeof(float)*roi_in->width*roi_in->height);
 
   const float wb[3] =
@@ -712,151 +817,19 @@ void process_nlmeans(
   };
   precondition((float *)ivoid, in, roi_in->width, roi_in->height, aa, bb);
 
-  // for each shift vector
-  for(int kj=-K; kj<=K; kj++)
+  // weighted sums of all shifted pixels, weights in col[3].
+  // the distance is scaled and offset to bring it into a computable range.
+  const dt_nlmeans_param_t params =
   {
-    for(int ki=-K; ki<=K; ki++)
-    {
-      // TODO: adaptive K tests here!
-      // TODO: expf eval for real bilateral experience :)
-
-      int inited_slide = 0;
-      // don't construct summed area tables but use sliding window! (applies to cpu version res < 1k only, or else we will add up errors)
-      // do this in parallel with a little threading overhead. could parallelize the outer loops with a bit more memory
-#ifdef _OPENMP
-      #  pragma omp parallel for schedule(static) default(none) firstprivate(inited_slide) shared(kj, ki, roi_out, roi_in, in, ovoid, Sa)
-#endif
-      for(int j=0; j<roi_out->height; j++)
-      {
-        if(j+kj < 0 || j+kj >= roi_out->height) continue;
-        float *S = Sa + dt_get_thread_num() * roi_out->width;
-        const float *ins = in + 4*(roi_in->width *(j+kj) + ki);
-        float *out = ((float *)ovoid) + 4*roi_out->width*j;
-
-        const int Pm = MIN(MIN(P, j+kj), j);
-        const int PM = MIN(MIN(P, roi_out->height-1-j-kj), roi_out->height-1-j);
-        // first line of every thread
-        // TODO: also every once in a while to assert numerical precision!
-        if(!inited_slide)
-        {
-          // sum up a line
-          memset(S, 0x0, sizeof(float)*roi_out->width);
-          for(int jj=-Pm; jj<=PM; jj++)
-          {
-            int i = MAX(0, -ki);
-            float *s = S + i;
-            const float *inp  = in + 4*i + 4* roi_in->width *(j+jj);
-            const float *inps = in + 4*i + 4*(roi_in->width *(j+jj+kj) + ki);
-            const int last = roi_out->width + MIN(0, -ki);
-            for(; i<last; i++, inp+=4, inps+=4, s++)
-            {
-              for(int k=0; k<3; k++)
-                s[0] += (inp[k] - inps[k])*(inp[k] - inps[k]);
-            }
-          }
-          // only reuse this if we had a full stripe
-          if(Pm == P && PM == P) inited_slide = 1;
-        }
+    .patch_radius = P,
+    .search_radius = K,
+    .norm = { 1.0f, 1.0f, 1.0f, 0.0f },
+    .scale = .015f/(2*P+1),
+    .offset = 2.0f,
+    .pipe = piece->pipe
+  };
+  dt_nlmeans_accumulate(in, (float *)ovoid, roi_out->width, roi_out->height, &params);
 
-        // sliding window for this line:
-        float *s = S;
-        float slide = 0.0f;
-        // sum up the first -P..P
-        for(int i=0; i<2*P+1; i++) slide += s[i];
-        for(int i=0; i<roi_out->width; i++)
-        {
-          // FIXME: the comment above is actually relevant even for 1000 px width already.
-          // XXX    numerical precision will not forgive us:
-          if(i-P > 0 && i+P<roi_out->width)
-            slide += s[P] - s[-P-1];
-          if(i+ki >= 0 && i+ki < roi_out->width)
-          {
-            // TODO: could put that outside the loop.
-            // DEBUG XXX bring back to computable range:
-            const float norm = .015f/(2*P+1);
-            const __m128 iv = { ins[0], ins[1], ins[2], 1.0f };
-            _mm_store_ps(out, _mm_load_ps(out) + iv * _mm_set1_ps(fast_mexp2f(fmaxf(0.0f, slide*norm-2.0f))));
-            // _mm_store_ps(out, _mm_load_ps(out) + iv * _mm_set1_ps(fast_mexp2f(fmaxf(0.0f, slide*norm))));
-          }
-          s   ++;
-          ins += 4;
-          out += 4;
-        }
-        if(inited_slide && j+P+1+MAX(0,kj) < roi_out->height)
-        {
-          // sliding window in j direction:
-          int i = MAX(0, -ki);
-          float *s = S + i;
-          const float *inp  = in + 4*i + 4* roi_in->width *(j+P+1);
-          const float *inps = in + 4*i + 4*(roi_in->width *(j+P+1+kj) + ki);
-          const float *inm  = in + 4*i + 4* roi_in->width *(j-P);
-          const float *inms = in + 4*i + 4*(roi_in->width *(j-P+kj) + ki);
-          const int last = roi_out->width + MIN(0, -ki);
-          for(; ((unsigned long)s & 0xf) != 0 && i<last; i++, inp+=4, inps+=4, inm+=4, inms+=4, s++)
-          {
-            float stmp = s[0];
-            for(int k=0; k<3; k++)
-              stmp += ((inp[k] - inps[k])*(inp[k] - inps[k])
-                       -  (inm[k] - inms[k])*(inm[k] - inms[k]));
-            s[0] = stmp;
-          }
-          /* Process most of the line 4 pixels at a time */
-          for(; i<last-4; i+=4, inp+=16, inps+=16, inm+=16, inms+=16, s+=4)
-          {
-            __m128 sv = _mm_load_ps(s);
-            const __m128 inp1 = _mm_load_ps(inp)    - _mm_load_ps(inps);
-            const __m128 inp2 = _mm_load_ps(inp+4)  - _mm_load_ps(inps+4);
-            const __m128 inp3 = _mm_load_ps(inp+8)  - _mm_load_ps(inps+8);
-            const __m128 inp4 = _mm_load_ps(inp+12) - _mm_load_ps(inps+12);
-
-            const __m128 inp12lo = _mm_unpacklo_ps(inp1,inp2);
-            const __m128 inp34lo = _mm_unpacklo_ps(inp3,inp4);
-            const __m128 inp12hi = _mm_unpackhi_ps(inp1,inp2);
-            const __m128 inp34hi = _mm_unpackhi_ps(inp3,inp4);
-
-            const __m128 inpv0 = _mm_movelh_ps(inp12lo,inp34lo);
-            sv += inpv0*inpv0;
-
-            const __m128 inpv1 = _mm_movehl_ps(inp34lo,inp12lo);
-            sv += inpv1*inpv1;
-
-            const __m128 inpv2 = _mm_movelh_ps(inp12hi,inp34hi);
-            sv += inpv2*inpv2;
-
-            const __m128 inm1 = _mm_load_ps(inm)    - _mm_load_ps(inms);
-            const __m128 inm2 = _mm_load_ps(inm+4)  - _mm_load_ps(inms+4);
-            const __m128 inm3 = _mm_load_ps(inm+8)  - _mm_load_ps(inms+8);
-            const __m128 inm4 = _mm_load_ps(inm+12) - _mm_load_ps(inms+12);
-
-            const __m128 inm12lo = _mm_unpacklo_ps(inm1,inm2);
-            const __m128 inm34lo = _mm_unpacklo_ps(inm3,inm4);
-            const __m128 inm12hi = _mm_unpackhi_ps(inm1,inm2);
-            const __m128 inm34hi = _mm_unpackhi_ps(inm3,inm4);
-
-            const __m128 inmv0 = _mm_movelh_ps(inm12lo,inm34lo);
-            sv -= inmv0*inmv0;
-
-            const __m128 inmv1 = _mm_movehl_ps(inm34lo,inm12lo);
-            sv -= inmv1*inmv1;
-
-            const __m128 inmv2 = _mm_movelh_ps(inm12hi,inm34hi);
-            sv -= inmv2*inmv2;
-
-            _mm_store_ps(s, sv);
-          }
-          for(; i<last; i++, inp+=4, inps+=4, inm+=4, inms+=4, s++)
-          {
-            float stmp = s[0];
-            for(int k=0; k<3; k++)
-              stmp += ((inp[k] - inps[k])*(inp[k] - inps[k])
-                       -  (inm[k] - inms[k])*(inm[k] - inms[k]));
-            s[0] = stmp;
-          }
-        }
-        else inited_slide = 0;
-      }
-    }
-  }
   // normalize
 #ifdef _OPENMP
   #pragma omp parallel for default(none) schedule(static) shared(ovoid,roi_out,d)
@@ -874,7 +847,6 @@ void process_nlmeans(
     }
   }
   // free shared tmp memory:
-  free(Sa);
   free(in);
   backtransform((float *)ovoid, roi_in->width, roi_in->height, aa, bb);
 
@@ -895,7 +867,7 @@ static int bucket_next(unsigned int *state, unsigned int max)
 
 int process_nlmeans_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_mem dev_in, cl_mem dev_out, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out)
 {
-  dt_iop_denoiseprofile_params_t *d = (dt_iop_denoiseprofile_params_t *)piece->data;
+  dt_iop_denoiseprofile_data_t *d = (dt_iop_denoiseprofile_data_t *)piece->data;
   dt_iop_denoiseprofile_global_data_t *gd = (dt_iop_denoiseprofile_global_data_t *)self->data;
 
   const int devid = piece->pipe->devid;
@@ -1111,7 +1083,7 @@ int process_wavelets_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *p
   dt_iop_denoiseprofile_data_t *d = (dt_iop_denoiseprofile_data_t *)piece->data;
   dt_iop_denoiseprofile_global_data_t *gd = (dt_iop_denoiseprofile_global_data_t *)self->data;
 
-  const int max_max_scale = 5; // hard limit
+  const int max_max_scale = MAX_MAX_SCALE;
   int max_scale = 0;
   const float scale = roi_in->scale/piece->iscale;
   // largest desired filter on input buffer (20% of input dim)
@@ -1416,7 +1388,7 @@ error:
 
 int process_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_mem dev_in, cl_mem dev_out, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out)
 {
-  dt_iop_denoiseprofile_params_t *d = (dt_iop_denoiseprofile_params_t *)piece->data;
+  dt_iop_denoiseprofile_data_t *d = (dt_iop_denoiseprofile_data_t *)piece->data;
 
   if(d->mode == MODE_NLMEANS)
   {
@@ -1437,7 +1409,7 @@ void process(
   const dt_iop_roi_t *roi_in,
   const dt_iop_roi_t *roi_out)
 {
-  dt_iop_denoiseprofile_params_t *d = (dt_iop_denoiseprofile_params_t *)piece->data;
+  dt_iop_denoiseprofile_data_t *d = (dt_iop_denoiseprofile_data_t *)piece->data;
   if(d->mode == MODE_NLMEANS)
     process_nlmeans(self, piece, ivoid, ovoid, roi_in, roi_out);
   else
@@ -1601,7 +1573,16 @@ void commit_params (struct dt_iop_module_t *self, dt_iop_params_t *params, dt_de
   dt_iop_denoiseprofile_data_t *d = (dt_iop_denoiseprofile_data_t *)piece->data;
 
   // copy everything first and make some changes later
-  memcpy(d, p, sizeof(*d));
+  d->radius = p->radius;
+  d->strength = p->strength;
+  d->mode = p->mode;
+  // the wavelet buffers are only kept for the next run in wavelet mode
+  if(d->mode != MODE_WAVELETS) free_wavelet_buffers(d, pipe);
+  for(int k=0; k<3; k++)
+  {
+    d->a[k] = p->a[k];
+    d->b[k] = p->b[k];
+  }
 
   // compare if a[0] in params is set to "magic value" -1.0 for autodetection
   if ( p->a[0] == -1.0 )
@@ -1621,11 +1602,18 @@ void commit_params (struct dt_iop_module_t *self, dt_iop_params_t *params, dt_de
 void init_pipe(struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_pixelpipe_iop_t *piece)
 {
   piece->data = malloc(sizeof(dt_iop_denoiseprofile_data_t));
+  dt_iop_denoiseprofile_data_t *d = (dt_iop_denoiseprofile_data_t *)piece->data;
+  for(int k=0; k<MAX_MAX_SCALE; k++) d->buf[k] = NULL;
+  d->tmp = NULL;
+  d->buf_size = 0;
+  d->charged = 0;
   self->commit_params(self, self->default_params, pipe, piece);
 }
 
 void cleanup_pipe(struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_pixelpipe_iop_t *piece)
 {
+  dt_iop_denoiseprofile_data_t *d = (dt_iop_denoiseprofile_data_t *)piece->data;
+  free_wavelet_buffers(d, pipe);
   free(piece->data);
 }
 
@@ -87,7 +87,7 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
   for(int k=1; k<numl_cap; k++)
   {
     const int wd = (int)(1 + (width>>(k-1))), ht = (int)(1 + (height>>(k-1)));
-    tmp[k] = (float *)malloc(sizeof(float)*wd*ht);
+    tmp[k] = (float *)dt_dev_pixelpipe_scratch_alloc(piece->pipe, sizeof(float)*wd*ht);
   }
 
   for(int level=1; level<numl_cap; level++) dt_iop_equalizer_wtf(out, tmp, level, width, height);
@@ -151,7 +151,7 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
   // printf("applied\n");
   for(int level=numl_cap-1; level>0; level--) dt_iop_equalizer_iwtf(out, tmp, level, width, height);
 
-  for(int k=1; k<numl_cap; k++) free(tmp[k]);
+  for(int k=1; k<numl_cap; k++) dt_dev_pixelpipe_scratch_free(piece->pipe, tmp[k]);
   free(tmp);
   // printf("thread %d finished equalizer", (int)pthread_self());
   // if(piece->iscale != 1.0) printf(" for preview\n");
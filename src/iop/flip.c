@@ -178,6 +178,31 @@ int distort_backtransform(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece,
   return 1;
 }
 
+int warp_backtransform(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out, float *points, size_t points_count)
+{
+  if(!points) return 1;
+  dt_iop_flip_data_t *d = (dt_iop_flip_data_t *)piece->data;
+
+  // same as process(), which flips all of roi_in into roi_out
+  const float iw = roi_in->width, ih = roi_in->height;
+  for(size_t k=0; k<3*points_count; k++)
+  {
+    float *p = points + 2*k;
+    float x = p[0], y = p[1];
+    if(d->orientation & 4)
+    {
+      const float t = x;
+      x = y;
+      y = t;
+    }
+    if(d->orientation & 2) y = ih - y - 1.0f;
+    if(d->orientation & 1) x = iw - x - 1.0f;
+    p[0] = x;
+    p[1] = y;
+  }
+  return 1;
+}
+
 // 1st pass: how large would the output be, given this input roi?
 // this is always called with the full buffer before processing.
 void modify_roi_out(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece, dt_iop_roi_t *roi_out, const dt_iop_roi_t *roi_in)
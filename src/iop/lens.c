@@ -136,6 +136,168 @@ _lens_sanitize(const char *orig_lens)
 }
 
 
+// get the distortion map for the current params at image size orig_w x orig_h, compute it if needed.
+// returns NULL if all maps are in use, callers have to ask lensfun directly then.
+static dt_iop_lensfun_map_t *
+_lens_map_get(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, lfModifier *modifier, const float orig_w, const float orig_h)
+{
+  dt_iop_lensfun_global_data_t *gd = (dt_iop_lensfun_global_data_t *)self->data;
+  dt_iop_lensfun_data_t *d = (dt_iop_lensfun_data_t *)piece->data;
+  dt_iop_lensfun_map_t *map = NULL;
+
+  dt_pthread_mutex_lock(&gd->map_lock);
+  gd->map_clock++;
+  for(int k=0; k<DT_IOP_LENSFUN_MAPS; k++)
+  {
+    dt_iop_lensfun_map_t *m = gd->map + k;
+    if(m->grid && m->hash == d->hash && m->width == orig_w && m->height == orig_h)
+    {
+      m->users++;
+      m->used = gd->map_clock;
+      dt_pthread_mutex_unlock(&gd->map_lock);
+      return m;
+    }
+    // replace the least recently used one
+    if(!m->users && (!map || m->used < map->used)) map = m;
+  }
+  if(!map)
+  {
+    dt_pthread_mutex_unlock(&gd->map_lock);
+    return NULL;
+  }
+
+  dt_times_t start;
+  dt_get_times(&start);
+
+  free(map->grid);
+  map->hash = d->hash;
+  map->width = orig_w;
+  map->height = orig_h;
+  map->gw = orig_w/DT_IOP_LENSFUN_MAP_STEP + 2;
+  map->gh = orig_h/DT_IOP_LENSFUN_MAP_STEP + 2;
+  map->grid = (float *)dt_alloc_align(16, sizeof(float)*6*map->gw*map->gh);
+  if(!map->grid)
+  {
+    dt_pthread_mutex_unlock(&gd->map_lock);
+    return NULL;
+  }
+
+  // the map stays locked while it is filled, so other pipes asking for it just wait
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) shared(map, modifier) schedule(static)
+#endif
+  for(int j=0; j<map->gh; j++)
+  {
+    float buf[6];
+    float *node = map->grid + (size_t)6*j*map->gw;
+    for(int i=0; i<map->gw; i++, node+=6)
+    {
+      const float x = i*DT_IOP_LENSFUN_MAP_STEP, y = j*DT_IOP_LENSFUN_MAP_STEP;
+      lf_modifier_apply_subpixel_geometry_distortion(modifier, x, y, 1, 1, buf);
+      node[0] = buf[2] - x;
+      node[1] = buf[3] - y;
+      node[2] = buf[0] - buf[2];
+      node[3] = buf[1] - buf[3];
+      node[4] = buf[4] - buf[2];
+      node[5] = buf[5] - buf[3];
+    }
+  }
+  map->users = 1;
+  map->used = gd->map_clock;
+  dt_show_times(&start, "[lens]", "computing %dx%d distortion map", map->gw, map->gh);
+  dt_pthread_mutex_unlock(&gd->map_lock);
+  return map;
+}
+
+static void
+_lens_map_release(dt_iop_module_t *self, dt_iop_lensfun_map_t *map)
+{
+  if(!map) return;
+  dt_iop_lensfun_global_data_t *gd = (dt_iop_lensfun_global_data_t *)self->data;
+  dt_pthread_mutex_lock(&gd->map_lock);
+  map->users--;
+  dt_pthread_mutex_unlock(&gd->map_lock);
+}
+
+// displacements of grid column i, interpolated between the rows row0 and row1
+static inline void
+_lens_map_column(const float *row0, const float *row1, const int i, const float ty, float *v)
+{
+  for(int c=0; c<6; c++)
+    v[c] = row0[6*i+c] + ty*(row1[6*i+c] - row0[6*i+c]);
+}
+
+// r, g and b positions for the pixel at (x, y) from the displacements v
+static inline void
+_lens_map_position(const float x, const float y, const float *v, float *pos)
+{
+  pos[2] = x + v[0];
+  pos[3] = y + v[1];
+  pos[0] = pos[2] + v[2];
+  pos[1] = pos[3] + v[3];
+  pos[4] = pos[2] + v[4];
+  pos[5] = pos[3] + v[5];
+}
+
+// same as lf_modifier_apply_subpixel_geometry_distortion() for one row of width pixels
+// starting at (x, y), but from the map if there is one.
+static void
+_lens_map_row(const dt_iop_lensfun_map_t *map, lfModifier *modifier, const int x, const int y, const int width, float *pos)
+{
+  if(!map)
+  {
+    lf_modifier_apply_subpixel_geometry_distortion(modifier, x, y, width, 1, pos);
+    return;
+  }
+  const float fy = y/(float)DT_IOP_LENSFUN_MAP_STEP;
+  const int gy = CLAMP((int)floorf(fy), 0, map->gh-2);
+  const float ty = fy - gy;
+  const float *row0 = map->grid + (size_t)6*gy*map->gw;
+  const float *row1 = row0 + (size_t)6*map->gw;
+
+  // columns left and right of the current cell
+  float left[6], right[6];
+  int cell = -2;
+  for(int i=0; i<width; i++, pos+=6)
+  {
+    const float fx = (x+i)/(float)DT_IOP_LENSFUN_MAP_STEP;
+    const int gx = CLAMP((int)floorf(fx), 0, map->gw-2);
+    if(gx != cell)
+    {
+      if(gx == cell+1) memcpy(left, right, sizeof(left));
+      else _lens_map_column(row0, row1, gx, ty, left);
+      _lens_map_column(row0, row1, gx+1, ty, right);
+      cell = gx;
+    }
+    const float tx = fx - gx;
+    float v[6];
+    for(int c=0; c<6; c++) v[c] = left[c] + tx*(right[c] - left[c]);
+    _lens_map_position(x+i, y, v, pos);
+  }
+}
+
+// the same for a single point
+static void
+_lens_map_point(const dt_iop_lensfun_map_t *map, lfModifier *modifier, const float x, const float y, float *pos)
+{
+  if(!map)
+  {
+    lf_modifier_apply_subpixel_geometry_distortion(modifier, x, y, 1, 1, pos);
+    return;
+  }
+  const float fx = x/DT_IOP_LENSFUN_MAP_STEP, fy = y/DT_IOP_LENSFUN_MAP_STEP;
+  const int gx = CLAMP((int)floorf(fx), 0, map->gw-2);
+  const int gy = CLAMP((int)floorf(fy), 0, map->gh-2);
+  const float tx = fx - gx, ty = fy - gy;
+  const float *row0 = map->grid + (size_t)6*gy*map->gw;
+  const float *row1 = row0 + (size_t)6*map->gw;
+  float left[6], right[6], v[6];
+  _lens_map_column(row0, row1, gx, ty, left);
+  _lens_map_column(row0, row1, gx+1, ty, right);
+  for(int c=0; c<6; c++) v[c] = left[c] + tx*(right[c] - left[c]);
+  _lens_map_position(x, y, v, pos);
+}
+
 void
 process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoid, void *ovoid, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out)
 {
@@ -168,6 +330,11 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoi
                    d->target_geom, d->modify_flags, d->inverse);
   dt_pthread_mutex_unlock(&darktable.plugin_threadsafe);
 
+  // the displacements don't change while other modules are edited, look them up
+  dt_iop_lensfun_map_t *map = NULL;
+  if(modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION | LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
+    map = _lens_map_get(self, piece, modifier, orig_w, orig_h);
+
   if(d->inverse)
   {
     // reverse direction (useful for renderings)
@@ -186,13 +353,12 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoi
       const struct  dt_interpolation* interpolation = dt_interpolation_new(DT_INTERPOLATION_USERPREF);
 
 #ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(roi_out, roi_in, in, d, ovoid, modifier, interpolation) schedule(static)
+      #pragma omp parallel for default(none) shared(roi_out, roi_in, in, d, ovoid, modifier, map, interpolation) schedule(static)
 #endif
       for (int y = 0; y < roi_out->height; y++)
       {
         float *pi = (float *)(((char *)d->tmpbuf2) + req2*dt_get_thread_num());
-        lf_modifier_apply_subpixel_geometry_distortion (
-          modifier, roi_out->x, roi_out->y+y, roi_out->width, 1, pi);
+        _lens_map_row(map, modifier, roi_out->x, roi_out->y+y, roi_out->width, pi);
         // reverse transform the global coords from lf to our buffer
         float *buf = ((float *)ovoid) + y*roi_out->width*ch;
         for (int x = 0; x < roi_out->width; x++,buf+=ch,pi+=6)
@@ -281,13 +447,12 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoi
       const struct dt_interpolation* interpolation = dt_interpolation_new(DT_INTERPOLATION_USERPREF);
 
 #ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(roi_in, roi_out, d, ovoid, modifier, interpolation) schedule(static)
+      #pragma omp parallel for default(none) shared(roi_in, roi_out, d, ovoid, modifier, map, interpolation) schedule(static)
 #endif
       for (int y = 0; y < roi_out->height; y++)
       {
         float *pi = (float *)(((char *)d->tmpbuf2) + dt_get_thread_num()*req2);
-        lf_modifier_apply_subpixel_geometry_distortion (
-          modifier, roi_out->x, roi_out->y+y, roi_out->width, 1, pi);
+        _lens_map_row(map, modifier, roi_out->x, roi_out->y+y, roi_out->width, pi);
         // reverse transform the global coords from lf to our buffer
         float *out = ((float *)ovoid) + y*roi_out->width*ch;
         for (int x = 0; x < roi_out->width; x++,pi+=6)
@@ -321,6 +486,7 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoi
         memcpy(out+ch*y*roi_out->width, input+ch*y*roi_out->width, ch*sizeof(float)*roi_out->width);
     }
   }
+  _lens_map_release(self, map);
   lf_modifier_destroy(modifier);
 
   if(g != NULL && self->dev->gui_attached && piece->pipe->type == DT_DEV_PIXELPIPE_PREVIEW)
@@ -344,6 +510,7 @@ process_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_mem
 
   float *tmpbuf = NULL;
   lfModifier *modifier = NULL;
+  dt_iop_lensfun_map_t *map = NULL;
 
   const int devid = piece->pipe->devid;
   const int iwidth = roi_in->width;
@@ -418,6 +585,9 @@ process_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_mem
                    d->target_geom, d->modify_flags, d->inverse);
   dt_pthread_mutex_unlock(&darktable.plugin_threadsafe);
 
+  if(modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION | LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
+    map = _lens_map_get(self, piece, modifier, orig_w, orig_h);
+
   if(d->inverse)
   {
     // reverse direction (useful for renderings)
@@ -425,13 +595,12 @@ process_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_mem
                    LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
     {
 #ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(roi_out, roi_in, tmpbuf, d, modifier) schedule(static)
+      #pragma omp parallel for default(none) shared(roi_out, roi_in, tmpbuf, d, modifier, map) schedule(static)
 #endif
       for (int y = 0; y < roi_out->height; y++)
       {
         float *pi = tmpbuf + y * tmpbufwidth;
-        lf_modifier_apply_subpixel_geometry_distortion (
-          modifier, roi_out->x, roi_out->y+y, roi_out->width, 1, pi);
+        _lens_map_row(map, modifier, roi_out->x, roi_out->y+y, roi_out->width, pi);
       }
 
       /* _blocking_ memory transfer: host tmpbuf buffer -> opencl dev_tmpbuf */
@@ -534,13 +703,12 @@ process_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_mem
                    LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
     {
 #ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(roi_out, roi_in, tmpbuf, d, modifier) schedule(static)
+      #pragma omp parallel for default(none) shared(roi_out, roi_in, tmpbuf, d, modifier, map) schedule(static)
 #endif
       for (int y = 0; y < roi_out->height; y++)
       {
         float *pi = tmpbuf + y * tmpbufwidth;
-        lf_modifier_apply_subpixel_geometry_distortion (
-          modifier, roi_out->x, roi_out->y+y, roi_out->width, 1, pi);
+        _lens_map_row(map, modifier, roi_out->x, roi_out->y+y, roi_out->width, pi);
       }
 
       /* _blocking_ memory transfer: host tmpbuf buffer -> opencl dev_tmpbuf */
@@ -575,6 +743,7 @@ process_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_mem
   dt_opencl_release_mem_object(dev_tmpbuf);
   dt_opencl_release_mem_object(dev_tmp);
   if (tmpbuf != NULL) free(tmpbuf);
+  _lens_map_release(self, map);
   if (modifier != NULL) lf_modifier_destroy(modifier);
   return TRUE;
 
@@ -582,6 +751,7 @@ error:
   if (dev_tmp != NULL) dt_opencl_release_mem_object(dev_tmp);
   if (dev_tmpbuf != NULL) dt_opencl_release_mem_object(dev_tmpbuf);
   if (tmpbuf != NULL) free(tmpbuf);
+  _lens_map_release(self, map);
   if (modifier != NULL) lf_modifier_destroy(modifier);
   dt_print(DT_DEBUG_OPENCL, "[opencl_lens] couldn't enqueue kernel! %d\n", err);
   return FALSE;
@@ -658,6 +828,75 @@ int distort_backtransform(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece,
   return 1;
 }
 
+int warp_backtransform(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out, float *points, size_t points_count)
+{
+  dt_iop_lensfun_data_t *d = (dt_iop_lensfun_data_t *)piece->data;
+
+  // nothing to correct, process() just copies
+  if(!d->lens->Maker || d->crop <= 0.0f) return 1;
+
+  const float scale = roi_in ? roi_in->scale : 1.0f;
+  const float orig_w = scale*piece->iwidth,
+              orig_h = scale*piece->iheight;
+
+  if(!points)
+  {
+    // the pipe asks once before it maps the strips of a run, in parallel. set up the
+    // modifier here, lensfun needs the global lock for that but only reads it afterwards.
+    if(d->warp_modifier) lf_modifier_destroy(d->warp_modifier);
+    dt_pthread_mutex_lock(&darktable.plugin_threadsafe);
+    d->warp_modifier = lf_modifier_new(d->lens, d->crop, orig_w, orig_h);
+    d->warp_modflags = lf_modifier_initialize(
+                         d->warp_modifier, d->lens, LF_PF_F32,
+                         d->focal, d->aperture,
+                         d->distance, d->scale,
+                         d->target_geom, d->modify_flags, d->inverse);
+    dt_pthread_mutex_unlock(&darktable.plugin_threadsafe);
+    // vignetting correction changes the pixels themselves, we have to run on our own then
+    return !(d->warp_modflags & LF_MODIFY_VIGNETTING);
+  }
+
+  lfModifier *modifier = d->warp_modifier;
+  if(!modifier) return 0;
+
+  if(d->warp_modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION |
+                         LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
+  {
+    dt_iop_lensfun_map_t *map = _lens_map_get(self, piece, modifier, orig_w, orig_h);
+    float buf[6];
+    for(size_t k=0; k<points_count; k++)
+    {
+      float *p = points + 6*k;
+      if(p[0] == p[2] && p[0] == p[4] && p[1] == p[3] && p[1] == p[5])
+      {
+        // one lookup gives the positions of all three channels
+        _lens_map_point(map, modifier, roi_out->x + p[0], roi_out->y + p[1], buf);
+        for(int c=0; c<6; c+=2)
+        {
+          p[c] = buf[c] - roi_in->x;
+          p[c+1] = buf[c+1] - roi_in->y;
+        }
+      }
+      else for(int c=0; c<6; c+=2)
+      {
+        _lens_map_point(map, modifier, roi_out->x + p[c], roi_out->y + p[c+1], buf);
+        p[c] = buf[c] - roi_in->x;
+        p[c+1] = buf[c+1] - roi_in->y;
+      }
+    }
+    _lens_map_release(self, map);
+  }
+  else
+  {
+    for(size_t k=0; k<3*points_count; k++)
+    {
+      points[2*k] += roi_out->x - roi_in->x;
+      points[2*k+1] += roi_out->y - roi_in->y;
+    }
+  }
+  return 1;
+}
+
 void modify_roi_out(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece, dt_iop_roi_t *roi_out, const dt_iop_roi_t *roi_in)
 {
   *roi_out = *roi_in;
@@ -686,6 +925,7 @@ void modify_roi_in(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *
   if (modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION |
                   LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
   {
+    dt_iop_lensfun_map_t *map = _lens_map_get(self, piece, modifier, orig_w, orig_h);
     // acquire temp memory for distorted pixel coords
     const size_t req2 = roi_in->width*2*3*sizeof(float);
     if(req2 > 0 && d->tmpbuf2_len < req2)
@@ -696,8 +936,7 @@ void modify_roi_in(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *
     }
     for (int y = 0; y < roi_out->height; y++)
     {
-      lf_modifier_apply_subpixel_geometry_distortion (
-        modifier, roi_out->x, roi_out->y+y, roi_out->width, 1, d->tmpbuf2);
+      _lens_map_row(map, modifier, roi_out->x, roi_out->y+y, roi_out->width, d->tmpbuf2);
       const float *pi = d->tmpbuf2;
       // reverse transform the global coords from lf to our buffer
       for (int x = 0; x < roi_out->width; x++)
@@ -713,6 +952,8 @@ void modify_roi_in(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *
       }
     }
 
+    _lens_map_release(self, map);
+
     const struct dt_interpolation* interpolation = dt_interpolation_new(DT_INTERPOLATION_USERPREF);
     roi_in->x = fmaxf(0.0f, xm-interpolation->width);
     roi_in->y = fmaxf(0.0f, ym-interpolation->width);
@@ -736,6 +977,8 @@ void commit_params (struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pi
   const lfCamera *camera = NULL;
   const lfCamera **cam = NULL;
 
+  if(d->warp_modifier) lf_modifier_destroy(d->warp_modifier);
+  d->warp_modifier = NULL;
   lf_lens_destroy(d->lens);
   d->lens = lf_lens_new();
 
@@ -786,6 +1029,10 @@ void commit_params (struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pi
   d->aperture     = p->aperture;
   d->distance     = p->distance;
   d->target_geom  = p->target_geom;
+  // identifies the distortion maps computed for these params (fnv-1a)
+  d->hash = 14695981039346656037ull;
+  for(size_t k=0; k<sizeof(dt_iop_lensfun_params_t); k++)
+    d->hash = (d->hash ^ ((const uint8_t *)p)[k]) * 1099511628211ull;
 #endif
 }
 
@@ -801,6 +1048,7 @@ void init_pipe (struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_p
   d->tmpbuf2 = NULL;
   d->tmpbuf_len = 0;
   d->tmpbuf = NULL;
+  d->warp_modifier = NULL;
   d->lens = lf_lens_new();
   self->commit_params(self, self->default_params, pipe, piece);
 #endif
@@ -812,6 +1060,7 @@ void cleanup_pipe (struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_de
 #error "lensfun needs to be ported to GEGL!"
 #else
   dt_iop_lensfun_data_t *d = (dt_iop_lensfun_data_t *)piece->data;
+  if(d->warp_modifier) lf_modifier_destroy(d->warp_modifier);
   lf_lens_destroy(d->lens);
   free(d->tmpbuf);
   free(d->tmpbuf2);
@@ -829,6 +1078,9 @@ void init_global(dt_iop_module_so_t *module)
   gd->kernel_lens_distort_lanczos2 = dt_opencl_create_kernel(program, "lens_distort_lanczos2");
   gd->kernel_lens_distort_lanczos3 = dt_opencl_create_kernel(program, "lens_distort_lanczos3");
   gd->kernel_lens_vignette = dt_opencl_create_kernel(program, "lens_vignette");
+  dt_pthread_mutex_init(&gd->map_lock, NULL);
+  memset(gd->map, 0, sizeof(gd->map));
+  gd->map_clock = 0;
 
   lfDatabase *dt_iop_lensfun_db = lf_db_new();
   gd->db = (void *)dt_iop_lensfun_db;
@@ -923,6 +1175,8 @@ void cleanup_global(dt_iop_module_so_t *module)
   dt_opencl_free_kernel(gd->kernel_lens_distort_lanczos2);
   dt_opencl_free_kernel(gd->kernel_lens_distort_lanczos3);
   dt_opencl_free_kernel(gd->kernel_lens_vignette);
+  for(int k=0; k<DT_IOP_LENSFUN_MAPS; k++) free(gd->map[k].grid);
+  dt_pthread_mutex_destroy(&gd->map_lock);
   free(module->data);
   module->data = NULL;
 }
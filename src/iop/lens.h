@@ -82,9 +82,31 @@ typedef struct dt_iop_lensfun_gui_data_t
 }
 dt_iop_lensfun_gui_data_t;
 
+// number of distortion maps kept around, and their grid spacing in pixels
+#define DT_IOP_LENSFUN_MAPS 4
+#define DT_IOP_LENSFUN_MAP_STEP 8
+
+/** displacements lensfun computes for a given set of params at a given scale,
+ * sampled on a coarse grid over the whole image and interpolated in between. */
+typedef struct dt_iop_lensfun_map_t
+{
+  uint64_t hash;            // of the params the map was computed for
+  float width, height;      // image size at the scale of the map
+  int gw, gh;               // grid nodes
+  int users;                // pipes currently working with it
+  uint64_t used;            // for lru replacement
+  // per node: green dx, dy, then red and blue relative to green.
+  float *grid;
+}
+dt_iop_lensfun_map_t;
+
 typedef struct dt_iop_lensfun_global_data_t
 {
   lfDatabase *db;
+  // distortion maps, shared by all pipes
+  dt_pthread_mutex_t map_lock;
+  dt_iop_lensfun_map_t map[DT_IOP_LENSFUN_MAPS];
+  uint64_t map_clock;
   int kernel_lens_distort_bilinear;
   int kernel_lens_distort_bicubic;
   int kernel_lens_distort_lanczos2;
@@ -108,6 +130,10 @@ typedef struct dt_iop_lensfun_data_t
   float aperture;
   float distance;
   lfLensType target_geom;
+  uint64_t hash;
+  // set up before the strips of a fused resampling run, which all share it. see warp_backtransform()
+  lfModifier *warp_modifier;
+  int warp_modflags;
 }
 dt_iop_lensfun_data_t;
 
@@ -25,6 +25,7 @@
 #include "gui/accelerators.h"
 #include "gui/gtk.h"
 #include "common/opencl.h"
+#include "common/nlmeans.h"
 #include <gtk/gtk.h>
 #include <stdlib.h>
 #include <xmmintrin.h>
@@ -127,35 +128,6 @@ void connect_key_accels(dt_iop_module_t *self)
 // void modify_roi_out(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece, dt_iop_roi_t *roi_out, const dt_iop_roi_t *roi_in);
 // void modify_roi_in(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece, const dt_iop_roi_t *roi_out, dt_iop_roi_t *roi_in);
 
-typedef union floatint_t
-{
-  float f;
-  uint32_t i;
-}
-floatint_t;
-
-static inline float
-fast_mexp2f(const float x)
-{
-  const float i1 = (float)0x3f800000u; // 2^0
-  const float i2 = (float)0x3f000000u; // 2^-1
-  const float k0 = i1 + x * (i2 - i1);
-  floatint_t k;
-  k.i = k0 >= (float)0x800000u ? k0 : 0;
-  return k.f;
-}
-
-static float gh(const float f, const float sharpness)
-{
-  const float f2 = f*sharpness;
-  return fast_mexp2f(f2);
-  // return 0.0001f + dt_fast_expf(-fabsf(f)*800.0f);
-  // return 1.0f/(1.0f + f*f);
-  // make spread bigger: less smoothing
-  // const float spread = 100.f;
-  // return 1.0f/(1.0f + fabsf(f)*spread);
-}
-
 #ifdef HAVE_OPENCL
 static int bucket_next(unsigned int *state, unsigned int max)
 {
@@ -396,146 +368,18 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
   float nL = 1.0f/max_L, nC = 1.0f/max_C;
   const float norm2[4] = { nL*nL, nC*nC, nC*nC, 1.0f };
 
-  float *Sa = dt_alloc_align(64, sizeof(float)*roi_out->width*dt_get_num_threads());
-  // we want to sum up weights in col[3], so need to init to 0:
-  memset(ovoid, 0x0, sizeof(float)*roi_out->width*roi_out->height*4);
-
-  // for each shift vector
-  for(int kj=-K; kj<=K; kj++)
+  // weighted sums of all shifted pixels, weights in col[3]
+  const dt_nlmeans_param_t params =
   {
-    for(int ki=-K; ki<=K; ki++)
-    {
-      int inited_slide = 0;
-      // don't construct summed area tables but use sliding window! (applies to cpu version res < 1k only, or else we will add up errors)
-      // do this in parallel with a little threading overhead. could parallelize the outer loops with a bit more memory
-#ifdef _OPENMP
-      #  pragma omp parallel for schedule(static) default(none) firstprivate(inited_slide) shared(kj, ki, roi_out, roi_in, ivoid, ovoid, Sa)
-#endif
-      for(int j=0; j<roi_out->height; j++)
-      {
-        if(j+kj < 0 || j+kj >= roi_out->height) continue;
-        float *S = Sa + dt_get_thread_num() * roi_out->width;
-        const float *ins = ((float *)ivoid) + 4*(roi_in->width *(j+kj) + ki);
-        float *out = ((float *)ovoid) + 4*roi_out->width*j;
-
-        const int Pm = MIN(MIN(P, j+kj), j);
-        const int PM = MIN(MIN(P, roi_out->height-1-j-kj), roi_out->height-1-j);
-        // first line of every thread
-        // TODO: also every once in a while to assert numerical precision!
-        if(!inited_slide)
-        {
-          // sum up a line
-          memset(S, 0x0, sizeof(float)*roi_out->width);
-          for(int jj=-Pm; jj<=PM; jj++)
-          {
-            int i = MAX(0, -ki);
-            float *s = S + i;
-            const float *inp  = ((float *)ivoid) + 4*i + 4* roi_in->width *(j+jj);
-            const float *inps = ((float *)ivoid) + 4*i + 4*(roi_in->width *(j+jj+kj) + ki);
-            const int last = roi_out->width + MIN(0, -ki);
-            for(; i<last; i++, inp+=4, inps+=4, s++)
-            {
-              for(int k=0; k<3; k++)
-                s[0] += (inp[k] - inps[k])*(inp[k] - inps[k]) * norm2[k];
-            }
-          }
-          // only reuse this if we had a full stripe
-          if(Pm == P && PM == P) inited_slide = 1;
-        }
-
-        // sliding window for this line:
-        float *s = S;
-        float slide = 0.0f;
-        // sum up the first -P..P
-        for(int i=0; i<2*P+1; i++) slide += s[i];
-        for(int i=0; i<roi_out->width; i++)
-        {
-          if(i-P > 0 && i+P<roi_out->width)
-            slide += s[P] - s[-P-1];
-          if(i+ki >= 0 && i+ki < roi_out->width)
-          {
-            const __m128 iv = { ins[0], ins[1], ins[2], 1.0f };
-            _mm_store_ps(out, _mm_load_ps(out) + iv * _mm_set1_ps(gh(slide, sharpness)));
-          }
-          s   ++;
-          ins += 4;
-          out += 4;
-        }
-        if(inited_slide && j+P+1+MAX(0,kj) < roi_out->height)
-        {
-          // sliding window in j direction:
-          int i = MAX(0, -ki);
-          float *s = S + i;
-          const float *inp  = ((float *)ivoid) + 4*i + 4* roi_in->width *(j+P+1);
-          const float *inps = ((float *)ivoid) + 4*i + 4*(roi_in->width *(j+P+1+kj) + ki);
-          const float *inm  = ((float *)ivoid) + 4*i + 4* roi_in->width *(j-P);
-          const float *inms = ((float *)ivoid) + 4*i + 4*(roi_in->width *(j-P+kj) + ki);
-          const int last = roi_out->width + MIN(0, -ki);
-          for(; ((unsigned long)s & 0xf) != 0 && i<last; i++, inp+=4, inps+=4, inm+=4, inms+=4, s++)
-          {
-            float stmp = s[0];
-            for(int k=0; k<3; k++)
-              stmp += ((inp[k] - inps[k])*(inp[k] - inps[k])
-                       -  (inm[k] - inms[k])*(inm[k] - inms[k])) * norm2[k];
-            s[0] = stmp;
-          }
-          /* Process most of the line 4 pixels at a time */
-          for(; i<last-4; i+=4, inp+=16, inps+=16, inm+=16, inms+=16, s+=4)
-          {
-            __m128 sv = _mm_load_ps(s);
-            const __m128 inp1 = _mm_load_ps(inp)    - _mm_load_ps(inps);
-            const __m128 inp2 = _mm_load_ps(inp+4)  - _mm_load_ps(inps+4);
-            const __m128 inp3 = _mm_load_ps(inp+8)  - _mm_load_ps(inps+8);
-            const __m128 inp4 = _mm_load_ps(inp+12) - _mm_load_ps(inps+12);
-
-            const __m128 inp12lo = _mm_unpacklo_ps(inp1,inp2);
-            const __m128 inp34lo = _mm_unpacklo_ps(inp3,inp4);
-            const __m128 inp12hi = _mm_unpackhi_ps(inp1,inp2);
-            const __m128 inp34hi = _mm_unpackhi_ps(inp3,inp4);
-
-            const __m128 inpv0 = _mm_movelh_ps(inp12lo,inp34lo);
-            sv += inpv0*inpv0 * _mm_set1_ps(norm2[0]);
-
-            const __m128 inpv1 = _mm_movehl_ps(inp34lo,inp12lo);
-            sv += inpv1*inpv1 * _mm_set1_ps(norm2[1]);
-
-            const __m128 inpv2 = _mm_movelh_ps(inp12hi,inp34hi);
-            sv += inpv2*inpv2 * _mm_set1_ps(norm2[2]);
-
-            const __m128 inm1 = _mm_load_ps(inm)    - _mm_load_ps(inms);
-            const __m128 inm2 = _mm_load_ps(inm+4)  - _mm_load_ps(inms+4);
-            const __m128 inm3 = _mm_load_ps(inm+8)  - _mm_load_ps(inms+8);
-            const __m128 inm4 = _mm_load_ps(inm+12) - _mm_load_ps(inms+12);
-
-            const __m128 inm12lo = _mm_unpacklo_ps(inm1,inm2);
-            const __m128 inm34lo = _mm_unpacklo_ps(inm3,inm4);
-            const __m128 inm12hi = _mm_unpackhi_ps(inm1,inm2);
-            const __m128 inm34hi = _mm_unpackhi_ps(inm3,inm4);
-
-            const __m128 inmv0 = _mm_movelh_ps(inm12lo,inm34lo);
-            sv -= inmv0*inmv0 * _mm_set1_ps(norm2[0]);
-
-            const __m128 inmv1 = _mm_movehl_ps(inm34lo,inm12lo);
-            sv -= inmv1*inmv1 * _mm_set1_ps(norm2[1]);
-
-            const __m128 inmv2 = _mm_movelh_ps(inm12hi,inm34hi);
-            sv -= inmv2*inmv2 * _mm_set1_ps(norm2[2]);
-
-            _mm_store_ps(s, sv);
-          }
-          for(; i<last; i++, inp+=4, inps+=4, inm+=4, inms+=4, s++)
-          {
-            float stmp = s[0];
-            for(int k=0; k<3; k++)
-              stmp += ((inp[k] - inps[k])*(inp[k] - inps[k])
-                       -  (inm[k] - inms[k])*(inm[k] - inms[k])) * norm2[k];
-            s[0] = stmp;
-          }
-        }
-        else inited_slide = 0;
-      }
-    }
-  }
+    .patch_radius = P,
+    .search_radius = K,
+    .norm = { norm2[0], norm2[1], norm2[2], 0.0f },
+    .scale = sharpness,
+    .offset = 0.0f,
+    .pipe = piece->pipe
+  };
+  dt_nlmeans_accumulate((const float *)ivoid, (float *)ovoid, roi_out->width, roi_out->height, &params);
+
   // normalize and apply chroma/luma blending
   // bias a bit towards higher values for low input values:
   // const __m128 weight = _mm_set_ps(1.0f, powf(d->chroma, 0.6), powf(d->chroma, 0.6), powf(d->luma, 0.6));
@@ -557,9 +401,6 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
       in  += 4;
     }
   }
-  // free shared tmp memory:
-  free(Sa);
-
   if(piece->pipe->mask_display)
     dt_iop_alpha_copy(ivoid, ovoid, roi_out->width, roi_out->height);
 }
@@ -249,7 +249,7 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
   const float halfmax = lmax/2.0;
   const float doublemax = lmax*2.0;
 
-  float *temp = dt_alloc_align(64, roi_out->width*roi_out->height*ch*sizeof(float));
+  float *temp = dt_dev_pixelpipe_scratch_alloc(piece->pipe, roi_out->width*roi_out->height*ch*sizeof(float));
   if(temp==NULL) return;
 
   // overlay highlights
@@ -336,7 +336,7 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
   if(piece->pipe->mask_display)
     dt_iop_alpha_copy(ivoid, ovoid, roi_out->width, roi_out->height);
 
-  free(temp);
+  dt_dev_pixelpipe_scratch_free(piece->pipe, temp);
 }
 
 
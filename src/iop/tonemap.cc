@@ -43,6 +43,7 @@ extern "C"
 #include "bauhaus/bauhaus.h"
 #include "develop/develop.h"
 #include "develop/imageop.h"
+#include "develop/pixelpipe_cache.h"
 #include "control/control.h"
 #include "gui/accelerators.h"
 #include "gui/gtk.h"
@@ -71,6 +72,11 @@ extern "C"
   typedef struct dt_iop_tonemapping_data_t
   {
     float contrast,Fsize;
+    // filtered log luminance of the last input, so changing only the contrast
+    // doesn't need to build the lattice again.
+    float *base;
+    size_t base_size;
+    uint64_t base_hash;
   }
   dt_iop_tonemapping_data_t;
 
@@ -129,33 +135,80 @@ extern "C"
     if(inv_sigma_s<3.0) inv_sigma_s=3.0;
     inv_sigma_s = 1.0/inv_sigma_s;
 
-    PermutohedralLattice<3,2> lattice(size, omp_get_max_threads());
+    // the base layer only depends on the input and the spatial extent. keep it
+    // around in the interactive pipes, where the input rarely changes.
+    const int keep = piece->pipe->type == DT_DEV_PIXELPIPE_FULL || piece->pipe->type == DT_DEV_PIXELPIPE_PREVIEW;
+    uint64_t hash = 0;
+    if(keep)
+    {
+      hash = dt_dev_pixelpipe_cache_hash(piece->pipe->image.id, roi_in, piece->pipe,
+                                         g_list_index(piece->pipe->nodes, piece));
+      const char *str = (const char *)&inv_sigma_s;
+      for(size_t k=0; k<sizeof(float); k++) hash = ((hash << 5) + hash) ^ str[k];
+    }
+
+    float *base = NULL;
+    if(keep && data->base && data->base_size == (size_t)size && data->base_hash == hash)
+    {
+      base = data->base;
+    }
+    else
+    {
+      if(!keep)
+      {
+        base = (float *)malloc(sizeof(float)*size);
+      }
+      else
+      {
+        if(data->base_size != (size_t)size)
+        {
+          free(data->base);
+          data->base = (float *)malloc(sizeof(float)*size);
+          data->base_size = size;
+        }
+        base = data->base;
+      }
 
-    // Build I=log(L)
-    // and splat into the lattice
+      PermutohedralLattice<3,2> lattice(size, omp_get_max_threads());
+
+      // Build I=log(L)
+      // and splat into the lattice
 #ifdef _OPENMP
-    #pragma omp parallel for shared(lattice)
+      #pragma omp parallel for shared(lattice)
 #endif
-    for(int j=0; j<height; j++)
-    {
-      int index = j*width;
-      const int thread = omp_get_thread_num();
-      const float *in = (const float*)ivoid + j*width*ch;
-      for(int i=0; i<width; i++, index++, in+=ch)
+      for(int j=0; j<height; j++)
       {
-        float L = 0.2126*in[0]+ 0.7152*in[1] + 0.0722*in[2];
-        if(L<=0.0) L=1e-6;
-        L = logf(L);
-        float pos[3] = {i*inv_sigma_s, j*inv_sigma_s, L*inv_sigma_r};
-        float val[2] = {L,  1.0};
-        lattice.splat(pos, val, index, thread);
+        int index = j*width;
+        const int thread = omp_get_thread_num();
+        const float *in = (const float*)ivoid + j*width*ch;
+        for(int i=0; i<width; i++, index++, in+=ch)
+        {
+          float L = 0.2126*in[0]+ 0.7152*in[1] + 0.0722*in[2];
+          if(L<=0.0) L=1e-6;
+          L = logf(L);
+          float pos[3] = {i*inv_sigma_s, j*inv_sigma_s, L*inv_sigma_r};
+          float val[2] = {L,  1.0};
+          lattice.splat(pos, val, index, thread);
+        }
       }
-    }
 
-    lattice.merge_splat_threads();
+      lattice.merge_splat_threads();
+
+      // blur the lattice
+      lattice.blur();
 
-    // blur the lattice
-    lattice.blur();
+      // and slice out log(base)
+#ifdef _OPENMP
+      #pragma omp parallel for shared(lattice, base)
+#endif
+      for(int index=0; index<size; index++)
+      {
+        float val[2];
+        lattice.slice(val, index);
+        base[index] = val[0]/val[1];
+      }
+      if(keep) data->base_hash = hash;
+    }
 
     //
     // Durand process :
@@ -179,7 +232,7 @@ extern "C"
 
     const float contr = 1./data->contrast;
 #ifdef _OPENMP
-    #pragma omp parallel for
+    #pragma omp parallel for shared(base)
 #endif
     for(int j=0; j<height; j++)
     {
@@ -188,12 +241,10 @@ extern "C"
       float *out = (float*)ovoid + j*width*ch;
       for(int i=0; i<width; i++, index++, in+=ch, out+=ch)
       {
-        float val[2];
-        lattice.slice(val, index);
         float L = 0.2126*in[0]+ 0.7152*in[1] + 0.0722*in[2];
         if(L<=0.0) L=1e-6;
         L = logf(L);
-        const float B = val[0]/val[1];
+        const float B = base[index];
         const float detail = L - B;
         const float Ln = expf(B*(contr - 1.0f) + detail - 1.0f);
 
@@ -211,6 +262,8 @@ extern "C"
     L = logf(L);
     const float Ln = expf(L*(contr - 1.0f) - 1.0f);
     for(int k=0; k<3; k++) pmax[k] *= Ln;
+
+    if(!keep) free(base);
   }
 
 
@@ -247,11 +300,17 @@ extern "C"
   void init_pipe (struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_pixelpipe_iop_t *piece)
   {
     piece->data = malloc(sizeof(dt_iop_tonemapping_data_t));
+    dt_iop_tonemapping_data_t *d = (dt_iop_tonemapping_data_t *)piece->data;
+    d->base = NULL;
+    d->base_size = 0;
+    d->base_hash = 0;
     self->commit_params(self, self->default_params, pipe, piece);
   }
 
   void cleanup_pipe (struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_pixelpipe_iop_t *piece)
   {
+    dt_iop_tonemapping_data_t *d = (dt_iop_tonemapping_data_t *)piece->data;
+    free(d->base);
     free(piece->data);
   }
 
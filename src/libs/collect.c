@@ -530,6 +530,7 @@ void view_popup_menu_onRemove (GtkWidget *menuitem, gpointer userdata)
 
   fullq = dt_util_dstrcat(fullq, "insert into selected_images select id from images where film_id  in (select id from film_rolls where folder like '%s%%')", filmroll_path);
   DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db), fullq, NULL, NULL, NULL);
+  dt_view_image_info_invalidate();
 
   dt_control_remove_images();
 }
@@ -993,6 +994,7 @@ static void _lib_folders_update_collection(const gchar *filmroll)
     DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, -1);
     sqlite3_step(stmt);
     sqlite3_finalize(stmt);
+    dt_view_image_info_invalidate();
 
     /* free allocated strings */
     g_free(complete_query);
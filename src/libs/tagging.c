@@ -545,6 +545,7 @@ _lib_tagging_tag_key_press(GtkWidget *entry, GdkEventKey *event, dt_lib_module_t
         if(selected_images)
         {
           GList *iter = selected_images;
+          dt_collection_changes_begin(darktable.collection);
           do
           {
             int imgid = GPOINTER_TO_INT(iter->data);
@@ -552,6 +553,7 @@ _lib_tagging_tag_key_press(GtkWidget *entry, GdkEventKey *event, dt_lib_module_t
             dt_image_synch_xmp(imgid);
           }
           while( (iter=g_list_next(iter)) !=NULL );
+          dt_collection_changes_end(darktable.collection);
         }
         g_list_free(selected_images);
       }
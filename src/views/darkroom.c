@@ -195,7 +195,9 @@ void expose(dt_view_t *self, cairo_t *cri, int32_t width_i, int32_t height_i, in
     surface = cairo_image_surface_create_for_data (dev->pipe->backbuf, CAIRO_FORMAT_RGB24, wd, ht, stride);
     cairo_set_source_rgb (cr, .2, .2, .2);
     cairo_paint(cr);
-    cairo_translate(cr, .5f*(width-wd), .5f*(height-ht));
+    // the coarse pass of a progressive update gets stretched to the size of the final image
+    const float upscale = dev->pipe->backbuf_upscale;
+    cairo_translate(cr, .5f*(width-wd*upscale), .5f*(height-ht*upscale));
     if(closeup)
     {
       const float closeup_scale = 2.0;
@@ -205,13 +207,14 @@ void expose(dt_view_t *self, cairo_t *cri, int32_t width_i, int32_t height_i, in
       dt_dev_check_zoom_bounds(dev, &zx1, &zy1, zoom, 1, &boxw, &boxh);
       dt_dev_check_zoom_bounds(dev, &zxm, &zym, zoom, 1, &boxw, &boxh);
       const float fx = 1.0 - fmaxf(0.0, (zx0 - zx1)/(zx0 - zxm)), fy = 1.0 - fmaxf(0.0, (zy0 - zy1)/(zy0 - zym));
-      cairo_translate(cr, -wd/(2.0*closeup_scale) * fx, -ht/(2.0*closeup_scale) * fy);
+      cairo_translate(cr, -wd*upscale/(2.0*closeup_scale) * fx, -ht*upscale/(2.0*closeup_scale) * fy);
     }
+    cairo_scale(cr, upscale, upscale);
     cairo_rectangle(cr, 0, 0, wd, ht);
     cairo_set_source_surface (cr, surface, 0, 0);
-    cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_FAST);
+    cairo_pattern_set_filter(cairo_get_source(cr), upscale > 1.0f ? CAIRO_FILTER_GOOD : CAIRO_FILTER_FAST);
     cairo_fill_preserve(cr);
-    cairo_set_line_width(cr, 1.0);
+    cairo_set_line_width(cr, 1.0/upscale);
     cairo_set_source_rgb (cr, .3, .3, .3);
     cairo_stroke(cr);
     cairo_surface_destroy (surface);
@@ -453,6 +456,7 @@ int try_enter(dt_view_t *self)
     DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, selected);
     sqlite3_step(stmt);
     sqlite3_finalize(stmt);
+    dt_view_image_info_invalidate();
   }
 
   if(selected < 0)
@@ -496,6 +500,7 @@ select_this_image(const int imgid)
     DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
     sqlite3_step(stmt);
     sqlite3_finalize(stmt);
+    dt_view_image_info_invalidate();
   }
 }
 
@@ -376,6 +376,23 @@ grid_to_index (int row, int col, int stride, int offset)
 }
 #endif
 
+/** group id of a visible image, from the prefetched page if possible */
+static int
+_get_group_id (const int imgid)
+{
+  const dt_view_image_info_t *info = dt_view_image_info_get(imgid);
+  if(info) return info->group_id;
+
+  int group_id = -1;
+  const dt_image_t *image = dt_image_cache_read_get(darktable.image_cache, imgid);
+  if(image)
+  {
+    group_id = image->group_id;
+    dt_image_cache_read_release(darktable.image_cache, image);
+  }
+  return group_id;
+}
+
 static void
 expose_filemanager (dt_view_t *self, cairo_t *cr, int32_t width, int32_t height, int32_t pointerx, int32_t pointery)
 {
@@ -505,18 +522,22 @@ expose_filemanager (dt_view_t *self, cairo_t *cr, int32_t width, int32_t height,
 
   // prefetch the ids so that we can peek into the future to see if there are adjacent images in the same group.
   int *query_ids = (int*)calloc(max_rows*max_cols, sizeof(int));
+  int num_query_ids = 0;
   if(!query_ids) goto after_drawing;
   for(int row = 0; row < max_rows; row++)
   {
     for(int col = 0; col < max_cols; col++)
     {
       if(sqlite3_step(lib->statements.main_query) == SQLITE_ROW)
-        query_ids[row*iir+col] = sqlite3_column_int(lib->statements.main_query, 0);
+        query_ids[num_query_ids++] = sqlite3_column_int(lib->statements.main_query, 0);
       else goto end_query_cache;
     }
   }
 
 end_query_cache:
+  // fetch selection, labels, grouping and history state of the whole page at once
+  dt_view_image_info_prefetch(query_ids, num_query_ids);
+
   mouse_over_id = -1;
   cairo_save(cr);
   int current_image =0;
@@ -597,11 +618,7 @@ escape_image_loop:
 
       if(id > 0)
       {
-        const dt_image_t *image = dt_image_cache_read_get(darktable.image_cache, id);
-        int group_id = -1;
-        if(image)
-          group_id = image->group_id;
-        dt_image_cache_read_release(darktable.image_cache, image);
+        const int group_id = _get_group_id(id);
 
         if (iir == 1 && row)
           continue;
@@ -633,11 +650,7 @@ escape_image_loop:
           {
             int _id = query_ids[current_image - iir];
             if(_id > 0)
-            {
-              const dt_image_t *_img = dt_image_cache_read_get(darktable.image_cache, _id);
-              neighbour_group = _img->group_id;
-              dt_image_cache_read_release(darktable.image_cache, _img);
-            }
+              neighbour_group = _get_group_id(_id);
           }
           if(neighbour_group != group_id)
           {
@@ -650,11 +663,7 @@ escape_image_loop:
           {
             int _id = query_ids[current_image-1];
             if(_id > 0)
-            {
-              const dt_image_t *_img = dt_image_cache_read_get(darktable.image_cache, _id);
-              neighbour_group = _img->group_id;
-              dt_image_cache_read_release(darktable.image_cache, _img);
-            }
+              neighbour_group = _get_group_id(_id);
           }
           if(neighbour_group != group_id)
           {
@@ -667,11 +676,7 @@ escape_image_loop:
           {
             int _id = query_ids[current_image+iir];
             if(_id > 0)
-            {
-              const dt_image_t *_img = dt_image_cache_read_get(darktable.image_cache, _id);
-              neighbour_group = _img->group_id;
-              dt_image_cache_read_release(darktable.image_cache, _img);
-            }
+              neighbour_group = _get_group_id(_id);
           }
           if(neighbour_group != group_id)
           {
@@ -684,11 +689,7 @@ escape_image_loop:
           {
             int _id = query_ids[current_image+1];
             if(_id > 0)
-            {
-              const dt_image_t *_img = dt_image_cache_read_get(darktable.image_cache, _id);
-              neighbour_group = _img->group_id;
-              dt_image_cache_read_release(darktable.image_cache, _img);
-            }
+              neighbour_group = _get_group_id(_id);
           }
           if(neighbour_group != group_id)
           {
@@ -944,6 +945,36 @@ expose_zoomable (dt_view_t *self, cairo_t *cr, int32_t width, int32_t height, in
   cairo_translate(cr, -offset_x*wd, -offset_y*ht);
   cairo_translate(cr, -MIN(offset_i*wd, 0.0), 0.0);
 
+  // collect the visible ids first, so decorations can be fetched for all of them at once.
+  // rows above the collection stay 0, a row ends at the first missing image (marked -1).
+  int *query_ids = (int*)calloc(max_rows*max_cols, sizeof(int));
+  int *page_ids = (int*)malloc(sizeof(int)*max_rows*max_cols);
+  if(!query_ids || !page_ids) goto failure;
+  int num_page_ids = 0;
+  for(int row = 0, row_offset = offset; row < max_rows; row++, row_offset += DT_LIBRARY_MAX_ZOOM)
+  {
+    if(row_offset < 0) continue;
+
+    /* clear and reset main query */
+    DT_DEBUG_SQLITE3_CLEAR_BINDINGS(lib->statements.main_query);
+    DT_DEBUG_SQLITE3_RESET(lib->statements.main_query);
+
+    DT_DEBUG_SQLITE3_BIND_INT(lib->statements.main_query, 1, row_offset);
+    DT_DEBUG_SQLITE3_BIND_INT(lib->statements.main_query, 2, max_cols);
+    int col = 0;
+    for(; col < max_cols; col++)
+    {
+      if(sqlite3_step(lib->statements.main_query) != SQLITE_ROW) break;
+      query_ids[row*max_cols + col] = page_ids[num_page_ids++] = sqlite3_column_int(lib->statements.main_query, 0);
+    }
+    if(col < max_cols)
+    {
+      query_ids[row*max_cols + col] = -1;
+      break;
+    }
+  }
+  dt_view_image_info_prefetch(page_ids, num_page_ids);
+
   for(int row = 0; row < max_rows; row++)
   {
     if(offset < 0)
@@ -953,17 +984,11 @@ expose_zoomable (dt_view_t *self, cairo_t *cr, int32_t width, int32_t height, in
       continue;
     }
 
-    /* clear and reset main query */
-    DT_DEBUG_SQLITE3_CLEAR_BINDINGS(lib->statements.main_query);
-    DT_DEBUG_SQLITE3_RESET(lib->statements.main_query);
-
-    DT_DEBUG_SQLITE3_BIND_INT(lib->statements.main_query, 1, offset);
-    DT_DEBUG_SQLITE3_BIND_INT(lib->statements.main_query, 2, max_cols);
     for(int col = 0; col < max_cols; col++)
     {
-      if(sqlite3_step(lib->statements.main_query) == SQLITE_ROW)
+      if(query_ids[row*max_cols + col] > 0)
       {
-        id = sqlite3_column_int(lib->statements.main_query, 0);
+        id = query_ids[row*max_cols + col];
 
         // set mouse over id
         if((zoom == 1 && mouse_over_id < 0) || ((!pan || track) && seli == col && selj == row))
@@ -984,6 +1009,8 @@ expose_zoomable (dt_view_t *self, cairo_t *cr, int32_t width, int32_t height, in
     offset += DT_LIBRARY_MAX_ZOOM;
   }
 failure:
+  free(query_ids);
+  free(page_ids);
 
   lib->zoom_x = zoom_x;
   lib->zoom_y = zoom_y;
@@ -1291,6 +1318,9 @@ void leave(dt_view_t *self)
   dt_library_t *lib = (dt_library_t *)self->data;
   lib->button = 0;
   lib->pan = 0;
+
+  // other views don't keep the prefetched decorations up to date
+  dt_view_image_info_invalidate();
 }
 
 void reset(dt_view_t *self)
@@ -1453,6 +1483,7 @@ int button_pressed(dt_view_t *self, double x, double y, double pressure, int whi
           DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, group_id);
           sqlite3_step(stmt);
           sqlite3_finalize(stmt);
+          dt_view_image_info_invalidate();
         }
         else if(group_id == darktable.gui->expanded_group_id) // the group is already expanded, so ...
         {
@@ -42,6 +42,11 @@
 
 #define DECORATION_SIZE_LIMIT 40
 
+static void _view_image_info_changed_callback(gpointer instance, gpointer user_data)
+{
+  dt_view_image_info_invalidate();
+}
+
 void dt_view_manager_init(dt_view_manager_t *vm)
 {
   /* prepare statements */
@@ -52,6 +57,20 @@ void dt_view_manager_init(dt_view_manager_t *vm)
   DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "select color from color_labels where imgid=?1", -1, &vm->statements.get_color, NULL);
   DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "select id from images where group_id = (select group_id from images where id=?1) and id != ?2", -1, &vm->statements.get_grouped, NULL);
 
+  /* decorations of the visible page, refetched whenever something may have changed them */
+  vm->page.infos = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+  vm->page.dirty = 1;
+  dt_control_signal_connect(darktable.signals, DT_SIGNAL_COLLECTION_CHANGED,
+                            G_CALLBACK(_view_image_info_changed_callback), NULL);
+  dt_control_signal_connect(darktable.signals, DT_SIGNAL_TAG_CHANGED,
+                            G_CALLBACK(_view_image_info_changed_callback), NULL);
+  dt_control_signal_connect(darktable.signals, DT_SIGNAL_FILMROLLS_CHANGED,
+                            G_CALLBACK(_view_image_info_changed_callback), NULL);
+  dt_control_signal_connect(darktable.signals, DT_SIGNAL_DEVELOP_MIPMAP_UPDATED,
+                            G_CALLBACK(_view_image_info_changed_callback), NULL);
+  dt_control_signal_connect(darktable.signals, DT_SIGNAL_DEVELOP_HISTORY_CHANGE,
+                            G_CALLBACK(_view_image_info_changed_callback), NULL);
+
   int res=0, midx=0;
   char *modules[] =
   {
@@ -84,6 +103,11 @@ void dt_view_manager_init(dt_view_manager_t *vm)
 void dt_view_manager_cleanup(dt_view_manager_t *vm)
 {
   for(int k=0; k<vm->num_views; k++) dt_view_unload_module(vm->view + k);
+  dt_control_signal_disconnect(darktable.signals, G_CALLBACK(_view_image_info_changed_callback), NULL);
+  g_hash_table_destroy(vm->page.infos);
+  vm->page.infos = NULL;
+  free(vm->page.imgids);
+  vm->page.imgids = NULL;
 }
 
 const dt_view_t *dt_view_manager_get_current_view(dt_view_manager_t *vm)
@@ -676,6 +700,71 @@ dt_view_get_image_to_act_on()
   }
 }
 
+void dt_view_image_info_invalidate()
+{
+  if(darktable.view_manager) darktable.view_manager->page.dirty = 1;
+}
+
+const dt_view_image_info_t *dt_view_image_info_get(const int32_t imgid)
+{
+  dt_view_manager_t *vm = darktable.view_manager;
+  if(vm->page.dirty) return NULL;
+  return (const dt_view_image_info_t *)g_hash_table_lookup(vm->page.infos, GINT_TO_POINTER(imgid));
+}
+
+void dt_view_image_info_prefetch(const int32_t *imgids, const int num)
+{
+  dt_view_manager_t *vm = darktable.view_manager;
+
+  // nothing changed since the last time? then we're done.
+  if(!vm->page.dirty && num == vm->page.num &&
+     (num == 0 || !memcmp(imgids, vm->page.imgids, sizeof(int32_t)*num)))
+    return;
+
+  // clear the flag before running the query, so changes done meanwhile are not lost.
+  vm->page.dirty = 0;
+  g_hash_table_remove_all(vm->page.infos);
+  if(num > vm->page.alloc)
+  {
+    free(vm->page.imgids);
+    vm->page.imgids = (int32_t *)malloc(sizeof(int32_t)*num);
+    vm->page.alloc = vm->page.imgids ? num : 0;
+  }
+  vm->page.num = MIN(num, vm->page.alloc);
+  if(vm->page.num <= 0) return;
+  memcpy(vm->page.imgids, imgids, sizeof(int32_t)*vm->page.num);
+
+  gchar *ids = NULL;
+  for(int k=0; k<vm->page.num; k++)
+    ids = dt_util_dstrcat(ids, k ? ",%d" : "%d", imgids[k]);
+
+  // one round trip for everything dt_view_image_expose() would otherwise ask per thumbnail:
+  gchar *query = g_strdup_printf(
+                   "select id, group_id, "
+                   "exists(select 1 from selected_images where imgid = images.id), "
+                   "exists(select 1 from history where imgid = images.id), "
+                   "exists(select 1 from images as g where g.group_id = images.group_id and g.id != images.id), "
+                   "(select sum(1 << color) from color_labels where imgid = images.id) "
+                   "from images where id in (%s)", ids);
+
+  sqlite3_stmt *stmt;
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), query, -1, &stmt, NULL);
+  while(sqlite3_step(stmt) == SQLITE_ROW)
+  {
+    dt_view_image_info_t *info = (dt_view_image_info_t *)g_malloc(sizeof(dt_view_image_info_t));
+    info->imgid       = sqlite3_column_int(stmt, 0);
+    info->group_id    = sqlite3_column_int(stmt, 1);
+    info->selected    = sqlite3_column_int(stmt, 2);
+    info->altered     = sqlite3_column_int(stmt, 3);
+    info->grouped     = sqlite3_column_int(stmt, 4);
+    info->colorlabels = sqlite3_column_int(stmt, 5);
+    g_hash_table_insert(vm->page.infos, GINT_TO_POINTER(info->imgid), info);
+  }
+  sqlite3_finalize(stmt);
+  g_free(query);
+  g_free(ids);
+}
+
 void
 dt_view_image_expose(
   dt_view_image_over_t *image_over,
@@ -718,15 +807,23 @@ dt_view_image_expose(
   // this is a gui thread only thing. no mutex required:
   imgsel = darktable.control->global_settings.lib_image_mouse_over_id;
 
+  // decorations prefetched by the lighttable for the whole page, if any:
+  const dt_view_image_info_t *info = dt_view_image_info_get(imgid);
+
 #if DRAW_SELECTED == 1
-  /* clear and reset statements */
-  DT_DEBUG_SQLITE3_CLEAR_BINDINGS(darktable.view_manager->statements.is_selected);
-  DT_DEBUG_SQLITE3_RESET(darktable.view_manager->statements.is_selected);
-  /* bind imgid to prepared statments */
-  DT_DEBUG_SQLITE3_BIND_INT(darktable.view_manager->statements.is_selected, 1, imgid);
-  /* lets check if imgid is selected */
-  if(sqlite3_step(darktable.view_manager->statements.is_selected) == SQLITE_ROW)
-    selected = 1;
+  if(info)
+    selected = info->selected;
+  else
+  {
+    /* clear and reset statements */
+    DT_DEBUG_SQLITE3_CLEAR_BINDINGS(darktable.view_manager->statements.is_selected);
+    DT_DEBUG_SQLITE3_RESET(darktable.view_manager->statements.is_selected);
+    /* bind imgid to prepared statments */
+    DT_DEBUG_SQLITE3_BIND_INT(darktable.view_manager->statements.is_selected, 1, imgid);
+    /* lets check if imgid is selected */
+    if(sqlite3_step(darktable.view_manager->statements.is_selected) == SQLITE_ROW)
+      selected = 1;
+  }
 #endif
 
   const dt_image_t *img = dt_image_cache_read_testget(darktable.image_cache, imgid);
@@ -973,15 +1070,20 @@ dt_view_image_expose(
       cairo_set_line_width(cr, 1.5);
 
 #if DRAW_GROUPING == 1
-      DT_DEBUG_SQLITE3_CLEAR_BINDINGS(darktable.view_manager->statements.get_grouped);
-      DT_DEBUG_SQLITE3_RESET(darktable.view_manager->statements.get_grouped);
-      DT_DEBUG_SQLITE3_BIND_INT(darktable.view_manager->statements.get_grouped, 1, imgid);
-      DT_DEBUG_SQLITE3_BIND_INT(darktable.view_manager->statements.get_grouped, 2, imgid);
-
-      /* lets check if imgid is in a group */
-      if(sqlite3_step(darktable.view_manager->statements.get_grouped) == SQLITE_ROW)
-        is_grouped = 1;
-      else if(img && darktable.gui->expanded_group_id == img->group_id)
+      if(info)
+        is_grouped = info->grouped;
+      else
+      {
+        DT_DEBUG_SQLITE3_CLEAR_BINDINGS(darktable.view_manager->statements.get_grouped);
+        DT_DEBUG_SQLITE3_RESET(darktable.view_manager->statements.get_grouped);
+        DT_DEBUG_SQLITE3_BIND_INT(darktable.view_manager->statements.get_grouped, 1, imgid);
+        DT_DEBUG_SQLITE3_BIND_INT(darktable.view_manager->statements.get_grouped, 2, imgid);
+
+        /* lets check if imgid is in a group */
+        if(sqlite3_step(darktable.view_manager->statements.get_grouped) == SQLITE_ROW)
+          is_grouped = 1;
+      }
+      if(!is_grouped && img && darktable.gui->expanded_group_id == img->group_id)
         darktable.gui->expanded_group_id = -1;
 #endif
 
@@ -1013,13 +1115,18 @@ dt_view_image_expose(
       }
 
 #if DRAW_HISTORY == 1
-      DT_DEBUG_SQLITE3_CLEAR_BINDINGS(darktable.view_manager->statements.have_history);
-      DT_DEBUG_SQLITE3_RESET(darktable.view_manager->statements.have_history);
-      DT_DEBUG_SQLITE3_BIND_INT(darktable.view_manager->statements.have_history, 1, imgid);
+      if(info)
+        altered = info->altered;
+      else
+      {
+        DT_DEBUG_SQLITE3_CLEAR_BINDINGS(darktable.view_manager->statements.have_history);
+        DT_DEBUG_SQLITE3_RESET(darktable.view_manager->statements.have_history);
+        DT_DEBUG_SQLITE3_BIND_INT(darktable.view_manager->statements.have_history, 1, imgid);
 
-      /* lets check if imgid has history */
-      if(sqlite3_step(darktable.view_manager->statements.have_history) == SQLITE_ROW)
-        altered = 1;
+        /* lets check if imgid has history */
+        if(sqlite3_step(darktable.view_manager->statements.have_history) == SQLITE_ROW)
+          altered = 1;
+      }
 #endif
 
     // image altered?
@@ -1059,19 +1166,33 @@ dt_view_image_expose(
     const float y = zoom == 1 ? 0.17*fscale: 0.1*height;
     const float r = zoom == 1 ? 0.01*fscale : 0.03*width;
 
-    /* clear and reset prepared statement */
-    DT_DEBUG_SQLITE3_CLEAR_BINDINGS(darktable.view_manager->statements.get_color);
-    DT_DEBUG_SQLITE3_RESET(darktable.view_manager->statements.get_color);
-
-    /* setup statement and iterate rows */
-    DT_DEBUG_SQLITE3_BIND_INT(darktable.view_manager->statements.get_color, 1, imgid);
-    while(sqlite3_step(darktable.view_manager->statements.get_color) == SQLITE_ROW)
+    if(info)
     {
-      cairo_save(cr);
-      int col = sqlite3_column_int(darktable.view_manager->statements.get_color, 0);
-      // see src/dtgtk/paint.c
-      dtgtk_cairo_paint_label(cr, x+(3*r*col)-5*r, y-r, r*2, r*2, col);
-      cairo_restore(cr);
+      for(int col=0; col<8; col++)
+      {
+        if(!(info->colorlabels & (1<<col))) continue;
+        cairo_save(cr);
+        // see src/dtgtk/paint.c
+        dtgtk_cairo_paint_label(cr, x+(3*r*col)-5*r, y-r, r*2, r*2, col);
+        cairo_restore(cr);
+      }
+    }
+    else
+    {
+      /* clear and reset prepared statement */
+      DT_DEBUG_SQLITE3_CLEAR_BINDINGS(darktable.view_manager->statements.get_color);
+      DT_DEBUG_SQLITE3_RESET(darktable.view_manager->statements.get_color);
+
+      /* setup statement and iterate rows */
+      DT_DEBUG_SQLITE3_BIND_INT(darktable.view_manager->statements.get_color, 1, imgid);
+      while(sqlite3_step(darktable.view_manager->statements.get_color) == SQLITE_ROW)
+      {
+        cairo_save(cr);
+        int col = sqlite3_column_int(darktable.view_manager->statements.get_color, 0);
+        // see src/dtgtk/paint.c
+        dtgtk_cairo_paint_label(cr, x+(3*r*col)-5*r, y-r, r*2, r*2, col);
+        cairo_restore(cr);
+      }
     }
   }
 #endif
@@ -1199,6 +1320,7 @@ void dt_view_set_selection(int imgid, int value)
     sqlite3_step(darktable.view_manager->statements.make_selected);
   }
 
+  dt_view_image_info_invalidate();
 }
 
 /**
@@ -1234,6 +1356,8 @@ void dt_view_toggle_selection(int imgid)
     DT_DEBUG_SQLITE3_BIND_INT(darktable.view_manager->statements.make_selected, 1, imgid);
     sqlite3_step(darktable.view_manager->statements.make_selected);
   }
+
+  dt_view_image_info_invalidate();
 }
 
 /**
@@ -1302,6 +1426,7 @@ void dt_view_filmstrip_set_active_image(dt_view_manager_t *vm,int iid)
   /* setup statement and execute */
   DT_DEBUG_SQLITE3_BIND_INT(darktable.view_manager->statements.make_selected, 1, iid);
   sqlite3_step(darktable.view_manager->statements.make_selected);
+  dt_view_image_info_invalidate();
 
   dt_view_filmstrip_scroll_to_image(vm, iid, TRUE);
 }
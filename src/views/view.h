@@ -122,6 +122,28 @@ dt_view_image_expose(
   int32_t py,
   gboolean full_preview);
 
+/** thumbnail decorations of one image, as fetched for the visible page */
+typedef struct dt_view_image_info_t
+{
+  int32_t imgid;
+  int32_t group_id;
+  uint8_t selected;     // in selected_images
+  uint8_t altered;      // has history
+  uint8_t grouped;      // other images share the group_id
+  uint8_t colorlabels;  // bitmask of color labels (1<<color)
+}
+dt_view_image_info_t;
+
+/** fetch decorations of all given images in one query, to be used by
+    dt_view_image_expose(). this is a no-op if the same ids have already been
+    fetched and nothing was invalidated since. gui thread only. */
+void dt_view_image_info_prefetch(const int32_t *imgids, const int num);
+/** get the prefetched decorations of an image, NULL if not available. */
+const dt_view_image_info_t *dt_view_image_info_get(const int32_t imgid);
+/** drop the prefetched decorations, they will be refetched on next prefetch.
+    this only sets a flag and may be called from any thread. */
+void dt_view_image_info_invalidate();
+
 /** Set the selection bit to a given value for the specified image */
 void dt_view_set_selection(int imgid, int value);
 /** toggle selection of given image. */
@@ -157,6 +179,18 @@ typedef struct dt_view_manager_t
     sqlite3_stmt *get_grouped;
   } statements;
 
+  /* decorations of the visible thumbnails, see dt_view_image_info_prefetch() */
+  struct
+  {
+    /* imgid -> dt_view_image_info_t, NULL if nothing is prefetched */
+    GHashTable *infos;
+    /* the ids the table has been filled for, in display order */
+    int32_t *imgids;
+    int num, alloc;
+    /* set by dt_view_image_info_invalidate() */
+    volatile int dirty;
+  } page;
+
 
   /*
    * Proxy
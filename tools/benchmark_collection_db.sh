@@ -0,0 +1,117 @@
+#!/bin/sh
+#
+# generate a synthetic library database and time the queries a collection
+# refresh runs (see dt_collection_update() and dt_collection_get_count()).
+#
+# usage: benchmark_collection_db.sh [number of images] [database file]
+#
+# the database is created with the same tables darktable uses. run it once
+# with NOINDEX=1 in the environment to get numbers without the indices
+# dt_control_create_database_indices() adds.
+
+NUM_IMAGES=${1:-200000}
+DBFILE=${2:-/tmp/darktable_benchmark.db}
+
+if ! which sqlite3 >/dev/null 2>&1 ; then
+  echo "sqlite3 command line tool not found"
+  exit 1
+fi
+
+rm -f "$DBFILE"
+
+echo "creating $NUM_IMAGES images in $DBFILE"
+sqlite3 "$DBFILE" <<EOF
+create table film_rolls (id integer primary key, datetime_accessed char(20), folder varchar(1024));
+create table images (id integer primary key autoincrement, group_id integer, film_id integer,
+  width int, height int, filename varchar, maker varchar, model varchar,
+  lens varchar, exposure real, aperture real, iso real, focal_length real,
+  focus_distance real, datetime_taken char(20), flags integer,
+  output_width integer, output_height integer, crop real,
+  raw_parameters integer, raw_denoise_threshold real,
+  raw_auto_bright_threshold real, raw_black real, raw_maximum real,
+  caption varchar, description varchar, license varchar, sha1sum char(40),
+  orientation integer ,histogram blob, lightmap blob, longitude double,
+  latitude double, color_matrix blob, colorspace integer);
+create index group_id_index on images (group_id);
+create table selected_images (imgid integer primary key);
+create table history (imgid integer, num integer, module integer,
+  operation varchar(256), op_params blob, enabled integer,
+  blendop_params blob, blendop_version integer, multi_priority integer, multi_name varchar(256), snapshot_num integer default -1);
+create index imgid_index on history (imgid);
+create table tags (id integer primary key, name varchar, icon blob, description varchar, flags integer);
+create table tagged_images (imgid integer, tagid integer, primary key(imgid, tagid));
+create table color_labels (imgid integer, color integer);
+create unique index color_labels_idx ON color_labels(imgid,color);
+create table meta_data (id integer,key integer,value varchar);
+
+begin;
+with recursive n(i) as (select 1 union all select i+1 from n where i < $NUM_IMAGES / 500 + 1)
+  insert into film_rolls (id, folder) select i, '/home/user/pictures/roll_' || i from n;
+with recursive n(i) as (select 1 union all select i+1 from n where i < $NUM_IMAGES)
+  insert into images (id, group_id, film_id, filename, maker, model, lens, iso, aperture, datetime_taken, flags)
+  select i, i, i / 500 + 1, 'IMG_' || i || '.CR2', 'Canon', 'EOS 5D Mark III', 'EF24-70mm f/2.8L USM',
+         100 << (i % 6), 2.8 + (i % 5), '2013:' || (1 + i % 12) || ':' || (1 + i % 28) || ' 12:00:' || (i % 60),
+         (i * 7) % 6 from n;
+with recursive n(i) as (select 1 union all select i+1 from n where i < 200)
+  insert into tags (id, name) select i, 'places|country ' || (i % 20) || '|city ' || i from n;
+insert into tagged_images select id, 1 + (id * 13) % 200 from images where id % 3 = 0;
+insert or ignore into tagged_images select id, 1 + (id * 17) % 200 from images where id % 5 = 0;
+insert into color_labels select id, id % 5 from images where id % 4 = 0;
+insert into history (imgid, num, operation) select id, 0, 'exposure' from images where id % 7 = 0;
+insert into meta_data select id, 2, 'holiday trip number ' || (id % 1000) from images where id % 2 = 0;
+insert into meta_data select id, 0, 'photographer ' || (id % 50) from images;
+insert into selected_images select id from images where id % 100 = 0;
+commit;
+EOF
+
+if [ -z "$NOINDEX" ]; then
+  echo "creating indices"
+  sqlite3 "$DBFILE" <<EOF
+create index images_film_id_index on images (film_id, filename);
+create index images_datetime_taken_index on images (datetime_taken);
+create index images_filename_index on images (filename);
+create index film_rolls_folder_index on film_rolls (folder);
+create index tagged_images_tagid_index on tagged_images (tagid, imgid);
+create index tags_name_index on tags (name);
+create index color_labels_color_index on color_labels (color, imgid);
+create index meta_data_index on meta_data (id, key);
+create index meta_data_key_index on meta_data (key, id);
+analyze;
+EOF
+  # not every sqlite3 is built with fts4, darktable falls back to like '%...%' then
+  if sqlite3 "$DBFILE" "create virtual table meta_data_fts using fts4(value)" 2>/dev/null; then
+    sqlite3 "$DBFILE" "insert into meta_data_fts (docid, value) select rowid, value from meta_data"
+    HAVE_FTS=1
+  fi
+fi
+
+# the where clauses of typical collections, as built by dt_collection_update()
+WHERE_FILM="(film_id = 42) and (flags & 8) != 8 and (flags & 7) >= 1 and (flags & 7) != 6"
+WHERE_TAG="(flags & 8) != 8 and (id in (select imgid from tagged_images as a join tags as b on a.tagid = b.id where name like 'places|country 3|%'))"
+WHERE_LABEL="(flags & 8) != 8 and (id in (select imgid from color_labels where color=2))"
+WHERE_ALTERED="(flags & 8) != 8 and exists(select 1 from history where imgid = images.id)"
+WHERE_TITLE_LIKE="(flags & 8) != 8 and (id in (select id from meta_data where key = 2 and value like '%trip number 12%'))"
+WHERE_TITLE_FTS="(flags & 8) != 8 and (id in (select id from meta_data where key = 2 and rowid in (select docid from meta_data_fts where value match 'trip* number* 12*')))"
+
+run()
+{
+  echo
+  echo "== $1"
+  sqlite3 "$DBFILE" <<EOF
+.timer on
+select count(*) from (select distinct id from images where $2 order by filename limit 0, 100);
+select count(id) from images where $2;
+begin;
+delete from selected_images where imgid not in (select distinct id from images where $2);
+rollback;
+EOF
+}
+
+run "film roll" "$WHERE_FILM"
+run "tag" "$WHERE_TAG"
+run "color label" "$WHERE_LABEL"
+run "altered" "$WHERE_ALTERED"
+run "title like" "$WHERE_TITLE_LIKE"
+if [ -n "$HAVE_FTS" ]; then
+  run "title fts" "$WHERE_TITLE_FTS"
+fi
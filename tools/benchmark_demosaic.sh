@@ -0,0 +1,37 @@
+#!/bin/sh
+#
+# measure the throughput of the ppg demosaicer for a range of thread counts.
+#
+# usage: benchmark_demosaic.sh <raw file> [max threads]
+#
+# the image is exported at full resolution with darktable-cli, which makes
+# demosaic run 1:1. the numbers are the megapixels per second demosaic_ppg()
+# reports with -d perf, green equilibration is not included. pick an image
+# without an xmp sidecar (or with ppg selected in it), amaze is not measured.
+
+RAW="$1"
+MAX_THREADS=${2:-$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 4)}
+CLI=${DARKTABLE_CLI:-darktable-cli}
+OUT=$(mktemp -d /tmp/darktable_benchmark.XXXXXX)
+
+if [ -z "$RAW" ] || [ ! -f "$RAW" ]; then
+  echo "usage: $0 <raw file> [max threads]"
+  exit 1
+fi
+
+if ! which "$CLI" >/dev/null 2>&1 ; then
+  echo "$CLI not found, set DARKTABLE_CLI to its location"
+  exit 1
+fi
+
+echo "threads  MP/s"
+THREADS=1
+while [ "$THREADS" -le "$MAX_THREADS" ]; do
+  RATE=$(OMP_NUM_THREADS=$THREADS "$CLI" "$RAW" "$OUT/out_$THREADS.pfm" --hq true \
+           --core --library :memory: --configdir "$OUT" -d perf 2>&1 \
+         | sed -n 's/.*\[demosaic\] ppg: \([0-9.]*\) MP\/s.*/\1/p' | tail -n 1)
+  printf "%7d  %s\n" "$THREADS" "${RATE:-?}"
+  THREADS=$((THREADS * 2))
+done
+
+rm -rf "$OUT"
@@ -0,0 +1,64 @@
+#!/bin/sh
+#
+# compare the instruction set levels of the runtime dispatched kernels.
+#
+# usage: benchmark_isa.sh <image> [<xmp file>] [runs]
+#
+# the image is exported with darktable-cli once per level (--isa), the
+# per module wall times come from --profile. only modules using a
+# dispatched kernel (see DT_ISA_KERNELS in src/CMakeLists.txt) should
+# differ, so use an xmp with e.g. denoise (non-local means) switched on.
+# levels the cpu can't run fall back to the best one it can, see -d perf.
+
+IMAGE="$1"
+XMP=""
+RUNS=3
+if [ -n "$2" ] && [ -f "$2" ]; then
+  XMP="$2"
+  RUNS=${3:-3}
+else
+  RUNS=${2:-3}
+fi
+CLI=${DARKTABLE_CLI:-darktable-cli}
+OUT=$(mktemp -d /tmp/darktable_benchmark.XXXXXX)
+
+if [ -z "$IMAGE" ] || [ ! -f "$IMAGE" ]; then
+  echo "usage: $0 <image> [<xmp file>] [runs]"
+  exit 1
+fi
+
+if ! which "$CLI" >/dev/null 2>&1 ; then
+  echo "$CLI not found, set DARKTABLE_CLI to its location"
+  exit 1
+fi
+
+for ISA in sse2 avx avx2; do
+  RUN=1
+  while [ "$RUN" -le "$RUNS" ]; do
+    rm -f "$OUT/out.pfm"
+    "$CLI" "$IMAGE" ${XMP:+"$XMP"} "$OUT/out.pfm" --core --library :memory: --configdir "$OUT" \
+      --isa "$ISA" --profile "$OUT/$ISA-$RUN.csv" -d perf 2>&1 \
+      | sed -n 's/.*\[cpu\] .*kernels use \(.*\)$/\1/p' | tail -n 1 > "$OUT/$ISA.level"
+    RUN=$((RUN + 1))
+  done
+done
+
+# best of all runs per module and level, modules sorted by their sse2 time
+awk -F, '
+  $1 == "total" {
+    np = split(FILENAME, parts, "/"); split(parts[np], f, "-"); isa = f[1]
+    key = $2; if(key == "") key = "(input)"
+    if(!((key, isa) in best) || $5 < best[key, isa]) best[key, isa] = $5
+    modules[key] = 1
+  }
+  END {
+    printf "%-16s %9s %9s %9s\n", "module", "sse2", "avx", "avx2"
+    for(m in modules)
+      printf "%-16s %9.3f %9.3f %9.3f\n", m, best[m, "sse2"], best[m, "avx"], best[m, "avx2"]
+  }' "$OUT"/*-*.csv | { read HEADER; echo "$HEADER"; sort -k2 -n -r; }
+
+for ISA in sse2 avx avx2; do
+  echo "$ISA ran as: $(cat "$OUT/$ISA.level" 2>/dev/null)"
+done
+
+rm -rf "$OUT"
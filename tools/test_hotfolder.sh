@@ -0,0 +1,119 @@
+#!/bin/sh
+#
+# exercise the hot folder import (DT_FSWATCH_DIRECTORY in src/common/fswatch.c)
+# by writing files into a watched local directory.
+#
+# usage: test_hotfolder.sh <raw image> [<jpeg image>]
+#
+# darktable is started on an empty library with --hotfolder. the raw is
+# written slowly in two halves, a second copy lands under a temporary dot
+# name and is renamed, as copy tools do, and the jpeg (if given) is
+# ignored by the import settings. both raws have to show up in the library
+# exactly once, nothing may be counted as failed, and a restart must not
+# pick up the imported files again. darktable needs a display, run this
+# under xvfb-run on headless machines.
+
+RAW="$1"
+JPEG="$2"
+DT=${DARKTABLE:-darktable}
+TMP=$(mktemp -d /tmp/darktable_hotfolder.XXXXXX)
+HOT="$TMP/hot"
+LOG="$TMP/log"
+FAILED=0
+
+if [ -z "$RAW" ] || [ ! -f "$RAW" ]; then
+  echo "usage: $0 <raw image> [<jpeg image>]"
+  exit 1
+fi
+
+for TOOL in "$DT" sqlite3; do
+  if ! which "$TOOL" >/dev/null 2>&1 ; then
+    echo "$TOOL not found, set DARKTABLE to the location of darktable"
+    exit 1
+  fi
+done
+
+mkdir -p "$HOT" "$TMP/config" "$TMP/cache"
+EXT="${RAW##*.}"
+
+start_darktable()
+{
+  "$DT" --library "$TMP/library.db" --configdir "$TMP/config" --cachedir "$TMP/cache" \
+    --conf ui_last/import_ignore_jpegs=TRUE --hotfolder "$HOT" -d fswatch > "$LOG" 2>&1 &
+  PID=$!
+  # wait for the watch to be in place
+  WAIT=0
+  while ! grep -q "\[fswatch_add\] Watch on object" "$LOG" 2>/dev/null; do
+    sleep 1
+    WAIT=$((WAIT + 1))
+    if [ "$WAIT" -gt 60 ]; then
+      echo "darktable did not start watching $HOT"
+      kill "$PID" 2>/dev/null
+      exit 1
+    fi
+  done
+}
+
+stop_darktable()
+{
+  kill "$PID" 2>/dev/null
+  wait "$PID" 2>/dev/null
+}
+
+images_in_library()
+{
+  sqlite3 "$TMP/library.db" "select count(*) from images where filename like 'hot_%'"
+}
+
+check()
+{
+  if [ "$1" != "$2" ]; then
+    echo "FAILED: $3 (got $1, expected $2)"
+    FAILED=1
+  else
+    echo "ok: $3"
+  fi
+}
+
+start_darktable
+
+# a file which is still being written must not be imported half way
+SIZE=$(wc -c < "$RAW")
+head -c $((SIZE / 2)) "$RAW" > "$HOT/hot_slow.$EXT"
+sleep 1
+tail -c +$((SIZE / 2 + 1)) "$RAW" >> "$HOT/hot_slow.$EXT"
+
+cp "$RAW" "$HOT/.hot_renamed.$EXT.part"
+mv "$HOT/.hot_renamed.$EXT.part" "$HOT/hot_renamed.$EXT"
+
+if [ -n "$JPEG" ] && [ -f "$JPEG" ]; then
+  cp "$JPEG" "$HOT/hot_ignored.jpg"
+fi
+
+WAIT=0
+while [ "$(images_in_library)" -lt 2 ] && [ "$WAIT" -lt 30 ]; do
+  sleep 1
+  WAIT=$((WAIT + 1))
+done
+# give a late duplicate import the chance to show up
+sleep 3
+stop_darktable
+
+check "$(images_in_library)" 2 "both raws imported once"
+check "$(grep -c "\[fswatch\] could not import" "$LOG")" 0 "no failed imports"
+check "$(sed -n 's/.* \([0-9]*\) failed$/\1/p' "$LOG" | tail -n 1)" 0 "failure counter"
+check "$(grep -c "\[fswatch\] new file .*hot_ignored" "$LOG")" 0 "ignored jpeg not picked up"
+
+# a restart sees the same files again, they are in the library already
+start_darktable
+sleep 5
+stop_darktable
+
+check "$(grep -c "\[fswatch\] new file" "$LOG")" 0 "nothing picked up again after a restart"
+check "$(images_in_library)" 2 "still two images after a restart"
+
+if [ "$FAILED" -ne 0 ]; then
+  echo "logs and library are kept in $TMP"
+  exit 1
+fi
+rm -rf "$TMP"